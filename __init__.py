@@ -2,9 +2,10 @@ from .python.constants import McuType, BASEDIR, FW_PATH, USBPACKET_MAX_SIZE  # n
 from .python.spi import PandaSpiException, PandaProtocolMismatch, STBootloaderSPIHandle  # noqa: F401
 from .python.serial import PandaSerial  # noqa: F401
 from .python.utils import logger # noqa: F401
+from .python.native import CAN_MESSAGE_DTYPE, pack_can_records, unpack_can_records, can_records_to_tuples  # noqa: F401
 from .python import (Panda, PandaDFU, # noqa: F401
                      pack_can_buffer, unpack_can_buffer, calculate_checksum,
-                     DLC_TO_LEN, LEN_TO_DLC, CANPACKET_HEAD_SIZE)
+                     DLC_TO_LEN, LEN_TO_DLC, CANPACKET_HEAD_SIZE, CANPACKET_TIMESTAMP_SIZE)
 
 # panda jungle
 from .board.jungle import PandaJungle, PandaJungleDFU # noqa: F401
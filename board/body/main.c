@@ -10,6 +10,12 @@
 #include "board/body/can.h"
 #include "opendbc/safety/safety.h"
 #include "board/drivers/can_common.h"
+#include "board/drivers/can_filter.h"
+#include "board/drivers/can_prio.h"
+#include "board/drivers/can_tx_slots.h"
+#include "board/drivers/can_sched.h"
+#include "board/drivers/can_tx_timed.h"
+#include "board/drivers/can_tx_timer.h"
 #include "board/drivers/fdcan.h"
 #include "board/can_comms.h"
 #include "board/body/dotstar.h"
@@ -50,7 +56,7 @@ void bldc_tim8_handler(void) {
 void tick_handler(void) {
   if (TICK_TIMER->SR != 0) {
     if (can_health[0].transmit_error_cnt >= 128) {
-      (void)llcan_init(CANIF_FROM_CAN_NUM(0));
+      (void)can_core_init(0);
     }
     static bool led_on = false;
     led_set(LED_RED, led_on);
@@ -110,6 +116,7 @@ int main(void) {
 
   led_init();
   microsecond_timer_init();
+  can_tx_timer_init();
   tick_timer_init();
   usb_init();
   body_can_init();
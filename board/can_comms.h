@@ -17,6 +17,17 @@
     byte 5: checksum = XOR(header[0..4] + payload)
     bytes 6..13 (classic CAN, up to 8 bytes) / bytes 6..69 (CAN FD, up to 64 bytes): payload
 
+  With CAN_COMMS_FLAG_TIMESTAMPS, packets sent to the host carry the microsecond
+  timer value of when the frame was received, queued for TX or rejected, as a
+  little endian uint32 between the header and the payload:
+    bytes 6..9: timestamp
+    bytes 10.. : payload
+    byte 5: checksum = XOR(header[0..4] + timestamp + payload)
+
+  With CAN_COMMS_FLAG_TX_TIMESTAMPS, packets sent from the host carry the microsecond
+  timer value to send the frame at in the same place, with the same checksum. Frames
+  are held until then, or sent right away if the target is 0 or already passed.
+
   USB/SPI transfer chunking used by this file:
   +--------------------------------------------+   ...   +--------------------------------------------+
   | transport chunk 0                          |         | transport chunk N                          |
@@ -27,49 +38,195 @@
 
   * comms_can_read outputs this buffer in chunks of a specified length.
     chunks are always the given length, except the last one.
-  * comms_can_write reads in this buffer in chunks.
-  * both functions maintain an overflow buffer for a partial CANPacket_t that
-    spans multiple transfers/chunks.
-  * the overflow buffers are reset by a dedicated control transfer handler,
+    The RX rings already hold the packets in the wire format with timestamp, so
+    runs of packets are copied straight out of them. Without timestamps, the
+    same runs are copied with the timestamp cut out of each packet on the way.
+    A packet spanning multiple transfers/chunks stays in its ring until it's sent.
+  * comms_can_prio_read does the same for the ring of the priority CAN IDs
+    (see can_prio.h), which is sent from its own USB endpoint.
+  * comms_can_write reads in this buffer in chunks, and maintains an overflow
+    buffer for a partial CANPacket_t that spans multiple transfers/chunks.
+  * The checksum is only computed at this boundary: it's checked once in
+    comms_can_write and set once when a packet is pushed to an RX ring. The
+    queues in between carry trusted frames with the checksum byte unused.
+  * the partial packets are dropped by a dedicated control transfer handler,
     which is sent by the host on each start of a connection.
 */
 
 typedef struct {
   uint32_t ptr;
   uint32_t tail_size;
-  uint8_t data[72];
+  uint8_t data[CANPACKET_HEAD_SIZE + CAN_COMMS_TIMESTAMP_SIZE + CANPACKET_DATA_SIZE_MAX];
 } asm_buffer;
 
-static asm_buffer can_read_buffer = {.ptr = 0U, .tail_size = 0U};
+static uint16_t can_comms_flags = 0U;
+static uint8_t can_read_ring = CAN_RX_RING_CNT; // ring of the packet partially sent to the host
+
+// length in the ring of the packet at offset from the read pointer
+static uint32_t can_rx_packet_len(const can_rx_ring *q, uint32_t offset) {
+  uint8_t header;
+  can_rx_read(q, offset, &header, 1U);
+  return CAN_RX_PACKET_SIZE(dlc_to_len[header >> 4U]);
+}
+
+static uint32_t can_rx_packet_timestamp(const can_rx_ring *q, uint32_t offset) {
+  uint8_t dat[CAN_COMMS_TIMESTAMP_SIZE];
+  uint32_t ret;
+  can_rx_read(q, offset + CANPACKET_HEAD_SIZE, dat, CAN_COMMS_TIMESTAMP_SIZE);
+  BYTE_ARRAY_TO_WORD(ret, dat);
+  return ret;
+}
+
+// true if timestamp a isn't newer than b, safe across the timer wraparound
+static bool can_rx_not_newer(uint32_t a, uint32_t b) {
+  return (b - a) < 0x80000000U;
+}
+
+// returns the ring with the oldest packet, CAN_RX_RING_CNT if all are empty.
+// next_ts is set to the oldest packet in the other rings, if there is one.
+static uint8_t can_rx_oldest_ring(uint32_t *next_ts, bool *next_valid) {
+  uint8_t oldest = CAN_RX_RING_CNT;
+  uint32_t oldest_ts = 0U;
+  *next_valid = false;
+
+  for (uint8_t i = 0U; i < CAN_RX_RING_CNT; i++) {
+    const can_rx_ring *q = &can_rx_rings[i];
+    if (can_rx_pending(q) > 0U) {
+      uint32_t ts = can_rx_packet_timestamp(q, 0U);
+      if ((oldest == CAN_RX_RING_CNT) || !can_rx_not_newer(oldest_ts, ts)) {
+        if (oldest != CAN_RX_RING_CNT) {
+          *next_ts = oldest_ts;
+          *next_valid = true;
+        }
+        oldest = i;
+        oldest_ts = ts;
+      } else if (!*next_valid || !can_rx_not_newer(*next_ts, ts)) {
+        *next_ts = ts;
+        *next_valid = true;
+      } else {
+        // newer than both
+      }
+    }
+  }
+  return oldest;
+}
+
+// copies bytes [offset, offset + len) of the packet at the read pointer with its timestamp cut out
+static void can_rx_read_without_timestamp(const can_rx_ring *q, uint32_t offset, uint8_t *dst, uint32_t len) {
+  uint8_t header[CANPACKET_HEAD_SIZE + CAN_COMMS_TIMESTAMP_SIZE];
+  uint32_t pos = 0U;
+
+  if (offset < CANPACKET_HEAD_SIZE) {
+    can_rx_read(q, 0U, header, sizeof(header));
+    // take the timestamp back out of the checksum
+    header[5] ^= calculate_checksum(&header[CANPACKET_HEAD_SIZE], CAN_COMMS_TIMESTAMP_SIZE);
+    pos = MIN(len, CANPACKET_HEAD_SIZE - offset);
+    (void)memcpy(dst, &header[offset], pos);
+  }
+  if (pos < len) {
+    can_rx_read(q, offset + pos + CAN_COMMS_TIMESTAMP_SIZE, &dst[pos], len - pos);
+  }
+}
+
+// copies the whole packets in the run_len ring bytes at the read pointer with their timestamps cut out
+static void can_rx_read_run_without_timestamps(const can_rx_ring *q, uint32_t run_len, uint8_t *dst) {
+  uint32_t offset = 0U;
+  uint32_t pos = 0U;
+
+  while (offset < run_len) {
+    uint8_t header[CANPACKET_HEAD_SIZE + CAN_COMMS_TIMESTAMP_SIZE];
+    can_rx_read(q, offset, header, sizeof(header));
+    header[5] ^= calculate_checksum(&header[CANPACKET_HEAD_SIZE], CAN_COMMS_TIMESTAMP_SIZE);
+    (void)memcpy(&dst[pos], header, CANPACKET_HEAD_SIZE);
+
+    uint32_t data_len = dlc_to_len[header[0] >> 4U];
+    can_rx_read(q, offset + sizeof(header), &dst[pos + CANPACKET_HEAD_SIZE], data_len);
+    offset += sizeof(header) + data_len;
+    pos += CANPACKET_HEAD_SIZE + data_len;
+  }
+}
+
+// the packet at the read pointer, extended to the following packets that fit into space on the wire and
+// are still older than next_ts. Returns the run's length in the ring, wire_len is set to its size on the wire.
+static uint32_t can_rx_run_len(const can_rx_ring *q, bool timestamps, uint32_t space, bool next_valid, uint32_t next_ts, uint32_t *wire_len) {
+  uint32_t cut = timestamps ? 0U : CAN_COMMS_TIMESTAMP_SIZE;
+  uint32_t run_len = can_rx_packet_len(q, 0U);
+  *wire_len = run_len - cut;
+
+  // a partial packet is finished on its own
+  if (q->read_offset == 0U) {
+    uint32_t pending = can_rx_pending(q);
+    while (run_len < pending) {
+      uint32_t len = can_rx_packet_len(q, run_len);
+      if (((*wire_len + len - cut) > space) ||
+          (next_valid && !can_rx_not_newer(can_rx_packet_timestamp(q, run_len), next_ts))) {
+        break;
+      }
+      run_len += len;
+      *wire_len += len - cut;
+    }
+  }
+  return run_len;
+}
+
+// copies what fits of the run_len ring bytes at the read pointer to data[*pos], returns true once
+// all of it was sent and released. A partial packet is continued on the next read.
+static bool can_rx_send_run(can_rx_ring *q, uint32_t run_len, uint32_t wire_len, bool timestamps, uint8_t *data, uint32_t *pos, uint32_t max_len) {
+  bool ret = false;
+  uint32_t copy_len = MIN(wire_len - q->read_offset, max_len - *pos);
+  if (timestamps) {
+    can_rx_read(q, q->read_offset, &data[*pos], copy_len);
+  } else if (copy_len == wire_len) {
+    can_rx_read_run_without_timestamps(q, run_len, &data[*pos]);
+  } else {
+    can_rx_read_without_timestamp(q, q->read_offset, &data[*pos], copy_len);
+  }
+  *pos += copy_len;
+  q->read_offset += copy_len;
+
+  if (q->read_offset == wire_len) {
+    q->read_offset = 0U;
+    can_rx_release(q, run_len);
+    ret = true;
+  }
+  return ret;
+}
 
 int comms_can_read(uint8_t *data, uint32_t max_len) {
+  bool timestamps = (can_comms_flags & CAN_COMMS_FLAG_TIMESTAMPS) != 0U;
   uint32_t pos = 0U;
 
-  // Send tail of previous message if it is in buffer
-  if (can_read_buffer.ptr > 0U) {
-    uint32_t overflow_len = MIN(max_len - pos, can_read_buffer.ptr);
-    (void)memcpy(&data[pos], can_read_buffer.data, overflow_len);
-    pos += overflow_len;
-    (void)memcpy(can_read_buffer.data, &can_read_buffer.data[overflow_len], can_read_buffer.ptr - overflow_len);
-    can_read_buffer.ptr -= overflow_len;
-  }
-
-  if (can_read_buffer.ptr == 0U) {
-    // Fill rest of buffer with new data
-    CANPacket_t can_packet;
-    while ((pos < max_len) && can_pop(&can_rx_q, &can_packet)) {
-      uint32_t pckt_len = CANPACKET_HEAD_SIZE + dlc_to_len[can_packet.data_len_code];
-      if ((pos + pckt_len) <= max_len) {
-        (void)memcpy(&data[pos], (uint8_t*)&can_packet, pckt_len);
-        pos += pckt_len;
-      } else {
-        (void)memcpy(&data[pos], (uint8_t*)&can_packet, max_len - pos);
-        can_read_buffer.ptr += pckt_len - (max_len - pos);
-        // cppcheck-suppress objectIndex
-        (void)memcpy(can_read_buffer.data, &((uint8_t*)&can_packet)[(max_len - pos)], can_read_buffer.ptr);
-        pos = max_len;
+  while (pos < max_len) {
+    uint32_t next_ts = 0U;
+    bool next_valid = false;
+    if (can_read_ring == CAN_RX_RING_CNT) {
+      can_read_ring = can_rx_oldest_ring(&next_ts, &next_valid);
+      if (can_read_ring == CAN_RX_RING_CNT) {
+        break;
       }
     }
+    can_rx_ring *q = &can_rx_rings[can_read_ring];
+
+    uint32_t wire_len;
+    uint32_t run_len = can_rx_run_len(q, timestamps, max_len - pos, next_valid, next_ts, &wire_len);
+    if (can_rx_send_run(q, run_len, wire_len, timestamps, data, &pos, max_len)) {
+      can_read_ring = CAN_RX_RING_CNT;
+    }
+  }
+
+  return pos;
+}
+
+// the priority ring on its own, there's nothing to merge
+int comms_can_prio_read(uint8_t *data, uint32_t max_len) {
+  bool timestamps = (can_comms_flags & CAN_COMMS_FLAG_TIMESTAMPS) != 0U;
+  can_rx_ring *q = &can_rx_prio_ring;
+  uint32_t pos = 0U;
+
+  while ((pos < max_len) && (can_rx_pending(q) > 0U)) {
+    uint32_t wire_len;
+    uint32_t run_len = can_rx_run_len(q, timestamps, max_len - pos, false, 0U, &wire_len);
+    (void)can_rx_send_run(q, run_len, wire_len, timestamps, data, &pos, max_len);
   }
 
   return pos;
@@ -77,22 +234,56 @@ int comms_can_read(uint8_t *data, uint32_t max_len) {
 
 static asm_buffer can_write_buffer = {.ptr = 0U, .tail_size = 0U};
 
+static uint32_t comms_can_write_packet_len(uint8_t header) {
+  uint32_t ts_size = ((can_comms_flags & CAN_COMMS_FLAG_TX_TIMESTAMPS) != 0U) ? CAN_COMMS_TIMESTAMP_SIZE : 0U;
+  return CANPACKET_HEAD_SIZE + ts_size + dlc_to_len[header >> 4U];
+}
+
+// returns true if the frame was held for a timed send
+static bool comms_can_write_packet(const uint8_t *data, uint32_t len) {
+  CANPacket_t to_push = {0};
+  bool timed = false;
+
+  // the only place the checksum is checked, the frames are trusted from here on
+  if (calculate_checksum(data, len) != 0U) {
+    uint8_t bus_number = (data[0] >> 1U) & 0x7U;
+    if (bus_number < PANDA_CAN_CNT) {
+      can_health[CAN_NUM_FROM_BUS_NUM(bus_number)].total_tx_checksum_error_cnt += 1U;
+    }
+  } else if ((can_comms_flags & CAN_COMMS_FLAG_TX_TIMESTAMPS) != 0U) {
+    uint32_t target;
+    BYTE_ARRAY_TO_WORD(target, &data[CANPACKET_HEAD_SIZE]);
+    (void)memcpy((uint8_t*)&to_push, data, CANPACKET_HEAD_SIZE);
+    (void)memcpy(to_push.data, &data[CANPACKET_HEAD_SIZE + CAN_COMMS_TIMESTAMP_SIZE], len - CANPACKET_HEAD_SIZE - CAN_COMMS_TIMESTAMP_SIZE);
+
+    if ((target != 0U) && (((target - microsecond_timer_get()) - 1U) < 0x7FFFFFFFU)) {
+      tx_buffer_overflow += can_tx_timed_push(&to_push, target) ? 0U : 1U;
+      timed = true;
+    } else {
+      can_send(&to_push, to_push.bus, false);
+    }
+  } else {
+    (void)memcpy((uint8_t*)&to_push, data, len);
+    can_send(&to_push, to_push.bus, false);
+  }
+  return timed;
+}
+
 // send on CAN
 void comms_can_write(const uint8_t *data, uint32_t len) {
   uint32_t pos = 0U;
+  bool timed = false;
 
   // Assembling can message with data from buffer
   if (can_write_buffer.ptr != 0U) {
     if (can_write_buffer.tail_size <= (len - pos)) {
       // we have enough data to complete the buffer
-      CANPacket_t to_push = {0};
       (void)memcpy(&can_write_buffer.data[can_write_buffer.ptr], &data[pos], can_write_buffer.tail_size);
       can_write_buffer.ptr += can_write_buffer.tail_size;
       pos += can_write_buffer.tail_size;
 
       // send out
-      (void)memcpy((uint8_t*)&to_push, can_write_buffer.data, can_write_buffer.ptr);
-      can_send(&to_push, to_push.bus, false);
+      timed = comms_can_write_packet(can_write_buffer.data, can_write_buffer.ptr) || timed;
 
       // reset overflow buffer
       can_write_buffer.ptr = 0U;
@@ -109,11 +300,9 @@ void comms_can_write(const uint8_t *data, uint32_t len) {
 
   // rest of the message
   while (pos < len) {
-    uint32_t pckt_len = CANPACKET_HEAD_SIZE + dlc_to_len[(data[pos] >> 4U)];
+    uint32_t pckt_len = comms_can_write_packet_len(data[pos]);
     if ((pos + pckt_len) <= len) {
-      CANPacket_t to_push = {0};
-      (void)memcpy((uint8_t*)&to_push, &data[pos], pckt_len);
-      can_send(&to_push, to_push.bus, false);
+      timed = comms_can_write_packet(&data[pos], pckt_len) || timed;
       pos += pckt_len;
     } else {
       (void)memcpy(can_write_buffer.data, &data[pos], len - pos);
@@ -123,22 +312,58 @@ void comms_can_write(const uint8_t *data, uint32_t len) {
     }
   }
 
+  if (timed) {
+    can_tx_timed_timer_kick();
+  }
   refresh_can_tx_slots_available();
 }
 
-void comms_can_reset(void) {
+void comms_can_reset(uint16_t flags) {
+  can_comms_flags = flags & CAN_COMMS_FLAGS_SUPPORTED;
   can_write_buffer.ptr = 0U;
   can_write_buffer.tail_size = 0U;
-  can_read_buffer.ptr = 0U;
-  can_read_buffer.tail_size = 0U;
+  can_tx_timed_clear();
+
+  // drop the packet partially sent to the host
+  if (can_read_ring != CAN_RX_RING_CNT) {
+    can_rx_ring *q = &can_rx_rings[can_read_ring];
+    q->read_offset = 0U;
+    can_rx_release(q, can_rx_packet_len(q, 0U));
+    can_read_ring = CAN_RX_RING_CNT;
+  }
+  if (can_rx_prio_ring.read_offset != 0U) {
+    can_rx_prio_ring.read_offset = 0U;
+    can_rx_release(&can_rx_prio_ring, can_rx_packet_len(&can_rx_prio_ring, 0U));
+  }
+}
+
+// true if a transfer of up to max_msgs frames can be taken. With TX credits the host only
+// sends what fits in each bus's TX queue, so one stalled bus doesn't hold up the others.
+bool can_tx_comms_writable(uint32_t max_msgs) {
+  bool queues_ok = ((can_comms_flags & CAN_COMMS_FLAG_TX_CREDITS) != 0U) || can_tx_check_min_slots_free(max_msgs);
+  return queues_ok && (can_tx_timed_slots_empty() >= max_msgs);
+}
+
+// uint16 free slots of each bus TX queue, then of the timed TX heap
+uint32_t can_tx_credits_get(uint8_t *resp) {
+  uint32_t credits[CAN_TX_CREDITS_CNT] = {
+    can_slots_empty(&can_tx1_q),
+    can_slots_empty(&can_tx2_q),
+    can_slots_empty(&can_tx3_q),
+    can_tx_timed_slots_empty(),
+  };
+  for (uint32_t i = 0U; i < CAN_TX_CREDITS_CNT; i++) {
+    resp[2U * i] = (uint8_t)(credits[i] & 0xFFU);
+    resp[(2U * i) + 1U] = (uint8_t)((credits[i] >> 8U) & 0xFFU);
+  }
+  return 2U * CAN_TX_CREDITS_CNT;
 }
 
-// TODO: make this more general!
 void refresh_can_tx_slots_available(void) {
-  if (can_tx_check_min_slots_free(MAX_CAN_MSGS_PER_USB_BULK_TRANSFER)) {
+  if (can_tx_comms_writable(MAX_CAN_MSGS_PER_USB_BULK_TRANSFER)) {
     can_tx_comms_resume_usb();
   }
-  if (can_tx_check_min_slots_free(MAX_CAN_MSGS_PER_SPI_BULK_TRANSFER)) {
+  if (can_tx_comms_writable(MAX_CAN_MSGS_PER_SPI_BULK_TRANSFER)) {
     can_tx_comms_resume_spi();
   }
 }
@@ -7,8 +7,19 @@ typedef struct {
   uint16_t length;
 } __attribute__((packed)) ControlPacket_t;
 
+// CAN wire format options, requested by the host on communications reset (0xc0)
+#define CAN_COMMS_FLAG_TIMESTAMPS 0x1U // 4 byte microsecond timestamp after the header of packets sent to the host
+#define CAN_COMMS_FLAG_TX_TIMESTAMPS 0x2U // 4 byte target send time after the header of packets from the host
+#define CAN_COMMS_FLAG_TX_CREDITS 0x4U // host only sends frames that fit in the per-bus TX credits (0xc7)
+#define CAN_COMMS_FLAGS_SUPPORTED (CAN_COMMS_FLAG_TIMESTAMPS | CAN_COMMS_FLAG_TX_TIMESTAMPS | CAN_COMMS_FLAG_TX_CREDITS)
+#define CAN_COMMS_TIMESTAMP_SIZE 4U
+#define CAN_TX_CREDITS_CNT 4U // free slots in the three bus TX queues and the timed TX heap
+
 int comms_control_handler(ControlPacket_t *req, uint8_t *resp);
 void comms_endpoint2_write(const uint8_t *data, uint32_t len);
 void comms_can_write(const uint8_t *data, uint32_t len);
 int comms_can_read(uint8_t *data, uint32_t max_len);
-void comms_can_reset(void);
+int comms_can_prio_read(uint8_t *data, uint32_t max_len);
+void can_prio_set_active(bool active);
+void comms_can_reset(uint16_t flags);
+uint32_t can_tx_credits_get(uint8_t *resp);
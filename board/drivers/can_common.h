@@ -17,24 +17,49 @@ bool can_loopback = false;
   extern can_ring can_##x; \
   can_ring can_##x = { .w_ptr = 0, .r_ptr = 0, .fifo_size = (size), .elems = (CANPacket_t *)&(elems_##x) };
 
-#define CAN_RX_BUFFER_SIZE 4096U
+// RX rings, one byte ring per producer
+#define can_rx_buffer(x, size) \
+  static uint8_t buf_##x[size] CAN_RX_BUFFER_SECTION;
+
+// 304KB in total, ~4500 classic frames per RX ring
+#define CAN_RX_RING_SIZE 0x14000U
+#define CAN_ECHO_RING_SIZE 0x4000U
+#define CAN_REJECT_RING_SIZE 0x4000U
+#define CAN_PRIO_RING_SIZE 0x1000U
 #define CAN_TX_BUFFER_SIZE 416U
 
 #ifdef STM32H7
 // ITCM RAM and DTCM RAM are the fastest for Cortex-M7 core access
-__attribute__((section(".axisram"))) can_buffer(rx_q, CAN_RX_BUFFER_SIZE)
+#define CAN_RX_BUFFER_SECTION __attribute__((section(".axisram")))
 __attribute__((section(".itcmram"))) can_buffer(tx1_q, CAN_TX_BUFFER_SIZE)
 __attribute__((section(".itcmram"))) can_buffer(tx2_q, CAN_TX_BUFFER_SIZE)
 #else  // kept for PC
-can_buffer(rx_q, CAN_RX_BUFFER_SIZE)
+#define CAN_RX_BUFFER_SECTION
 can_buffer(tx1_q, CAN_TX_BUFFER_SIZE)
 can_buffer(tx2_q, CAN_TX_BUFFER_SIZE)
 #endif
 can_buffer(tx3_q, CAN_TX_BUFFER_SIZE)
 
+can_rx_buffer(rx1_q, CAN_RX_RING_SIZE)
+can_rx_buffer(rx2_q, CAN_RX_RING_SIZE)
+can_rx_buffer(rx3_q, CAN_RX_RING_SIZE)
+can_rx_buffer(echo1_q, CAN_ECHO_RING_SIZE)
+can_rx_buffer(echo2_q, CAN_ECHO_RING_SIZE)
+can_rx_buffer(echo3_q, CAN_ECHO_RING_SIZE)
+can_rx_buffer(reject_q, CAN_REJECT_RING_SIZE)
+can_rx_buffer(prio_q, CAN_PRIO_RING_SIZE)
+
 // FIXME:
 // cppcheck-suppress misra-c2012-9.3
 can_ring *can_queues[PANDA_CAN_CNT] = {&can_tx1_q, &can_tx2_q, &can_tx3_q};
+// indexed with CAN_RX_RING_{RX,ECHO,REJECT}
+#define CAN_RX_RING(x) { .w_ptr = 0U, .r_ptr = 0U, .size = sizeof(buf_##x), .buf = buf_##x, .read_offset = 0U, .clear_ptr = sizeof(buf_##x) }
+can_rx_ring can_rx_rings[CAN_RX_RING_CNT] = {
+  CAN_RX_RING(rx1_q), CAN_RX_RING(rx2_q), CAN_RX_RING(rx3_q),
+  CAN_RX_RING(echo1_q), CAN_RX_RING(echo2_q), CAN_RX_RING(echo3_q),
+  CAN_RX_RING(reject_q),
+};
+can_rx_ring can_rx_prio_ring = CAN_RX_RING(prio_q);
 
 // ********************* interrupt safe queue *********************
 bool can_pop(can_ring *q, CANPacket_t *elem) {
@@ -55,6 +80,19 @@ bool can_pop(can_ring *q, CANPacket_t *elem) {
   return ret;
 }
 
+bool can_peek(can_ring *q, CANPacket_t *elem) {
+  bool ret = false;
+
+  ENTER_CRITICAL();
+  if (q->w_ptr != q->r_ptr) {
+    *elem = q->elems[q->r_ptr];
+    ret = true;
+  }
+  EXIT_CRITICAL();
+
+  return ret;
+}
+
 bool can_push(can_ring *q, const CANPacket_t *elem) {
   bool ret = false;
   uint32_t next_w_ptr;
@@ -74,9 +112,7 @@ bool can_push(can_ring *q, const CANPacket_t *elem) {
   if (!ret) {
     #ifdef DEBUG
       print("can_push to ");
-      if (q == &can_rx_q) {
-        print("can_rx_q");
-      } else if (q == &can_tx1_q) {
+      if (q == &can_tx1_q) {
         print("can_tx1_q");
       } else if (q == &can_tx2_q) {
         print("can_tx2_q");
@@ -114,6 +150,94 @@ void can_clear(can_ring *q) {
   refresh_can_tx_slots_available();
 }
 
+// ********************* lock-free RX rings *********************
+// Each ring has a single producer, only the producer writes w_ptr and only the consumer writes r_ptr.
+// The barriers order the buffer accesses against the pointer updates.
+bool can_rx_ring_push(can_rx_ring *q, const CANPacket_t *elem, uint32_t timestamp) {
+  bool ret = false;
+  uint32_t data_len = dlc_to_len[elem->data_len_code];
+  uint32_t len = CAN_RX_PACKET_SIZE(data_len);
+  uint32_t w_ptr = q->w_ptr;
+  uint32_t r_ptr = q->r_ptr;
+  uint32_t space = (r_ptr > w_ptr) ? (r_ptr - w_ptr - 1U) : ((q->size - 1U) - (w_ptr - r_ptr));
+
+  if (len <= space) {
+    // serialize in the wire format. Frames inside the firmware don't carry a valid checksum,
+    // it's only computed here on the way to the host, and covers the timestamp
+    uint8_t pkt[CAN_RX_PACKET_SIZE(CANPACKET_DATA_SIZE_MAX)];
+    (void)memcpy(pkt, (const uint8_t *)elem, CANPACKET_HEAD_SIZE);
+    pkt[5] = 0U;
+    WORD_TO_BYTE_ARRAY(&pkt[CANPACKET_HEAD_SIZE], timestamp);
+    (void)memcpy(&pkt[CANPACKET_HEAD_SIZE + CAN_COMMS_TIMESTAMP_SIZE], elem->data, data_len);
+    pkt[5] = calculate_checksum(pkt, len);
+
+    // don't overwrite the bytes before the consumer is done with them
+    __DMB();
+    uint32_t first = MIN(len, q->size - w_ptr);
+    (void)memcpy(&q->buf[w_ptr], pkt, first);
+    (void)memcpy(q->buf, &pkt[first], len - first);
+    // publish the packet before the pointer
+    __DMB();
+    q->w_ptr = ((w_ptr + len) >= q->size) ? ((w_ptr + len) - q->size) : (w_ptr + len);
+    ret = true;
+  }
+  return ret;
+}
+
+bool can_rx_push(uint8_t ring, const CANPacket_t *elem, uint32_t timestamp) {
+  return can_rx_ring_push(&can_rx_rings[ring], elem, timestamp);
+}
+
+// bytes waiting in the ring, which can be read after this returns
+uint32_t can_rx_pending(const can_rx_ring *q) {
+  uint32_t w_ptr = q->w_ptr;
+  uint32_t r_ptr = q->r_ptr;
+  __DMB();
+  return (w_ptr >= r_ptr) ? (w_ptr - r_ptr) : ((q->size - r_ptr) + w_ptr);
+}
+
+// copies len bytes at offset from the read pointer, in at most two memcpys
+void can_rx_read(const can_rx_ring *q, uint32_t offset, uint8_t *dst, uint32_t len) {
+  uint32_t start = q->r_ptr + offset;
+  if (start >= q->size) {
+    start -= q->size;
+  }
+  uint32_t first = MIN(len, q->size - start);
+  (void)memcpy(dst, &q->buf[start], first);
+  (void)memcpy(&dst[first], q->buf, len - first);
+}
+
+// frees len bytes once they've been read
+void can_rx_release(can_rx_ring *q, uint32_t len) {
+  uint32_t r_ptr = q->r_ptr + len;
+  if (r_ptr >= q->size) {
+    r_ptr -= q->size;
+  }
+  if (q->clear_ptr != q->size) {
+    r_ptr = q->clear_ptr;
+    q->clear_ptr = q->size;
+  }
+  __DMB();
+  q->r_ptr = r_ptr;
+}
+
+// consumer side only, producers keep running.
+// A packet partially sent to the host is kept until it's complete, so the stream stays aligned.
+static void can_rx_ring_clear(can_rx_ring *q) {
+  if (q->read_offset == 0U) {
+    q->r_ptr = q->w_ptr;
+  } else {
+    q->clear_ptr = q->w_ptr;
+  }
+}
+
+void can_rx_clear(void) {
+  for (uint8_t i = 0U; i < CAN_RX_RING_CNT; i++) {
+    can_rx_ring_clear(&can_rx_rings[i]);
+  }
+  can_rx_ring_clear(&can_rx_prio_ring);
+}
+
 // assign CAN numbering
 // bus num: CAN Bus numbers in panda, sent to/from USB
 //    Min: 0; Max: 127; Bit 7 marks message as receipt (bus 129 is receipt for but 1)
@@ -126,9 +250,9 @@ void can_clear(can_ring *q) {
 // Helpers
 // Panda:       Bus 0=CAN1   Bus 1=CAN2   Bus 2=CAN3
 bus_config_t bus_config[PANDA_CAN_CNT] = {
-  { .bus_lookup = 0U, .can_num_lookup = 0U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false },
-  { .bus_lookup = 1U, .can_num_lookup = 1U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false },
-  { .bus_lookup = 2U, .can_num_lookup = 2U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false },
+  { .bus_lookup = 0U, .can_num_lookup = 0U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false, .tx_fifo_el_cnt = 1U, .tx_queue_mode = false },
+  { .bus_lookup = 1U, .can_num_lookup = 1U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false, .tx_fifo_el_cnt = 1U, .tx_queue_mode = false },
+  { .bus_lookup = 2U, .can_num_lookup = 2U, .forwarding_bus = -1, .can_speed = 5000U, .can_data_speed = 20000U, .canfd_auto = false, .canfd_enabled = false, .brs_enabled = false, .canfd_non_iso = false, .tx_fifo_el_cnt = 1U, .tx_queue_mode = false },
 };
 
 void can_init_all(void) {
@@ -160,20 +284,7 @@ bool can_tx_check_min_slots_free(uint32_t min) {
 }
 
 uint8_t calculate_checksum(const uint8_t *dat, uint32_t len) {
-  uint8_t checksum = 0U;
-  for (uint32_t i = 0U; i < len; i++) {
-    checksum ^= dat[i];
-  }
-  return checksum;
-}
-
-void can_set_checksum(CANPacket_t *packet) {
-  packet->checksum = 0U;
-  packet->checksum = calculate_checksum((uint8_t *) packet, CANPACKET_HEAD_SIZE + GET_LEN(packet));
-}
-
-bool can_check_checksum(CANPacket_t *packet) {
-  return (calculate_checksum((uint8_t *) packet, CANPACKET_HEAD_SIZE + GET_LEN(packet)) == 0U);
+  return checksum_xor(0U, dat, len);
 }
 
 void can_send(CANPacket_t *to_push, uint8_t bus_number, bool skip_tx_hook) {
@@ -187,10 +298,10 @@ void can_send(CANPacket_t *to_push, uint8_t bus_number, bool skip_tx_hook) {
     safety_tx_blocked += 1U;
     to_push->returned = 0U;
     to_push->rejected = 1U;
-
-    // data changed
-    can_set_checksum(to_push);
-    rx_buffer_overflow += can_push(&can_rx_q, to_push) ? 0U : 1U;
+    // host writes, the TX timers and forwarding from the RX interrupts all reject into this ring
+    ENTER_CRITICAL();
+    rx_buffer_overflow += can_rx_push(CAN_RX_RING_REJECT, to_push, microsecond_timer_get()) ? 0U : 1U;
+    EXIT_CRITICAL();
   }
 }
 
@@ -0,0 +1,59 @@
+#include "board/drivers/drivers.h"
+
+// Host configurable CAN RX filters, applied in software right before frames are queued for
+// the host. They're not programmed into the FDCAN filter elements: frames the core rejects
+// never reach can_rx(), so the safety, ignition and forwarding hooks would miss them and
+// they wouldn't be counted in total_rx_filtered_cnt.
+
+#define CAN_FILTER_EXT_ID_MAX 0x1FFFFFFFU
+
+can_filter_t can_filters[PANDA_CAN_CNT];
+
+static bool can_filter_std_id_set(const can_filter_t *filter, uint32_t addr) {
+  return ((filter->std_bitmap[addr / 32U] >> (addr % 32U)) & 1U) != 0U;
+}
+
+void can_filter_clear(can_filter_t *filter) {
+  (void)memset(filter, 0, sizeof(can_filter_t));
+}
+
+bool can_filter_add_std(can_filter_t *filter, uint32_t addr) {
+  bool ret = false;
+  if (addr < CAN_FILTER_STD_ID_CNT) {
+    filter->std_bitmap[addr / 32U] |= (1UL << (addr % 32U));
+    ret = true;
+  }
+  return ret;
+}
+
+bool can_filter_add_ext_range(can_filter_t *filter, uint32_t start, uint32_t end) {
+  bool ret = false;
+  if ((start <= end) && (end <= CAN_FILTER_EXT_ID_MAX)) {
+    if (filter->ext_range_cnt < CAN_FILTER_EXT_RANGE_MAX) {
+      filter->ext_range_start[filter->ext_range_cnt] = start;
+      filter->ext_range_end[filter->ext_range_cnt] = end;
+      filter->ext_range_cnt += 1U;
+      ret = true;
+    } else {
+      // deliver more than requested rather than silently dropping frames the host asked for
+      filter->ext_overflow = true;
+    }
+  }
+  return ret;
+}
+
+bool can_filter_match(const can_filter_t *filter, uint32_t addr, bool extended) {
+  bool ret = !filter->enabled;
+  if (!ret) {
+    if (extended) {
+      ret = filter->ext_overflow;
+      for (uint8_t i = 0U; (i < filter->ext_range_cnt) && !ret; i++) {
+        ret = (addr >= filter->ext_range_start[i]) && (addr <= filter->ext_range_end[i]);
+      }
+    } else if (addr < CAN_FILTER_STD_ID_CNT) {
+      ret = can_filter_std_id_set(filter, addr);
+    } else {
+    }
+  }
+  return ret;
+}
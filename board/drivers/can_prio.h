@@ -0,0 +1,51 @@
+#include "board/drivers/drivers.h"
+
+// Host configurable list of priority CAN IDs. While the host polls the USB interrupt
+// endpoint (alt setting USB_ALT_PRIO), received frames with these IDs go to their own
+// RX ring that's sent from there, the rest keep going over the bulk endpoint.
+// Frames go to the bulk endpoint as well when the priority ring is full.
+
+can_prio_id_t can_prio_ids[CAN_PRIO_ID_CNT];
+static bool can_prio_active = false;
+
+void can_prio_clear(void) {
+  (void)memset(can_prio_ids, 0, sizeof(can_prio_ids));
+}
+
+bool can_prio_set(uint8_t idx, const can_prio_id_t *id) {
+  bool ret = false;
+  uint32_t addr_max = id->extended ? 0x1FFFFFFFU : 0x7FFU;
+  if ((idx < CAN_PRIO_ID_CNT) && (id->bus < PANDA_CAN_CNT) && (id->addr <= addr_max)) {
+    can_prio_ids[idx] = *id;
+    ret = true;
+  }
+  return ret;
+}
+
+bool can_prio_match(uint8_t bus, uint32_t addr, bool extended) {
+  bool ret = false;
+  for (uint8_t i = 0U; (i < CAN_PRIO_ID_CNT) && !ret; i++) {
+    const can_prio_id_t *id = &can_prio_ids[i];
+    ret = id->enabled && (id->bus == bus) && (id->addr == addr) && (id->extended == extended);
+  }
+  return ret;
+}
+
+void can_prio_set_active(bool active) {
+  can_prio_active = active;
+}
+
+// called from can_rx(), returns false if the frame goes to the bulk endpoint instead
+bool can_prio_rx_push(uint8_t bus, const CANPacket_t *pkt, uint32_t timestamp) {
+  bool ret = false;
+  if (can_prio_active && can_prio_match(bus, pkt->addr, pkt->extended != 0U)) {
+    // the RX interrupts of all CAN cores feed this ring
+    ENTER_CRITICAL();
+    ret = can_rx_ring_push(&can_rx_prio_ring, pkt, timestamp);
+    EXIT_CRITICAL();
+    if (ret) {
+      can_prio_comms_resume_usb();
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,100 @@
+#include "board/drivers/drivers.h"
+
+// Periodic CAN TX scheduler. Entries are sent through can_send(), so the safety hooks
+// still apply. can_sched_run() is called from a timer compare interrupt at the next
+// deadline and doesn't touch the hardware itself.
+
+can_sched_entry_t can_sched_entries[CAN_SCHED_ENTRY_CNT];
+can_sched_stats_t can_sched_stats[CAN_SCHED_ENTRY_CNT];
+
+void can_sched_clear(void) {
+  (void)memset(can_sched_entries, 0, sizeof(can_sched_entries));
+  (void)memset(can_sched_stats, 0, sizeof(can_sched_stats));
+}
+
+// entries with a zero period are disabled, the first send is right away
+bool can_sched_set(uint8_t idx, const can_sched_entry_t *entry, uint32_t now) {
+  bool ret = false;
+  if (idx < CAN_SCHED_ENTRY_CNT) {
+    uint32_t data_len = dlc_to_len[entry->pkt.data_len_code];
+    bool counter_valid = !entry->counter_enabled ||
+                         ((entry->counter_byte < data_len) && (entry->counter_width > 0U) && ((entry->counter_shift + entry->counter_width) <= 8U));
+    bool checksum_valid = (entry->checksum == CAN_SCHED_CHECKSUM_NONE) ||
+                          (((entry->checksum == CAN_SCHED_CHECKSUM_XOR) || (entry->checksum == CAN_SCHED_CHECKSUM_SUM)) && (data_len > 0U));
+
+    if ((entry->period_us == 0U) || ((entry->period_us >= CAN_SCHED_PERIOD_MIN_US) && counter_valid && checksum_valid && (entry->pkt.bus < PANDA_CAN_CNT))) {
+      ENTER_CRITICAL();
+      can_sched_entries[idx] = *entry;
+      can_sched_entries[idx].enabled = (entry->period_us != 0U);
+      can_sched_entries[idx].counter = 0U;
+      can_sched_entries[idx].next = now;
+      (void)memset(&can_sched_stats[idx], 0, sizeof(can_sched_stats_t));
+      EXIT_CRITICAL();
+      ret = true;
+    }
+  }
+  return ret;
+}
+
+static void can_sched_send(can_sched_entry_t *entry) {
+  CANPacket_t to_send = entry->pkt;
+  uint32_t data_len = dlc_to_len[to_send.data_len_code];
+
+  if (entry->counter_enabled) {
+    uint8_t mask = (uint8_t)(((1U << entry->counter_width) - 1U) << entry->counter_shift);
+    to_send.data[entry->counter_byte] = (to_send.data[entry->counter_byte] & ~mask) | ((entry->counter << entry->counter_shift) & mask);
+    entry->counter = (entry->counter + 1U) & ((1U << entry->counter_width) - 1U);
+  }
+
+  if (entry->checksum == CAN_SCHED_CHECKSUM_XOR) {
+    uint8_t checksum = 0U;
+    for (uint32_t i = 0U; i < (data_len - 1U); i++) {
+      checksum ^= to_send.data[i];
+    }
+    to_send.data[data_len - 1U] = checksum;
+  } else if (entry->checksum == CAN_SCHED_CHECKSUM_SUM) {
+    uint32_t checksum = (to_send.addr & 0xFFU) + ((to_send.addr >> 8) & 0xFFU) + ((to_send.addr >> 16) & 0xFFU) + (to_send.addr >> 24) + data_len;
+    for (uint32_t i = 0U; i < (data_len - 1U); i++) {
+      checksum += to_send.data[i];
+    }
+    to_send.data[data_len - 1U] = (uint8_t)(checksum & 0xFFU);
+  } else {
+    // no checksum
+  }
+
+  can_send(&to_send, to_send.bus, false);
+}
+
+// sends everything that's due, returns false if nothing is scheduled, otherwise next is set to the earliest deadline
+bool can_sched_run(uint32_t now, uint32_t *next) {
+  bool scheduled = false;
+  uint32_t earliest = 0U;
+
+  for (uint8_t i = 0U; i < CAN_SCHED_ENTRY_CNT; i++) {
+    can_sched_entry_t *entry = &can_sched_entries[i];
+    if (entry->enabled) {
+      uint32_t late = now - entry->next;
+      if (late < 0x80000000U) {
+        // skip the periods that are already over
+        uint32_t missed = late / entry->period_us;
+        late -= missed * entry->period_us;
+
+        can_sched_stats[i].miss_cnt += missed;
+        can_sched_stats[i].sent_cnt += 1U;
+        can_sched_stats[i].last_jitter_us = late;
+        can_sched_stats[i].max_jitter_us = MAX(can_sched_stats[i].max_jitter_us, late);
+        can_sched_send(entry);
+
+        entry->next += (missed + 1U) * entry->period_us;
+      }
+
+      if (!scheduled || ((entry->next - now) < (earliest - now))) {
+        earliest = entry->next;
+      }
+      scheduled = true;
+    }
+  }
+
+  *next = earliest;
+  return scheduled;
+}
@@ -0,0 +1,119 @@
+#include "board/drivers/drivers.h"
+
+// Bookkeeping of what was put in which FDCAN Tx buffer, so pending frames can be cancelled
+// individually. The core sends pending buffers in arbitration order, lowest buffer number
+// first on equal IDs, so frames that have to go out in the order they were sent in are only
+// put where arbitration keeps them behind everything already pending. A slot stays taken
+// until the Tx Event FIFO reports its frame completed, matched by the message marker, or
+// its cancellation finished. Nothing here touches the hardware.
+
+void can_tx_slots_init(can_tx_slots_t *slots, uint8_t cnt) {
+  (void)memset(slots, 0, sizeof(can_tx_slots_t));
+  slots->cnt = MIN(cnt, CAN_TX_SLOT_CNT_MAX);
+}
+
+// lower goes first: 11 bit base ID, then standard before extended, then the 18 extended ID bits
+static uint32_t can_tx_arbitration_key(uint32_t addr, bool extended) {
+  uint32_t key;
+  if (extended) {
+    key = (((addr >> 18) & 0x7FFU) << 19) | (1UL << 18) | (addr & 0x3FFFFU);
+  } else {
+    key = (addr & 0x7FFU) << 19;
+  }
+  return key;
+}
+
+// returns a free slot for the frame, CAN_TX_SLOT_NONE if there is none.
+// in_order: only a slot the core will send after all pending slots
+uint8_t can_tx_slot_alloc(const can_tx_slots_t *slots, uint32_t pending, uint32_t addr, bool extended, bool in_order) {
+  uint8_t ret = CAN_TX_SLOT_NONE;
+  uint8_t first = 0U;
+  bool blocked = false;
+
+  if (in_order) {
+    uint32_t key = can_tx_arbitration_key(addr, extended);
+    for (uint8_t i = 0U; i < slots->cnt; i++) {
+      if (((pending >> i) & 1U) != 0U) {
+        uint32_t pending_key = can_tx_arbitration_key(slots->slot[i].addr, slots->slot[i].extended);
+        if (pending_key > key) {
+          blocked = true;
+        } else if (pending_key == key) {
+          first = i + 1U;
+        } else {
+          // goes out first anyway
+        }
+      }
+    }
+  }
+
+  if (!blocked) {
+    uint32_t taken = pending | slots->awaiting;
+    for (uint8_t i = first; i < slots->cnt; i++) {
+      if (((taken >> i) & 1U) == 0U) {
+        ret = i;
+        break;
+      }
+    }
+  }
+  return ret;
+}
+
+// returns the message marker to put in the Tx buffer element
+uint8_t can_tx_slot_set(can_tx_slots_t *slots, uint8_t idx, const CANPacket_t *echo, uint32_t timestamp) {
+  uint8_t marker = 0U;
+  if (idx < slots->cnt) {
+    can_tx_slot_t *slot = &slots->slot[idx];
+    // a new generation, so a stale event of the previous frame in this slot can't match
+    marker = (uint8_t)(((slot->marker + (CAN_TX_MARKER_IDX_MASK + 1U)) & ~CAN_TX_MARKER_IDX_MASK) | idx);
+    slot->echo = *echo;
+    slot->addr = echo->addr;
+    slot->extended = (echo->extended != 0U);
+    slot->timestamp = timestamp;
+    slot->marker = marker;
+    slots->awaiting |= (1UL << idx);
+  }
+  return marker;
+}
+
+// frees the slot of a completed frame, echo is set to what was sent
+bool can_tx_slot_complete(can_tx_slots_t *slots, uint8_t marker, CANPacket_t *echo) {
+  bool ret = false;
+  uint8_t idx = marker & CAN_TX_MARKER_IDX_MASK;
+  if ((idx < slots->cnt) && (((slots->awaiting >> idx) & 1U) != 0U) && (slots->slot[idx].marker == marker)) {
+    *echo = slots->slot[idx].echo;
+    slots->awaiting &= ~(1UL << idx);
+    slots->host_cancelled &= ~(1UL << idx);
+    ret = true;
+  }
+  return ret;
+}
+
+// frees slots whose frames will never complete, returns how many there were
+uint32_t can_tx_slots_drop(can_tx_slots_t *slots, uint32_t mask) {
+  uint32_t cnt = 0U;
+  for (uint32_t dropped = slots->awaiting & mask; dropped != 0U; dropped &= (dropped - 1U)) {
+    cnt += 1U;
+  }
+  slots->awaiting &= ~mask;
+  slots->host_cancelled &= ~mask;
+  return cnt;
+}
+
+// returns the bitmask of pending slots with the address if match_addr, and at least older_than_us old
+uint32_t can_tx_slots_match(const can_tx_slots_t *slots, uint32_t pending, bool match_addr, uint32_t addr, uint32_t older_than_us, uint32_t now) {
+  uint32_t ret = 0U;
+  for (uint8_t i = 0U; i < slots->cnt; i++) {
+    const can_tx_slot_t *slot = &slots->slot[i];
+    if ((((pending >> i) & 1U) != 0U) && (!match_addr || (slot->addr == addr)) && ((now - slot->timestamp) >= older_than_us)) {
+      ret |= (1UL << i);
+    }
+  }
+  return ret;
+}
+
+// microsecond timer value of a Tx event, from the timestamp counter counting nominal bit times.
+// can_speed is in kbps multiplied by 10, the counter wraps around after 65536 bits
+uint32_t can_tx_event_timestamp(uint32_t now, uint16_t tsc_now, uint16_t tsc_event, uint32_t can_speed) {
+  uint32_t bits = ((uint32_t)tsc_now - tsc_event) & 0xFFFFU;
+  return now - ((bits * 10000U) / can_speed);
+}
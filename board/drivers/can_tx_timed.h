@@ -0,0 +1,116 @@
+#include "board/drivers/drivers.h"
+
+// Frames from the host with a target send time, held in a min-heap ordered by target
+// until due. They go through can_send() when released, so the safety hooks apply at
+// send time. can_tx_timed_run() is called from a timer compare interrupt at the
+// earliest target and doesn't touch the hardware itself.
+// All targets are within 2^31 us of the current time, which keeps the ordering valid
+// across the timer wraparound.
+
+static can_tx_timed_t can_tx_timed_heap[CAN_TX_TIMED_CNT];
+static uint32_t can_tx_timed_cnt = 0U;
+static uint32_t can_tx_timed_seq = 0U;
+
+// true if a goes out before b
+static bool can_tx_timed_before(const can_tx_timed_t *a, const can_tx_timed_t *b) {
+  bool ret;
+  if (a->target != b->target) {
+    ret = (b->target - a->target) < 0x80000000U;
+  } else {
+    ret = (b->seq - a->seq) < 0x80000000U;
+  }
+  return ret;
+}
+
+static void can_tx_timed_swap(uint32_t a, uint32_t b) {
+  can_tx_timed_t tmp = can_tx_timed_heap[a];
+  can_tx_timed_heap[a] = can_tx_timed_heap[b];
+  can_tx_timed_heap[b] = tmp;
+}
+
+void can_tx_timed_clear(void) {
+  ENTER_CRITICAL();
+  can_tx_timed_cnt = 0U;
+  EXIT_CRITICAL();
+}
+
+uint32_t can_tx_timed_slots_empty(void) {
+  return CAN_TX_TIMED_CNT - can_tx_timed_cnt;
+}
+
+bool can_tx_timed_push(const CANPacket_t *pkt, uint32_t target) {
+  bool ret = false;
+
+  ENTER_CRITICAL();
+  if (can_tx_timed_cnt < CAN_TX_TIMED_CNT) {
+    uint32_t i = can_tx_timed_cnt;
+    can_tx_timed_heap[i].pkt = *pkt;
+    can_tx_timed_heap[i].target = target;
+    can_tx_timed_heap[i].seq = can_tx_timed_seq;
+    can_tx_timed_seq++;
+    can_tx_timed_cnt++;
+
+    // sift up
+    while (i > 0U) {
+      uint32_t parent = (i - 1U) / 2U;
+      if (!can_tx_timed_before(&can_tx_timed_heap[i], &can_tx_timed_heap[parent])) {
+        break;
+      }
+      can_tx_timed_swap(i, parent);
+      i = parent;
+    }
+    ret = true;
+  }
+  EXIT_CRITICAL();
+
+  return ret;
+}
+
+static void can_tx_timed_pop(CANPacket_t *pkt) {
+  *pkt = can_tx_timed_heap[0].pkt;
+  can_tx_timed_cnt--;
+  can_tx_timed_heap[0] = can_tx_timed_heap[can_tx_timed_cnt];
+
+  // sift down
+  uint32_t i = 0U;
+  while (true) {
+    uint32_t first = i;
+    uint32_t left = (2U * i) + 1U;
+    uint32_t right = left + 1U;
+    if ((left < can_tx_timed_cnt) && can_tx_timed_before(&can_tx_timed_heap[left], &can_tx_timed_heap[first])) {
+      first = left;
+    }
+    if ((right < can_tx_timed_cnt) && can_tx_timed_before(&can_tx_timed_heap[right], &can_tx_timed_heap[first])) {
+      first = right;
+    }
+    if (first == i) {
+      break;
+    }
+    can_tx_timed_swap(i, first);
+    i = first;
+  }
+}
+
+// sends everything that's due, returns false if nothing is held, otherwise next is set to the earliest target
+bool can_tx_timed_run(uint32_t now, uint32_t *next) {
+  bool released = false;
+  bool ret = false;
+
+  ENTER_CRITICAL();
+  while ((can_tx_timed_cnt > 0U) && ((now - can_tx_timed_heap[0].target) < 0x80000000U)) {
+    CANPacket_t to_send;
+    can_tx_timed_pop(&to_send);
+    can_send(&to_send, to_send.bus, false);
+    released = true;
+  }
+  if (can_tx_timed_cnt > 0U) {
+    *next = can_tx_timed_heap[0].target;
+    ret = true;
+  }
+  EXIT_CRITICAL();
+
+  if (released) {
+    refresh_can_tx_slots_available();
+  }
+  return ret;
+}
@@ -0,0 +1,58 @@
+#include "board/drivers/drivers.h"
+
+// The periodic CAN TX scheduler and the timed TX frames run from compare channels 1 and 2
+// of the microsecond timer, which are set to their earliest deadline after every run.
+
+#define CAN_TX_TIMER_INTERRUPT_RATE ((CAN_SCHED_ENTRY_CNT * 1000000U / CAN_SCHED_PERIOD_MIN_US) + 50000U)
+
+// the compare only triggers on a match, catch deadlines that passed while running
+static void can_tx_timer_set(volatile uint32_t *ccr, uint32_t next, uint32_t generate) {
+  *ccr = next;
+  if ((microsecond_timer_get() - next) < 0x80000000U) {
+    MICROSECOND_TIMER->EGR = generate;
+  }
+}
+
+static void can_tx_timer_handler(void) {
+  uint32_t next;
+
+  if ((MICROSECOND_TIMER->SR & TIM_SR_CC1IF) != 0U) {
+    MICROSECOND_TIMER->SR = ~TIM_SR_CC1IF;
+    if (can_sched_run(microsecond_timer_get(), &next)) {
+      can_tx_timer_set(&(MICROSECOND_TIMER->CCR1), next, TIM_EGR_CC1G);
+    } else {
+      register_clear_bits(&(MICROSECOND_TIMER->DIER), TIM_DIER_CC1IE);
+    }
+  }
+
+  if ((MICROSECOND_TIMER->SR & TIM_SR_CC2IF) != 0U) {
+    MICROSECOND_TIMER->SR = ~TIM_SR_CC2IF;
+    if (can_tx_timed_run(microsecond_timer_get(), &next)) {
+      can_tx_timer_set(&(MICROSECOND_TIMER->CCR2), next, TIM_EGR_CC2G);
+    } else {
+      register_clear_bits(&(MICROSECOND_TIMER->DIER), TIM_DIER_CC2IE);
+    }
+  }
+}
+
+void can_tx_timer_init(void) {
+  REGISTER_INTERRUPT(MICROSECOND_TIMER_IRQ, can_tx_timer_handler, CAN_TX_TIMER_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_TX_TIMER)
+  MICROSECOND_TIMER->SR = 0U;
+  NVIC_EnableIRQ(MICROSECOND_TIMER_IRQ);
+}
+
+// call after changing the schedule, the handler picks the next deadline
+void can_sched_timer_kick(void) {
+  ENTER_CRITICAL();
+  register_set_bits(&(MICROSECOND_TIMER->DIER), TIM_DIER_CC1IE);
+  MICROSECOND_TIMER->EGR = TIM_EGR_CC1G;
+  EXIT_CRITICAL();
+}
+
+// call after adding timed frames
+void can_tx_timed_timer_kick(void) {
+  ENTER_CRITICAL();
+  register_set_bits(&(MICROSECOND_TIMER->DIER), TIM_DIER_CC2IE);
+  MICROSECOND_TIMER->EGR = TIM_EGR_CC2G;
+  EXIT_CRITICAL();
+}
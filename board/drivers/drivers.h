@@ -2,7 +2,7 @@
 
 #include "board/can.h"
 #include "board/health.h"
-#include "board/crc.h"
+#include "board/checksum.h"
 #ifdef STM32H7
 #include "board/stm32h7/lladc_declarations.h"
 #endif
@@ -32,6 +32,8 @@ typedef struct {
   bool canfd_enabled;
   bool brs_enabled;
   bool canfd_non_iso;
+  uint8_t tx_fifo_el_cnt; // hardware TX elements, the rest of the message RAM goes to RX
+  bool tx_queue_mode;     // send pending TX elements in CAN ID priority order instead of the order they were sent in
 } bus_config_t;
 
 extern uint32_t safety_tx_blocked;
@@ -50,6 +52,7 @@ extern bool can_loopback;
 
 // ******************* functions prototypes *********************
 bool can_init(uint8_t can_number);
+bool can_core_init(uint8_t can_number);
 void process_can(uint8_t can_number);
 
 // ********************* instantiate queues *********************
@@ -61,8 +64,38 @@ extern can_ring *can_queues[PANDA_CAN_CNT];
 
 // ********************* interrupt safe queue *********************
 bool can_pop(can_ring *q, CANPacket_t *elem);
+bool can_peek(can_ring *q, CANPacket_t *elem);
 bool can_push(can_ring *q, const CANPacket_t *elem);
 uint32_t can_slots_empty(const can_ring *q);
+
+// ********************* lock-free RX rings *********************
+// packets for the host, one single-producer/single-consumer byte ring for each producer.
+// Packets are stored back to back in the wire format with timestamp (see can_comms.h),
+// so a classic frame takes 18 bytes and may wrap around the end of the buffer.
+#define CAN_RX_RING_CNT ((2U * PANDA_CAN_CNT) + 1U)
+#define CAN_RX_RING_RX(can_number) (can_number)                    // can_rx()
+#define CAN_RX_RING_ECHO(can_number) (PANDA_CAN_CNT + (can_number)) // process_can()
+#define CAN_RX_RING_REJECT (2U * PANDA_CAN_CNT)                     // can_send()
+#define CAN_RX_PACKET_SIZE(data_len) (CANPACKET_HEAD_SIZE + CAN_COMMS_TIMESTAMP_SIZE + (data_len))
+
+typedef struct {
+  volatile uint32_t w_ptr; // byte offsets, only the producer writes w_ptr
+  volatile uint32_t r_ptr; // and only the consumer writes r_ptr
+  uint32_t size;
+  uint8_t *buf;
+  uint32_t read_offset;    // consumer: bytes of the packet at r_ptr already sent to the host
+  uint32_t clear_ptr;      // consumer: where to continue after that packet if cleared meanwhile, size otherwise
+} can_rx_ring;
+extern can_rx_ring can_rx_rings[CAN_RX_RING_CNT];
+
+extern can_rx_ring can_rx_prio_ring; // can_rx() of the priority CAN IDs, read from the USB interrupt endpoint
+
+bool can_rx_ring_push(can_rx_ring *q, const CANPacket_t *elem, uint32_t timestamp);
+bool can_rx_push(uint8_t ring, const CANPacket_t *elem, uint32_t timestamp);
+uint32_t can_rx_pending(const can_rx_ring *q);
+void can_rx_read(const can_rx_ring *q, uint32_t offset, uint8_t *dst, uint32_t len);
+void can_rx_release(can_rx_ring *q, uint32_t len);
+void can_rx_clear(void);
 extern bus_config_t bus_config[PANDA_CAN_CNT];
 
 #define CANIF_FROM_CAN_NUM(num) (cans[num])
@@ -76,11 +109,140 @@ void can_set_forwarding(uint8_t from, uint8_t to);
 #endif
 bool can_tx_check_min_slots_free(uint32_t min);
 uint8_t calculate_checksum(const uint8_t *dat, uint32_t len);
-void can_set_checksum(CANPacket_t *packet);
-bool can_check_checksum(CANPacket_t *packet);
 void can_send(CANPacket_t *to_push, uint8_t bus_number, bool skip_tx_hook);
 bool is_speed_valid(uint32_t speed, const uint32_t *all_speeds, uint8_t len);
 
+// ******************** can_filter ********************
+
+#define CAN_FILTER_STD_ID_CNT 0x800U
+#define CAN_FILTER_EXT_RANGE_MAX 16U
+
+typedef struct {
+  bool enabled;
+  bool ext_overflow; // more ranges were requested than can be stored, let all extended IDs through
+  uint32_t std_bitmap[CAN_FILTER_STD_ID_CNT / 32U];
+  uint8_t ext_range_cnt;
+  uint32_t ext_range_start[CAN_FILTER_EXT_RANGE_MAX];
+  uint32_t ext_range_end[CAN_FILTER_EXT_RANGE_MAX];
+} can_filter_t;
+
+// indexed by bus number
+extern can_filter_t can_filters[PANDA_CAN_CNT];
+
+void can_filter_clear(can_filter_t *filter);
+bool can_filter_add_std(can_filter_t *filter, uint32_t addr);
+bool can_filter_add_ext_range(can_filter_t *filter, uint32_t start, uint32_t end);
+bool can_filter_match(const can_filter_t *filter, uint32_t addr, bool extended);
+
+// ******************** can_prio ********************
+
+#define CAN_PRIO_ID_CNT 16U
+
+typedef struct {
+  uint32_t addr;
+  uint8_t bus;
+  bool extended;
+  bool enabled;
+} can_prio_id_t;
+
+extern can_prio_id_t can_prio_ids[CAN_PRIO_ID_CNT];
+
+void can_prio_clear(void);
+bool can_prio_set(uint8_t idx, const can_prio_id_t *id);
+bool can_prio_match(uint8_t bus, uint32_t addr, bool extended);
+bool can_prio_rx_push(uint8_t bus, const CANPacket_t *pkt, uint32_t timestamp);
+
+// ******************** can_tx_slots ********************
+
+// FDCAN dedicated Tx buffers of each CAN core
+#define CAN_TX_SLOT_CNT_MAX 32U
+#define CAN_TX_SLOT_NONE 0xFFU
+
+// Tx Event FIFO message marker: slot index in the low 5 bits, a per-slot generation in the high 3 bits
+#define CAN_TX_MARKER_IDX_MASK 0x1FU
+
+typedef struct {
+  uint32_t addr;
+  uint32_t timestamp; // when it was handed to the core
+  bool extended;
+  uint8_t marker;
+  CANPacket_t echo;
+} can_tx_slot_t;
+
+typedef struct {
+  uint8_t cnt;
+  uint32_t awaiting;  // bitmask of the slots handed to the core that haven't completed or been cancelled
+  uint32_t host_cancelled;  // bitmask of the awaiting slots the host asked to cancel
+  can_tx_slot_t slot[CAN_TX_SLOT_CNT_MAX];
+} can_tx_slots_t;
+
+// pending: bitmask of the slots the core hasn't sent yet (TXBRP)
+void can_tx_slots_init(can_tx_slots_t *slots, uint8_t cnt);
+uint8_t can_tx_slot_alloc(const can_tx_slots_t *slots, uint32_t pending, uint32_t addr, bool extended, bool in_order);
+uint8_t can_tx_slot_set(can_tx_slots_t *slots, uint8_t idx, const CANPacket_t *echo, uint32_t timestamp);
+bool can_tx_slot_complete(can_tx_slots_t *slots, uint8_t marker, CANPacket_t *echo);
+uint32_t can_tx_slots_drop(can_tx_slots_t *slots, uint32_t mask);
+uint32_t can_tx_slots_match(const can_tx_slots_t *slots, uint32_t pending, bool match_addr, uint32_t addr, uint32_t older_than_us, uint32_t now);
+uint32_t can_tx_event_timestamp(uint32_t now, uint16_t tsc_now, uint16_t tsc_event, uint32_t can_speed);
+
+// ******************** can_sched ********************
+
+#define CAN_SCHED_ENTRY_CNT 32U
+#define CAN_SCHED_PERIOD_MIN_US 1000U
+
+// checksum written to the last data byte
+#define CAN_SCHED_CHECKSUM_NONE 0U
+#define CAN_SCHED_CHECKSUM_XOR 1U // XOR of the other data bytes
+#define CAN_SCHED_CHECKSUM_SUM 2U // sum of the address bytes, length and other data bytes
+
+typedef struct {
+  CANPacket_t pkt;        // first, so the tests' packed CANPacket_t binding gives the same layout
+  uint32_t period_us;
+  uint32_t next;          // microsecond timer value of the next send
+  bool enabled;
+  bool counter_enabled;   // rolling counter in data[counter_byte], bits counter_shift to counter_shift + counter_width - 1
+  uint8_t counter_byte;
+  uint8_t counter_shift;
+  uint8_t counter_width;
+  uint8_t counter;
+  uint8_t checksum;
+} can_sched_entry_t;
+
+typedef struct {
+  uint32_t sent_cnt;
+  uint32_t miss_cnt;      // sends skipped because they were a whole period or more late
+  uint32_t last_jitter_us;
+  uint32_t max_jitter_us;
+} can_sched_stats_t;
+
+extern can_sched_entry_t can_sched_entries[CAN_SCHED_ENTRY_CNT];
+extern can_sched_stats_t can_sched_stats[CAN_SCHED_ENTRY_CNT];
+
+void can_sched_clear(void);
+bool can_sched_set(uint8_t idx, const can_sched_entry_t *entry, uint32_t now);
+bool can_sched_run(uint32_t now, uint32_t *next);
+
+// ******************** can_tx_timed ********************
+
+#define CAN_TX_TIMED_CNT 256U
+
+typedef struct {
+  CANPacket_t pkt;        // first, so the tests' packed CANPacket_t binding gives the same layout
+  uint32_t target;        // microsecond timer value to send at
+  uint32_t seq;           // keeps frames with the same target in order
+} can_tx_timed_t;
+
+void can_tx_timed_clear(void);
+uint32_t can_tx_timed_slots_empty(void);
+bool can_tx_timed_push(const CANPacket_t *pkt, uint32_t target);
+bool can_tx_timed_run(uint32_t now, uint32_t *next);
+
+// ******************** can_tx_timer ********************
+
+void can_tx_timer_init(void);
+void can_sched_timer_kick(void);
+void can_tx_timed_timer_kick(void);
+
 // ******************** clock_source ********************
 
 void clock_source_set_timer_params(uint16_t param1, uint16_t param2);
@@ -104,7 +266,8 @@ void fan_init(void);
 void fan_tick(void);
 
 // ******************** fdcan ********************
-#ifdef STM32H7
+// FDCAN1 is also defined on PC, by the emulated cores of board/fake_fdcan.h
+#if defined(STM32H7) || defined(FDCAN1)
 
 typedef struct {
   volatile uint32_t header[2];
@@ -116,10 +279,15 @@ extern FDCAN_GlobalTypeDef *cans[PANDA_CAN_CNT];
 #define CAN_ACK_ERROR 3U
 
 void can_clear_send(FDCAN_GlobalTypeDef *FDCANx, uint8_t can_number);
+uint32_t can_cancel_send(uint8_t can_number, bool match_addr, uint32_t addr, uint32_t older_than_us, bool by_host);
 void update_can_health_pkt(uint8_t can_number, uint32_t ir_reg);
 
 void can_rx(uint8_t can_number);
 
+#endif
+
+#ifdef STM32H7
+
 // ******************** harness ********************
 
 #define HARNESS_STATUS_NC 0U
@@ -154,7 +322,10 @@ bool harness_check_ignition(void);
 void harness_tick(void);
 void harness_init(void);
 
+#endif // STM32H7
+
 // ******************** interrupts ********************
+#if defined(STM32H7) || defined(FDCAN1)
 
 typedef struct interrupt {
   IRQn_Type irq_type;
@@ -186,7 +357,7 @@ void handle_interrupt(IRQn_Type irq_type);
 void interrupt_timer_handler(void);
 void init_interrupts(bool check_rate_limit);
 
-#endif // STM32H7
+#endif
 
 // ******************** registers ********************
 
@@ -233,6 +404,8 @@ void can_tx_comms_resume_spi(void);
 void spi_init(void);
 void spi_rx_done(void);
 void spi_tx_done(bool reset);
+void spi_stage_fill(void);
+void llspi_stage_kick(void);
 
 // ******************** uart ********************
 #ifdef STM32H7
@@ -282,3 +455,4 @@ static void hexdump(const void *a, int l);
 void usb_init(void);
 void refresh_can_tx_slots_available(void);
 void can_tx_comms_resume_usb(void);
+void can_prio_comms_resume_usb(void);
@@ -2,6 +2,9 @@
 
 FDCAN_GlobalTypeDef *cans[PANDA_CAN_CNT] = {FDCAN1, FDCAN2, FDCAN3};
 
+static fdcan_msg_ram_layout_t can_msg_ram_layouts[PANDA_CAN_CNT];
+static can_tx_slots_t can_tx_slots[PANDA_CAN_CNT];
+
 static bool can_set_speed(uint8_t can_number) {
   bool ret = true;
   FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
@@ -18,6 +21,71 @@ static bool can_set_speed(uint8_t can_number) {
   return ret;
 }
 
+// (re)initialize the core with the bus' message RAM split and TX mode
+bool can_core_init(uint8_t can_number) {
+  FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
+  const bus_config_t *config = &bus_config[BUS_NUM_FROM_CAN_NUM(can_number)];
+
+  if (!fdcan_msg_ram_layout(config->tx_fifo_el_cnt, &can_msg_ram_layouts[can_number])) {
+    (void)fdcan_msg_ram_layout(FDCAN_TX_FIFO_EL_CNT_DEFAULT, &can_msg_ram_layouts[can_number]);
+  }
+  can_tx_slots_init(&can_tx_slots[can_number], (uint8_t)can_msg_ram_layouts[can_number].tx_fifo_el_cnt);
+  return llcan_init(FDCANx, &can_msg_ram_layouts[can_number]);
+}
+
+// cancels pending TX buffers, with the address if match_addr, at least older_than_us old.
+// Returns how many cancellations were requested, frames already being sent still go out.
+// The ones that didn't are counted as cancelled if by_host, lost otherwise, when the cancellation finishes.
+uint32_t can_cancel_send(uint8_t can_number, bool match_addr, uint32_t addr, uint32_t older_than_us, bool by_host) {
+  uint32_t cnt = 0U;
+
+  ENTER_CRITICAL();
+  FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
+  uint32_t mask = can_tx_slots_match(&can_tx_slots[can_number], FDCANx->TXBRP, match_addr, addr, older_than_us, microsecond_timer_get());
+  if (mask != 0U) {
+    if (by_host) {
+      can_tx_slots[can_number].host_cancelled |= mask;
+    }
+    llcan_cancel_send(FDCANx, mask);
+  }
+  EXIT_CRITICAL();
+
+  for (; mask != 0U; mask &= (mask - 1U)) {
+    cnt += 1U;
+  }
+  return cnt;
+}
+
+// frees slots whose frames will never go out and counts them
+static void can_tx_slots_account(uint8_t can_number, uint32_t mask) {
+  uint32_t by_host = mask & can_tx_slots[can_number].host_cancelled;
+  can_health[can_number].total_tx_cancelled_cnt += can_tx_slots_drop(&can_tx_slots[can_number], by_host);
+  can_health[can_number].total_tx_lost_cnt += can_tx_slots_drop(&can_tx_slots[can_number], mask);
+}
+
+// echoes the frames the core completed and frees the slots of the cancelled ones
+static void can_tx_events(uint8_t can_number) {
+  FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
+  uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
+  uint32_t TxEventSA = FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET) + (can_msg_ram_layouts[can_number].tx_event_fifo_offset * 4U);
+
+  while ((FDCANx->TXEFS & FDCAN_TXEFS_EFFL) != 0U) {
+    uint32_t event_idx = (FDCANx->TXEFS & FDCAN_TXEFS_EFGI) >> FDCAN_TXEFS_EFGI_Pos;
+    const uint32_t *event = (const uint32_t *)(TxEventSA + (event_idx * FDCAN_TX_EVENT_FIFO_EL_SIZE));
+
+    CANPacket_t to_push;
+    if (can_tx_slot_complete(&can_tx_slots[can_number], (uint8_t)(event[1] >> 24), &to_push)) {
+      uint32_t timestamp = can_tx_event_timestamp(microsecond_timer_get(), (uint16_t)(FDCANx->TSCV & FDCAN_TSCV_TSC), (uint16_t)(event[1] & 0xFFFFU), bus_config[bus_number].can_speed);
+      rx_buffer_overflow += can_rx_push(CAN_RX_RING_ECHO(can_number), &to_push, timestamp) ? 0U : 1U;
+    }
+    FDCANx->TXEFA = event_idx;
+  }
+
+  // cancelled before going out
+  uint32_t cancelled = FDCANx->TXBCF & ~(FDCANx->TXBTO) & ~(FDCANx->TXBRP);
+  can_tx_slots_account(can_number, cancelled);
+}
+
 void can_clear_send(FDCAN_GlobalTypeDef *FDCANx, uint8_t can_number) {
   static uint32_t last_reset = 0U;
   uint32_t time = microsecond_timer_get();
@@ -25,8 +93,13 @@ void can_clear_send(FDCAN_GlobalTypeDef *FDCANx, uint8_t can_number) {
   // Resetting CAN core is a slow blocking operation, limit frequency
   if (get_ts_elapsed(time, last_reset) > 100000U) {  // 10 Hz
     can_health[can_number].can_core_reset_cnt += 1U;
-    can_health[can_number].total_tx_lost_cnt += (FDCAN_TX_FIFO_EL_CNT - (FDCANx->TXFQS & FDCAN_TXFQS_TFFL)); // TX FIFO msgs will be lost after reset
-    llcan_clear_send(FDCANx);
+    // frames that didn't complete yet will be lost after reset
+    ENTER_CRITICAL();
+    can_tx_events(can_number);
+    can_tx_slots_account(can_number, 0xFFFFFFFFU);
+    EXIT_CRITICAL();
+    llcan_clear_send(FDCANx, &can_msg_ram_layouts[can_number]);
+    can_tx_slots_init(&can_tx_slots[can_number], (uint8_t)can_msg_ram_layouts[can_number].tx_fifo_el_cnt);
     last_reset = time;
   }
 }
@@ -60,8 +133,8 @@ void update_can_health_pkt(uint8_t can_number, uint32_t ir_reg) {
   can_health[can_number].receive_error_cnt = ((ecr_reg & FDCAN_ECR_REC) >> FDCAN_ECR_REC_Pos);
   can_health[can_number].transmit_error_cnt = ((ecr_reg & FDCAN_ECR_TEC) >> FDCAN_ECR_TEC_Pos);
 
-  can_health[can_number].irq0_call_rate = interrupts[can_irq_number[can_number][0]].call_rate;
-  can_health[can_number].irq1_call_rate = interrupts[can_irq_number[can_number][1]].call_rate;
+  can_health[can_number].irq0_call_rate = (uint16_t)interrupts[can_irq_number[can_number][0]].call_rate;
+  can_health[can_number].irq1_call_rate = (uint16_t)interrupts[can_irq_number[can_number][1]].call_rate;
 
   if (ir_reg != 0U) {
     // Clear error interrupts
@@ -72,11 +145,13 @@ void update_can_health_pkt(uint8_t can_number, uint32_t ir_reg) {
       can_health[can_number].total_rx_lost_cnt += 1U;
     }
     // Cases:
-    // 1. while multiplexing between buses 1 and 3 we are getting ACK errors that overwhelm CAN core, by resetting it recovers faster
-    // 2. H7 gets stuck in bus off recovery state indefinitely
-    if ((((can_health[can_number].last_error == CAN_ACK_ERROR) || (can_health[can_number].last_data_error == CAN_ACK_ERROR)) && (can_health[can_number].transmit_error_cnt > 127U)) ||
-     ((ir_reg & FDCAN_IR_BO) != 0U)) {
+    // 1. while multiplexing between buses 1 and 3 we are getting ACK errors that overwhelm CAN core, dropping the pending frames recovers faster
+    // 2. H7 gets stuck in bus off recovery state indefinitely, only a core reset helps
+    if ((ir_reg & FDCAN_IR_BO) != 0U) {
       can_clear_send(FDCANx, can_number);
+    } else if (((can_health[can_number].last_error == CAN_ACK_ERROR) || (can_health[can_number].last_data_error == CAN_ACK_ERROR)) && (can_health[can_number].transmit_error_cnt > 127U)) {
+      (void)can_cancel_send(can_number, false, 0U, 0U, false);
+    } else {
     }
   }
 }
@@ -90,58 +165,63 @@ void process_can(uint8_t can_number) {
     FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
     uint8_t bus_number = BUS_NUM_FROM_CAN_NUM(can_number);
 
-    FDCANx->IR |= FDCAN_IR_TFE; // Clear Tx FIFO Empty flag
-
-    if ((FDCANx->TXFQS & FDCAN_TXFQS_TFQF) == 0U) {
-      CANPacket_t to_send;
-      if (can_pop(can_queues[bus_number], &to_send)) {
-        if (can_check_checksum(&to_send)) {
-          can_health[can_number].total_tx_cnt += 1U;
-
-          uint32_t TxFIFOSA = FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET) + (FDCAN_RX_FIFO_0_EL_CNT * FDCAN_RX_FIFO_0_EL_SIZE);
-          // get the index of the next TX FIFO element (0 to FDCAN_TX_FIFO_EL_CNT - 1)
-          uint32_t tx_index = (FDCANx->TXFQS >> FDCAN_TXFQS_TFQPI_Pos) & 0x1FU;
-          // only send if we have received a packet
-          canfd_fifo *fifo;
-          fifo = (canfd_fifo *)(TxFIFOSA + (tx_index * FDCAN_TX_FIFO_EL_SIZE));
-
-          fifo->header[0] = (to_send.extended << 30) | ((to_send.extended != 0U) ? (to_send.addr) : (to_send.addr << 18));
-
-          // If canfd_auto is set, outgoing packets will be automatically sent as CAN-FD if an incoming CAN-FD packet was seen
-          bool fd = bus_config[can_number].canfd_auto ? bus_config[can_number].canfd_enabled : (bool)(to_send.fd > 0U);
-          uint32_t canfd_enabled_header = fd ? (1UL << 21) : 0UL;
-
-          uint32_t brs_enabled_header = bus_config[can_number].brs_enabled ? (1UL << 20) : 0UL;
-          fifo->header[1] = (to_send.data_len_code << 16) | canfd_enabled_header | brs_enabled_header;
-
-          uint8_t data_len_w = (dlc_to_len[to_send.data_len_code] / 4U);
-          data_len_w += ((dlc_to_len[to_send.data_len_code] % 4U) > 0U) ? 1U : 0U;
-          for (unsigned int i = 0; i < data_len_w; i++) {
-            BYTE_ARRAY_TO_WORD(fifo->data_word[i], &to_send.data[i*4U]);
-          }
-
-          FDCANx->TXBAR = (1UL << tx_index);
-
-          // Send back to USB
-          CANPacket_t to_push;
-
-          to_push.fd = fd;
-          to_push.returned = 1U;
-          to_push.rejected = 0U;
-          to_push.extended = to_send.extended;
-          to_push.addr = to_send.addr;
-          to_push.bus = bus_number;
-          to_push.data_len_code = to_send.data_len_code;
-          (void)memcpy(to_push.data, to_send.data, dlc_to_len[to_push.data_len_code]);
-          can_set_checksum(&to_push);
-
-          rx_buffer_overflow += can_push(&can_rx_q, &to_push) ? 0U : 1U;
-        } else {
-          can_health[can_number].total_tx_checksum_error_cnt += 1U;
-        }
-
-        refresh_can_tx_slots_available();
+    FDCANx->IR |= (FDCAN_IR_TEFN | FDCAN_IR_TCF); // Clear TX Event FIFO New Entry and Cancellation Finished flags
+    can_tx_events(can_number);
+
+    // fill as many TX buffers as are free
+    bool popped = false;
+    bool in_order = !bus_config[bus_number].tx_queue_mode;
+    uint32_t pending = FDCANx->TXBRP;
+    CANPacket_t to_send;
+    while (can_peek(can_queues[bus_number], &to_send)) {
+      uint8_t tx_index = can_tx_slot_alloc(&can_tx_slots[can_number], pending, to_send.addr, to_send.extended != 0U, in_order);
+      if (tx_index == CAN_TX_SLOT_NONE) {
+        break;
+      }
+      (void)can_pop(can_queues[bus_number], &to_send);
+      popped = true;
+      can_health[can_number].total_tx_cnt += 1U;
+
+      uint32_t TxBufferSA = FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET) + (can_msg_ram_layouts[can_number].tx_fifo_offset * 4U);
+      canfd_fifo *fifo;
+      fifo = (canfd_fifo *)(TxBufferSA + (tx_index * FDCAN_TX_FIFO_EL_SIZE));
+
+      fifo->header[0] = (to_send.extended << 30) | ((to_send.extended != 0U) ? (to_send.addr) : (to_send.addr << 18));
+
+      // If canfd_auto is set, outgoing packets will be automatically sent as CAN-FD if an incoming CAN-FD packet was seen
+      bool fd = bus_config[can_number].canfd_auto ? bus_config[can_number].canfd_enabled : (bool)(to_send.fd > 0U);
+      uint32_t canfd_enabled_header = fd ? (1UL << 21) : 0UL;
+
+      // echoed back to the host when the TX event reports the frame completed
+      CANPacket_t to_push;
+
+      to_push.fd = fd;
+      to_push.returned = 1U;
+      to_push.rejected = 0U;
+      to_push.extended = to_send.extended;
+      to_push.addr = to_send.addr;
+      to_push.bus = bus_number;
+      to_push.data_len_code = to_send.data_len_code;
+      (void)memcpy(to_push.data, to_send.data, dlc_to_len[to_push.data_len_code]);
+
+      uint8_t marker = can_tx_slot_set(&can_tx_slots[can_number], tx_index, &to_push, microsecond_timer_get());
+
+      uint32_t brs_enabled_header = bus_config[can_number].brs_enabled ? (1UL << 20) : 0UL;
+      // store a TX event with the message marker
+      fifo->header[1] = ((uint32_t)marker << 24) | (1UL << 23) | (to_send.data_len_code << 16) | canfd_enabled_header | brs_enabled_header;
+
+      uint8_t data_len_w = (dlc_to_len[to_send.data_len_code] / 4U);
+      data_len_w += ((dlc_to_len[to_send.data_len_code] % 4U) > 0U) ? 1U : 0U;
+      for (unsigned int i = 0; i < data_len_w; i++) {
+        BYTE_ARRAY_TO_WORD(fifo->data_word[i], &to_send.data[i*4U]);
       }
+
+      FDCANx->TXBAR = (1UL << tx_index);
+      pending |= (1UL << tx_index);
+    }
+
+    if (popped) {
+      refresh_can_tx_slots_available();
     }
     EXIT_CRITICAL();
   }
@@ -158,17 +238,18 @@ void can_rx(uint8_t can_number) {
   // Clear all new messages from Rx FIFO 0
   FDCANx->IR |= FDCAN_IR_RF0N;
   while ((FDCANx->RXF0S & FDCAN_RXF0S_F0FL) != 0U) {
+    uint32_t timestamp = microsecond_timer_get();
     can_health[can_number].total_rx_cnt += 1U;
-    // get the index of the next RX FIFO element (0 to FDCAN_RX_FIFO_0_EL_CNT - 1)
+    // get the index of the next RX FIFO element (0 to rx_fifo_0_el_cnt - 1)
     uint32_t rx_fifo_idx = (uint8_t)((FDCANx->RXF0S >> FDCAN_RXF0S_F0GI_Pos) & 0x3FU);
 
     // Recommended to offset get index by at least +1 if RX FIFO is in overwrite mode and full (datasheet)
     if ((FDCANx->RXF0S & FDCAN_RXF0S_F0F) == FDCAN_RXF0S_F0F) {
-      rx_fifo_idx = ((rx_fifo_idx + 1U) >= FDCAN_RX_FIFO_0_EL_CNT) ? 0U : (rx_fifo_idx + 1U);
+      rx_fifo_idx = ((rx_fifo_idx + 1U) >= can_msg_ram_layouts[can_number].rx_fifo_0_el_cnt) ? 0U : (rx_fifo_idx + 1U);
       can_health[can_number].total_rx_lost_cnt += 1U; // At least one message was lost
     }
 
-    uint32_t RxFIFO0SA = FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET);
+    uint32_t RxFIFO0SA = FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET) + (can_msg_ram_layouts[can_number].rx_fifo_0_offset * 4U);
     CANPacket_t to_push;
     const canfd_fifo *fifo;
 
@@ -191,7 +272,6 @@ void can_rx(uint8_t can_number) {
     for (unsigned int i = 0; i < data_len_w; i++) {
       WORD_TO_BYTE_ARRAY(&to_push.data[i*4U], fifo->data_word[i]);
     }
-    can_set_checksum(&to_push);
 
     // forwarding (panda only)
     int bus_fwd_num = safety_fwd_hook(bus_number, to_push.addr);
@@ -199,19 +279,8 @@ void can_rx(uint8_t can_number) {
       bus_fwd_num = bus_config[can_number].forwarding_bus;
     }
     if (bus_fwd_num != -1) {
-      CANPacket_t to_send;
-
-      to_send.fd = to_push.fd;
-      to_send.returned = 0U;
-      to_send.rejected = 0U;
-      to_send.extended = to_push.extended;
-      to_send.addr = to_push.addr;
-      to_send.bus = to_push.bus;
-      to_send.data_len_code = to_push.data_len_code;
-      (void)memcpy(to_send.data, to_push.data, dlc_to_len[to_push.data_len_code]);
-      can_set_checksum(&to_send);
-
-      can_send(&to_send, bus_fwd_num, true);
+      // can_send() only changes the frame when the TX hook runs, it's queued as is
+      can_send(&to_push, bus_fwd_num, true);
       can_health[can_number].total_fwd_cnt += 1U;
     }
 
@@ -223,7 +292,13 @@ void can_rx(uint8_t can_number) {
     ignition_can_hook(&to_push);
 
     led_set(LED_BLUE, true);
-    rx_buffer_overflow += can_push(&can_rx_q, &to_push) ? 0U : 1U;
+    if (can_filter_match(&can_filters[bus_number], to_push.addr, to_push.extended != 0U)) {
+      if (!can_prio_rx_push(bus_number, &to_push, timestamp)) {
+        rx_buffer_overflow += can_rx_push(CAN_RX_RING_RX(can_number), &to_push, timestamp) ? 0U : 1U;
+      }
+    } else {
+      can_health[can_number].total_rx_filtered_cnt += 1U;
+    }
 
     // Enable CAN FD and BRS if CAN FD message was received
     if (!(bus_config[can_number].canfd_enabled) && (canfd_frame)) {
@@ -236,6 +311,8 @@ void can_rx(uint8_t can_number) {
     // update read index
     FDCANx->RXF0A = rx_fifo_idx;
   }
+  // SPI stages these for the host's next exchange in the background
+  llspi_stage_kick();
 
   // Error handling
   if ((ir_reg & (FDCAN_IR_PED | FDCAN_IR_PEA | FDCAN_IR_EP | FDCAN_IR_BO | FDCAN_IR_RF0L)) != 0U) {
@@ -263,9 +340,8 @@ bool can_init(uint8_t can_number) {
   REGISTER_INTERRUPT(FDCAN3_IT1_IRQn, FDCAN3_IT1_IRQ_Handler, CAN_INTERRUPT_RATE, FAULT_INTERRUPT_RATE_CAN_3)
 
   if (can_number != 0xffU) {
-    FDCAN_GlobalTypeDef *FDCANx = CANIF_FROM_CAN_NUM(can_number);
     ret &= can_set_speed(can_number);
-    ret &= llcan_init(FDCANx);
+    ret &= can_core_init(can_number);
     // in case there are queued up messages
     process_can(can_number);
   }
@@ -6,9 +6,11 @@
 #ifdef STM32H7
 __attribute__((section(".sram12"))) uint8_t spi_buf_rx[SPI_BUF_SIZE];
 __attribute__((section(".sram12"))) uint8_t spi_buf_tx[SPI_BUF_SIZE];
+__attribute__((section(".sram12"))) static uint8_t spi_buf_stage[2][SPI_BUF_SIZE];
 #else
 uint8_t spi_buf_rx[SPI_BUF_SIZE];
 uint8_t spi_buf_tx[SPI_BUF_SIZE];
+static uint8_t spi_buf_stage[2][SPI_BUF_SIZE];
 #endif
 
 #define SPI_CHECKSUM_START 0xABU
@@ -24,9 +26,30 @@ enum {
   SPI_STATE_HEADER_NACK,
   SPI_STATE_DATA_RX,
   SPI_STATE_DATA_RX_ACK,
-  SPI_STATE_DATA_TX
+  SPI_STATE_DATA_TX,
+  SPI_STATE_XCHG_RX,
+  SPI_STATE_XCHG_TX
 };
 
+// CAN exchange (protocol version 3): after the header, one full-duplex transfer carries the
+// packets for the panda on MOSI and the ones for the host on MISO. The response is staged
+// while the bus is idle, so it's ready as soon as the header interrupt sets up both DMAs:
+// HACK + DACK + status + 2 byte RX length + RX data + checksum
+// The host polls for the HACK like it does in version 2, so a panda that's slow to get to
+// the header interrupt only costs polls. Both DMAs are set up with SPI off, the poll byte
+// that gets the HACK is the first one of the MOSI DMA and the data follows it.
+//
+// There are two staging buffers. One is on its way to the host, the other one is filled
+// from the CAN RX rings by a low priority interrupt, so the header only has to read what
+// came in since and swap them.
+#define SPI_EP_CAN_XCHG 5U
+#define SPI_XCHG_HEADER_SIZE 4U
+#define SPI_STAGE_HEADROOM (1U + SPI_XCHG_HEADER_SIZE) // HACK and the exchange header in front of the staged data
+#define SPI_XCHG_DATA_MAX (SPI_BUF_SIZE - 0x40U) // the host's XFER_SIZE
+#define SPI_XCHG_STATUS_TX_ACCEPTED 0x1U // the MOSI data of this transfer is taken, resend it otherwise
+#define SPI_XCHG_STATUS_LAST_TX_DROPPED 0x2U // the MOSI data of the last accepted transfer had a bad checksum, resend it
+#define SPI_STAGE_CHUNK 0x200U // most bytes staged with interrupts off, what an SPI interrupt may wait on the fill
+
 uint16_t spi_error_count = 0;
 
 #define SPI_HEADER_SIZE 7U
@@ -35,10 +58,18 @@ uint16_t spi_error_count = 0;
 void llspi_init(void);
 void llspi_mosi_dma(uint8_t *addr, int len);
 void llspi_miso_dma(const uint8_t *addr, int len);
+void llspi_xchg_dma(uint8_t *mosi_addr, int mosi_len, const uint8_t *miso_addr, int miso_len);
 
 static uint8_t spi_state = SPI_STATE_HEADER;
 static uint16_t spi_data_len_mosi;
 static bool spi_can_tx_ready = false;
+static bool spi_xchg_active = false;
+static uint8_t spi_stage_idx = 0U; // the buffer being filled
+static uint16_t spi_stage_start = 0U; // staged data left behind by spi_stage_take starts here
+static uint16_t spi_stage_len = 0U;
+static uint8_t spi_stage_checksum = 0U;
+static bool spi_xchg_tx_accepted = false;
+static bool spi_xchg_tx_dropped = false;
 static const unsigned char version_text[] = "VERSION";
 
 static uint16_t spi_version_packet(uint8_t *out) {
@@ -70,7 +101,7 @@ static uint16_t spi_version_packet(uint8_t *out) {
   data_len += 1U;
 
   // SPI protocol version
-  out[data_pos + data_len] = 0x2;
+  out[data_pos + data_len] = 0x3;
   data_len += 1U;
 
   // data length
@@ -79,7 +110,7 @@ static uint16_t spi_version_packet(uint8_t *out) {
 
   // CRC8
   uint16_t resp_len = data_pos + data_len;
-  out[resp_len] = crc_checksum(out, resp_len, 0xD5U);
+  out[resp_len] = crc8_spi(out, resp_len);
   resp_len += 1U;
 
   return resp_len;
@@ -95,15 +126,101 @@ void spi_init(void) {
 }
 
 static bool validate_checksum(const uint8_t *data, uint16_t len) {
-  // TODO: can speed this up by casting the bulk to uint32_t and xor-ing the bytes afterwards
-  uint8_t checksum = SPI_CHECKSUM_START;
-  for(uint16_t i = 0U; i < len; i++){
-    checksum ^= data[i];
+  return checksum_xor(SPI_CHECKSUM_START, data, len) == 0U;
+}
+
+// reads up to max_len more RX CAN data behind what's already staged, leaving room for the checksum
+static uint16_t spi_stage_read(uint16_t max_len) {
+  uint16_t end = SPI_STAGE_HEADROOM + spi_stage_start + spi_stage_len;
+  uint8_t *dst = &spi_buf_stage[spi_stage_idx][end];
+  uint16_t len = (uint16_t)comms_can_read(dst, MIN(max_len, SPI_BUF_SIZE - 1U - end));
+  spi_stage_checksum ^= checksum_xor(0U, dst, len);
+  spi_stage_len += len;
+  return len;
+}
+
+// the staged buffer goes out, the next response is staged in the other one
+static uint8_t *spi_stage_swap(void) {
+  uint8_t *buf = &spi_buf_stage[spi_stage_idx][spi_stage_start];
+  spi_stage_idx ^= 1U;
+  spi_stage_start = 0U;
+  spi_stage_len = 0U;
+  spi_stage_checksum = 0U;
+  llspi_stage_kick();
+  return buf;
+}
+
+// runs in the low priority interrupt, SPI interrupts only wait on a chunk
+void spi_stage_fill(void) {
+  bool more = true;
+  while (more) {
+    ENTER_CRITICAL();
+    more = spi_xchg_active && (spi_stage_read(MIN(SPI_XCHG_DATA_MAX - spi_stage_len, SPI_STAGE_CHUNK)) > 0U);
+    EXIT_CRITICAL();
+  }
+}
+
+// staged data goes out first when the host switches to endpoint 1 reads with less room than is staged.
+// the rest stays where it is, a response is built in front of it over what was taken
+static uint16_t spi_stage_take(uint8_t *dst, uint16_t max_len) {
+  const uint8_t *buf = &spi_buf_stage[spi_stage_idx][SPI_STAGE_HEADROOM + spi_stage_start];
+  uint16_t len = MIN(spi_stage_len, max_len);
+  (void)memcpy(dst, buf, len);
+  spi_stage_checksum ^= checksum_xor(0U, buf, len);
+  spi_stage_len -= len;
+  spi_stage_start = (spi_stage_len > 0U) ? (spi_stage_start + len) : 0U;
+  return len;
+}
+
+// endpoint 1 response in place: DACK + 2 byte length + data + checksum, right in front of the staged data
+static uint8_t *spi_stage_read_response(uint16_t max_len, uint16_t *response_len) {
+  (void)spi_stage_read(max_len - spi_stage_len);
+
+  uint16_t data_len = spi_stage_len;
+  uint8_t checksum = spi_stage_checksum;
+  uint8_t *buf = spi_stage_swap();
+  buf[2] = SPI_DACK;
+  buf[3] = data_len & 0xFFU;
+  buf[4] = (data_len >> 8) & 0xFFU;
+  buf[SPI_STAGE_HEADROOM + data_len] = SPI_CHECKSUM_START ^ SPI_DACK ^ buf[3] ^ buf[4] ^ checksum;
+  *response_len = data_len + 4U;
+  return &buf[2];
+}
+
+static uint8_t *spi_xchg_response(uint16_t *response_len) {
+  // only what came in since the last fill is read here, at most a chunk like the fill does
+  // with interrupts off. the rest is staged for the next exchange
+  spi_xchg_active = true;
+  (void)spi_stage_read(MIN(SPI_XCHG_DATA_MAX - spi_stage_len, SPI_STAGE_CHUNK));
+
+  // a full TX queue is known now, the MOSI data is dropped and the host sends it again.
+  // so is the data after a dropped one, the host resends that first to keep the order
+  spi_xchg_tx_accepted = (spi_data_len_mosi > 0U) && spi_can_tx_ready && !spi_xchg_tx_dropped;
+  if (spi_xchg_tx_accepted) {
+    spi_can_tx_ready = false;
+  }
+
+  uint8_t status = spi_xchg_tx_accepted ? SPI_XCHG_STATUS_TX_ACCEPTED : 0U;
+  if (spi_xchg_tx_dropped) {
+    spi_xchg_tx_dropped = false;
+    status |= SPI_XCHG_STATUS_LAST_TX_DROPPED;
   }
-  return checksum == 0U;
+
+  uint16_t data_len = spi_stage_len;
+  uint8_t checksum = spi_stage_checksum;
+  uint8_t *buf = spi_stage_swap();
+  buf[0] = SPI_HACK;
+  buf[1] = SPI_DACK;
+  buf[2] = status;
+  buf[3] = data_len & 0xFFU;
+  buf[4] = (data_len >> 8) & 0xFFU;
+  buf[SPI_STAGE_HEADROOM + data_len] = SPI_CHECKSUM_START ^ SPI_DACK ^ status ^ buf[3] ^ buf[4] ^ checksum;
+  *response_len = SPI_STAGE_HEADROOM + data_len + 1U;
+  return buf;
 }
 
 void spi_rx_done(void) {
+  const uint8_t *response = spi_buf_tx;
   uint16_t response_len = 0U;
   uint8_t next_rx_state = SPI_STATE_HEADER_NACK;
   bool checksum_valid = false;
@@ -120,7 +237,11 @@ void spi_rx_done(void) {
     next_rx_state = SPI_STATE_HEADER_NACK;;
   } else if (spi_state == SPI_STATE_HEADER) {
     checksum_valid = validate_checksum(spi_buf_rx, SPI_HEADER_SIZE);
-    if ((spi_buf_rx[0] == SPI_SYNC_BYTE) && checksum_valid) {
+    if ((spi_buf_rx[0] == SPI_SYNC_BYTE) && checksum_valid && (spi_endpoint == SPI_EP_CAN_XCHG) && (spi_data_len_mosi <= SPI_XCHG_DATA_MAX)) {
+      // response: HACK and the staged CAN data, while receiving the data portion
+      response = spi_xchg_response(&response_len);
+      next_rx_state = SPI_STATE_XCHG_RX;
+    } else if ((spi_buf_rx[0] == SPI_SYNC_BYTE) && checksum_valid) {
       // response: ACK and start receiving data portion
       spi_buf_tx[0] = SPI_HACK;
       next_rx_state = SPI_STATE_HEADER_ACK;
@@ -143,14 +264,27 @@ void spi_rx_done(void) {
         if (spi_data_len_mosi >= sizeof(ControlPacket_t)) {
           ControlPacket_t ctrl = {0};
           (void)memcpy((uint8_t*)&ctrl, &spi_buf_rx[SPI_HEADER_SIZE], sizeof(ControlPacket_t));
+          if (ctrl.request == 0xc0U) {
+            // communications reset, staged data is from before it. USB reads don't see
+            // staged data, so staging waits for the next exchange
+            spi_xchg_active = false;
+            spi_stage_start = 0U;
+            spi_stage_len = 0U;
+            spi_stage_checksum = 0U;
+            spi_xchg_tx_dropped = false;
+          }
           response_len = comms_control_handler(&ctrl, &spi_buf_tx[3]);
           response_ack = true;
         } else {
           print("SPI: insufficient data for control handler\n");
         }
       } else if ((spi_endpoint == 1U) || (spi_endpoint == 0x81U)) {
-        if (spi_data_len_mosi == 0U) {
-          response_len = comms_can_read(&(spi_buf_tx[3]), spi_data_len_miso);
+        if ((spi_data_len_mosi == 0U) && (spi_stage_len <= MIN(spi_data_len_miso, SPI_XCHG_DATA_MAX))) {
+          // the staged buffer is the response
+          response = spi_stage_read_response(MIN(spi_data_len_miso, SPI_XCHG_DATA_MAX), &response_len);
+        } else if (spi_data_len_mosi == 0U) {
+          response_len = spi_stage_take(&(spi_buf_tx[3]), spi_data_len_miso);
+          response_len += comms_can_read(&(spi_buf_tx[3U + response_len]), spi_data_len_miso - response_len);
           response_ack = true;
         } else {
           print("SPI: did not expect data for can_read\n");
@@ -194,7 +328,10 @@ void spi_rx_done(void) {
       #endif
     }
 
-    if (!response_ack) {
+    if (response != spi_buf_tx) {
+      // ready to go out
+      next_rx_state = SPI_STATE_DATA_TX;
+    } else if (!response_ack) {
       spi_buf_tx[0] = SPI_NACK;
       next_rx_state = SPI_STATE_HEADER_NACK;
       response_len = 1U;
@@ -205,27 +342,43 @@ void spi_rx_done(void) {
       spi_buf_tx[2] = (response_len >> 8) & 0xFFU;
 
       // Add checksum
-      uint8_t checksum = SPI_CHECKSUM_START;
-      for(uint16_t i = 0U; i < (response_len + 3U); i++) {
-        checksum ^= spi_buf_tx[i];
-      }
-      spi_buf_tx[response_len + 3U] = checksum;
+      spi_buf_tx[response_len + 3U] = checksum_xor(SPI_CHECKSUM_START, spi_buf_tx, response_len + 3U);
       response_len += 4U;
 
       next_rx_state = SPI_STATE_DATA_TX;
     }
+  } else if (spi_state == SPI_STATE_XCHG_RX) {
+    // the poll byte that got the HACK is in front of the data
+    checksum_valid = validate_checksum(&(spi_buf_rx[SPI_HEADER_SIZE]), spi_data_len_mosi + 1U);
+    if (spi_xchg_tx_accepted) {
+      if (checksum_valid) {
+        comms_can_write(&spi_buf_rx[SPI_HEADER_SIZE], spi_data_len_mosi);
+      } else {
+        spi_xchg_tx_dropped = true;
+        refresh_can_tx_slots_available();
+      }
+    }
+    // the response is still going out
+    next_rx_state = SPI_STATE_XCHG_TX;
   } else {
     print("SPI: RX unexpected state: "); puth(spi_state); print("\n");
   }
 
   // send out response
-  if (response_len == 0U) {
-    print("SPI: no response\n");
-    spi_buf_tx[0] = SPI_NACK;
-    spi_state = SPI_STATE_HEADER_NACK;
-    response_len = 1U;
+  if (next_rx_state == SPI_STATE_XCHG_RX) {
+    // the poll byte that gets the HACK lands on the header checksum, the header is parsed already
+    llspi_xchg_dma(&spi_buf_rx[SPI_HEADER_SIZE - 1U], spi_data_len_mosi + 2U, response, response_len);
+  } else if (next_rx_state != SPI_STATE_XCHG_TX) {
+    if (response_len == 0U) {
+      print("SPI: no response\n");
+      spi_buf_tx[0] = SPI_NACK;
+      spi_state = SPI_STATE_HEADER_NACK;
+      response_len = 1U;
+    }
+    llspi_miso_dma(response, response_len);
+  } else {
+    // nothing to send
   }
-  llspi_miso_dma(spi_buf_tx, response_len);
 
   spi_state = next_rx_state;
   if (!checksum_valid) {
@@ -234,7 +387,16 @@ void spi_rx_done(void) {
 }
 
 void spi_tx_done(bool reset) {
-  if ((spi_state == SPI_STATE_HEADER_NACK) || reset) {
+  if ((spi_state == SPI_STATE_XCHG_RX) && spi_xchg_tx_accepted) {
+    // the data portion didn't make it
+    spi_xchg_tx_dropped = true;
+    refresh_can_tx_slots_available();
+  }
+
+  if ((spi_state == SPI_STATE_XCHG_RX) || (spi_state == SPI_STATE_XCHG_TX)) {
+    spi_state = SPI_STATE_HEADER;
+    llspi_mosi_dma(spi_buf_rx, SPI_HEADER_SIZE);
+  } else if ((spi_state == SPI_STATE_HEADER_NACK) || reset) {
     // Reset state
     spi_state = SPI_STATE_HEADER;
     llspi_mosi_dma(spi_buf_rx, SPI_HEADER_SIZE);
@@ -1,4 +1,6 @@
 #include "board/drivers/drivers.h"
+#include "board/drivers/usb_desc.h"
+#include "board/drivers/usb_sof.h"
 
 // IRQs: OTG_FS
 
@@ -30,21 +32,6 @@ typedef union _USB_Setup {
 #define  USB_REQ_SET_CONFIGURATION                      0x09
 #define  USB_REQ_SET_INTERFACE                          0x0B
 
-#define  USB_DESC_TYPE_DEVICE                           0x01
-#define  USB_DESC_TYPE_CONFIGURATION                    0x02
-#define  USB_DESC_TYPE_STRING                           0x03
-#define  USB_DESC_TYPE_INTERFACE                        0x04
-#define  USB_DESC_TYPE_ENDPOINT                         0x05
-#define  USB_DESC_TYPE_DEVICE_QUALIFIER                 0x06
-#define  USB_DESC_TYPE_BINARY_OBJECT_STORE              0x0f
-
-// offsets for configuration strings
-#define  STRING_OFFSET_LANGID                           0x00
-#define  STRING_OFFSET_IMANUFACTURER                    0x01
-#define  STRING_OFFSET_IPRODUCT                         0x02
-#define  STRING_OFFSET_ISERIAL                          0x03
-#define  STRING_OFFSET_ICONFIGURATION                   0x04
-
 // WinUSB requests
 #define  WINUSB_REQ_GET_COMPATID_DESCRIPTOR             0x04
 #define  WINUSB_REQ_GET_EXT_PROPS_OS                    0x05
@@ -53,16 +40,6 @@ typedef union _USB_Setup {
 #define STS_DATA_UPDT                          2
 #define STS_SETUP_UPDT                         6
 
-// for the repeating interfaces
-#define DSCR_INTERFACE_LEN 9
-#define DSCR_ENDPOINT_LEN 7
-#define DSCR_CONFIG_LEN 9
-#define DSCR_DEVICE_LEN 18
-
-// endpoint types
-#define ENDPOINT_TYPE_BULK 2
-#define ENDPOINT_TYPE_INT 3
-
 // These are arbitrary values used in bRequest
 #define  MS_VENDOR_CODE 0x20
 #define  WEBUSB_VENDOR_CODE 0x30
@@ -72,18 +49,23 @@ typedef union _USB_Setup {
 #define BINARY_OBJECT_STORE_DESCRIPTOR          0x0F
 #define WINUSB_PLATFORM_DESCRIPTOR_LENGTH       0x9E
 
-// Convert machine byte order to USB byte order
-#define TOUSBORDER(num)\
-  ((num) & 0xFFU), (((uint16_t)(num) >> 8) & 0xFFU)
-
 // take in string length and return the first 2 bytes of a string descriptor
 #define STRING_DESCRIPTOR_HEADER(size)\
   (((((size) * 2) + 2) & 0xFF) | 0x0300)
 
-#define ENDPOINT_RCV 0x80
-#define ENDPOINT_SND 0x00
+// CAN data for the host is sent in bulk IN transfers of up to this many bytes, the EP1
+// TX FIFO is refilled from its empty interrupt while the transfer goes out
+#define USB_EP1_XFER_MAX 0x800U
+#define USB_EP1_TXFIFO_WORDS 0x80U
+
+#define USB_PRIO_TXFIFO_WORDS 0x10U
 
 static uint8_t response[USBPACKET_MAX_SIZE];
+static uint8_t prio_response[USBPACKET_MAX_SIZE];
+static uint8_t ep1_txdata[USB_EP1_XFER_MAX] __attribute__((aligned(4)));
+static uint32_t ep1_txlen = 0U;
+static uint32_t ep1_txpos = 0U;
+static bool ep1_xfer_active = false;
 
 // current packet
 static USB_Setup_TypeDef setup;
@@ -94,6 +76,7 @@ static bool outep3_processing = false;
 // Store the current interface alt setting.
 static int current_int0_alt_setting = 0;
 
+
 // packet read and write
 
 static void *USB_ReadPacket(void *dest, uint16_t len) {
@@ -152,6 +135,58 @@ static void USB_WritePacket_EP0(uint8_t *src, uint16_t len) {
   }
 }
 
+// load the whole packets that fit, wait for the FIFO to empty for the rest
+static void usb_ep1_fill_fifo(void) {
+  while (ep1_txpos < ep1_txlen) {
+    uint32_t len = MIN(ep1_txlen - ep1_txpos, USBPACKET_MAX_SIZE);
+    uint32_t count32b = (len + 3U) / 4U;
+    if ((USBx_INEP(1U)->DTXFSTS & USB_OTG_DTXFSTS_INEPTFSAV) < count32b) {
+      break;
+    }
+    const uint32_t *src = (const uint32_t *)&ep1_txdata[ep1_txpos];
+    for (uint32_t i = 0U; i < count32b; i++) {
+      USBx_DFIFO(1U) = src[i];
+    }
+    ep1_txpos += len;
+  }
+
+  if (ep1_txpos < ep1_txlen) {
+    USBx_DEVICE->DIEPEMPMSK |= (1UL << 1);
+  } else {
+    USBx_DEVICE->DIEPEMPMSK &= ~(1UL << 1);
+  }
+}
+
+// one transfer with everything that's queued, up to USB_EP1_XFER_MAX. A transfer ending
+// in a short packet (or a zero length one, when nothing is queued) completes the host's read.
+static void usb_ep1_start_xfer(void) {
+  ep1_txlen = (uint32_t)comms_can_read(ep1_txdata, USB_EP1_XFER_MAX);
+  ep1_txpos = 0U;
+  uint32_t numpacket = MAX((ep1_txlen + (USBPACKET_MAX_SIZE - 1U)) / USBPACKET_MAX_SIZE, 1U);
+
+  #ifdef DEBUG_USB
+  print("  EP1 transfer ");
+  puth(ep1_txlen);
+  print("\n");
+  #endif
+
+  ep1_xfer_active = true;
+  USBx_INEP(1U)->DIEPTSIZ = ((numpacket << 19) & USB_OTG_DIEPTSIZ_PKTCNT) |
+                            (ep1_txlen         & USB_OTG_DIEPTSIZ_XFRSIZ);
+  USBx_INEP(1U)->DIEPCTL |= (USB_OTG_DIEPCTL_CNAK | USB_OTG_DIEPCTL_EPENA);
+  usb_ep1_fill_fifo();
+}
+
+// loads a packet of priority CAN IDs for the next poll of EP4, unless one is already waiting
+static void usb_prio_load(void) {
+  if ((current_int0_alt_setting == USB_ALT_PRIO) && ((USBx_INEP(USB_PRIO_EP)->DIEPCTL & USB_OTG_DIEPCTL_EPENA) == 0U)) {
+    int len = comms_can_prio_read(prio_response, USBPACKET_MAX_SIZE);
+    if (len > 0) {
+      USB_WritePacket((void *)prio_response, len, USB_PRIO_EP);
+    }
+  }
+}
+
 static void usb_reset(void) {
   // unmask endpoint interrupts, so many sets
   USBx_DEVICE->DAINT = 0xFFFFFFFFU;
@@ -179,7 +214,13 @@ static void usb_reset(void) {
   USBx->DIEPTXF0_HNPTXFSIZ = (0x40UL << 16) | 0x40U;
 
   // EP1, massive
-  USBx->DIEPTXF[0] = (0x40UL << 16) | 0x80U;
+  USBx->DIEPTXF[0] = (USB_EP1_TXFIFO_WORDS << 16) | 0x80U;
+  ep1_xfer_active = false;
+  USBx_DEVICE->DIEPEMPMSK &= ~(1UL << 1);
+
+  // EP4, one packet
+  USBx->DIEPTXF[1] = (USB_PRIO_TXFIFO_WORDS << 16) | (0x80U + USB_EP1_TXFIFO_WORDS);
+  can_prio_set_active(false);
 
   // flush TX fifo
   USBx->GRSTCTL = USB_OTG_GRSTCTL_TXFFLSH | USB_OTG_GRSTCTL_TXFNUM_4;
@@ -224,53 +265,6 @@ static void usb_setup(void) {
     0x01, 0x00 // bNumConfigurations, bReserved
   };
 
-  static uint8_t configuration_desc[] = {
-    DSCR_CONFIG_LEN, USB_DESC_TYPE_CONFIGURATION, // Length, Type,
-    TOUSBORDER(0x0045U), // Total Len (uint16)
-    0x01, 0x01, STRING_OFFSET_ICONFIGURATION, // Num Interface, Config Value, Configuration
-    0xc0, 0x32, // Attributes, Max Power
-    // interface 0 ALT 0
-    DSCR_INTERFACE_LEN, USB_DESC_TYPE_INTERFACE, // Length, Type
-    0x00, 0x00, 0x03, // Index, Alt Index idx, Endpoint count
-    0XFF, 0xFF, 0xFF, // Class, Subclass, Protocol
-    0x00, // Interface
-      // endpoint 1, read CAN
-      DSCR_ENDPOINT_LEN, USB_DESC_TYPE_ENDPOINT, // Length, Type
-      ENDPOINT_RCV | 1, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
-      TOUSBORDER(0x0040U), // Max Packet (0x0040)
-      0x00, // Polling Interval (NA)
-      // endpoint 2, send serial
-      DSCR_ENDPOINT_LEN, USB_DESC_TYPE_ENDPOINT, // Length, Type
-      ENDPOINT_SND | 2, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
-      TOUSBORDER(0x0040U), // Max Packet (0x0040)
-      0x00, // Polling Interval
-      // endpoint 3, send CAN
-      DSCR_ENDPOINT_LEN, USB_DESC_TYPE_ENDPOINT, // Length, Type
-      ENDPOINT_SND | 3, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
-      TOUSBORDER(0x0040U), // Max Packet (0x0040)
-      0x00, // Polling Interval
-    // interface 0 ALT 1
-    DSCR_INTERFACE_LEN, USB_DESC_TYPE_INTERFACE, // Length, Type
-    0x00, 0x01, 0x03, // Index, Alt Index idx, Endpoint count
-    0XFF, 0xFF, 0xFF, // Class, Subclass, Protocol
-    0x00, // Interface
-      // endpoint 1, read CAN
-      DSCR_ENDPOINT_LEN, USB_DESC_TYPE_ENDPOINT, // Length, Type
-      ENDPOINT_RCV | 1, ENDPOINT_TYPE_INT, // Endpoint Num/Direction, Type
-      TOUSBORDER(0x0040U), // Max Packet (0x0040)
-      0x05, // Polling Interval (5 frames)
-      // endpoint 2, send serial
-      DSCR_ENDPOINT_LEN, USB_DESC_TYPE_ENDPOINT, // Length, Type
-      ENDPOINT_SND | 2, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
-      TOUSBORDER(0x0040U), // Max Packet (0x0040)
-      0x00, // Polling Interval
-      // endpoint 3, send CAN
-      DSCR_ENDPOINT_LEN, USB_DESC_TYPE_ENDPOINT, // Length, Type
-      ENDPOINT_SND | 3, ENDPOINT_TYPE_BULK, // Endpoint Num/Direction, Type
-      TOUSBORDER(0x0040U), // Max Packet (0x0040)
-      0x00, // Polling Interval
-  };
-
   // STRING_DESCRIPTOR_HEADER is for uint16 string descriptors
   // it takes in a string length, which is bytes/2 because unicode
   static uint16_t string_language_desc[] = {
@@ -442,6 +436,10 @@ static void usb_setup(void) {
                               USB_OTG_DIEPCTL_SD0PID_SEVNFRM | USB_OTG_DIEPCTL_USBAEP;
       USBx_INEP(1U)->DIEPINT = 0xFF;
 
+      USBx_INEP(USB_PRIO_EP)->DIEPCTL = (0x40U & USB_OTG_DIEPCTL_MPSIZ) | (3UL << 18) | (2UL << 22) |
+                                        USB_OTG_DIEPCTL_SD0PID_SEVNFRM | USB_OTG_DIEPCTL_USBAEP;
+      USBx_INEP(USB_PRIO_EP)->DIEPINT = 0xFF;
+
       USBx_OUTEP(2U)->DOEPTSIZ = (1UL << 19) | 0x40U;
       USBx_OUTEP(2U)->DOEPCTL = (0x40U & USB_OTG_DOEPCTL_MPSIZ) | (2UL << 18) |
                                USB_OTG_DOEPCTL_SD0PID_SEVNFRM | USB_OTG_DOEPCTL_USBAEP;
@@ -485,7 +483,7 @@ static void usb_setup(void) {
           //print("D");
           break;
         case USB_DESC_TYPE_CONFIGURATION:
-          USB_WritePacket(configuration_desc, MIN(sizeof(configuration_desc), setup.b.wLength.w), 0);
+          USB_WritePacket(usb_configuration_desc, MIN(sizeof(usb_configuration_desc), setup.b.wLength.w), 0);
           USBx_OUTEP(0U)->DOEPCTL |= USB_OTG_DOEPCTL_CNAK;
           break;
         case USB_DESC_TYPE_DEVICE_QUALIFIER:
@@ -552,6 +550,8 @@ static void usb_setup(void) {
     case USB_REQ_SET_INTERFACE:
       // Store the alt setting number for IN EP behavior.
       current_int0_alt_setting = setup.b.wValue.w;
+      // priority CAN IDs only leave the bulk endpoint while the host polls for them
+      can_prio_set_active(current_int0_alt_setting == USB_ALT_PRIO);
       USB_WritePacket(0, 0, 0);
       USBx_OUTEP(0U)->DOEPCTL |= USB_OTG_DOEPCTL_CNAK;
       break;
@@ -598,6 +598,9 @@ void usb_irqhandler(void) {
   //USBx->GINTMSK = 0;
   static uint8_t usbdata[0x100] __attribute__((aligned(4)));
   unsigned int gintsts = USBx->GINTSTS;
+
+  // latched before anything else, the time from the SOF to here is what the host can't correct for
+  usb_sof_irq(gintsts);
   unsigned int gotgint = USBx->GOTGINT;
   unsigned int daint = USBx_DEVICE->DAINT;
 
@@ -808,18 +811,28 @@ void usb_irqhandler(void) {
 
     //TODO add default case. Should it NAK?
     switch (current_int0_alt_setting) {
-      case 0: ////// Bulk config
+      case USB_ALT_BULK: ////// Bulk config
+      case USB_ALT_PRIO:
         // *** IN token received when TxFIFO is empty
-        if ((USBx_INEP(1U)->DIEPINT & USB_OTG_DIEPMSK_ITTXFEMSK) != 0U) {
+        if ((USBx_INEP(1U)->DIEPINT & USB_OTG_DIEPINT_XFRC) != 0U) {
+          ep1_xfer_active = false;
+        }
+        if (ep1_xfer_active) {
+          // *** TxFIFO empty, load the rest of the transfer
+          if (((USBx_DEVICE->DIEPEMPMSK & (1UL << 1)) != 0U) && ((USBx_INEP(1U)->DIEPINT & USB_OTG_DIEPINT_TXFE) != 0U)) {
+            usb_ep1_fill_fifo();
+          }
+        } else if ((USBx_INEP(1U)->DIEPINT & USB_OTG_DIEPMSK_ITTXFEMSK) != 0U) {
           #ifdef DEBUG_USB
           print("  IN PACKET QUEUE\n");
           #endif
-          // TODO: always assuming max len, can we get the length?
-          USB_WritePacket((void *)response, comms_can_read(response, 0x40), 1);
+          usb_ep1_start_xfer();
+        } else {
+          // nothing to do
         }
         break;
 
-      case 1: ////// Interrupt config
+      case USB_ALT_INT: ////// Interrupt config
         // *** IN token received when TxFIFO is empty
         if ((USBx_INEP(1U)->DIEPINT & USB_OTG_DIEPMSK_ITTXFEMSK) != 0U) {
           #ifdef DEBUG_USB
@@ -837,6 +850,11 @@ void usb_irqhandler(void) {
         break;
     }
 
+    // *** priority CAN IDs, the next packet is loaded once the last one went out
+    if ((USBx_INEP(USB_PRIO_EP)->DIEPINT & (USB_OTG_DIEPINT_XFRC | USB_OTG_DIEPMSK_ITTXFEMSK)) != 0U) {
+      usb_prio_load();
+    }
+
     if ((USBx_INEP(0U)->DIEPINT & USB_OTG_DIEPMSK_ITTXFEMSK) != 0U) {
       #ifdef DEBUG_USB
       print("  IN PACKET QUEUE\n");
@@ -858,6 +876,7 @@ void usb_irqhandler(void) {
     // clear interrupts
     USBx_INEP(0U)->DIEPINT = USBx_INEP(0U)->DIEPINT; // Why ep0?
     USBx_INEP(1U)->DIEPINT = USBx_INEP(1U)->DIEPINT;
+    USBx_INEP(USB_PRIO_EP)->DIEPINT = USBx_INEP(USB_PRIO_EP)->DIEPINT;
   }
 
   // clear all interrupts we handled
@@ -876,3 +895,10 @@ void can_tx_comms_resume_usb(void) {
   }
   EXIT_CRITICAL();
 }
+
+// called after priority CAN IDs were queued
+void can_prio_comms_resume_usb(void) {
+  ENTER_CRITICAL();
+  usb_prio_load();
+  EXIT_CRITICAL();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+// (frame number, microsecond timer) latched at SOF, for lining up the panda's timer with the host's USB frames.
+// The SOF interrupt is only unmasked for a while after the host asks for them, it fires every frame.
+// Only USBx's GINTSTS and GINTMSK and USBx_DEVICE's DSTS are used, so the tests can fake them.
+#define USB_SOF_LATCH_CNT 8U
+#define USB_SOF_LATCH_FRAMES 5000U
+typedef struct {
+  uint16_t frame;
+  uint32_t us;
+} usb_sof_latch_t;
+static usb_sof_latch_t usb_sof_latches[USB_SOF_LATCH_CNT];
+static uint8_t usb_sof_latch_idx = 0U;
+static uint8_t usb_sof_latch_cnt = 0U;
+static uint32_t usb_sof_latch_frames = 0U;
+
+static void usb_sof_latch(void) {
+  uint32_t us = microsecond_timer_get();
+  usb_sof_latches[usb_sof_latch_idx].frame = (uint16_t)((USBx_DEVICE->DSTS & USB_OTG_DSTS_FNSOF) >> USB_OTG_DSTS_FNSOF_Pos);
+  usb_sof_latches[usb_sof_latch_idx].us = us;
+  usb_sof_latch_idx = (usb_sof_latch_idx + 1U) % USB_SOF_LATCH_CNT;
+  usb_sof_latch_cnt = MIN(usb_sof_latch_cnt + 1U, USB_SOF_LATCH_CNT);
+
+  usb_sof_latch_frames -= 1U;
+  if (usb_sof_latch_frames == 0U) {
+    USBx->GINTMSK &= ~USB_OTG_GINTMSK_SOFM;
+  }
+}
+
+// SOF part of the USB interrupt, gintsts as the interrupt found it. The SOF status is set every
+// frame, masked or not, so other interrupts see it too. It's only latched while latching is on.
+void usb_sof_irq(uint32_t gintsts) {
+  if ((gintsts & USB_OTG_GINTSTS_SOF) != 0U) {
+    if (((USBx->GINTMSK & USB_OTG_GINTMSK_SOFM) != 0U) && (usb_sof_latch_frames > 0U)) {
+      usb_sof_latch();
+    }
+    USBx->GINTSTS = USB_OTG_GINTSTS_SOF;
+  }
+}
+
+// (re)starts latching and writes the latest latches, oldest first, as 6 bytes each:
+// frame number (uint16) and microsecond timer (uint32), little endian
+uint8_t usb_sof_latches_get(uint8_t *resp) {
+  uint8_t resp_len = 0U;
+  ENTER_CRITICAL();
+  if (usb_sof_latch_frames == 0U) {
+    // the ones from last time are stale
+    usb_sof_latch_cnt = 0U;
+    USBx->GINTSTS = USB_OTG_GINTSTS_SOF;
+    USBx->GINTMSK |= USB_OTG_GINTMSK_SOFM;
+  }
+  usb_sof_latch_frames = USB_SOF_LATCH_FRAMES;
+
+  for (uint8_t i = 0U; i < usb_sof_latch_cnt; i++) {
+    const usb_sof_latch_t *l = &usb_sof_latches[(usb_sof_latch_idx + USB_SOF_LATCH_CNT - usb_sof_latch_cnt + i) % USB_SOF_LATCH_CNT];
+    resp[resp_len] = (uint8_t)(l->frame & 0xFFU);
+    resp[resp_len + 1U] = (uint8_t)((l->frame >> 8U) & 0xFFU);
+    resp[resp_len + 2U] = (uint8_t)(l->us & 0xFFU);
+    resp[resp_len + 3U] = (uint8_t)((l->us >> 8U) & 0xFFU);
+    resp[resp_len + 4U] = (uint8_t)((l->us >> 16U) & 0xFFU);
+    resp[resp_len + 5U] = (uint8_t)((l->us >> 24U) & 0xFFU);
+    resp_len += 6U;
+  }
+  EXIT_CRITICAL();
+  return resp_len;
+}
@@ -0,0 +1,584 @@
+// minimal FDCAN cores for tests, so board/drivers/fdcan.h and board/stm32h7/llfdcan.h run on PC.
+// The registers the drivers use are emulated with their side effects, the message RAM is mapped at
+// the chip's address. The tests play the bus: fdcan_emu_rx() receives a frame into RX FIFO 0,
+// fdcan_emu_tx() sends the pending TX buffer that wins arbitration, fdcan_emu_irq() runs the
+// handlers of the pending interrupts. Not emulated: the acceptance filters, bus errors (see
+// fdcan_emu_error()) and the timing of the bus, that's up to the caller of fdcan_emu_tx_start()
+// and fdcan_emu_tx_done().
+#include <stdbool.h>
+#include <sys/mman.h>
+
+// ***************************** device header *****************************
+// what board/stm32h7/inc/stm32h725xx.h has for the FDCAN cores
+
+typedef enum {
+  FDCAN1_IT0_IRQn = 19,
+  FDCAN2_IT0_IRQn = 20,
+  FDCAN1_IT1_IRQn = 21,
+  FDCAN2_IT1_IRQn = 22,
+  FDCAN3_IT0_IRQn = 159,
+  FDCAN3_IT1_IRQn = 160,
+} IRQn_Type;
+#define NUM_INTERRUPTS 163U
+
+// registers with side effects are arrays, accessed through the macros below
+typedef struct {
+  volatile uint32_t CREL;
+  volatile uint32_t ENDN;
+  volatile uint32_t RESERVED1;
+  volatile uint32_t DBTP;
+  volatile uint32_t TEST;
+  volatile uint32_t RWD;
+  volatile uint32_t cccr[1];
+  volatile uint32_t NBTP;
+  volatile uint32_t TSCC;
+  volatile uint32_t tscv[1];
+  volatile uint32_t TOCC;
+  volatile uint32_t TOCV;
+  volatile uint32_t RESERVED2[4];
+  volatile uint32_t ECR;
+  volatile uint32_t PSR;
+  volatile uint32_t TDCR;
+  volatile uint32_t RESERVED3;
+  volatile uint32_t IR;
+  volatile uint32_t IE;
+  volatile uint32_t ILS;
+  volatile uint32_t ILE;
+  volatile uint32_t RESERVED4[8];
+  volatile uint32_t GFC;
+  volatile uint32_t SIDFC;
+  volatile uint32_t XIDFC;
+  volatile uint32_t RESERVED5;
+  volatile uint32_t XIDAM;
+  volatile uint32_t HPMS;
+  volatile uint32_t NDAT1;
+  volatile uint32_t NDAT2;
+  volatile uint32_t RXF0C;
+  volatile uint32_t rxf0s[1];
+  volatile uint32_t RXF0A;
+  volatile uint32_t RXBC;
+  volatile uint32_t RXF1C;
+  volatile uint32_t RXF1S;
+  volatile uint32_t RXF1A;
+  volatile uint32_t RXESC;
+  volatile uint32_t TXBC;
+  volatile uint32_t TXFQS;
+  volatile uint32_t TXESC;
+  volatile uint32_t txbrp[1];
+  volatile uint32_t txbar[1];
+  volatile uint32_t txbcr[1];
+  volatile uint32_t txbto[1];
+  volatile uint32_t txbcf[1];
+  volatile uint32_t TXBTIE;
+  volatile uint32_t TXBCIE;
+  volatile uint32_t RESERVED6[2];
+  volatile uint32_t TXEFC;
+  volatile uint32_t txefs[1];
+  volatile uint32_t TXEFA;
+  volatile uint32_t RESERVED7;
+} FDCAN_GlobalTypeDef;
+
+FDCAN_GlobalTypeDef fdcan_emu_regs[3];
+#define FDCAN1 (&fdcan_emu_regs[0])
+#define FDCAN2 (&fdcan_emu_regs[1])
+#define FDCAN3 (&fdcan_emu_regs[2])
+
+#define SRAMCAN_BASE 0x4000AC00UL
+#define SRAMCAN_SIZE 0x2800UL
+
+#define FDCAN_CCCR_INIT 0x1UL
+#define FDCAN_CCCR_CCE 0x2UL
+#define FDCAN_CCCR_ASM 0x4UL
+#define FDCAN_CCCR_CSA 0x8UL
+#define FDCAN_CCCR_CSR 0x10UL
+#define FDCAN_CCCR_MON 0x20UL
+#define FDCAN_CCCR_DAR 0x40UL
+#define FDCAN_CCCR_TEST 0x80UL
+#define FDCAN_CCCR_FDOE 0x100UL
+#define FDCAN_CCCR_BRSE 0x200UL
+#define FDCAN_CCCR_PXHD 0x1000UL
+#define FDCAN_CCCR_TXP 0x4000UL
+#define FDCAN_CCCR_NISO 0x8000UL
+#define FDCAN_TEST_LBCK 0x10UL
+
+#define FDCAN_NBTP_NTSEG2_Pos 0U
+#define FDCAN_NBTP_NTSEG1_Pos 8U
+#define FDCAN_NBTP_NBRP_Pos 16U
+#define FDCAN_NBTP_NSJW_Pos 25U
+#define FDCAN_DBTP_DSJW_Pos 0U
+#define FDCAN_DBTP_DTSEG2_Pos 4U
+#define FDCAN_DBTP_DTSEG1_Pos 8U
+#define FDCAN_DBTP_DBRP_Pos 16U
+#define FDCAN_TSCC_TSS_Pos 0U
+#define FDCAN_TSCV_TSC 0xFFFFUL
+
+#define FDCAN_ECR_TEC_Pos 0U
+#define FDCAN_ECR_TEC 0xFFUL
+#define FDCAN_ECR_REC_Pos 8U
+#define FDCAN_ECR_REC 0x7F00UL
+#define FDCAN_PSR_LEC_Pos 0U
+#define FDCAN_PSR_LEC 0x7UL
+#define FDCAN_PSR_EP_Pos 5U
+#define FDCAN_PSR_EP 0x20UL
+#define FDCAN_PSR_EW_Pos 6U
+#define FDCAN_PSR_EW 0x40UL
+#define FDCAN_PSR_BO_Pos 7U
+#define FDCAN_PSR_BO 0x80UL
+#define FDCAN_PSR_DLEC_Pos 8U
+#define FDCAN_PSR_DLEC 0x700UL
+
+// IR, IE and ILS have the same bits
+#define FDCAN_IR_RF0N 0x1UL
+#define FDCAN_IR_RF0L 0x8UL
+#define FDCAN_IR_TCF 0x400UL
+#define FDCAN_IR_TEFN 0x1000UL
+#define FDCAN_IR_TEFL 0x8000UL
+#define FDCAN_IR_EP 0x800000UL
+#define FDCAN_IR_BO 0x2000000UL
+#define FDCAN_IR_PEA 0x8000000UL
+#define FDCAN_IR_PED 0x10000000UL
+#define FDCAN_IE_RF0NE FDCAN_IR_RF0N
+#define FDCAN_IE_RF0LE FDCAN_IR_RF0L
+#define FDCAN_IE_TCFE FDCAN_IR_TCF
+#define FDCAN_IE_TEFNE FDCAN_IR_TEFN
+#define FDCAN_IE_EPE FDCAN_IR_EP
+#define FDCAN_IE_BOE FDCAN_IR_BO
+#define FDCAN_IE_PEAE FDCAN_IR_PEA
+#define FDCAN_IE_PEDE FDCAN_IR_PED
+#define FDCAN_ILS_TCFL FDCAN_IR_TCF
+#define FDCAN_ILS_TEFNL FDCAN_IR_TEFN
+#define FDCAN_ILE_EINT0 0x1UL
+#define FDCAN_ILE_EINT1 0x2UL
+
+#define FDCAN_GFC_RRFE 0x1UL
+#define FDCAN_GFC_RRFS 0x2UL
+#define FDCAN_GFC_ANFE_Pos 2U
+#define FDCAN_GFC_ANFE 0xCUL
+#define FDCAN_GFC_ANFS_Pos 4U
+#define FDCAN_GFC_ANFS 0x30UL
+#define FDCAN_SIDFC_FLSSA_Pos 2U
+#define FDCAN_SIDFC_FLSSA 0xFFFCUL
+#define FDCAN_SIDFC_LSS_Pos 16U
+#define FDCAN_SIDFC_LSS 0xFF0000UL
+#define FDCAN_XIDFC_FLESA_Pos 2U
+#define FDCAN_XIDFC_FLESA 0xFFFCUL
+#define FDCAN_XIDFC_LSE_Pos 16U
+#define FDCAN_XIDFC_LSE 0x7F0000UL
+
+#define FDCAN_RXF0C_F0SA_Pos 2U
+#define FDCAN_RXF0C_F0SA 0xFFFCUL
+#define FDCAN_RXF0C_F0S_Pos 16U
+#define FDCAN_RXF0C_F0S 0x7F0000UL
+#define FDCAN_RXF0C_F0OM 0x80000000UL
+#define FDCAN_RXF0S_F0FL 0x7FUL
+#define FDCAN_RXF0S_F0GI_Pos 8U
+#define FDCAN_RXF0S_F0PI_Pos 16U
+#define FDCAN_RXF0S_F0F 0x1000000UL
+#define FDCAN_RXF0S_RF0L 0x2000000UL
+#define FDCAN_RXESC_F0DS_Pos 0U
+
+#define FDCAN_TXBC_TBSA_Pos 2U
+#define FDCAN_TXBC_TBSA 0xFFFCUL
+#define FDCAN_TXBC_NDTB_Pos 16U
+#define FDCAN_TXBC_NDTB 0x3F0000UL
+#define FDCAN_TXBC_TFQS 0x3F000000UL
+#define FDCAN_TXBC_TFQM 0x40000000UL
+#define FDCAN_TXESC_TBDS_Pos 0U
+#define FDCAN_TXBCIE_CFIE 0xFFFFFFFFUL
+#define FDCAN_TXEFC_EFSA_Pos 2U
+#define FDCAN_TXEFC_EFSA 0xFFFCUL
+#define FDCAN_TXEFC_EFS_Pos 16U
+#define FDCAN_TXEFC_EFS 0x3F0000UL
+#define FDCAN_TXEFC_EFWM 0x3F000000UL
+#define FDCAN_TXEFS_EFFL 0x3FUL
+#define FDCAN_TXEFS_EFGI_Pos 8U
+#define FDCAN_TXEFS_EFGI 0x1F00UL
+#define FDCAN_TXEFS_EFPI_Pos 16U
+#define FDCAN_TXEFS_EFF 0x1000000UL
+#define FDCAN_TXEFS_TEFL 0x2000000UL
+
+// ***************************** emulation *****************************
+
+// on the chip writes to these take effect right away, so every access brings the cores up to date
+uint8_t fdcan_emu_sync(void);
+#define CCCR cccr[fdcan_emu_sync()]
+#define TSCV tscv[fdcan_emu_sync()]
+#define RXF0S rxf0s[fdcan_emu_sync()]
+#define TXBRP txbrp[fdcan_emu_sync()]
+#define TXBAR txbar[fdcan_emu_sync()]
+#define TXBCR txbcr[fdcan_emu_sync()]
+#define TXBTO txbto[fdcan_emu_sync()]
+#define TXBCF txbcf[fdcan_emu_sync()]
+#define TXEFS txefs[fdcan_emu_sync()]
+
+#define FDCAN_EMU_ACK_NONE 0xFFFFFFFFU
+#define FDCAN_EMU_KER_CK_KHZ 80000U  // PLL1Q
+
+typedef struct {
+  uint32_t addr;
+  bool extended;
+  bool fd;
+  bool brs;
+  uint8_t data_len_code;
+  uint8_t data[64];
+} fdcan_emu_frame_t;
+
+typedef struct {
+  uint32_t ir;  // IR is write 1 to clear, the handlers' read-modify-writes clear all of it
+  uint8_t rx_get;
+  uint8_t rx_put;
+  uint8_t rx_fill;
+  uint8_t ev_get;
+  uint8_t ev_put;
+  uint8_t ev_fill;
+  bool tx_busy;   // between fdcan_emu_tx_start() and fdcan_emu_tx_done()
+  uint8_t tx_idx; // the TX buffer on the bus
+} fdcan_emu_core_t;
+
+static fdcan_emu_core_t fdcan_emu_cores[3];
+static bool fdcan_emu_nvic[NUM_INTERRUPTS];
+static const uint8_t fdcan_emu_dlc_to_len[16] = {0U, 1U, 2U, 3U, 4U, 5U, 6U, 7U, 8U, 12U, 16U, 20U, 24U, 32U, 48U, 64U};
+static const uint8_t fdcan_emu_el_data_size[8] = {8U, 12U, 16U, 20U, 24U, 32U, 48U, 64U};
+
+// NULL when the message RAM couldn't be mapped, the tests skip then
+volatile uint32_t *fdcan_emu_ram = NULL;
+
+__attribute__((constructor)) static void fdcan_emu_map(void) {
+  uintptr_t page = SRAMCAN_BASE & ~0xFFFUL;
+  size_t len = ((SRAMCAN_BASE + SRAMCAN_SIZE) - page + 0xFFFUL) & ~0xFFFUL;
+  void *ram = mmap((void *)page, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ram == (void *)page) {
+    fdcan_emu_ram = (volatile uint32_t *)SRAMCAN_BASE;
+  } else if (ram != MAP_FAILED) {
+    (void)munmap(ram, len);
+  } else {
+  }
+}
+
+void NVIC_EnableIRQ(IRQn_Type irq) { fdcan_emu_nvic[irq] = true; }
+void NVIC_DisableIRQ(IRQn_Type irq) { fdcan_emu_nvic[irq] = false; }
+
+static volatile uint32_t *fdcan_emu_element(uint32_t start_w, uint32_t idx, uint32_t el_w) {
+  return &fdcan_emu_ram[start_w + (idx * el_w)];
+}
+
+static uint32_t fdcan_emu_rx_el_w(const FDCAN_GlobalTypeDef *FDCANx) {
+  return 2U + (fdcan_emu_el_data_size[(FDCANx->RXESC >> FDCAN_RXESC_F0DS_Pos) & 0x7U] / 4U);
+}
+
+static uint32_t fdcan_emu_tx_el_w(const FDCAN_GlobalTypeDef *FDCANx) {
+  return 2U + (fdcan_emu_el_data_size[(FDCANx->TXESC >> FDCAN_TXESC_TBDS_Pos) & 0x7U] / 4U);
+}
+
+static void fdcan_emu_update(uint8_t can_number) {
+  FDCAN_GlobalTypeDef *FDCANx = &fdcan_emu_regs[can_number];
+  fdcan_emu_core_t *core = &fdcan_emu_cores[can_number];
+  uint32_t rx_size = (FDCANx->RXF0C & FDCAN_RXF0C_F0S) >> FDCAN_RXF0C_F0S_Pos;
+  uint32_t ev_size = (FDCANx->TXEFC & FDCAN_TXEFC_EFS) >> FDCAN_TXEFC_EFS_Pos;
+
+  // leaving initialization ends the configuration change, clock stop follows its request
+  if ((FDCANx->cccr[0] & FDCAN_CCCR_INIT) == 0U) {
+    FDCANx->cccr[0] &= ~FDCAN_CCCR_CCE;
+  }
+  FDCANx->cccr[0] = (FDCANx->cccr[0] & ~FDCAN_CCCR_CSA) | (((FDCANx->cccr[0] & FDCAN_CCCR_CSR) != 0U) ? FDCAN_CCCR_CSA : 0U);
+
+  // configuration resets the FIFOs and the pending requests
+  if ((FDCANx->cccr[0] & FDCAN_CCCR_INIT) != 0U) {
+    *core = (fdcan_emu_core_t){0};
+    FDCANx->txbrp[0] = 0U;
+    FDCANx->txbto[0] = 0U;
+    FDCANx->txbcf[0] = 0U;
+    FDCANx->txbar[0] = 0U;
+    FDCANx->txbcr[0] = 0U;
+  }
+
+  // acknowledging an element frees it and the ones before it
+  if (FDCANx->RXF0A != FDCAN_EMU_ACK_NONE) {
+    if ((FDCANx->RXF0A < rx_size) && (core->rx_fill > 0U)) {
+      uint32_t freed = ((FDCANx->RXF0A + rx_size - core->rx_get) % rx_size) + 1U;
+      core->rx_fill -= MIN(freed, (uint32_t)core->rx_fill);
+      core->rx_get = (FDCANx->RXF0A + 1U) % rx_size;
+    }
+    FDCANx->RXF0A = FDCAN_EMU_ACK_NONE;
+  }
+  if (FDCANx->TXEFA != FDCAN_EMU_ACK_NONE) {
+    if ((FDCANx->TXEFA < ev_size) && (core->ev_fill > 0U)) {
+      uint32_t freed = ((FDCANx->TXEFA + ev_size - core->ev_get) % ev_size) + 1U;
+      core->ev_fill -= MIN(freed, (uint32_t)core->ev_fill);
+      core->ev_get = (FDCANx->TXEFA + 1U) % ev_size;
+    }
+    FDCANx->TXEFA = FDCAN_EMU_ACK_NONE;
+  }
+
+  uint32_t buffers = (1UL << ((FDCANx->TXBC & FDCAN_TXBC_NDTB) >> FDCAN_TXBC_NDTB_Pos)) - 1U;
+  if (FDCANx->txbar[0] != 0U) {
+    uint32_t added = FDCANx->txbar[0] & buffers;
+    FDCANx->txbrp[0] |= added;
+    FDCANx->txbto[0] &= ~added;
+    FDCANx->txbcf[0] &= ~added;
+    FDCANx->txbar[0] = 0U;
+  }
+  // cancellations finish right away, except for the frame on the bus. It goes out, see fdcan_emu_tx_done()
+  uint32_t on_bus = core->tx_busy ? (1UL << core->tx_idx) : 0U;
+  if ((FDCANx->txbcr[0] & ~on_bus) != 0U) {
+    uint32_t cancelled = FDCANx->txbcr[0] & FDCANx->txbrp[0] & ~on_bus;
+    FDCANx->txbrp[0] &= ~cancelled;
+    FDCANx->txbcf[0] |= cancelled;
+    if ((cancelled & FDCANx->TXBCIE) != 0U) {
+      core->ir |= FDCAN_IR_TCF;
+    }
+    FDCANx->txbcr[0] &= on_bus;
+  }
+
+  FDCANx->rxf0s[0] = core->rx_fill | ((uint32_t)core->rx_get << FDCAN_RXF0S_F0GI_Pos) | ((uint32_t)core->rx_put << FDCAN_RXF0S_F0PI_Pos) |
+                     (((rx_size != 0U) && (core->rx_fill == rx_size)) ? FDCAN_RXF0S_F0F : 0U);
+  FDCANx->txefs[0] = core->ev_fill | ((uint32_t)core->ev_get << FDCAN_TXEFS_EFGI_Pos) | ((uint32_t)core->ev_put << FDCAN_TXEFS_EFPI_Pos) |
+                     (((ev_size != 0U) && (core->ev_fill == ev_size)) ? FDCAN_TXEFS_EFF : 0U);
+
+  // the timestamp counter counts nominal bit times
+  uint32_t nbtp = FDCANx->NBTP;
+  uint64_t bit_tq = 3U + ((nbtp >> FDCAN_NBTP_NTSEG1_Pos) & 0xFFU) + ((nbtp >> FDCAN_NBTP_NTSEG2_Pos) & 0x7FU);
+  uint64_t tq_per_ms = FDCAN_EMU_KER_CK_KHZ / (((nbtp >> FDCAN_NBTP_NBRP_Pos) & 0x1FFU) + 1U);
+  FDCANx->tscv[0] = (uint32_t)((((uint64_t)MICROSECOND_TIMER->CNT * tq_per_ms) / (bit_tq * 1000U)) & FDCAN_TSCV_TSC);
+}
+
+uint8_t fdcan_emu_sync(void) {
+  for (uint8_t i = 0U; i < 3U; i++) {
+    fdcan_emu_update(i);
+  }
+  return 0U;
+}
+
+// back to reset values, the tests call this before can_init()
+void fdcan_emu_reset(void) {
+  for (uint8_t i = 0U; i < 3U; i++) {
+    fdcan_emu_regs[i] = (FDCAN_GlobalTypeDef){0};
+    fdcan_emu_regs[i].RXF0A = FDCAN_EMU_ACK_NONE;
+    fdcan_emu_regs[i].TXEFA = FDCAN_EMU_ACK_NONE;
+    fdcan_emu_cores[i] = (fdcan_emu_core_t){0};
+  }
+  for (uint32_t i = 0U; (fdcan_emu_ram != NULL) && (i < (SRAMCAN_SIZE / 4U)); i++) {
+    fdcan_emu_ram[i] = 0U;
+  }
+}
+
+// a frame from the bus, false when it didn't make it into RX FIFO 0
+bool fdcan_emu_rx(uint8_t can_number, const fdcan_emu_frame_t *frame) {
+  FDCAN_GlobalTypeDef *FDCANx = &fdcan_emu_regs[can_number];
+  fdcan_emu_core_t *core = &fdcan_emu_cores[can_number];
+  uint32_t rx_size = (FDCANx->RXF0C & FDCAN_RXF0C_F0S) >> FDCAN_RXF0C_F0S_Pos;
+  bool ret = false;
+
+  (void)fdcan_emu_sync();
+  if (((FDCANx->cccr[0] & FDCAN_CCCR_INIT) == 0U) && (rx_size != 0U)) {
+    if (core->rx_fill < rx_size) {
+      core->rx_fill += 1U;
+      ret = true;
+    } else if ((FDCANx->RXF0C & FDCAN_RXF0C_F0OM) != 0U) {
+      // overwrite mode, the oldest element goes
+      core->rx_get = (core->rx_get + 1U) % rx_size;
+      ret = true;
+    } else {
+      core->ir |= FDCAN_IR_RF0L;
+    }
+
+    if (ret) {
+      volatile uint32_t *el = fdcan_emu_element((FDCANx->RXF0C & FDCAN_RXF0C_F0SA) >> FDCAN_RXF0C_F0SA_Pos, core->rx_put, fdcan_emu_rx_el_w(FDCANx));
+      el[0] = frame->extended ? ((1UL << 30) | (frame->addr & 0x1FFFFFFFU)) : ((frame->addr & 0x7FFU) << 18);
+      el[1] = ((uint32_t)frame->data_len_code << 16) | (frame->fd ? (1UL << 21) : 0U) | ((frame->fd && frame->brs) ? (1UL << 20) : 0U) |
+              (FDCANx->tscv[0] & FDCAN_TSCV_TSC);
+      for (uint8_t i = 0U; i < ((fdcan_emu_dlc_to_len[frame->data_len_code] + 3U) / 4U); i++) {
+        el[2U + i] = frame->data[i * 4U] | ((uint32_t)frame->data[(i * 4U) + 1U] << 8) | ((uint32_t)frame->data[(i * 4U) + 2U] << 16) |
+                     ((uint32_t)frame->data[(i * 4U) + 3U] << 24);
+      }
+      core->rx_put = (core->rx_put + 1U) % rx_size;
+      core->ir |= FDCAN_IR_RF0N;
+    }
+    fdcan_emu_update(can_number);
+  }
+  return ret;
+}
+
+// lower goes first: 11 bit base ID, then standard before extended, then the 18 extended ID bits
+static uint32_t fdcan_emu_priority(uint32_t header0) {
+  uint32_t ret;
+  if ((header0 & (1UL << 30)) != 0U) {
+    ret = (((header0 >> 18) & 0x7FFU) << 19) | (1UL << 18) | (header0 & 0x3FFFFU);
+  } else {
+    ret = ((header0 >> 18) & 0x7FFU) << 19;
+  }
+  return ret;
+}
+
+static void fdcan_emu_tx_frame(const FDCAN_GlobalTypeDef *FDCANx, uint8_t idx, fdcan_emu_frame_t *frame) {
+  const volatile uint32_t *el = fdcan_emu_element((FDCANx->TXBC & FDCAN_TXBC_TBSA) >> FDCAN_TXBC_TBSA_Pos, idx, fdcan_emu_tx_el_w(FDCANx));
+  frame->extended = ((el[0] >> 30) & 0x1U) != 0U;
+  frame->addr = frame->extended ? (el[0] & 0x1FFFFFFFU) : ((el[0] >> 18) & 0x7FFU);
+  frame->fd = ((el[1] >> 21) & 0x1U) != 0U;
+  frame->brs = frame->fd && (((el[1] >> 20) & 0x1U) != 0U);
+  frame->data_len_code = (el[1] >> 16) & 0xFU;
+  for (uint8_t i = 0U; i < fdcan_emu_dlc_to_len[frame->data_len_code]; i++) {
+    frame->data[i] = (uint8_t)(el[2U + (i / 4U)] >> ((i % 4U) * 8U));
+  }
+}
+
+// puts the pending TX buffer that wins arbitration on the bus, lowest buffer number first on equal IDs.
+// false when nothing can go out. The frame stays pending, and can't be cancelled, until fdcan_emu_tx_done()
+bool fdcan_emu_tx_start(uint8_t can_number, fdcan_emu_frame_t *frame) {
+  FDCAN_GlobalTypeDef *FDCANx = &fdcan_emu_regs[can_number];
+  fdcan_emu_core_t *core = &fdcan_emu_cores[can_number];
+  bool ret = false;
+
+  (void)fdcan_emu_sync();
+  uint32_t pending = FDCANx->txbrp[0];
+  bool bus_monitoring = ((FDCANx->cccr[0] & FDCAN_CCCR_MON) != 0U) && ((FDCANx->TEST & FDCAN_TEST_LBCK) == 0U);
+  if (!core->tx_busy && ((FDCANx->cccr[0] & FDCAN_CCCR_INIT) == 0U) && !bus_monitoring && (pending != 0U)) {
+    uint32_t tx_start_w = (FDCANx->TXBC & FDCAN_TXBC_TBSA) >> FDCAN_TXBC_TBSA_Pos;
+    uint32_t best = 0xFFFFFFFFU;
+    for (uint8_t i = 0U; i < 32U; i++) {
+      if ((pending & (1UL << i)) != 0U) {
+        uint32_t prio = fdcan_emu_priority(fdcan_emu_element(tx_start_w, i, fdcan_emu_tx_el_w(FDCANx))[0]);
+        if (prio < best) {
+          best = prio;
+          core->tx_idx = i;
+        }
+      }
+    }
+    core->tx_busy = true;
+    if (frame != NULL) {
+      fdcan_emu_tx_frame(FDCANx, core->tx_idx, frame);
+    }
+    ret = true;
+  }
+  return ret;
+}
+
+// the frame on the bus went out. false when there was none, it's gone when the core was reset since.
+// Also false for a frame of the internal loopback, it's received instead
+bool fdcan_emu_tx_done(uint8_t can_number, fdcan_emu_frame_t *frame) {
+  FDCAN_GlobalTypeDef *FDCANx = &fdcan_emu_regs[can_number];
+  fdcan_emu_core_t *core = &fdcan_emu_cores[can_number];
+  bool ret = false;
+
+  (void)fdcan_emu_sync();
+  if (core->tx_busy) {
+    uint8_t idx = core->tx_idx;
+    uint32_t tx_start_w = (FDCANx->TXBC & FDCAN_TXBC_TBSA) >> FDCAN_TXBC_TBSA_Pos;
+    const volatile uint32_t *el = fdcan_emu_element(tx_start_w, idx, fdcan_emu_tx_el_w(FDCANx));
+    fdcan_emu_frame_t sent;
+    fdcan_emu_tx_frame(FDCANx, idx, &sent);
+
+    core->tx_busy = false;
+    FDCANx->txbrp[0] &= ~(1UL << idx);
+    FDCANx->txbto[0] |= (1UL << idx);
+    // a cancellation requested while it was on the bus finishes along with it
+    if ((FDCANx->txbcr[0] & (1UL << idx)) != 0U) {
+      FDCANx->txbcr[0] &= ~(1UL << idx);
+      FDCANx->txbcf[0] |= (1UL << idx);
+      if ((FDCANx->TXBCIE & (1UL << idx)) != 0U) {
+        core->ir |= FDCAN_IR_TCF;
+      }
+    }
+
+    // event FIFO control
+    if (((el[1] >> 23) & 0x1U) != 0U) {
+      uint32_t ev_size = (FDCANx->TXEFC & FDCAN_TXEFC_EFS) >> FDCAN_TXEFC_EFS_Pos;
+      if (core->ev_fill < ev_size) {
+        volatile uint32_t *ev = fdcan_emu_element((FDCANx->TXEFC & FDCAN_TXEFC_EFSA) >> FDCAN_TXEFC_EFSA_Pos, core->ev_put, 2U);
+        ev[0] = el[0];
+        ev[1] = (el[1] & 0xFF3F0000U) | (1UL << 22) | (FDCANx->tscv[0] & FDCAN_TSCV_TSC);
+        core->ev_put = (core->ev_put + 1U) % ev_size;
+        core->ev_fill += 1U;
+        core->ir |= FDCAN_IR_TEFN;
+      } else {
+        core->ir |= FDCAN_IR_TEFL;
+      }
+    }
+    fdcan_emu_update(can_number);
+
+    if ((FDCANx->TEST & FDCAN_TEST_LBCK) != 0U) {
+      (void)fdcan_emu_rx(can_number, &sent);
+    } else {
+      if (frame != NULL) {
+        *frame = sent;
+      }
+      ret = true;
+    }
+  }
+  return ret;
+}
+
+// sends the pending TX buffer that wins arbitration, right away.
+// false when nothing went out on the bus, frames of the internal loopback are received instead
+bool fdcan_emu_tx(uint8_t can_number, fdcan_emu_frame_t *frame) {
+  bool ret = false;
+  if (fdcan_emu_tx_start(can_number, NULL)) {
+    ret = fdcan_emu_tx_done(can_number, frame);
+  }
+  return ret;
+}
+
+// bus errors: sets the protocol status and error counters, raises the IR flags
+void fdcan_emu_error(uint8_t can_number, uint32_t psr, uint32_t ecr, uint32_t ir) {
+  fdcan_emu_regs[can_number].PSR = psr;
+  fdcan_emu_regs[can_number].ECR = ecr;
+  fdcan_emu_cores[can_number].ir |= ir;
+}
+
+void can_rx(uint8_t can_number);
+void process_can(uint8_t can_number);
+
+// runs the handlers of the interrupt lines with enabled flags pending, returns the lines that ran
+uint8_t fdcan_emu_irq(uint8_t can_number) {
+  static const IRQn_Type irqs[3][2] = {
+    {FDCAN1_IT0_IRQn, FDCAN1_IT1_IRQn},
+    {FDCAN2_IT0_IRQn, FDCAN2_IT1_IRQn},
+    {FDCAN3_IT0_IRQn, FDCAN3_IT1_IRQn},
+  };
+  FDCAN_GlobalTypeDef *FDCANx = &fdcan_emu_regs[can_number];
+  fdcan_emu_core_t *core = &fdcan_emu_cores[can_number];
+  uint8_t ret = 0U;
+
+  (void)fdcan_emu_sync();
+  uint32_t flags = core->ir & FDCANx->IE;
+  bool line0 = ((flags & ~FDCANx->ILS) != 0U) && ((FDCANx->ILE & FDCAN_ILE_EINT0) != 0U) && fdcan_emu_nvic[irqs[can_number][0]];
+  bool line1 = ((flags & FDCANx->ILS) != 0U) && ((FDCANx->ILE & FDCAN_ILE_EINT1) != 0U) && fdcan_emu_nvic[irqs[can_number][1]];
+
+  FDCANx->IR = core->ir;
+  if (line0) {
+    can_rx(can_number);
+    core->ir &= ~(flags & ~FDCANx->ILS);
+    ret |= 1U;
+  }
+  if (line1) {
+    process_can(can_number);
+    core->ir &= ~(flags & FDCANx->ILS);
+    ret |= 2U;
+  }
+  FDCANx->IR = core->ir;
+  return ret;
+}
+
+// Benchmark and load test loop: receives cnt frames on can_number in batches, running the RX
+// interrupt after each batch, then lets every core send what it has pending until they're idle.
+// Returns how many frames went out on the buses.
+uint32_t fdcan_emu_rx_burst(uint8_t can_number, const fdcan_emu_frame_t *frames, uint32_t cnt, uint32_t batch) {
+  uint32_t sent = 0U;
+  for (uint32_t i = 0U; i < cnt; i += batch) {
+    for (uint32_t j = i; j < MIN(i + batch, cnt); j++) {
+      (void)fdcan_emu_rx(can_number, &frames[j]);
+    }
+    (void)fdcan_emu_irq(can_number);
+
+    for (uint8_t c = 0U; c < 3U; c++) {
+      bool busy = true;
+      while (busy) {
+        while (fdcan_emu_tx(c, NULL)) {
+          sent += 1U;
+        }
+        busy = (fdcan_emu_irq(c) != 0U);
+      }
+    }
+  }
+  return sent;
+}
@@ -9,6 +9,7 @@
 
 #define ENTER_CRITICAL() 0
 #define EXIT_CRITICAL() 0
+#define __DMB() __sync_synchronize()
 
 void print(const char *a) {
   printf("%s", a);
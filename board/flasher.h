@@ -103,6 +103,16 @@ int comms_can_read(uint8_t *data, uint32_t max_len) {
   return 0;
 }
 
+int comms_can_prio_read(uint8_t *data, uint32_t max_len) {
+  UNUSED(data);
+  UNUSED(max_len);
+  return 0;
+}
+
+void can_prio_set_active(bool active) {
+  UNUSED(active);
+}
+
 void refresh_can_tx_slots_available(void) {}
 
 void comms_endpoint2_write(const uint8_t *data, uint32_t len) {
@@ -52,8 +52,9 @@ typedef struct __attribute__((packed)) {
   uint8_t canfd_enabled;
   uint8_t brs_enabled;
   uint8_t canfd_non_iso;
-  uint32_t irq0_call_rate;
-  uint32_t irq1_call_rate;
-  uint32_t irq2_call_rate;
+  uint16_t irq0_call_rate; // bounded by CAN_INTERRUPT_RATE
+  uint16_t irq1_call_rate;
+  uint32_t total_rx_filtered_cnt; // Received messages dropped by the host RX filter
   uint32_t can_core_reset_cnt;
+  uint32_t total_tx_cancelled_cnt; // Tx frames cancelled at the host's request
 } can_health_t;
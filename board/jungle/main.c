@@ -14,6 +14,12 @@
 #include "board/jungle/jungle_health.h"
 
 #include "board/drivers/can_common.h"
+#include "board/drivers/can_filter.h"
+#include "board/drivers/can_prio.h"
+#include "board/drivers/can_tx_slots.h"
+#include "board/drivers/can_sched.h"
+#include "board/drivers/can_tx_timed.h"
+#include "board/drivers/can_tx_timer.h"
 
 #include "board/drivers/fdcan.h"
 
@@ -52,7 +58,7 @@ void tick_handler(void) {
     if (generated_can_traffic) {
       for (int i = 0; i < 3; i++) {
         if (can_health[i].transmit_error_cnt >= 128) {
-          (void)llcan_init(CANIF_FROM_CAN_NUM(i));
+          (void)can_core_init((uint8_t)i);
         }
       }
     }
@@ -61,7 +67,11 @@ void tick_handler(void) {
     if ((loop_counter % 8) == 0U) {
       #ifdef DEBUG
         print("** blink ");
-        print("rx:"); puth4(can_rx_q.r_ptr); print("-"); puth4(can_rx_q.w_ptr); print("  ");
+        print("rx:");
+        for (uint8_t i = 0U; i < CAN_RX_RING_CNT; i++) {
+          print(" "); puth(can_rx_rings[i].r_ptr); print("-"); puth(can_rx_rings[i].w_ptr);
+        }
+        print("  ");
         print("tx1:"); puth4(can_tx1_q.r_ptr); print("-"); puth4(can_tx1_q.w_ptr); print("  ");
         print("tx2:"); puth4(can_tx2_q.r_ptr); print("-"); puth4(can_tx2_q.w_ptr); print("  ");
         print("tx3:"); puth4(can_tx3_q.r_ptr); print("-"); puth4(can_tx3_q.w_ptr); print("\n");
@@ -132,6 +142,7 @@ int main(void) {
   enable_fpu();
 
   microsecond_timer_init();
+  can_tx_timer_init();
 
   // 8Hz timer
   REGISTER_INTERRUPT(TICK_TIMER_IRQ, tick_handler, 10U, FAULT_INTERRUPT_RATE_TICK)
@@ -172,7 +183,6 @@ int main(void) {
           to_send.bus = i % 3U;
           to_send.data_len_code = i % 8U;
           (void)memcpy(to_send.data, "\xff\xff\xff\xff\xff\xff\xff\xff", dlc_to_len[to_send.data_len_code]);
-          can_set_checksum(&to_send);
 
           can_send(&to_send, to_send.bus, true);
         }
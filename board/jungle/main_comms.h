@@ -77,9 +77,14 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       resp[3] = ((time & 0xFF000000U) >> 24U);
       resp_len = 4U;
       break;
-    // **** 0xc0: reset communications
+    // **** 0xb6: get the latest (USB frame number, microsecond timer) pairs latched at SOF, keeps latching for 5s
+    case 0xb6:
+      COMPILE_TIME_ASSERT((USB_SOF_LATCH_CNT * 6U) <= USBPACKET_MAX_SIZE);
+      resp_len = usb_sof_latches_get(resp);
+      break;
+    // **** 0xc0: reset communications, param1: CAN wire format flags
     case 0xc0:
-      comms_can_reset();
+      comms_can_reset(req->param1);
       break;
     // **** 0xc1: get hardware type
     case 0xc1:
@@ -105,6 +110,10 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       (void)memcpy(resp, ((uint8_t *)UID_BASE), 12);
       resp_len = 12;
       break;
+    // **** 0xc7: get CAN TX credits, free slots of the bus TX queues and the timed TX heap
+    case 0xc7:
+      resp_len = can_tx_credits_get(resp);
+      break;
     // **** 0xd0: fetch serial (aka the provisioned dongle ID)
     case 0xd0:
       // addresses are OTP
@@ -181,12 +190,18 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       }
       break;
     // **** 0xdd: get healthpacket and CANPacket version hashes
-    case 0xdd: {
-      uint32_t versions[2] = {JUNGLE_HEALTH_PACKET_VERSION, CAN_PACKET_VERSION_HASH};
-      (void)memcpy(resp, (uint8_t *)versions, sizeof(versions));
-      resp_len = sizeof(versions);
+    // param1 = 1: get supported CAN wire format flags
+    case 0xdd:
+      if (req->param1 == 1U) {
+        uint32_t flags = CAN_COMMS_FLAGS_SUPPORTED;
+        (void)memcpy(resp, (uint8_t *)&flags, sizeof(flags));
+        resp_len = sizeof(flags);
+      } else {
+        uint32_t versions[2] = {JUNGLE_HEALTH_PACKET_VERSION, CAN_PACKET_VERSION_HASH};
+        (void)memcpy(resp, (uint8_t *)versions, sizeof(versions));
+        resp_len = sizeof(versions);
+      }
       break;
-    }
     // **** 0xde: set can bitrate
     case 0xde:
       if ((req->param1 < PANDA_CAN_CNT) && is_speed_valid(req->param2, speeds, sizeof(speeds)/sizeof(speeds[0]))) {
@@ -211,7 +226,7 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
     case 0xf1:
       if (req->param1 == 0xFFFFU) {
         print("Clearing CAN Rx queue\n");
-        can_clear(&can_rx_q);
+        can_rx_clear();
       } else if (req->param1 < PANDA_CAN_CNT) {
         print("Clearing CAN Tx queue\n");
         can_clear(can_queues[req->param1]);
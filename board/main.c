@@ -15,6 +15,12 @@
 #include "board/health.h"
 
 #include "board/drivers/can_common.h"
+#include "board/drivers/can_filter.h"
+#include "board/drivers/can_prio.h"
+#include "board/drivers/can_tx_slots.h"
+#include "board/drivers/can_sched.h"
+#include "board/drivers/can_tx_timed.h"
+#include "board/drivers/can_tx_timer.h"
 
 #include "board/drivers/fdcan.h"
 
@@ -51,6 +57,10 @@ void set_safety_mode(uint16_t mode, uint16_t param) {
   safety_tx_blocked = 0;
   safety_rx_invalid = 0;
 
+  // periodic and timed messages were set up for the previous mode
+  can_sched_clear();
+  can_tx_timed_clear();
+
   switch (mode_copy) {
     case SAFETY_SILENT:
       set_intercept_relay(false, false);
@@ -67,9 +77,8 @@ void set_safety_mode(uint16_t mode, uint16_t param) {
       heartbeat_counter = 0U;
       heartbeat_lost = false;
 
-      // Clear any pending messages in the can core (i.e. sending while comma power is unplugged)
-      // TODO: rewrite using hardware queues rather than fifo to cancel specific messages
-      can_clear_send(CANIF_FROM_CAN_NUM(1), 1);
+      // Cancel any pending messages in the can core (i.e. sending while comma power is unplugged)
+      (void)can_cancel_send(1U, false, 0U, 0U, false);
       if (param == 0U) {
         current_board->set_can_mode(CAN_MODE_OBD_CAN2);
       } else {
@@ -156,7 +165,11 @@ static void tick_handler(void) {
       //puth(usart1_dma); print(" "); puth(DMA2_Stream5->M0AR); print(" "); puth(DMA2_Stream5->NDTR); print("\n");
       #ifdef DEBUG
         print("** blink ");
-        print("rx:"); puth4(can_rx_q.r_ptr); print("-"); puth4(can_rx_q.w_ptr); print("  ");
+        print("rx:");
+        for (uint8_t i = 0U; i < CAN_RX_RING_CNT; i++) {
+          print(" "); puth(can_rx_rings[i].r_ptr); print("-"); puth(can_rx_rings[i].w_ptr);
+        }
+        print("  ");
         print("tx1:"); puth4(can_tx1_q.r_ptr); print("-"); puth4(can_tx1_q.w_ptr); print("  ");
         print("tx2:"); puth4(can_tx2_q.r_ptr); print("-"); puth4(can_tx2_q.w_ptr); print("  ");
         print("tx3:"); puth4(can_tx3_q.r_ptr); print("-"); puth4(can_tx3_q.w_ptr); print("\n");
@@ -302,6 +315,7 @@ int main(void) {
   enable_fpu();
 
   microsecond_timer_init();
+  can_tx_timer_init();
 
   current_board->set_siren(false);
   if (current_board->has_fan) {
@@ -4,6 +4,12 @@ extern int _app_start[0xc000]; // Only first 3 sectors of size 0x4000 are used
 void set_safety_mode(uint16_t mode, uint16_t param);
 bool is_car_safety_mode(uint16_t mode);
 
+static bool can_cancel_match_addr = false;
+static uint32_t can_cancel_addr = 0U;
+static uint32_t can_filter_ext_range_start = 0U;
+static can_sched_entry_t can_sched_staged;
+static can_prio_id_t can_prio_staged;
+
 static int get_health_pkt(void *dat) {
   COMPILE_TIME_ASSERT(sizeof(struct health_t) <= USBPACKET_MAX_SIZE);
   struct health_t * health = (struct health_t*)dat;
@@ -74,6 +80,61 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
 #endif
 
   switch (req->request) {
+    // **** 0xa0: stage periodic CAN message data
+    // param1: byte offset, param2: two data bytes, little endian
+    case 0xa0:
+      if (req->param1 < (CANPACKET_DATA_SIZE_MAX - 1U)) {
+        can_sched_staged.pkt.data[req->param1] = (uint8_t)(req->param2 & 0xFFU);
+        can_sched_staged.pkt.data[req->param1 + 1U] = (uint8_t)(req->param2 >> 8U);
+      }
+      break;
+    // **** 0xa1: stage periodic CAN message bus and address
+    // param1: bus << 13 | ID bits 28-16, param2: ID bits 15-0
+    case 0xa1:
+      {
+        uint32_t addr = ((req->param1 & 0x1FFFU) << 16) | req->param2;
+        can_sched_staged.pkt.bus = (uint8_t)(req->param1 >> 13);
+        can_sched_staged.pkt.addr = addr;
+        can_sched_staged.pkt.extended = (addr >= 0x800U);
+      }
+      break;
+    // **** 0xa2: stage periodic CAN message period
+    // param1: period in us bits 31-16, param2: period in us bits 15-0
+    case 0xa2:
+      can_sched_staged.period_us = ((uint32_t)req->param1 << 16) | req->param2;
+      break;
+    // **** 0xa3: set periodic CAN message from the staged one, a zero period disables it
+    // param1: index << 8 | DLC, index 0xFF clears all
+    // param2: bits 5-0 counter byte, 8-6 counter shift, 11-9 counter width - 1, 12 counter enabled, 15-13 checksum rule
+    case 0xa3:
+      {
+        uint8_t idx = (uint8_t)(req->param1 >> 8);
+        if (idx == 0xFFU) {
+          can_sched_clear();
+        } else {
+          can_sched_staged.pkt.data_len_code = (uint8_t)(req->param1 & 0xFU);
+          can_sched_staged.pkt.fd = (dlc_to_len[can_sched_staged.pkt.data_len_code] > 8U);
+          can_sched_staged.counter_byte = (uint8_t)(req->param2 & 0x3FU);
+          can_sched_staged.counter_shift = (uint8_t)((req->param2 >> 6) & 0x7U);
+          can_sched_staged.counter_width = (uint8_t)(((req->param2 >> 9) & 0x7U) + 1U);
+          can_sched_staged.counter_enabled = (((req->param2 >> 12) & 1U) != 0U);
+          can_sched_staged.checksum = (uint8_t)(req->param2 >> 13);
+          if (can_sched_set(idx, &can_sched_staged, microsecond_timer_get())) {
+            can_sched_timer_kick();
+          }
+        }
+        (void)memset(&can_sched_staged, 0, sizeof(can_sched_staged));
+      }
+      break;
+    // **** 0xa4: get periodic CAN message stats
+    // param1: index
+    case 0xa4:
+      if (req->param1 < CAN_SCHED_ENTRY_CNT) {
+        COMPILE_TIME_ASSERT(sizeof(can_sched_stats_t) <= USBPACKET_MAX_SIZE);
+        (void)memcpy(resp, &can_sched_stats[req->param1], sizeof(can_sched_stats_t));
+        resp_len = sizeof(can_sched_stats_t);
+      }
+      break;
     // **** 0xa8: get microsecond timer
     case 0xa8:
       time = microsecond_timer_get();
@@ -97,6 +158,23 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       resp[1] = ((fan_state.rpm & 0xFF00U) >> 8U);
       resp_len = 2;
       break;
+    // **** 0xb3: stage priority CAN ID
+    // param1: bus << 13 | ID bits 28-16, param2: ID bits 15-0
+    case 0xb3:
+      can_prio_staged.bus = (uint8_t)(req->param1 >> 13);
+      can_prio_staged.addr = ((req->param1 & 0x1FFFU) << 16) | req->param2;
+      break;
+    // **** 0xb4: set priority CAN ID entry to the staged ID, sent on USB alt setting 2's interrupt endpoint
+    // param1: index, 0xFF clears all. param2: bit 0 = enable, bit 1 = extended
+    case 0xb4:
+      if (req->param1 == 0xFFU) {
+        can_prio_clear();
+      } else if (req->param1 < CAN_PRIO_ID_CNT) {
+        can_prio_staged.enabled = (req->param2 & 0x1U) != 0U;
+        can_prio_staged.extended = (req->param2 & 0x2U) != 0U;
+        (void)can_prio_set((uint8_t)req->param1, &can_prio_staged);
+      }
+      break;
     // **** 0xb5: request deep sleep, wakes on CAN or SBU
     #ifdef ALLOW_DEBUG
     case 0xb5:
@@ -105,9 +183,14 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       stop_mode_requested = true;
       break;
     #endif
-    // **** 0xc0: reset communications state
+    // **** 0xb6: get the latest (USB frame number, microsecond timer) pairs latched at SOF, keeps latching for 5s
+    case 0xb6:
+      COMPILE_TIME_ASSERT((USB_SOF_LATCH_CNT * 6U) <= USBPACKET_MAX_SIZE);
+      resp_len = usb_sof_latches_get(resp);
+      break;
+    // **** 0xc0: reset communications state, param1: CAN wire format flags
     case 0xc0:
-      comms_can_reset();
+      comms_can_reset(req->param1);
       break;
     // **** 0xc1: get hardware type
     case 0xc1:
@@ -153,6 +236,10 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       resp[0] = current_board->read_som_gpio();
       resp_len = 1;
       break;
+    // **** 0xc7: get CAN TX credits, free slots of the bus TX queues and the timed TX heap
+    case 0xc7:
+      resp_len = can_tx_credits_get(resp);
+      break;
     // **** 0xd0: fetch serial (aka the provisioned dongle ID)
     case 0xd0:
       // addresses are OTP
@@ -227,12 +314,18 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
       set_safety_mode(req->param1, (uint16_t)req->param2);
       break;
     // **** 0xdd: get health and CAN packet versions
-    case 0xdd: {
-      uint32_t versions[2] = {HEALTH_PACKET_VERSION, CAN_PACKET_VERSION_HASH};
-      (void)memcpy(resp, (uint8_t *)versions, sizeof(versions));
-      resp_len = sizeof(versions);
+    // param1 = 1: get supported CAN wire format flags
+    case 0xdd:
+      if (req->param1 == 1U) {
+        uint32_t flags = CAN_COMMS_FLAGS_SUPPORTED;
+        (void)memcpy(resp, (uint8_t *)&flags, sizeof(flags));
+        resp_len = sizeof(flags);
+      } else {
+        uint32_t versions[2] = {HEALTH_PACKET_VERSION, CAN_PACKET_VERSION_HASH};
+        (void)memcpy(resp, (uint8_t *)versions, sizeof(versions));
+        resp_len = sizeof(versions);
+      }
       break;
-    }
     // **** 0xde: set can bitrate
     case 0xde:
       if ((req->param1 < PANDA_CAN_CNT) && is_speed_valid(req->param2, speeds, sizeof(speeds)/sizeof(speeds[0]))) {
@@ -279,11 +372,73 @@ int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
     case 0xe8:
       bus_config[req->param1].canfd_auto = req->param2 > 0U;
       break;
+    // **** 0xe9: CAN RX filter control. param2: 0 = clear and disable, 1 = enable
+    case 0xe9:
+      if (req->param1 < PANDA_CAN_CNT) {
+        if (req->param2 == 0U) {
+          can_filter_clear(&can_filters[req->param1]);
+        } else {
+          can_filters[req->param1].enabled = true;
+        }
+      }
+      break;
+    // **** 0xea: add standard ID to CAN RX filter
+    case 0xea:
+      if (req->param1 < PANDA_CAN_CNT) {
+        (void)can_filter_add_std(&can_filters[req->param1], req->param2);
+      }
+      break;
+    // **** 0xeb: set start of extended ID range for CAN RX filter
+    // param1: ID bits 28-16, param2: ID bits 15-0
+    case 0xeb:
+      can_filter_ext_range_start = ((req->param1 & 0x1FFFU) << 16) | req->param2;
+      break;
+    // **** 0xec: add extended ID range for CAN RX filter, ending at the given ID
+    // param1: bus << 13 | ID bits 28-16, param2: ID bits 15-0
+    case 0xec:
+      {
+        uint8_t bus_number = (uint8_t)(req->param1 >> 13);
+        uint32_t addr = ((req->param1 & 0x1FFFU) << 16) | req->param2;
+        if (bus_number < PANDA_CAN_CNT) {
+          (void)can_filter_add_ext_range(&can_filters[bus_number], can_filter_ext_range_start, addr);
+        }
+      }
+      break;
+    // **** 0xed: set CAN TX elements and mode
+    // param1: bus, param2: bit 8 = TX queue mode, bits 7-0 = number of TX elements
+    case 0xed:
+      {
+        fdcan_msg_ram_layout_t layout;
+        if ((req->param1 < PANDA_CAN_CNT) && fdcan_msg_ram_layout(req->param2 & 0xFFU, &layout)) {
+          bus_config[req->param1].tx_fifo_el_cnt = (uint8_t)(req->param2 & 0xFFU);
+          bus_config[req->param1].tx_queue_mode = ((req->param2 >> 8) & 0x1U) != 0U;
+          (void)can_init(CAN_NUM_FROM_BUS_NUM(req->param1));
+        }
+      }
+      break;
+    // **** 0xee: only cancel pending CAN TX frames with this address on the next 0xef
+    // param1: ID bits 28-16, param2: ID bits 15-0
+    case 0xee:
+      can_cancel_match_addr = true;
+      can_cancel_addr = ((req->param1 & 0x1FFFU) << 16) | req->param2;
+      break;
+    // **** 0xef: cancel pending CAN TX frames at least this old
+    // param1: bus << 14 | age in us bits 29-16, param2: age in us bits 15-0
+    case 0xef:
+      {
+        uint8_t bus_number = (uint8_t)(req->param1 >> 14);
+        uint32_t older_than_us = ((req->param1 & 0x3FFFU) << 16) | req->param2;
+        if (bus_number < PANDA_CAN_CNT) {
+          (void)can_cancel_send(CAN_NUM_FROM_BUS_NUM(bus_number), can_cancel_match_addr, can_cancel_addr, older_than_us, true);
+        }
+        can_cancel_match_addr = false;
+      }
+      break;
     // **** 0xf1: Clear CAN ring buffer.
     case 0xf1:
       if (req->param1 == 0xFFFFU) {
         print("Clearing CAN Rx queue\n");
-        can_clear(&can_rx_q);
+        can_rx_clear();
       } else if (req->param1 < PANDA_CAN_CNT) {
         print("Clearing CAN Tx queue\n");
         can_clear(can_queues[req->param1]);
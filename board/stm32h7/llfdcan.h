@@ -144,7 +144,8 @@ void llcan_irq_enable(const FDCAN_GlobalTypeDef *FDCANx) {
   }
 }
 
-bool llcan_init(FDCAN_GlobalTypeDef *FDCANx) {
+// layout: message RAM split, see fdcan_msg_ram_layout()
+bool llcan_init(FDCAN_GlobalTypeDef *FDCANx, const fdcan_msg_ram_layout_t *layout) {
   uint32_t can_number = CAN_NUM_FROM_CANIF(FDCANx);
   bool ret = fdcan_request_init(FDCANx);
 
@@ -160,37 +161,43 @@ bool llcan_init(FDCAN_GlobalTypeDef *FDCANx) {
     // FD with BRS
     FDCANx->CCCR |= (FDCAN_CCCR_FDOE | FDCAN_CCCR_BRSE);
 
-    // Set TX mode to FIFO
+    // Only dedicated TX buffers, which can be cancelled individually
     FDCANx->TXBC &= ~(FDCAN_TXBC_TFQM);
     // Configure TX element data size
     FDCANx->TXESC |= 0x7U << FDCAN_TXESC_TBDS_Pos; // 64 bytes
     //Configure RX FIFO0 element data size
     FDCANx->RXESC |= 0x7U << FDCAN_RXESC_F0DS_Pos;
     // Disable filtering, accept all valid frames received
-    FDCANx->XIDFC &= ~(FDCAN_XIDFC_LSE); // No extended filters
-    FDCANx->SIDFC &= ~(FDCAN_SIDFC_LSS); // No standard filters
+    FDCANx->XIDFC &= ~(FDCAN_XIDFC_LSE | FDCAN_XIDFC_FLESA); // No extended filters
+    FDCANx->SIDFC &= ~(FDCAN_SIDFC_LSS | FDCAN_SIDFC_FLSSA); // No standard filters
     FDCANx->GFC &= ~(FDCAN_GFC_RRFE); // Accept extended remote frames
     FDCANx->GFC &= ~(FDCAN_GFC_RRFS); // Accept standard remote frames
     FDCANx->GFC &= ~(FDCAN_GFC_ANFE); // Accept extended frames to FIFO 0
     FDCANx->GFC &= ~(FDCAN_GFC_ANFS); // Accept standard frames to FIFO 0
 
-    uint32_t RxFIFO0SA = FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET);
-    uint32_t TxFIFOSA = RxFIFO0SA + (FDCAN_RX_FIFO_0_EL_CNT * FDCAN_RX_FIFO_0_EL_SIZE);
-
     // RX FIFO 0
-    FDCANx->RXF0C |= (FDCAN_RX_FIFO_0_OFFSET + (can_number * FDCAN_OFFSET_W)) << FDCAN_RXF0C_F0SA_Pos;
-    FDCANx->RXF0C |= FDCAN_RX_FIFO_0_EL_CNT << FDCAN_RXF0C_F0S_Pos;
+    FDCANx->RXF0C &= ~(FDCAN_RXF0C_F0SA | FDCAN_RXF0C_F0S);
+    FDCANx->RXF0C |= (layout->rx_fifo_0_offset + (can_number * FDCAN_OFFSET_W)) << FDCAN_RXF0C_F0SA_Pos;
+    FDCANx->RXF0C |= layout->rx_fifo_0_el_cnt << FDCAN_RXF0C_F0S_Pos;
     // RX FIFO 0 switch to non-blocking (overwrite) mode
     FDCANx->RXF0C |= FDCAN_RXF0C_F0OM;
 
-    // TX FIFO (mode set earlier)
-    FDCANx->TXBC |= (FDCAN_TX_FIFO_OFFSET + (can_number * FDCAN_OFFSET_W)) << FDCAN_TXBC_TBSA_Pos;
-    FDCANx->TXBC |= FDCAN_TX_FIFO_EL_CNT << FDCAN_TXBC_TFQS_Pos;
+    // TX buffers, no FIFO/queue
+    FDCANx->TXBC &= ~(FDCAN_TXBC_TBSA | FDCAN_TXBC_NDTB | FDCAN_TXBC_TFQS);
+    FDCANx->TXBC |= (layout->tx_fifo_offset + (can_number * FDCAN_OFFSET_W)) << FDCAN_TXBC_TBSA_Pos;
+    FDCANx->TXBC |= layout->tx_fifo_el_cnt << FDCAN_TXBC_NDTB_Pos;
+
+    // TX event FIFO, reports completed frames with their message marker
+    FDCANx->TXEFC &= ~(FDCAN_TXEFC_EFSA | FDCAN_TXEFC_EFS | FDCAN_TXEFC_EFWM);
+    FDCANx->TXEFC |= (layout->tx_event_fifo_offset + (can_number * FDCAN_OFFSET_W)) << FDCAN_TXEFC_EFSA_Pos;
+    FDCANx->TXEFC |= layout->tx_event_fifo_el_cnt << FDCAN_TXEFC_EFS_Pos;
+    // Timestamp counter counting nominal bit times, for the TX event timestamps
+    FDCANx->TSCC = (0x1UL << FDCAN_TSCC_TSS_Pos);
 
     // Flush allocated RAM
-    uint32_t EndAddress = TxFIFOSA + (FDCAN_TX_FIFO_EL_CNT * FDCAN_TX_FIFO_EL_SIZE);
-    for (uint32_t RAMcounter = RxFIFO0SA; RAMcounter < EndAddress; RAMcounter += 4U) {
-        *(uint32_t *)(RAMcounter) = 0x00000000;
+    uint32_t *ram = (uint32_t *)(FDCAN_START_ADDRESS + (can_number * FDCAN_OFFSET));
+    for (uint32_t i = 0U; i < layout->size_w; i++) {
+        ram[i] = 0x00000000;
     }
 
     // Enable both interrupts for each module
@@ -201,9 +208,11 @@ bool llcan_init(FDCAN_GlobalTypeDef *FDCANx) {
     FDCANx->IE |= FDCAN_IE_RF0NE; // Rx FIFO 0 new message
     FDCANx->IE |= FDCAN_IE_PEDE | FDCAN_IE_PEAE | FDCAN_IE_BOE | FDCAN_IE_EPE | FDCAN_IE_RF0LE;
 
-    // Messages for INT1 (Only TFE works??)
-    FDCANx->ILS |= FDCAN_ILS_TFEL;
-    FDCANx->IE |= FDCAN_IE_TFEE; // Tx FIFO empty
+    // Messages for INT1, a TX buffer is free again
+    FDCANx->TXBTIE = 0U;
+    FDCANx->TXBCIE = FDCAN_TXBCIE_CFIE >> (FDCAN_TX_FIFO_EL_CNT_MAX - layout->tx_fifo_el_cnt);
+    FDCANx->ILS |= (FDCAN_ILS_TEFNL | FDCAN_ILS_TCFL);
+    FDCANx->IE |= (FDCAN_IE_TEFNE | FDCAN_IE_TCFE); // TX event FIFO new entry and cancellation finished
 
     ret = fdcan_exit_init(FDCANx);
     if(!ret) {
@@ -218,10 +227,14 @@ bool llcan_init(FDCAN_GlobalTypeDef *FDCANx) {
   return ret;
 }
 
-void llcan_clear_send(FDCAN_GlobalTypeDef *FDCANx) {
-  // from datasheet: "Transmit cancellation is not intended for Tx FIFO operation."
-  // so we need to clear pending transmission manually by resetting FDCAN core
+// resets the core, for when cancelling the pending TX buffers isn't enough (e.g. stuck in bus off)
+void llcan_clear_send(FDCAN_GlobalTypeDef *FDCANx, const fdcan_msg_ram_layout_t *layout) {
   FDCANx->IR |= 0x3FCFFFFFU; // clear all interrupts
-  bool ret = llcan_init(FDCANx);
+  bool ret = llcan_init(FDCANx, layout);
   UNUSED(ret);
 }
+
+// requests cancellation of the pending TX buffers in mask, a buffer already being sent finishes first
+void llcan_cancel_send(FDCAN_GlobalTypeDef *FDCANx, uint32_t mask) {
+  FDCANx->TXBCR = mask;
+}
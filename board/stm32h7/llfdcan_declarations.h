@@ -14,25 +14,10 @@
 
 // FDCAN core settings
 #define FDCAN_START_ADDRESS 0x4000AC00UL
-#define FDCAN_OFFSET 3384UL // bytes for each FDCAN module, equally
-#define FDCAN_OFFSET_W 846UL // words for each FDCAN module, equally
 
-// FDCAN_RX_FIFO_0_EL_CNT + FDCAN_TX_FIFO_EL_CNT can't exceed 47 elements (47 * 72 bytes = 3,384 bytes) per FDCAN module
-
-// RX FIFO 0
-#define FDCAN_RX_FIFO_0_EL_CNT 46UL
-#define FDCAN_RX_FIFO_0_HEAD_SIZE 8UL // bytes
-#define FDCAN_RX_FIFO_0_DATA_SIZE 64UL // bytes
-#define FDCAN_RX_FIFO_0_EL_SIZE (FDCAN_RX_FIFO_0_HEAD_SIZE + FDCAN_RX_FIFO_0_DATA_SIZE)
-#define FDCAN_RX_FIFO_0_EL_W_SIZE (FDCAN_RX_FIFO_0_EL_SIZE / 4UL)
-#define FDCAN_RX_FIFO_0_OFFSET 0UL
-
-// TX FIFO
-#define FDCAN_TX_FIFO_EL_CNT 1UL
-#define FDCAN_TX_FIFO_HEAD_SIZE 8UL // bytes
-#define FDCAN_TX_FIFO_DATA_SIZE 64UL // bytes
-#define FDCAN_TX_FIFO_EL_SIZE (FDCAN_TX_FIFO_HEAD_SIZE + FDCAN_TX_FIFO_DATA_SIZE)
-#define FDCAN_TX_FIFO_OFFSET (FDCAN_RX_FIFO_0_OFFSET + (FDCAN_RX_FIFO_0_EL_CNT * FDCAN_RX_FIFO_0_EL_W_SIZE))
+// Message RAM split of each FDCAN module, see llfdcan_layout.h. With the default single TX element
+// RX FIFO 0 gets 45 elements (45 * 72 + 8 + 72 bytes = 3,320 bytes)
+#include "llfdcan_layout.h"
 
 #define CAN_NAME_FROM_CANIF(CAN_DEV) (((CAN_DEV)==FDCAN1) ? "FDCAN1" : (((CAN_DEV) == FDCAN2) ? "FDCAN2" : "FDCAN3"))
 #define CAN_NUM_FROM_CANIF(CAN_DEV) (((CAN_DEV)==FDCAN1) ? 0UL : (((CAN_DEV) == FDCAN2) ? 1UL : 2UL))
@@ -46,5 +31,6 @@ extern const uint32_t data_speeds[DATA_SPEEDS_ARRAY_SIZE];
 bool llcan_set_speed(FDCAN_GlobalTypeDef *FDCANx, uint32_t speed, uint32_t data_speed, bool non_iso, bool loopback, bool silent);
 void llcan_irq_disable(const FDCAN_GlobalTypeDef *FDCANx);
 void llcan_irq_enable(const FDCAN_GlobalTypeDef *FDCANx);
-bool llcan_init(FDCAN_GlobalTypeDef *FDCANx);
-void llcan_clear_send(FDCAN_GlobalTypeDef *FDCANx);
+bool llcan_init(FDCAN_GlobalTypeDef *FDCANx, const fdcan_msg_ram_layout_t *layout);
+void llcan_clear_send(FDCAN_GlobalTypeDef *FDCANx, const fdcan_msg_ram_layout_t *layout);
+void llcan_cancel_send(FDCAN_GlobalTypeDef *FDCANx, uint32_t mask);
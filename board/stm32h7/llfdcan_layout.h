@@ -0,0 +1,60 @@
+#pragma once
+
+// FDCAN message RAM layout, kept free of register access so it's checked on the host
+
+#define FDCAN_OFFSET 3384UL // bytes for each FDCAN module, equally
+#define FDCAN_OFFSET_W 846UL // words for each FDCAN module, equally
+
+// RX FIFO 0
+#define FDCAN_RX_FIFO_0_EL_CNT_MAX 64UL
+#define FDCAN_RX_FIFO_0_HEAD_SIZE 8UL // bytes
+#define FDCAN_RX_FIFO_0_DATA_SIZE 64UL // bytes
+#define FDCAN_RX_FIFO_0_EL_SIZE (FDCAN_RX_FIFO_0_HEAD_SIZE + FDCAN_RX_FIFO_0_DATA_SIZE)
+#define FDCAN_RX_FIFO_0_EL_W_SIZE (FDCAN_RX_FIFO_0_EL_SIZE / 4UL)
+
+// TX buffers
+#define FDCAN_TX_FIFO_EL_CNT_MAX 32UL
+#define FDCAN_TX_FIFO_EL_CNT_DEFAULT 1UL
+#define FDCAN_TX_FIFO_HEAD_SIZE 8UL // bytes
+#define FDCAN_TX_FIFO_DATA_SIZE 64UL // bytes
+#define FDCAN_TX_FIFO_EL_SIZE (FDCAN_TX_FIFO_HEAD_SIZE + FDCAN_TX_FIFO_DATA_SIZE)
+#define FDCAN_TX_FIFO_EL_W_SIZE (FDCAN_TX_FIFO_EL_SIZE / 4UL)
+
+// TX event FIFO, one element for each TX buffer
+#define FDCAN_TX_EVENT_FIFO_EL_SIZE 8UL // bytes
+#define FDCAN_TX_EVENT_FIFO_EL_W_SIZE (FDCAN_TX_EVENT_FIFO_EL_SIZE / 4UL)
+
+// offsets are in words from the start of the module's message RAM
+typedef struct {
+  uint32_t rx_fifo_0_el_cnt;
+  uint32_t tx_fifo_el_cnt;
+  uint32_t tx_event_fifo_el_cnt;
+  uint32_t rx_fifo_0_offset;
+  uint32_t tx_event_fifo_offset;
+  uint32_t tx_fifo_offset;
+  uint32_t size_w;
+} fdcan_msg_ram_layout_t;
+
+bool fdcan_msg_ram_layout(uint32_t tx_fifo_el_cnt, fdcan_msg_ram_layout_t *layout);
+
+// RX FIFO 0 | TX event FIFO | TX buffers
+// The TX elements are fixed, RX FIFO 0 gets what's left of the module's RAM.
+bool fdcan_msg_ram_layout(uint32_t tx_fifo_el_cnt, fdcan_msg_ram_layout_t *layout) {
+  bool ret = false;
+  uint32_t tx_w = tx_fifo_el_cnt * (FDCAN_TX_FIFO_EL_W_SIZE + FDCAN_TX_EVENT_FIFO_EL_W_SIZE);
+
+  if ((tx_fifo_el_cnt >= 1U) && (tx_fifo_el_cnt <= FDCAN_TX_FIFO_EL_CNT_MAX) && (tx_w < FDCAN_OFFSET_W)) {
+    uint32_t rx_fifo_0_el_cnt = MIN((FDCAN_OFFSET_W - tx_w) / FDCAN_RX_FIFO_0_EL_W_SIZE, FDCAN_RX_FIFO_0_EL_CNT_MAX);
+    if (rx_fifo_0_el_cnt > 0U) {
+      layout->rx_fifo_0_el_cnt = rx_fifo_0_el_cnt;
+      layout->tx_fifo_el_cnt = tx_fifo_el_cnt;
+      layout->tx_event_fifo_el_cnt = tx_fifo_el_cnt;
+      layout->rx_fifo_0_offset = 0U;
+      layout->tx_event_fifo_offset = layout->rx_fifo_0_offset + (rx_fifo_0_el_cnt * FDCAN_RX_FIFO_0_EL_W_SIZE);
+      layout->tx_fifo_offset = layout->tx_event_fifo_offset + (tx_fifo_el_cnt * FDCAN_TX_EVENT_FIFO_EL_W_SIZE);
+      layout->size_w = layout->tx_fifo_offset + (tx_fifo_el_cnt * FDCAN_TX_FIFO_EL_W_SIZE);
+      ret = true;
+    }
+  }
+  return ret;
+}
@@ -49,6 +49,39 @@ void llspi_miso_dma(const uint8_t *addr, int len) {
   register_set_bits(&(SPI4->CR1), SPI_CR1_SPE);
 }
 
+// both ways at once, SPI is off while they're set up so the first byte clocked after
+// goes out from miso_addr and comes in at mosi_addr
+// cppcheck-suppress constParameterPointer ; RX DMA writes through mosi_addr after return
+void llspi_xchg_dma(uint8_t *mosi_addr, int mosi_len, const uint8_t *miso_addr, int miso_len) {
+  // disable DMAs + SPI
+  register_clear_bits(&(SPI4->CFG1), SPI_CFG1_RXDMAEN | SPI_CFG1_TXDMAEN);
+  DMA2_Stream2->CR &= ~DMA_SxCR_EN;
+  DMA2_Stream3->CR &= ~DMA_SxCR_EN;
+  register_clear_bits(&(SPI4->CR1), SPI_CR1_SPE);
+
+  // drain the bus
+  while ((SPI4->SR & SPI_SR_RXP) != 0U) {
+    volatile uint8_t dat = SPI4->RXDR;
+    (void)dat;
+  }
+
+  // setup destination, source and lengths
+  register_set(&(DMA2_Stream2->M0AR), (uint32_t)mosi_addr, 0xFFFFFFFFU);
+  DMA2_Stream2->NDTR = mosi_len;
+  register_set(&(DMA2_Stream3->M0AR), (uint32_t)miso_addr, 0xFFFFFFFFU);
+  DMA2_Stream3->NDTR = miso_len;
+
+  // clear all pending, interrupt on TXC
+  SPI4->IFCR |= (0x1FFU << 3U);
+  register_set(&(SPI4->IER), (1U << SPI_IER_EOTIE_Pos), 0x3FFU);
+
+  // enable DMAs + SPI
+  DMA2_Stream2->CR |= DMA_SxCR_EN;
+  register_set_bits(&(SPI4->CFG1), SPI_CFG1_RXDMAEN | SPI_CFG1_TXDMAEN);
+  DMA2_Stream3->CR |= DMA_SxCR_EN;
+  register_set_bits(&(SPI4->CR1), SPI_CR1_SPE);
+}
+
 static bool spi_tx_dma_done = false;
 // master -> panda DMA finished
 static void DMA2_Stream2_IRQ_Handler(void) {
@@ -79,11 +112,20 @@ static void SPI4_IRQ_Handler(void) {
   }
 }
 
+// staging of the next CAN response, on an otherwise unused interrupt below the others
+static void SPI5_IRQ_Handler(void) {
+  spi_stage_fill();
+}
+
+void llspi_stage_kick(void) {
+  NVIC_SetPendingIRQ(SPI5_IRQn);
+}
 
 void llspi_init(void) {
   REGISTER_INTERRUPT(SPI4_IRQn, SPI4_IRQ_Handler, (SPI_IRQ_RATE * 2U), FAULT_INTERRUPT_RATE_SPI)
   REGISTER_INTERRUPT(DMA2_Stream2_IRQn, DMA2_Stream2_IRQ_Handler, SPI_IRQ_RATE, FAULT_INTERRUPT_RATE_SPI_DMA)
   REGISTER_INTERRUPT(DMA2_Stream3_IRQn, DMA2_Stream3_IRQ_Handler, SPI_IRQ_RATE, FAULT_INTERRUPT_RATE_SPI_DMA)
+  REGISTER_INTERRUPT(SPI5_IRQn, SPI5_IRQ_Handler, SPI_IRQ_RATE, FAULT_INTERRUPT_RATE_SPI)
 
   // Setup MOSI DMA
   register_set(&(DMAMUX1_Channel10->CCR), 83U, 0xFFFFFFFFU);
@@ -105,4 +147,7 @@ void llspi_init(void) {
   NVIC_EnableIRQ(DMA2_Stream2_IRQn);
   NVIC_EnableIRQ(DMA2_Stream3_IRQn);
   NVIC_EnableIRQ(SPI4_IRQn);
+
+  NVIC_SetPriority(SPI5_IRQn, 1U);
+  NVIC_EnableIRQ(SPI5_IRQn);
 }
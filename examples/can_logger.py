@@ -18,25 +18,25 @@ def can_logger():
     bus1_msg_cnt = 0
     bus2_msg_cnt = 0
 
-    start_time = time.time()
-    while True:
-      can_recv = p.can_recv()
-
-      for address, dat, src in can_recv:
-        csvwriter.writerow(
-          [str(src), str(hex(address)), f"0x{dat.hex()}", len(dat), str(time.time() - start_time)])
-
-        if src == 0:
-          bus0_msg_cnt += 1
-        elif src == 1:
-          bus1_msg_cnt += 1
-        elif src == 2:
-          bus2_msg_cnt += 1
-
-        print(f"Message Counts... Bus 0: {bus0_msg_cnt} Bus 1: {bus1_msg_cnt} Bus 2: {bus2_msg_cnt}", end='\r')
+    # messages keep being read while the file is written
+    start_time = time.monotonic()
+    stream = p.can_stream_start()
+    for rx_time, (address, dat, src) in stream:
+      csvwriter.writerow(
+        [str(src), str(hex(address)), f"0x{dat.hex()}", len(dat), str(rx_time - start_time)])
+
+      if src == 0:
+        bus0_msg_cnt += 1
+      elif src == 1:
+        bus1_msg_cnt += 1
+      elif src == 2:
+        bus2_msg_cnt += 1
+
+      print(f"Message Counts... Bus 0: {bus0_msg_cnt} Bus 1: {bus1_msg_cnt} Bus 2: {bus2_msg_cnt}", end='\r')
 
   except KeyboardInterrupt:
     print(f"\nNow exiting. Final message Counts... Bus 0: {bus0_msg_cnt} Bus 1: {bus1_msg_cnt} Bus 2: {bus2_msg_cnt}")
+    print(f"Dropped on the host: {stream.stats()['dropped']}, by the panda: {p.health()['rx_buffer_overflow']}")
     outputfile.close()
 
 if __name__ == "__main__":
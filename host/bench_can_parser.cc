@@ -0,0 +1,111 @@
+// Feeds CAN wire bytes through the host parser in transfer sized chunks and reports messages/s.
+//
+//   ./bench_can_parser [recording] [--timestamps] [--seconds N]
+//
+// A recording is the concatenated data of the panda's CAN bulk IN endpoint, as returned
+// by bulkRead(1, ...). Without one, a stream with a mix of CAN and CAN FD frames is generated.
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "can_parser.h"
+
+using namespace panda;
+
+constexpr size_t TRANSFER_SIZE = 16384U;
+constexpr size_t RING_SIZE = 0x4000U;
+
+static std::vector<uint8_t> generate(bool timestamps, size_t cnt) {
+  std::mt19937 rng(0);
+  std::vector<uint8_t> out;
+  for (size_t i = 0U; i < cnt; i++) {
+    uint8_t dlc = (i % 4U == 0U) ? (rng() % 16U) : 8U;
+    uint32_t addr = rng() % 0x800U;
+    uint8_t pkt[CANPACKET_SIZE_MAX] = {0};
+    size_t len = CANPACKET_HEAD_SIZE;
+    pkt[0] = (dlc << 4) | ((rng() % 3U) << 1);
+    uint32_t word = addr << 3;
+    memcpy(&pkt[1], &word, sizeof(word));
+    if (timestamps) {
+      uint32_t ts = (uint32_t)(i * 100U);
+      memcpy(&pkt[len], &ts, sizeof(ts));
+      len += CANPACKET_TIMESTAMP_SIZE;
+    }
+    for (uint8_t j = 0U; j < DLC_TO_LEN[dlc]; j++) {
+      pkt[len++] = rng() & 0xFFU;
+    }
+    uint8_t checksum = 0U;
+    for (size_t j = 0U; j < len; j++) {
+      checksum ^= pkt[j];
+    }
+    pkt[5] = checksum;
+    out.insert(out.end(), pkt, &pkt[len]);
+  }
+  return out;
+}
+
+int main(int argc, char **argv) {
+  std::string path;
+  bool timestamps = false;
+  double seconds = 2.0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--timestamps") == 0) {
+      timestamps = true;
+    } else if ((strcmp(argv[i], "--seconds") == 0) && ((i + 1) < argc)) {
+      seconds = atof(argv[++i]);
+    } else {
+      path = argv[i];
+    }
+  }
+
+  std::vector<uint8_t> wire;
+  if (path.empty()) {
+    wire = generate(timestamps, 100000U);
+  } else {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+      fprintf(stderr, "can't open %s\n", path.c_str());
+      return 1;
+    }
+    wire.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+  }
+
+  // everything is checked on the first pass, the ring is drained like the python side would
+  auto ring = std::make_unique<MessageRing<RING_SIZE>>();
+  auto out = std::make_unique<CanMessage[]>(RING_SIZE);
+  CanParser parser(timestamps);
+  uint64_t msgs = 0U;
+  uint64_t bytes = 0U;
+  uint64_t passes = 0U;
+  auto start = std::chrono::steady_clock::now();
+  double elapsed = 0.0;
+  while (elapsed < seconds) {
+    parser.reset(timestamps);
+    for (size_t pos = 0U; pos < wire.size(); pos += TRANSFER_SIZE) {
+      size_t len = std::min(TRANSFER_SIZE, wire.size() - pos);
+      msgs += parser.feed(&wire[pos], len, *ring);
+      (void)ring->pop(out.get(), RING_SIZE);
+    }
+    bytes += wire.size();
+    passes++;
+    if (parser.checksum_errors() > 0U) {
+      fprintf(stderr, "checksum error, not a CAN stream%s?\n", timestamps ? " with timestamps" : " without timestamps");
+      return 1;
+    }
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  printf("%" PRIu64 " passes over %zu bytes, %" PRIu64 " messages, %" PRIu64 " dropped\n", passes, wire.size(), msgs, parser.dropped());
+  printf("%.2f M messages/s, %.1f MB/s\n", (msgs / elapsed) / 1e6, (bytes / elapsed) / 1e6);
+  return 0;
+}
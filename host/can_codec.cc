@@ -0,0 +1,64 @@
+#include "can_parser.h"
+
+// C API of libpanda_can.so for python/native.py, it works on CAN_MESSAGE_DTYPE arrays in place
+using panda::CanMessage;
+using panda::CanParser;
+
+extern "C" {
+
+// parses the whole packets in dat, consumed is set to where the first incomplete one starts.
+// Returns the number of messages, or -1 on a bad checksum
+int panda_can_unpack(const uint8_t *dat, int len, bool timestamps, CanMessage *out, int max, int *consumed) {
+  int cnt = 0;
+  int pos = 0;
+  while (((len - pos) >= (int)panda::CANPACKET_HEAD_SIZE) && (cnt < max)) {
+    int pkt_len = (int)panda::can_packet_len(dat[pos], timestamps);
+    if ((len - pos) < pkt_len) {
+      break;
+    }
+    if (!panda::can_checksum_valid(&dat[pos], (size_t)pkt_len)) {
+      return -1;
+    }
+    panda::can_unpack(&dat[pos], (size_t)pkt_len, timestamps, &out[cnt]);
+    cnt++;
+    pos += pkt_len;
+  }
+  *consumed = pos;
+  return cnt;
+}
+
+// packs msgs back to back, a new chunk is started once one is over chunk_size bytes (0 for a single chunk).
+// chunk_ends gets the end offset of each chunk, out needs room for n packets of the largest size.
+// Returns the total length
+int panda_can_pack(const CanMessage *msgs, int n, bool tx_timestamps, int chunk_size, uint8_t *out, int *chunk_ends, int *chunk_cnt) {
+  int pos = 0;
+  int chunk_start = 0;
+  *chunk_cnt = 0;
+  for (int i = 0; i < n; i++) {
+    pos += (int)panda::can_pack(msgs[i], tx_timestamps, &out[pos]);
+    if ((chunk_size > 0) && ((pos - chunk_start) > chunk_size)) {
+      chunk_ends[(*chunk_cnt)++] = pos;
+      chunk_start = pos;
+    }
+  }
+  // the last chunk, can be empty
+  chunk_ends[(*chunk_cnt)++] = pos;
+  return pos;
+}
+
+// the streaming parser of the transfer pool, for the tests
+CanParser *panda_can_parser_new(bool timestamps) {
+  return new CanParser(timestamps);
+}
+
+void panda_can_parser_free(CanParser *p) {
+  delete p;
+}
+
+int panda_can_parser_feed(CanParser *p, const uint8_t *dat, int len, CanMessage *out, int max) {
+  panda::MessageSpan span(out, (size_t)max);
+  (void)p->feed(dat, (size_t)len, span);
+  return (p->checksum_errors() > 0U) ? -1 : (int)span.size();
+}
+
+}
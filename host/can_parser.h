@@ -0,0 +1,243 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// CAN packets of the bulk IN endpoint, see board/can_comms.h and unpack_can_buffer() in
+// python/__init__.py. Packets are decoded straight into preallocated slots, nothing here
+// allocates per message.
+
+namespace panda {
+
+constexpr size_t CANPACKET_HEAD_SIZE = 6U;
+constexpr size_t CANPACKET_TIMESTAMP_SIZE = 4U;
+constexpr size_t CANPACKET_DATA_SIZE_MAX = 64U;
+constexpr size_t CANPACKET_SIZE_MAX = CANPACKET_HEAD_SIZE + CANPACKET_TIMESTAMP_SIZE + CANPACKET_DATA_SIZE_MAX;
+
+constexpr uint8_t DLC_TO_LEN[16] = {0U, 1U, 2U, 3U, 4U, 5U, 6U, 7U, 8U, 12U, 16U, 20U, 24U, 32U, 48U, 64U};
+
+constexpr uint8_t CAN_FLAG_REJECTED = 0x1U;
+constexpr uint8_t CAN_FLAG_RETURNED = 0x2U;
+constexpr uint8_t CAN_FLAG_EXTENDED = 0x4U;
+constexpr uint8_t CAN_FLAG_FD = 0x8U;
+
+// mirrored by CAN_MESSAGE_DTYPE in python/native.py
+struct CanMessage {
+  uint32_t addr;
+  uint32_t timestamp;  // panda microsecond timer, or the target to send at with CAN_COMMS_FLAG_TX_TIMESTAMPS
+  uint8_t bus;
+  uint8_t flags;
+  uint8_t dlc;
+  uint8_t reserved;
+  uint8_t data[CANPACKET_DATA_SIZE_MAX];
+};
+static_assert(sizeof(CanMessage) == 76U, "CanMessage layout");
+
+// packs a message in the wire format of the bulk OUT endpoint, returns its length
+inline size_t can_pack(const CanMessage &msg, bool tx_timestamps, uint8_t *out) {
+  size_t len = CANPACKET_HEAD_SIZE;
+  uint32_t word = (msg.addr << 3) | (((msg.flags & CAN_FLAG_EXTENDED) != 0U) ? 0x4U : 0U);
+  out[0] = (uint8_t)((msg.dlc << 4) | ((msg.bus & 0x7U) << 1) | (((msg.flags & CAN_FLAG_FD) != 0U) ? 1U : 0U));
+  out[1] = word & 0xFFU;
+  out[2] = (word >> 8) & 0xFFU;
+  out[3] = (word >> 16) & 0xFFU;
+  out[4] = (word >> 24) & 0xFFU;
+  out[5] = 0U;
+  if (tx_timestamps) {
+    out[6] = msg.timestamp & 0xFFU;
+    out[7] = (msg.timestamp >> 8) & 0xFFU;
+    out[8] = (msg.timestamp >> 16) & 0xFFU;
+    out[9] = (msg.timestamp >> 24) & 0xFFU;
+    len += CANPACKET_TIMESTAMP_SIZE;
+  }
+  memcpy(&out[len], msg.data, DLC_TO_LEN[msg.dlc & 0xFU]);
+  len += DLC_TO_LEN[msg.dlc & 0xFU];
+
+  uint8_t checksum = 0U;
+  for (size_t i = 0U; i < len; i++) {
+    checksum ^= out[i];
+  }
+  out[5] = checksum;
+  return len;
+}
+
+inline size_t can_packet_len(uint8_t header0, bool timestamps) {
+  return CANPACKET_HEAD_SIZE + (timestamps ? CANPACKET_TIMESTAMP_SIZE : 0U) + DLC_TO_LEN[header0 >> 4];
+}
+
+inline bool can_checksum_valid(const uint8_t *pkt, size_t pkt_len) {
+  uint8_t checksum = 0U;
+  for (size_t i = 0U; i < pkt_len; i++) {
+    checksum ^= pkt[i];
+  }
+  return checksum == 0U;
+}
+
+// decodes a whole packet of the bulk IN endpoint with a valid checksum
+inline void can_unpack(const uint8_t *pkt, size_t pkt_len, bool timestamps, CanMessage *msg) {
+  size_t data_offset = CANPACKET_HEAD_SIZE;
+  msg->bus = (pkt[0] >> 1) & 0x7U;
+  msg->dlc = pkt[0] >> 4;
+  msg->flags = (pkt[1] & (CAN_FLAG_REJECTED | CAN_FLAG_RETURNED | CAN_FLAG_EXTENDED)) | (((pkt[0] & 0x1U) != 0U) ? CAN_FLAG_FD : 0U);
+  msg->reserved = 0U;
+  msg->addr = ((uint32_t)pkt[4] << 24 | (uint32_t)pkt[3] << 16 | (uint32_t)pkt[2] << 8 | pkt[1]) >> 3;
+  msg->timestamp = 0U;
+  if (timestamps) {
+    msg->timestamp = (uint32_t)pkt[9] << 24 | (uint32_t)pkt[8] << 16 | (uint32_t)pkt[7] << 8 | pkt[6];
+    data_offset += CANPACKET_TIMESTAMP_SIZE;
+  }
+  memcpy(msg->data, &pkt[data_offset], pkt_len - data_offset);
+  memset(&msg->data[pkt_len - data_offset], 0, CANPACKET_DATA_SIZE_MAX - (pkt_len - data_offset));
+}
+
+// Single producer, single consumer ring of decoded messages. The producer fills the slot
+// from reserve() in place and publishes it with commit().
+template <size_t N>
+class MessageRing {
+  static_assert((N & (N - 1U)) == 0U, "ring size must be a power of two");
+
+ public:
+  CanMessage *reserve() {
+    size_t w = write_.load(std::memory_order_relaxed);
+    return ((w - read_.load(std::memory_order_acquire)) < N) ? &buf_[w & (N - 1U)] : nullptr;
+  }
+
+  void commit() {
+    write_.store(write_.load(std::memory_order_relaxed) + 1U, std::memory_order_release);
+  }
+
+  size_t pop(CanMessage *out, size_t max) {
+    size_t r = read_.load(std::memory_order_relaxed);
+    size_t cnt = write_.load(std::memory_order_acquire) - r;
+    cnt = (cnt < max) ? cnt : max;
+    for (size_t i = 0U; i < cnt; i++) {
+      out[i] = buf_[(r + i) & (N - 1U)];
+    }
+    read_.store(r + cnt, std::memory_order_release);
+    return cnt;
+  }
+
+  bool empty() const {
+    return read_.load(std::memory_order_acquire) == write_.load(std::memory_order_acquire);
+  }
+
+  // consumer side, drops everything committed so far
+  void clear() {
+    read_.store(write_.load(std::memory_order_acquire), std::memory_order_release);
+  }
+
+ private:
+  CanMessage buf_[N];
+  std::atomic<size_t> write_{0U};
+  std::atomic<size_t> read_{0U};
+};
+
+// Fixed size output buffer with the same interface as MessageRing
+class MessageSpan {
+ public:
+  MessageSpan(CanMessage *buf, size_t max) : buf_(buf), max_(max) {}
+
+  CanMessage *reserve() { return (cnt_ < max_) ? &buf_[cnt_] : nullptr; }
+  void commit() { cnt_++; }
+  size_t size() const { return cnt_; }
+
+ private:
+  CanMessage *buf_;
+  size_t max_;
+  size_t cnt_ = 0U;
+};
+
+// Reassembles packets split across transfers. After a bad checksum the rest of the stream
+// can't be framed anymore, everything is dropped until reset().
+class CanParser {
+ public:
+  explicit CanParser(bool timestamps = false) : timestamps_(timestamps) {}
+
+  void reset(bool timestamps) {
+    timestamps_ = timestamps;
+    partial_len_ = 0U;
+    desync_ = false;
+  }
+
+  // returns the number of messages decoded, the ones that didn't fit in out are counted in dropped()
+  template <typename Sink>
+  size_t feed(const uint8_t *dat, size_t len, Sink &out) {
+    size_t cnt = 0U;
+    size_t pos = 0U;
+
+    if (desync_) {
+      return 0U;
+    }
+
+    // finish the packet from the previous transfer
+    if (partial_len_ > 0U) {
+      size_t pkt_len = packet_len(partial_[0]);
+      size_t n = pkt_len - partial_len_;
+      n = (n < len) ? n : len;
+      memcpy(&partial_[partial_len_], dat, n);
+      partial_len_ += n;
+      pos = n;
+      if (partial_len_ < pkt_len) {
+        return 0U;
+      }
+      partial_len_ = 0U;
+      if (!emit(partial_, pkt_len, out, &cnt)) {
+        return cnt;
+      }
+    }
+
+    while (pos < len) {
+      size_t pkt_len = packet_len(dat[pos]);
+      if ((len - pos) < pkt_len) {
+        partial_len_ = len - pos;
+        memcpy(partial_, &dat[pos], partial_len_);
+        break;
+      }
+      if (!emit(&dat[pos], pkt_len, out, &cnt)) {
+        break;
+      }
+      pos += pkt_len;
+    }
+    return cnt;
+  }
+
+  bool timestamps() const { return timestamps_; }
+  bool desync() const { return desync_; }
+  uint64_t dropped() const { return dropped_; }
+  uint64_t checksum_errors() const { return checksum_errors_; }
+
+ private:
+  size_t packet_len(uint8_t header0) const {
+    return can_packet_len(header0, timestamps_);
+  }
+
+  template <typename Sink>
+  bool emit(const uint8_t *pkt, size_t pkt_len, Sink &out, size_t *cnt) {
+    if (!can_checksum_valid(pkt, pkt_len)) {
+      checksum_errors_++;
+      desync_ = true;
+      return false;
+    }
+
+    CanMessage *msg = out.reserve();
+    if (msg == nullptr) {
+      dropped_++;
+      return true;
+    }
+    can_unpack(pkt, pkt_len, timestamps_, msg);
+    out.commit();
+    (*cnt)++;
+    return true;
+  }
+
+  bool timestamps_;
+  bool desync_ = false;
+  uint8_t partial_[CANPACKET_SIZE_MAX];
+  size_t partial_len_ = 0U;
+  uint64_t dropped_ = 0U;
+  uint64_t checksum_errors_ = 0U;
+};
+
+}  // namespace panda
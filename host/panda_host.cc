@@ -0,0 +1,365 @@
+#include "panda_host.h"
+
+#include <chrono>
+#include <cstring>
+
+namespace panda {
+
+constexpr uint16_t USB_VIDS[] = {0xbbaaU, 0x3801U};
+constexpr uint16_t USB_PIDS[] = {0xddeeU, 0xddccU};
+constexpr uint8_t CAN_RX_ENDPOINT = 0x81U;
+
+static bool is_panda(const libusb_device_descriptor &desc) {
+  bool vid = false;
+  bool pid = false;
+  for (uint16_t v : USB_VIDS) {
+    vid = vid || (desc.idVendor == v);
+  }
+  for (uint16_t p : USB_PIDS) {
+    pid = pid || (desc.idProduct == p);
+  }
+  return vid && pid;
+}
+
+PandaHost::~PandaHost() {
+  close();
+}
+
+int PandaHost::open(const std::string &serial, bool claim) {
+  close();
+
+  int ret = libusb_init(&ctx_);
+  if (ret < 0) {
+    ctx_ = nullptr;
+    return ret;
+  }
+
+  libusb_device **list = nullptr;
+  ssize_t cnt = libusb_get_device_list(ctx_, &list);
+  for (ssize_t i = 0; (i < cnt) && (dev_ == nullptr); i++) {
+    libusb_device_descriptor desc;
+    libusb_device_handle *handle = nullptr;
+    if ((libusb_get_device_descriptor(list[i], &desc) < 0) || !is_panda(desc) || (libusb_open(list[i], &handle) < 0)) {
+      continue;
+    }
+
+    unsigned char buf[64] = {0};
+    int len = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, buf, sizeof(buf));
+    std::string this_serial = (len > 0) ? std::string(reinterpret_cast<char *>(buf), len) : std::string();
+    if ((len > 0) && (serial.empty() || (this_serial == serial))) {
+      dev_ = handle;
+      serial_ = this_serial;
+      product_id_ = desc.idProduct;
+    } else {
+      libusb_close(handle);
+    }
+  }
+  if (list != nullptr) {
+    libusb_free_device_list(list, 1);
+  }
+
+  if (dev_ == nullptr) {
+    close();
+    return (cnt < 0) ? (int)cnt : LIBUSB_ERROR_NOT_FOUND;
+  }
+
+  // not supported on all platforms, same as the python handle
+  (void)libusb_set_auto_detach_kernel_driver(dev_, 1);
+#ifdef __APPLE__
+  claim = true;
+#endif
+  if (claim) {
+    ret = libusb_claim_interface(dev_, 0);
+    if (ret < 0) {
+      close();
+      return ret;
+    }
+    claimed_ = true;
+  }
+  return 0;
+}
+
+void PandaHost::close() {
+  can_rx_stop();
+  if (dev_ != nullptr) {
+    if (claimed_) {
+      (void)libusb_release_interface(dev_, 0);
+      claimed_ = false;
+    }
+    libusb_close(dev_);
+    dev_ = nullptr;
+  }
+  if (ctx_ != nullptr) {
+    libusb_exit(ctx_);
+    ctx_ = nullptr;
+  }
+  serial_.clear();
+  product_id_ = 0U;
+}
+
+int PandaHost::control_write(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, const uint8_t *data, uint16_t len, unsigned int timeout_ms) {
+  return libusb_control_transfer(dev_, request_type, request, value, index, const_cast<uint8_t *>(data), len, timeout_ms);
+}
+
+int PandaHost::control_read(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t len, unsigned int timeout_ms) {
+  return libusb_control_transfer(dev_, request_type, request, value, index, data, len, timeout_ms);
+}
+
+int PandaHost::bulk_write(uint8_t endpoint, const uint8_t *data, int len, unsigned int timeout_ms) {
+  int transferred = 0;
+  int ret = libusb_bulk_transfer(dev_, endpoint & 0x7FU, const_cast<uint8_t *>(data), len, &transferred, timeout_ms);
+  // a timeout can still have sent part of it
+  return ((ret == 0) || ((ret == LIBUSB_ERROR_TIMEOUT) && (transferred > 0))) ? transferred : ret;
+}
+
+int PandaHost::bulk_read(uint8_t endpoint, uint8_t *data, int len, unsigned int timeout_ms) {
+  endpoint |= 0x80U;
+  if ((endpoint == CAN_RX_ENDPOINT) && can_rx_running()) {
+    return LIBUSB_ERROR_BUSY;
+  }
+  int transferred = 0;
+  int ret = libusb_bulk_transfer(dev_, endpoint, data, len, &transferred, timeout_ms);
+  return (ret == 0) ? transferred : ret;
+}
+
+int PandaHost::interrupt_read(uint8_t endpoint, uint8_t *data, int len, unsigned int timeout_ms) {
+  int transferred = 0;
+  int ret = libusb_interrupt_transfer(dev_, endpoint | 0x80U, data, len, &transferred, timeout_ms);
+  return (ret == 0) ? transferred : ret;
+}
+
+int PandaHost::set_interface_alt_setting(int interface, int alt_setting) {
+  return libusb_set_interface_alt_setting(dev_, interface, alt_setting);
+}
+
+int PandaHost::can_rx_start(int transfer_cnt) {
+  if (dev_ == nullptr) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  if (can_rx_running()) {
+    return 0;
+  }
+  if ((transfer_cnt < 1) || (transfer_cnt > CAN_RX_TRANSFER_CNT_MAX)) {
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+
+  if (ring_ == nullptr) {
+    ring_ = std::make_unique<MessageRing<CAN_RX_RING_SIZE>>();
+  }
+  ring_->clear();
+  rx_error_ = 0;
+  running_ = true;
+
+  for (int i = 0; i < transfer_cnt; i++) {
+    libusb_transfer *transfer = libusb_alloc_transfer(0);
+    if (transfer == nullptr) {
+      can_rx_stop();
+      return LIBUSB_ERROR_NO_MEM;
+    }
+    buffers_.push_back(std::make_unique<uint8_t[]>(CAN_RX_TRANSFER_SIZE));
+    transfers_.push_back(transfer);
+    libusb_fill_bulk_transfer(transfer, dev_, CAN_RX_ENDPOINT, buffers_.back().get(), CAN_RX_TRANSFER_SIZE, can_rx_callback, this, 0);
+  }
+
+  // submitted in order, the event thread sees them complete in the same order
+  event_thread_ = std::thread(&PandaHost::event_loop, this);
+  for (libusb_transfer *transfer : transfers_) {
+    in_flight_++;
+    int ret = libusb_submit_transfer(transfer);
+    if (ret < 0) {
+      in_flight_--;
+      can_rx_stop();
+      return ret;
+    }
+  }
+  return 0;
+}
+
+void PandaHost::can_rx_stop() {
+  running_ = false;
+  for (libusb_transfer *transfer : transfers_) {
+    (void)libusb_cancel_transfer(transfer);
+  }
+  if (event_thread_.joinable()) {
+    event_thread_.join();
+  }
+  for (libusb_transfer *transfer : transfers_) {
+    libusb_free_transfer(transfer);
+  }
+  transfers_.clear();
+  buffers_.clear();
+}
+
+void PandaHost::event_loop() {
+  // keep handling events until the cancelled transfers are back
+  while (running_ || (in_flight_ > 0)) {
+    timeval tv = {0, 100000};
+    (void)libusb_handle_events_timeout_completed(ctx_, &tv, nullptr);
+  }
+}
+
+void LIBUSB_CALL PandaHost::can_rx_callback(libusb_transfer *transfer) {
+  static_cast<PandaHost *>(transfer->user_data)->can_rx_complete(transfer);
+}
+
+void PandaHost::can_rx_complete(libusb_transfer *transfer) {
+  bool received = false;
+
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED: {
+      uint32_t gen = reset_gen_.load(std::memory_order_acquire);
+      if (gen != parser_gen_) {
+        parser_.reset(reset_timestamps_.load());
+        parser_gen_ = gen;
+      }
+      received = parser_.feed(transfer->buffer, transfer->actual_length, *ring_) > 0U;
+      rx_dropped_ = parser_.dropped();
+      rx_checksum_errors_ = parser_.checksum_errors();
+      if (parser_.desync() && (rx_desync_gen_ != gen)) {
+        // wake can_recv to report it
+        rx_desync_gen_ = gen;
+        received = true;
+      }
+      break;
+    }
+    case LIBUSB_TRANSFER_CANCELLED:
+      break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      rx_error_ = LIBUSB_ERROR_NO_DEVICE;
+      running_ = false;
+      break;
+    default:
+      // same as the retries of Panda.can_recv
+      rx_transfer_errors_++;
+      break;
+  }
+
+  bool resubmitted = false;
+  if (running_ && (transfer->status != LIBUSB_TRANSFER_CANCELLED)) {
+    int ret = libusb_submit_transfer(transfer);
+    if (ret < 0) {
+      rx_error_ = ret;
+    } else {
+      resubmitted = true;
+    }
+  }
+  if (!resubmitted) {
+    in_flight_--;
+  }
+
+  if (received || !resubmitted) {
+    std::lock_guard<std::mutex> lk(rx_mutex_);
+    rx_cv_.notify_all();
+  }
+}
+
+void PandaHost::can_rx_reset(bool timestamps) {
+  reset_timestamps_ = timestamps;
+  reset_gen_.fetch_add(1U, std::memory_order_release);
+  if (ring_ != nullptr) {
+    ring_->clear();
+  }
+  // not running yet, the parser is picked up by the first transfer
+  if (!can_rx_running()) {
+    parser_.reset(timestamps);
+    parser_gen_ = reset_gen_.load();
+  }
+}
+
+int PandaHost::can_recv(CanMessage *out, int max, unsigned int timeout_ms) {
+  if (!can_rx_running()) {
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+
+  size_t cnt = ring_->pop(out, (size_t)max);
+  if ((cnt == 0U) && (timeout_ms > 0U)) {
+    std::unique_lock<std::mutex> lk(rx_mutex_);
+    rx_cv_.wait_for(lk, std::chrono::milliseconds(timeout_ms), [this] { return !ring_->empty() || (in_flight_ == 0) || can_rx_desync(); });
+    lk.unlock();
+    cnt = ring_->pop(out, (size_t)max);
+  }
+
+  if ((cnt == 0U) && can_rx_desync()) {
+    return CAN_RX_ERROR_DESYNC;
+  }
+  if ((cnt == 0U) && (in_flight_ == 0)) {
+    return (rx_error_ != 0) ? rx_error_.load() : LIBUSB_ERROR_IO;
+  }
+  return (int)cnt;
+}
+
+}  // namespace panda
+
+// C API for python/native.py, all ints are libusb return values
+using panda::CanMessage;
+using panda::PandaHost;
+
+extern "C" {
+
+PandaHost *panda_host_new(void) {
+  return new PandaHost();
+}
+
+void panda_host_free(PandaHost *h) {
+  delete h;
+}
+
+int panda_host_open(PandaHost *h, const char *serial, bool claim) {
+  return h->open((serial != nullptr) ? serial : "", claim);
+}
+
+int panda_host_serial(PandaHost *h, char *out, int len) {
+  int n = (int)h->serial().size();
+  n = (n < (len - 1)) ? n : (len - 1);
+  memcpy(out, h->serial().data(), n);
+  out[n] = '\0';
+  return n;
+}
+
+int panda_host_product_id(PandaHost *h) {
+  return h->product_id();
+}
+
+int panda_host_control_write(PandaHost *h, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, const uint8_t *data, uint16_t len, unsigned int timeout_ms) {
+  return h->control_write(request_type, request, value, index, data, len, timeout_ms);
+}
+
+int panda_host_control_read(PandaHost *h, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t len, unsigned int timeout_ms) {
+  return h->control_read(request_type, request, value, index, data, len, timeout_ms);
+}
+
+int panda_host_bulk_write(PandaHost *h, uint8_t endpoint, const uint8_t *data, int len, unsigned int timeout_ms) {
+  return h->bulk_write(endpoint, data, len, timeout_ms);
+}
+
+int panda_host_bulk_read(PandaHost *h, uint8_t endpoint, uint8_t *data, int len, unsigned int timeout_ms) {
+  return h->bulk_read(endpoint, data, len, timeout_ms);
+}
+
+int panda_host_interrupt_read(PandaHost *h, uint8_t endpoint, uint8_t *data, int len, unsigned int timeout_ms) {
+  return h->interrupt_read(endpoint, data, len, timeout_ms);
+}
+
+int panda_host_set_interface_alt_setting(PandaHost *h, int interface, int alt_setting) {
+  return h->set_interface_alt_setting(interface, alt_setting);
+}
+
+int panda_host_can_rx_start(PandaHost *h, int transfer_cnt) {
+  return h->can_rx_start(transfer_cnt);
+}
+
+void panda_host_can_rx_reset(PandaHost *h, bool timestamps) {
+  h->can_rx_reset(timestamps);
+}
+
+int panda_host_can_recv(PandaHost *h, CanMessage *out, int max, unsigned int timeout_ms) {
+  return h->can_recv(out, max, timeout_ms);
+}
+
+void panda_host_can_rx_stats(PandaHost *h, uint64_t *dropped, uint64_t *checksum_errors, uint64_t *transfer_errors) {
+  *dropped = h->can_rx_dropped();
+  *checksum_errors = h->can_rx_checksum_errors();
+  *transfer_errors = h->can_rx_transfer_errors();
+}
+
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libusb-1.0/libusb.h>
+
+#include "can_parser.h"
+
+// Native USB handle for python/native.py. Besides the synchronous transfers of the
+// python BaseHandle, it keeps a pool of bulk IN transfers on the CAN endpoint in flight,
+// decoded by an event thread into a ring that can_recv() pops from.
+
+namespace panda {
+
+constexpr int CAN_RX_TRANSFER_CNT_MAX = 32;
+constexpr int CAN_RX_TRANSFER_SIZE = 16384;  // same as the bulkRead of Panda.can_recv
+constexpr size_t CAN_RX_RING_SIZE = 0x4000U;
+// returned by can_recv() after a bad checksum, past libusb's error codes
+constexpr int CAN_RX_ERROR_DESYNC = -1000;
+
+class PandaHost {
+ public:
+  PandaHost() = default;
+  ~PandaHost();
+
+  PandaHost(const PandaHost &) = delete;
+  PandaHost &operator=(const PandaHost &) = delete;
+
+  // opens the first panda if serial is empty, all calls below return a negative libusb error on failure
+  int open(const std::string &serial, bool claim);
+  void close();
+  const std::string &serial() const { return serial_; }
+  uint16_t product_id() const { return product_id_; }
+
+  int control_write(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, const uint8_t *data, uint16_t len, unsigned int timeout_ms);
+  int control_read(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t len, unsigned int timeout_ms);
+  int bulk_write(uint8_t endpoint, const uint8_t *data, int len, unsigned int timeout_ms);
+  int bulk_read(uint8_t endpoint, uint8_t *data, int len, unsigned int timeout_ms);
+  int interrupt_read(uint8_t endpoint, uint8_t *data, int len, unsigned int timeout_ms);
+  int set_interface_alt_setting(int interface, int alt_setting);
+
+  // once started, the CAN endpoint is only read by the pool
+  int can_rx_start(int transfer_cnt);
+  bool can_rx_running() const { return !transfers_.empty(); }
+  // drops the queued messages and any partial packet, call after resetting the panda's CAN comms
+  void can_rx_reset(bool timestamps);
+  // waits up to timeout_ms for the first message, 0 if there was none and the negative error that stopped the pool.
+  // After a bad checksum the messages decoded before it are returned, then CAN_RX_ERROR_DESYNC until can_rx_reset()
+  int can_recv(CanMessage *out, int max, unsigned int timeout_ms);
+
+  bool can_rx_desync() const { return rx_desync_gen_.load() == reset_gen_.load(); }
+  uint64_t can_rx_dropped() const { return rx_dropped_.load(); }
+  uint64_t can_rx_checksum_errors() const { return rx_checksum_errors_.load(); }
+  uint64_t can_rx_transfer_errors() const { return rx_transfer_errors_.load(); }
+
+ private:
+  static void LIBUSB_CALL can_rx_callback(libusb_transfer *transfer);
+  void can_rx_complete(libusb_transfer *transfer);
+  void can_rx_stop();
+  void event_loop();
+
+  libusb_context *ctx_ = nullptr;
+  libusb_device_handle *dev_ = nullptr;
+  bool claimed_ = false;
+  std::string serial_;
+  uint16_t product_id_ = 0U;
+
+  std::vector<libusb_transfer *> transfers_;
+  std::vector<std::unique_ptr<uint8_t[]>> buffers_;
+  std::thread event_thread_;
+  std::atomic<bool> running_{false};
+  std::atomic<int> in_flight_{0};
+  std::atomic<int> rx_error_{0};
+
+  // the parser is only used on the event thread, resets are picked up from the generation
+  CanParser parser_;
+  std::atomic<uint32_t> reset_gen_{0U};
+  std::atomic<bool> reset_timestamps_{false};
+  uint32_t parser_gen_ = 0U;
+  // generation the parser lost the framing in
+  std::atomic<uint32_t> rx_desync_gen_{UINT32_MAX};
+  std::unique_ptr<MessageRing<CAN_RX_RING_SIZE>> ring_;
+
+  std::mutex rx_mutex_;
+  std::condition_variable rx_cv_;
+
+  std::atomic<uint64_t> rx_dropped_{0U};
+  std::atomic<uint64_t> rx_checksum_errors_{0U};
+  std::atomic<uint64_t> rx_transfer_errors_{0U};
+};
+
+}  // namespace panda
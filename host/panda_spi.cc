@@ -0,0 +1,239 @@
+#include "panda_spi.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include <sys/ioctl.h>
+
+namespace panda {
+
+constexpr uint8_t SYNC = 0x5AU;
+constexpr uint8_t HACK = 0x79U;
+constexpr uint8_t DACK = 0x85U;
+constexpr uint8_t NACK = 0x1FU;
+constexpr uint8_t CHECKSUM_START = 0xABU;
+
+constexpr uint32_t HEADER_SIZE = 7U;
+constexpr uint32_t MIN_ACK_TIMEOUT_MS = 100U;
+constexpr uint32_t USBPACKET_MAX_SIZE = 0x40U;
+constexpr uint32_t XFER_SIZE = 0x1000U - 0x40U;  // XFER_SIZE in python/spi.py
+constexpr uint8_t XCHG_ENDPOINT = 5U;
+constexpr uint32_t XCHG_HEADER_SIZE = 4U;  // DACK, status, RX length
+
+// the panda's header interrupt sets up the DMAs for what comes next, the
+// python handle gets this for free from the time between its xfer2 calls.
+// it's only a head start, the HACK polls are what wait for the panda
+constexpr uint16_t HEADER_DELAY_US = 20U;
+
+static uint8_t checksum(const uint8_t *data, uint32_t len) {
+  uint8_t cksum = CHECKSUM_START;
+  for (uint32_t i = 0U; i < len; i++) {
+    cksum ^= data[i];
+  }
+  return cksum;
+}
+
+static spi_ioc_transfer make_xfer(const uint8_t *tx, uint8_t *rx, uint32_t len) {
+  spi_ioc_transfer t = {};
+  t.tx_buf = (uintptr_t)tx;
+  t.rx_buf = (uintptr_t)rx;
+  t.len = len;
+  return t;
+}
+
+PandaSpi::PandaSpi(int fd) : fd_(fd) {}
+
+PandaSpi::PandaSpi(SpiXferFn xfer, void *ctx) : xfer_(xfer), ctx_(ctx) {}
+
+int PandaSpi::xfer(spi_ioc_transfer *xfers, unsigned int cnt) {
+  // chip select goes high between the transfers, not after the last one
+  for (unsigned int i = 0U; i < cnt; i++) {
+    xfers[i].cs_change = (i + 1U) < cnt;
+  }
+  int ret = (xfer_ != nullptr) ? xfer_(ctx_, xfers, cnt) : ioctl(fd_, SPI_IOC_MESSAGE(cnt), xfers);
+  return (ret < 0) ? SPI_ERR_IO : 0;
+}
+
+int PandaSpi::wait_for_ack(uint8_t ack, uint8_t tx, uint32_t len, unsigned int timeout_ms, bool polled) {
+  const auto start = std::chrono::steady_clock::now();
+  const auto timeout = std::chrono::milliseconds(std::max(MIN_ACK_TIMEOUT_MS, timeout_ms));
+
+  poll_.assign(len, tx);
+  rx_.resize(std::max<size_t>(rx_.size(), len));
+  while (true) {
+    // the first poll went out with what came before it
+    if (!polled) {
+      spi_ioc_transfer t = make_xfer(poll_.data(), rx_.data(), len);
+      int ret = xfer(&t, 1U);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+    polled = false;
+
+    if (rx_[0] == ack) {
+      return 0;
+    } else if (rx_[0] == NACK) {
+      return SPI_ERR_NACK;
+    } else if ((timeout_ms != 0U) && ((std::chrono::steady_clock::now() - start) >= timeout)) {
+      return SPI_ERR_MISSING_ACK;
+    }
+  }
+}
+
+int PandaSpi::read_rest(uint32_t have, uint32_t total) {
+  rx_.resize(std::max<size_t>(rx_.size(), total));
+  if (total <= have) {
+    return 0;
+  }
+  zeros_.resize(std::max<size_t>(zeros_.size(), total - have), 0U);
+  spi_ioc_transfer t = make_xfer(zeros_.data(), &rx_[have], total - have);
+  return xfer(&t, 1U);
+}
+
+void PandaSpi::pack_header(uint8_t endpoint, uint16_t tx_len, uint16_t max_rx_len) {
+  header_[0] = SYNC;
+  header_[1] = endpoint;
+  header_[2] = tx_len & 0xFFU;
+  header_[3] = (tx_len >> 8) & 0xFFU;
+  header_[4] = max_rx_len & 0xFFU;
+  header_[5] = (max_rx_len >> 8) & 0xFFU;
+  header_[6] = checksum(header_, HEADER_SIZE - 1U);
+}
+
+void PandaSpi::pack_data(const uint8_t *data, uint16_t len, uint32_t pad_to) {
+  tx_.assign(std::max<uint32_t>(len + 1U, pad_to), 0U);
+  memcpy(tx_.data(), data, len);
+  tx_[len] = checksum(data, len);
+}
+
+int PandaSpi::transfer(uint8_t endpoint, const uint8_t *data, uint16_t len, uint8_t *rx, uint16_t max_rx_len, unsigned int timeout_ms, bool expect_disconnect) {
+  max_rx_len = std::max<uint16_t>(USBPACKET_MAX_SIZE, max_rx_len);
+  const uint32_t ack_len = 3U + USBPACKET_MAX_SIZE + 1U;  // enough for a controlRead
+
+  // header and the first header ACK poll
+  pack_header(endpoint, len, max_rx_len);
+  poll_.assign(1U, 0x11U);
+  rx_.resize(std::max<size_t>(rx_.size(), ack_len));
+  spi_ioc_transfer header_xfers[2] = {make_xfer(header_, nullptr, HEADER_SIZE), make_xfer(poll_.data(), rx_.data(), 1U)};
+  header_xfers[0].delay_usecs = HEADER_DELAY_US;
+  int ret = xfer(header_xfers, 2U);
+  if (ret == 0) {
+    ret = wait_for_ack(HACK, 0x11U, 1U, MIN_ACK_TIMEOUT_MS, true);
+  }
+  if (ret < 0) {
+    return ret;
+  }
+
+  // data and the first data ACK poll
+  pack_data(data, len, 0U);
+  if (expect_disconnect) {
+    spi_ioc_transfer t = make_xfer(tx_.data(), nullptr, tx_.size());
+    ret = xfer(&t, 1U);
+    return (ret < 0) ? ret : 0;
+  }
+  poll_.assign(ack_len, 0x13U);
+  spi_ioc_transfer data_xfers[2] = {make_xfer(tx_.data(), nullptr, tx_.size()), make_xfer(poll_.data(), rx_.data(), ack_len)};
+  ret = xfer(data_xfers, 2U);
+  if (ret == 0) {
+    ret = wait_for_ack(DACK, 0x13U, ack_len, timeout_ms, true);
+  }
+  if (ret < 0) {
+    return ret;
+  }
+
+  // DACK + 2 byte length + response + checksum
+  const uint16_t response_len = rx_[1] | (rx_[2] << 8);
+  if (response_len > max_rx_len) {
+    return SPI_ERR_RESPONSE_LEN;
+  }
+  const uint32_t total = 3U + response_len + 1U;
+  ret = read_rest(ack_len, total);
+  if (ret < 0) {
+    return ret;
+  }
+  if (checksum(rx_.data(), total) != 0U) {
+    return SPI_ERR_BAD_CHECKSUM;
+  }
+  memcpy(rx, &rx_[3], response_len);
+  return response_len;
+}
+
+int PandaSpi::exchange(const uint8_t *data, uint16_t len, uint8_t *rx, uint8_t *status) {
+  if (len > XFER_SIZE) {
+    return SPI_ERR_RESPONSE_LEN;
+  }
+
+  // header and the first HACK poll, the poll that gets it is the first byte of the panda's data DMA
+  pack_header(XCHG_ENDPOINT, len, XFER_SIZE);
+  poll_.assign(1U, 0x11U);
+  rx_.resize(std::max<size_t>(rx_.size(), 1U));
+  spi_ioc_transfer header_xfers[2] = {make_xfer(header_, nullptr, HEADER_SIZE), make_xfer(poll_.data(), rx_.data(), 1U)};
+  header_xfers[0].delay_usecs = HEADER_DELAY_US;
+  int ret = xfer(header_xfers, 2U);
+  if (ret == 0) {
+    ret = wait_for_ack(HACK, 0x11U, 1U, MIN_ACK_TIMEOUT_MS, true);
+  }
+  if (ret < 0) {
+    return ret;
+  }
+
+  // the data while the staged response comes back
+  pack_data(data, len, XCHG_HEADER_SIZE + USBPACKET_MAX_SIZE + 1U);
+  rx_.resize(std::max<size_t>(rx_.size(), tx_.size()));
+  spi_ioc_transfer t = make_xfer(tx_.data(), rx_.data(), tx_.size());
+  ret = xfer(&t, 1U);
+  if (ret < 0) {
+    return ret;
+  }
+
+  if (rx_[0] == NACK) {
+    return SPI_ERR_NACK;
+  } else if (rx_[0] != DACK) {
+    return SPI_ERR_MISSING_ACK;
+  }
+  const uint16_t response_len = rx_[2] | (rx_[3] << 8);
+  if (response_len > XFER_SIZE) {
+    return SPI_ERR_RESPONSE_LEN;
+  }
+  const uint32_t total = XCHG_HEADER_SIZE + response_len + 1U;
+  ret = read_rest(tx_.size(), total);
+  if (ret < 0) {
+    return ret;
+  }
+  if (checksum(rx_.data(), total) != 0U) {
+    return SPI_ERR_BAD_CHECKSUM;
+  }
+  *status = rx_[1];
+  memcpy(rx, &rx_[XCHG_HEADER_SIZE], response_len);
+  return response_len;
+}
+
+}  // namespace panda
+
+using panda::PandaSpi;
+
+extern "C" {
+
+PandaSpi *panda_spi_new(int fd) {
+  return new PandaSpi(fd);
+}
+
+PandaSpi *panda_spi_new_with_xfer(panda::SpiXferFn xfer, void *ctx) {
+  return new PandaSpi(xfer, ctx);
+}
+
+void panda_spi_free(PandaSpi *h) {
+  delete h;
+}
+
+int panda_spi_transfer(PandaSpi *h, uint8_t endpoint, const uint8_t *data, uint16_t len, uint8_t *rx, uint16_t max_rx_len, unsigned int timeout_ms, bool expect_disconnect) {
+  return h->transfer(endpoint, data, len, rx, max_rx_len, timeout_ms, expect_disconnect);
+}
+
+int panda_spi_exchange(PandaSpi *h, const uint8_t *data, uint16_t len, uint8_t *rx, uint8_t *status) {
+  return h->exchange(data, len, rx, status);
+}
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <linux/spi/spidev.h>
+
+// Native SPI transfers for python/spi.py. One try of a transfer or a CAN exchange, see
+// board/drivers/spi.h for the protocol, with the ACK polls and checksums done here. The
+// transfers of a step go out as one SPI_IOC_MESSAGE, chip select still toggles between
+// them like between the xfer2 calls of PandaSpiHandle. Locking and retries stay in python.
+
+namespace panda {
+
+// error returns, the PandaSpiException they're raised as in python/spi.py
+constexpr int SPI_ERR_NACK = -1;          // PandaSpiNackResponse
+constexpr int SPI_ERR_MISSING_ACK = -2;   // PandaSpiMissingAck
+constexpr int SPI_ERR_BAD_CHECKSUM = -3;  // PandaSpiBadChecksum
+constexpr int SPI_ERR_RESPONSE_LEN = -4;  // PandaSpiException
+constexpr int SPI_ERR_IO = -5;            // PandaSpiTransferFailed
+
+// one SPI_IOC_MESSAGE, returns < 0 on failure. the tests run the firmware's state machine behind one
+using SpiXferFn = int (*)(void *ctx, spi_ioc_transfer *xfers, unsigned int cnt);
+
+class PandaSpi {
+ public:
+  explicit PandaSpi(int fd);
+  PandaSpi(SpiXferFn xfer, void *ctx);
+
+  // returns the response length, or one of the errors above
+  int transfer(uint8_t endpoint, const uint8_t *data, uint16_t len, uint8_t *rx, uint16_t max_rx_len, unsigned int timeout_ms, bool expect_disconnect);
+  // endpoint 5, rx has room for XFER_SIZE. returns the received length and the status byte
+  int exchange(const uint8_t *data, uint16_t len, uint8_t *rx, uint8_t *status);
+
+ private:
+  int xfer(spi_ioc_transfer *xfers, unsigned int cnt);
+  // polls with tx until the first byte is ack, polled when the first poll went out with what came before it
+  int wait_for_ack(uint8_t ack, uint8_t tx, uint32_t len, unsigned int timeout_ms, bool polled);
+  // reads up to total response bytes after the ones that came with the ACK
+  int read_rest(uint32_t have, uint32_t total);
+  void pack_header(uint8_t endpoint, uint16_t tx_len, uint16_t max_rx_len);
+  void pack_data(const uint8_t *data, uint16_t len, uint32_t pad_to);
+
+  int fd_ = -1;
+  SpiXferFn xfer_ = nullptr;
+  void *ctx_ = nullptr;
+
+  uint8_t header_[7] = {0};
+  std::vector<uint8_t> tx_;     // data + checksum, zero padded
+  std::vector<uint8_t> poll_;   // the byte polled for an ACK with
+  std::vector<uint8_t> rx_;     // response as it came in, from the ACK to the checksum
+  std::vector<uint8_t> zeros_;  // clocked out while reading the rest
+};
+
+}  // namespace panda
@@ -8,17 +8,24 @@ import struct
 import hashlib
 import binascii
 import ctypes
+from collections import deque
 from functools import wraps, partial
-from itertools import accumulate
+from itertools import accumulate, groupby
 
 import opendbc
 from opendbc.car.structs import CarParams
 
 from .base import BaseHandle
-from .constants import BASEDIR, FW_PATH, McuType, compute_version_hash
+from .can_stream import CAN_STREAM_RING_SIZE, CanStream
+from .clock_sync import ClockSync, read_min_rtt
+from .constants import BASEDIR, FW_PATH, USBPACKET_MAX_SIZE, McuType, compute_version_hash
 from .dfu import PandaDFU
+from .sof_sync import SofSync
 from .spi import PandaSpiHandle, PandaSpiException, PandaProtocolMismatch
+from .sim import SIM_SERIAL, PandaSimHandle
 from .usb import PandaUsbHandle
+from .native import CanRxDesyncError, PandaNativeHandle, can_records_from_tuples, can_records_to_tuples, load_can_library, \
+                     pack_can_records, unpack_can_records
 from .utils import logger
 
 # load libusb from pip package
@@ -32,6 +39,7 @@ except ImportError:
 __version__ = '0.0.10'
 
 CANPACKET_HEAD_SIZE = 0x6
+CANPACKET_TIMESTAMP_SIZE = 0x4
 DLC_TO_LEN = [0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64]
 LEN_TO_DLC = {length: dlc for (dlc, length) in enumerate(DLC_TO_LEN)}
 PANDA_CAN_CNT = 3
@@ -52,9 +60,13 @@ def _parse_c_struct(path, name):
     raise ValueError(f"unsupported {name} layout in {path}")
   return struct.Struct("<" + "".join(type_to_format[m[1]] for m in fields))
 
-def pack_can_buffer(arr, chunk=False, fd=False):
+def pack_can_buffer(arr, chunk=False, fd=False, tx_timestamps=False):
+  # with tx_timestamps, messages can have the panda's microsecond timer value to send at as a fourth element
+  if load_can_library() is not None:
+    return pack_can_records(can_records_from_tuples(arr, fd=fd), chunk_size=(256 if chunk else 0), tx_timestamps=tx_timestamps)
+
   snds = [bytearray(), ]
-  for address, dat, bus in arr:
+  for address, dat, bus, *target in arr:
     extended = 1 if address >= 0x800 else 0
     data_len_code = LEN_TO_DLC[len(dat)]
     header = bytearray(CANPACKET_HEAD_SIZE)
@@ -64,17 +76,25 @@ def pack_can_buffer(arr, chunk=False, fd=False):
     header[2] = (word_4b >> 8) & 0xFF
     header[3] = (word_4b >> 16) & 0xFF
     header[4] = (word_4b >> 24) & 0xFF
-    header[5] = calculate_checksum(header[:5] + dat)
+    # 0 sends right away
+    ts = struct.pack("<I", target[0] if target else 0) if tx_timestamps else b''
+    header[5] = calculate_checksum(header[:5] + ts + dat)
 
     snds[-1].extend(header)
+    snds[-1].extend(ts)
     snds[-1].extend(dat)
     if chunk and len(snds[-1]) > 256:
       snds.append(bytearray())
 
   return snds
 
-def unpack_can_buffer(dat):
+def unpack_can_buffer(dat, timestamps=False):
+  if load_can_library() is not None:
+    records, rest = unpack_can_records(dat, timestamps=timestamps)
+    return can_records_to_tuples(records, timestamps=timestamps), rest
+
   ret = []
+  ts_size = CANPACKET_TIMESTAMP_SIZE if timestamps else 0
 
   while len(dat) >= CANPACKET_HEAD_SIZE:
     data_len = DLC_TO_LEN[(dat[0]>>4)]
@@ -92,15 +112,19 @@ def unpack_can_buffer(dat):
       bus += 192
 
     # we need more from the next transfer
-    if data_len > len(dat) - CANPACKET_HEAD_SIZE:
+    pkt_len = CANPACKET_HEAD_SIZE + ts_size + data_len
+    if pkt_len > len(dat):
       break
 
-    assert calculate_checksum(dat[:(CANPACKET_HEAD_SIZE+data_len)]) == 0, "CAN packet checksum incorrect"
-
-    data = dat[CANPACKET_HEAD_SIZE:(CANPACKET_HEAD_SIZE+data_len)]
-    dat = dat[(CANPACKET_HEAD_SIZE+data_len):]
+    assert calculate_checksum(dat[:pkt_len]) == 0, "CAN packet checksum incorrect"
 
-    ret.append((address, data, bus))
+    data = dat[(CANPACKET_HEAD_SIZE + ts_size):pkt_len]
+    if timestamps:
+      timestamp = struct.unpack_from("<I", dat, CANPACKET_HEAD_SIZE)[0]
+      ret.append((address, data, bus, timestamp))
+    else:
+      ret.append((address, data, bus))
+    dat = dat[pkt_len:]
 
   return (ret, dat)
 
@@ -139,7 +163,7 @@ class Panda:
   CAN_PACKET_VERSION = compute_version_hash(os.path.join(opendbc.INCLUDE_PATH, "opendbc/safety/can.h"))
   HEALTH_PACKET_VERSION = compute_version_hash(os.path.join(BASEDIR, "board/health.h"))
   HEALTH_STRUCT = _parse_c_struct(os.path.join(BASEDIR, "board/health.h"), "health_t")
-  CAN_HEALTH_STRUCT = struct.Struct("<BIBBBBBBBBIIIIIIIHHBBBIIII")
+  CAN_HEALTH_STRUCT = struct.Struct("<BIBBBBBBBBIIIIIIIHHBBBHHIII")
 
   H7_DEVICES = [HW_TYPE_RED_PANDA, HW_TYPE_TRES, HW_TYPE_CUATRO, HW_TYPE_BODY]
   SUPPORTED_DEVICES = H7_DEVICES
@@ -150,12 +174,39 @@ class Panda:
   HARNESS_STATUS_NORMAL = 1
   HARNESS_STATUS_FLIPPED = 2
 
-  def __init__(self, serial: str | None = None, claim: bool = True, disable_checks: bool = True, can_speed_kbps: int = 500, cli: bool = True):
+  # CAN wire format flags, see board/comms_definitions.h
+  CAN_COMMS_FLAG_TIMESTAMPS = 1
+  CAN_COMMS_FLAG_TX_TIMESTAMPS = 2
+  CAN_COMMS_FLAG_TX_CREDITS = 4
+
+  # periodic CAN message checksums, see board/drivers/drivers.h
+  CAN_PERIODIC_CHECKSUM_NONE = 0
+  CAN_PERIODIC_CHECKSUM_XOR = 1
+  CAN_PERIODIC_CHECKSUM_SUM = 2
+  CAN_PERIODIC_CNT = 32
+
+  # priority CAN IDs, sent on their own interrupt endpoint, see board/drivers/can_prio.h
+  CAN_PRIO_ID_CNT = 16
+  USB_ALT_PRIO = 2
+
+  def __init__(self, serial: str | None = None, claim: bool = True, disable_checks: bool = True, can_speed_kbps: int = 500, cli: bool = True,
+               can_timestamps: bool = False, can_tx_timestamps: bool = False, can_tx_credits: bool = False):
     self._disable_checks = disable_checks
+    # can_recv returns (address, data, bus, timestamp) with the panda's microsecond timer value of each frame
+    self.can_timestamps = can_timestamps
+    # can_send_at sends frames at a given panda microsecond timer value
+    self.can_tx_timestamps = can_tx_timestamps
+    # can_send_many only sends the frames that fit in the panda's TX queue of their bus, the rest are held here
+    self.can_tx_credits = can_tx_credits
+    self._can_tx_held = [deque() for _ in range(PANDA_CAN_CNT)]
+    # credits left from the last 0xc7 read, the panda only frees more meanwhile
+    self._can_tx_credits_left = [0] * (PANDA_CAN_CNT + 1)
 
     self._handle: BaseHandle
     self._handle_open = False
     self.can_rx_overflow_buffer = b''
+    self.can_prio_overflow_buffer = b''
+    self._can_stream = None
     self._can_speed_kbps = can_speed_kbps
 
     if cli and serial is None:
@@ -195,6 +246,7 @@ class Panda:
     self.close()
 
   def close(self):
+    self.can_stream_stop()
     if self._handle_open:
       self._handle.close()
       self._handle_open = False
@@ -206,10 +258,13 @@ class Panda:
 
     self._handle = None
     while self._handle is None:
-      # try USB first, then SPI
-      self._context, self._handle, serial, self.bootstub = self.usb_connect(self._connect_serial, claim=claim, no_error=wait)
-      if self._handle is None:
-        self._context, self._handle, serial, self.bootstub = self.spi_connect(self._connect_serial)
+      if self._connect_serial == SIM_SERIAL:
+        self._context, self._handle, serial, self.bootstub = self.sim_connect()
+      else:
+        # try USB first, then SPI
+        self._context, self._handle, serial, self.bootstub = self.usb_connect(self._connect_serial, claim=claim, no_error=wait)
+        if self._handle is None:
+          self._context, self._handle, serial, self.bootstub = self.spi_connect(self._connect_serial)
       if not wait:
         break
 
@@ -220,6 +275,12 @@ class Panda:
     self._connect_serial = serial
     self._handle_open = True
     self.health_version, self.can_version = self.get_packets_versions()
+    if self.can_timestamps and not (self.get_can_comms_flags() & Panda.CAN_COMMS_FLAG_TIMESTAMPS):
+      raise RuntimeError("CAN timestamps not supported by panda's firmware. Reflash panda.")
+    if self.can_tx_timestamps and not (self.get_can_comms_flags() & Panda.CAN_COMMS_FLAG_TX_TIMESTAMPS):
+      raise RuntimeError("CAN TX timestamps not supported by panda's firmware. Reflash panda.")
+    if self.can_tx_credits and not (self.get_can_comms_flags() & Panda.CAN_COMMS_FLAG_TX_CREDITS):
+      raise RuntimeError("CAN TX credits not supported by panda's firmware. Reflash panda.")
     logger.debug("connected")
 
     # disable openpilot's heartbeat checks
@@ -268,8 +329,23 @@ class Panda:
     # got a device and all good
     return None, handle, spi_serial, bootstub
 
+  @classmethod
+  def sim_connect(cls):
+    # the virtual panda, see python/sim.py
+    try:
+      handle = PandaSimHandle.open()
+    except (OSError, RuntimeError):
+      logger.exception("failed to connect to the panda sim")
+      return None, None, None, False
+    return None, handle, SIM_SERIAL, False
+
   @classmethod
   def usb_connect(cls, serial, claim=True, no_error=False):
+    # the native library keeps CAN transfers in flight, see host/panda_host.h
+    native = PandaNativeHandle.open(serial, claim)
+    if native is not None:
+      return None, *native
+
     handle, usb_serial, bootstub = None, None, None
     context = usb1.USBContext()
     context.open()
@@ -312,7 +388,7 @@ class Panda:
     return isinstance(self._handle, PandaSpiHandle)
 
   def is_connected_usb(self):
-    return isinstance(self._handle, PandaUsbHandle)
+    return isinstance(self._handle, (PandaUsbHandle, PandaNativeHandle, PandaSimHandle))
 
   @classmethod
   def list(cls, usb_only: bool = False):
@@ -584,8 +660,9 @@ class Panda:
       "canfd_non_iso": a[21],
       "irq0_call_rate": a[22],
       "irq1_call_rate": a[23],
-      "irq2_call_rate": a[24],
+      "total_rx_filtered_cnt": a[24],
       "can_core_reset_count": a[25],
+      "total_tx_cancelled_cnt": a[26],
     }
 
   # ******************* control *******************
@@ -613,6 +690,13 @@ class Panda:
       return struct.unpack("<II", dat)
     return (0, 0)
 
+  def get_can_comms_flags(self):
+    # firmware without CAN wire format options returns the packet versions instead
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xdd, 1, 0, 4)
+    if dat and len(dat) == 4:
+      return struct.unpack("<I", dat)[0]
+    return 0
+
   def is_internal(self):
     return self.get_type() in Panda.INTERNAL_DEVICES
 
@@ -686,6 +770,75 @@ class Panda:
   def set_canfd_auto(self, bus, auto):
       self._handle.controlWrite(Panda.REQUEST_OUT, 0xe8, bus, int(auto), b'')
 
+  def set_can_tx_elements(self, bus, count, queue_mode=False):
+    """
+    Number of hardware TX elements on a bus, taken from the RX FIFO. With queue_mode, pending
+    elements go out in CAN ID priority order instead of the order they were sent in.
+    """
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xed, bus, (int(queue_mode) << 8) | count, b'')
+
+  def can_cancel(self, bus, addr=None, older_than_us=None):
+    """
+    Cancel frames on a bus that are pending in the CAN core's TX buffers, optionally only the ones with
+    the given address and/or queued at least older_than_us ago. Frames already on the wire still go out.
+    """
+    if addr is not None:
+      self._handle.controlWrite(Panda.REQUEST_OUT, 0xee, addr >> 16, addr & 0xFFFF, b'')
+    older_than_us = 0 if older_than_us is None else min(int(older_than_us), 0x3FFFFFFF)
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xef, (bus << 14) | (older_than_us >> 16), older_than_us & 0xFFFF, b'')
+
+  def set_can_periodic(self, index, bus, addr, dat, period_us, counter=None, checksum=CAN_PERIODIC_CHECKSUM_NONE):
+    """
+    Send a message every period_us from the panda, still subject to the safety mode, which clears all of them
+    when it changes. counter is an optional (byte, shift, width) rolling counter, checksum is written to the last byte.
+    A period of 0 stops the message.
+    """
+    assert 0 <= index < self.CAN_PERIODIC_CNT
+    dat = bytes(dat)
+    for i in range(0, len(dat), 2):
+      self._handle.controlWrite(Panda.REQUEST_OUT, 0xa0, i, int.from_bytes(dat[i:i + 2], "little"), b'')
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xa1, (bus << 13) | (addr >> 16), addr & 0xFFFF, b'')
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xa2, period_us >> 16, period_us & 0xFFFF, b'')
+
+    options = checksum << 13
+    if counter is not None:
+      byte, shift, width = counter
+      options |= (1 << 12) | ((width - 1) << 9) | (shift << 6) | byte
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xa3, (index << 8) | LEN_TO_DLC[len(dat)], options, b'')
+
+  def clear_can_periodic(self, index=None):
+    if index is None:
+      self._handle.controlWrite(Panda.REQUEST_OUT, 0xa3, 0xFF << 8, 0, b'')
+    else:
+      self.set_can_periodic(index, 0, 0, b'', 0)
+
+  def get_can_periodic_stats(self, index):
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xa4, index, 0, 16)
+    sent_cnt, miss_cnt, last_jitter_us, max_jitter_us = struct.unpack("<IIII", dat)
+    return {
+      "sent_cnt": sent_cnt,
+      "miss_cnt": miss_cnt,
+      "last_jitter_us": last_jitter_us,
+      "max_jitter_us": max_jitter_us,
+    }
+
+  def set_can_filters(self, bus, std_ids=None, ext_ranges=None):
+    """
+    Only receive frames matching the given standard IDs and inclusive (start, end) extended ID ranges on a bus.
+    Filters are applied in the firmware after the safety, ignition and forwarding hooks, so those still see
+    every frame; filtered frames are counted in total_rx_filtered_cnt. Call without any IDs to receive everything again.
+    """
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xe9, bus, 0, b'')
+    if std_ids is None and ext_ranges is None:
+      return
+
+    for addr in (std_ids or []):
+      self._handle.controlWrite(Panda.REQUEST_OUT, 0xea, bus, addr, b'')
+    for start, end in (ext_ranges or []):
+      self._handle.controlWrite(Panda.REQUEST_OUT, 0xeb, start >> 16, start & 0xFFFF, b'')
+      self._handle.controlWrite(Panda.REQUEST_OUT, 0xec, (bus << 13) | (end >> 16), end & 0xFFFF, b'')
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xe9, bus, 1, b'')
+
   def set_uart_baud(self, uart, rate):
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xe4, uart, int(rate / 300), b'')
 
@@ -704,11 +857,64 @@ class Panda:
   CAN_SEND_TIMEOUT_MS = 10
 
   def can_reset_communications(self):
-    self._handle.controlWrite(Panda.REQUEST_OUT, 0xc0, 0, 0, b'')
+    flags = Panda.CAN_COMMS_FLAG_TIMESTAMPS if self.can_timestamps else 0
+    flags |= Panda.CAN_COMMS_FLAG_TX_TIMESTAMPS if self.can_tx_timestamps else 0
+    flags |= Panda.CAN_COMMS_FLAG_TX_CREDITS if self.can_tx_credits else 0
+    for held in self._can_tx_held:
+      held.clear()
+    self._can_tx_credits_left = [0] * (PANDA_CAN_CNT + 1)
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xc0, flags, 0, b'')
+    if isinstance(self._handle, PandaNativeHandle):
+      self._handle.can_rx_reset(self.can_timestamps)
+
+  def get_can_tx_credits(self):
+    """Free slots in the panda's TX queue of each bus, then in its timed TX frame buffer"""
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xc7, 0, 0, 2 * (PANDA_CAN_CNT + 1))
+    return struct.unpack(f"<{PANDA_CAN_CNT + 1}H", dat)
+
+  def can_tx_pending(self):
+    """Number of frames held by can_send_many until their bus has room, per bus"""
+    return [len(held) for held in self._can_tx_held]
+
+  def _can_tx_take(self):
+    left = self._can_tx_credits_left
+    arr = []
+    for bus, held in enumerate(self._can_tx_held):
+      while len(held) > 0 and left[bus] > 0:
+        # timed frames wait in the timed buffer, then go to the bus queue
+        msg, _ = held[0]
+        if len(msg) > 3 and msg[3]:
+          if left[PANDA_CAN_CNT] == 0:
+            break
+          left[PANDA_CAN_CNT] -= 1
+        left[bus] -= 1
+        arr.append(held.popleft())
+    return arr
+
+  def _can_send_credited(self, timeout):
+    for held_fd, held in groupby(self._can_tx_take(), key=lambda h: h[1]):
+      self._can_send_packed([msg for msg, _ in held], held_fd, timeout)
 
   @ensure_can_packet_version
   def can_send_many(self, arr, *, fd=False, timeout=CAN_SEND_TIMEOUT_MS):
-    snds = pack_can_buffer(arr, chunk=(not self.spi), fd=fd)
+    if self.can_tx_credits:
+      # frames for a bus without room are held and go out first on a later call,
+      # can_send_many([]) sends whatever fits now
+      for msg in arr:
+        if not 0 <= msg[2] < PANDA_CAN_CNT:
+          raise ValueError(f"invalid bus {msg[2]}, the panda has buses 0 to {PANDA_CAN_CNT - 1}")
+      for msg in arr:
+        self._can_tx_held[msg[2]].append((msg, fd))
+      self._can_send_credited(timeout)
+      if any(len(held) > 0 for held in self._can_tx_held):
+        # out of cached credits, see what the panda freed since
+        self._can_tx_credits_left = list(self.get_can_tx_credits())
+        self._can_send_credited(timeout)
+    else:
+      self._can_send_packed(arr, fd, timeout)
+
+  def _can_send_packed(self, arr, fd, timeout):
+    snds = pack_can_buffer(arr, chunk=(not self.spi), fd=fd, tx_timestamps=self.can_tx_timestamps)
     for tx in snds:
       while len(tx) > 0:
         bs = self._handle.bulkWrite(3, tx, timeout=timeout)
@@ -717,8 +923,51 @@ class Panda:
   def can_send(self, addr, dat, bus, *, fd=False, timeout=CAN_SEND_TIMEOUT_MS):
     self.can_send_many([[addr, dat, bus]], fd=fd, timeout=timeout)
 
+  def can_send_at(self, addr, dat, bus, target_us, *, fd=False, timeout=CAN_SEND_TIMEOUT_MS):
+    """
+    Send a frame when the panda's microsecond timer reaches target_us, see get_microsecond_timer_offset.
+    Targets that already passed are sent right away, frames still held are dropped on a safety mode change.
+    """
+    if not self.can_tx_timestamps:
+      raise RuntimeError("connect with can_tx_timestamps=True to send at a given time")
+    # 0 means right away
+    target_us = (int(target_us) & 0xFFFFFFFF) or 1
+    self.can_send_many([[addr, dat, bus, target_us]], fd=fd, timeout=timeout)
+
   @ensure_can_packet_version
   def can_recv(self):
+    if self._can_stream is not None:
+      raise RuntimeError("CAN messages are read by the stream, use can_stream_start()'s CanStream")
+    return self._can_recv()
+
+  @ensure_can_packet_version
+  def can_stream_start(self, ring_size=CAN_STREAM_RING_SIZE):
+    """
+    Starts reading CAN messages on a background thread into a ring of ring_size messages,
+    can_recv can't be used until can_stream_stop. Works over USB and SPI.
+
+    Returns:
+      CanStream: read() and iterate for (host_time, msg) entries, stats() for the messages dropped on the host
+    """
+    if self._can_stream is not None:
+      raise RuntimeError("CAN stream already started")
+    self._can_stream = CanStream(self._can_recv, ring_size)
+    return self._can_stream
+
+  def can_stream_stop(self):
+    if self._can_stream is not None:
+      self._can_stream.stop()
+      self._can_stream = None
+
+  def _can_recv(self):
+    if isinstance(self._handle, PandaNativeHandle):
+      try:
+        return self._handle.can_recv(self.can_timestamps)
+      except CanRxDesyncError:
+        # both ends start over on a packet boundary
+        self.can_reset_communications()
+        raise
+
     dat = bytearray()
     while True:
       try:
@@ -727,7 +976,47 @@ class Panda:
       except (usb1.USBErrorIO, usb1.USBErrorOverflow):
         logger.error("CAN: BAD RECV, RETRYING")
         time.sleep(0.1)
-    msgs, self.can_rx_overflow_buffer = unpack_can_buffer(self.can_rx_overflow_buffer + dat)
+    msgs, self.can_rx_overflow_buffer = unpack_can_buffer(self.can_rx_overflow_buffer + dat, timestamps=self.can_timestamps)
+    return msgs
+
+  def can_rx_stats(self):
+    """
+    CAN messages the native USB handle dropped with a full ring, checksum errors and failed transfers,
+    None with the other handles
+    """
+    if isinstance(self._handle, PandaNativeHandle):
+      return self._handle.can_rx_stats()
+    return None
+
+  def set_can_prio_ids(self, ids):
+    """
+    Frames with these IDs are sent on the interrupt endpoint instead of the bulk one while
+    it's enabled with set_can_prio_enabled, read them with can_recv_prio.
+
+    Args:
+      ids: (bus, address) pairs, addresses from 0x800 up are extended
+    """
+    if len(ids) > Panda.CAN_PRIO_ID_CNT:
+      raise ValueError(f"at most {Panda.CAN_PRIO_ID_CNT} priority CAN IDs")
+    self._handle.controlWrite(Panda.REQUEST_OUT, 0xb4, 0xFF, 0, b'')
+    for i, (bus, addr) in enumerate(ids):
+      self._handle.controlWrite(Panda.REQUEST_OUT, 0xb3, (bus << 13) | (addr >> 16), addr & 0xFFFF, b'')
+      self._handle.controlWrite(Panda.REQUEST_OUT, 0xb4, i, 0x1 | (int(addr >= 0x800) << 1), b'')
+
+  def set_can_prio_enabled(self, enabled):
+    """USB only, the interrupt endpoint is polled by the host every frame"""
+    if self.spi:
+      raise RuntimeError("priority CAN IDs are only sent over USB")
+    self._handle.setInterfaceAltSetting(0, Panda.USB_ALT_PRIO if enabled else 0)
+    self.can_prio_overflow_buffer = b''
+
+  @ensure_can_packet_version
+  def can_recv_prio(self, timeout=CAN_SEND_TIMEOUT_MS):
+    try:
+      dat = self._handle.interruptRead(4, USBPACKET_MAX_SIZE, timeout=timeout)
+    except usb1.USBErrorTimeout:
+      dat = b''
+    msgs, self.can_prio_overflow_buffer = unpack_can_buffer(self.can_prio_overflow_buffer + dat, timestamps=self.can_timestamps)
     return msgs
 
   def can_clear(self, bus):
@@ -773,6 +1062,36 @@ class Panda:
     dat = self._handle.controlRead(Panda.REQUEST_IN, 0xa8, 0, 0, 4)
     return struct.unpack("I", dat)[0]
 
+  def get_microsecond_timer_offset(self, samples=10):
+    """
+    Offset from time.monotonic() in us to the panda's microsecond timer, which wraps around at 2**32:
+    panda_time = (host_time_us + offset) % 2**32. Taken from the sample with the shortest round trip.
+    """
+    panda_time, host_time, _ = read_min_rtt(self.get_microsecond_timer, burst=samples)
+    return (panda_time - int(host_time * 1e6)) % 2**32
+
+  def clock_sync(self, **kwargs):
+    """
+    ClockSync of the panda's microsecond timer, converts it to time.monotonic() with an error bound
+    and tracks the drift between the two, see python/clock_sync.py. Call sample() or start() on it.
+    """
+    return ClockSync(self.get_microsecond_timer, **kwargs)
+
+  def get_usb_sof_latches(self):
+    """
+    (USB frame number, microsecond timer) pairs the panda latched at the latest SOFs, oldest first.
+    Latching starts with the first call and stops 5s after the last one, so the first call returns nothing.
+    """
+    dat = self._handle.controlRead(Panda.REQUEST_IN, 0xb6, 0, 0, USBPACKET_MAX_SIZE)
+    return list(struct.iter_unpack("<HI", dat))
+
+  def sof_sync(self, host_frame, **kwargs):
+    """
+    SofSync of the panda's microsecond timer against the USB frames, host_frame() returns
+    (frame number, host time) from the host controller, see python/sof_sync.py. Only over USB.
+    """
+    return SofSync(self.get_usb_sof_latches, host_frame, **kwargs)
+
   # ******************* IR *******************
   def set_ir_power(self, percentage):
     self._handle.controlWrite(Panda.REQUEST_OUT, 0xb0, int(percentage), 0, b'')
@@ -0,0 +1,88 @@
+import time
+import threading
+from collections import deque
+
+from .utils import logger
+
+CAN_STREAM_RING_SIZE = 100000  # messages
+CAN_STREAM_IDLE_S = 0.001  # between reads that returned nothing
+
+
+class CanStream:
+  """
+  Reads CAN messages on a thread of its own into a bounded ring, see Panda.can_stream_start.
+  Entries are (host_time, msg), host_time is the time.monotonic() of the read the message
+  came with. When the ring is full new messages are dropped and counted, these are separate
+  from the messages dropped by the panda, the rx_buffer_overflow of Panda.health().
+  """
+  def __init__(self, recv, ring_size=CAN_STREAM_RING_SIZE):
+    self._recv = recv
+    self._ring = deque()
+    self._ring_size = ring_size
+    self._cv = threading.Condition()
+    self._running = True
+    self._error = None
+    self.received = 0
+    self.dropped = 0
+
+    self._thread = threading.Thread(target=self._run, name="panda-can-stream", daemon=True)
+    self._thread.start()
+
+  def _run(self):
+    while self._running:
+      try:
+        msgs = self._recv()
+      except Exception as e:
+        logger.exception("CAN stream: read failed")
+        with self._cv:
+          self._error = e
+          self._running = False
+          self._cv.notify_all()
+        break
+
+      if len(msgs) == 0:
+        time.sleep(CAN_STREAM_IDLE_S)
+        continue
+
+      host_time = time.monotonic()
+      with self._cv:
+        room = max(self._ring_size - len(self._ring), 0)
+        self._ring.extend((host_time, msg) for msg in msgs[:room])
+        self.received += len(msgs)
+        self.dropped += len(msgs) - min(room, len(msgs))
+        self._cv.notify_all()
+
+  @property
+  def running(self):
+    return self._running
+
+  def stop(self):
+    with self._cv:
+      self._running = False
+      self._cv.notify_all()
+    if self._thread is not threading.current_thread():
+      self._thread.join()
+
+  def read(self, max_msgs=None, timeout=None):
+    """
+    Takes up to max_msgs entries, waiting up to timeout seconds for the first one
+    (forever with None, not at all with 0). Raises the error that stopped the reader once the ring is empty.
+    """
+    with self._cv:
+      self._cv.wait_for(lambda: len(self._ring) > 0 or not self._running, timeout=timeout)
+      if len(self._ring) == 0 and self._error is not None:
+        raise self._error
+      n = len(self._ring) if max_msgs is None else min(max_msgs, len(self._ring))
+      return [self._ring.popleft() for _ in range(n)]
+
+  def __iter__(self):
+    """Entries one at a time until the stream is stopped"""
+    while True:
+      batch = self.read()
+      if len(batch) == 0:
+        return
+      yield from batch
+
+  def stats(self):
+    with self._cv:
+      return {"received": self.received, "dropped": self.dropped, "queued": len(self._ring)}
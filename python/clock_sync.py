@@ -0,0 +1,131 @@
+import math
+import time
+import threading
+from collections import deque
+
+from .utils import logger
+
+TIMER_WRAP = 2**32
+
+CLOCK_SYNC_BURST = 8  # timer reads per sample, the one with the shortest round trip is kept
+CLOCK_SYNC_WINDOW = 32  # samples the model is fit over
+CLOCK_SYNC_INTERVAL_S = 1.0
+
+
+def fit_line(xs, ys, default_slope):
+  """Least squares y = intercept + slope * x, returns (intercept, slope, residual max, slope error, x mean)"""
+  n = len(xs)
+  x_mean, y_mean = sum(xs) / n, sum(ys) / n
+  sxx = sum((x - x_mean) ** 2 for x in xs)
+  slope = default_slope if sxx == 0 else sum((x - x_mean) * (y - y_mean) for x, y in zip(xs, ys, strict=True)) / sxx
+  intercept = y_mean - slope * x_mean
+
+  residuals = [y - (intercept + slope * x) for x, y in zip(xs, ys, strict=True)]
+  residual_max = max(abs(r) for r in residuals)
+  # uncertainty of the slope, for extrapolating away from the samples
+  slope_err = 0.0 if n < 3 or sxx == 0 else math.sqrt(sum(r ** 2 for r in residuals) / (n - 2) / sxx)
+  return intercept, slope, residual_max, slope_err, x_mean
+
+
+def unwrap_timer(timer_us, ref):
+  return ref + ((timer_us - ref + TIMER_WRAP // 2) % TIMER_WRAP) - TIMER_WRAP // 2
+
+
+def read_min_rtt(read_timer, clock=time.monotonic, burst=CLOCK_SYNC_BURST):
+  """
+  Reads the timer burst times, returns (timer us, host time, round trip) of the read with the
+  shortest round trip, the host time is taken halfway through it
+  """
+  best = None
+  for _ in range(burst):
+    t0 = clock()
+    timer_us = read_timer()
+    t1 = clock()
+    if best is None or (t1 - t0) < best[2]:
+      best = (timer_us, (t0 + t1) / 2, t1 - t0)
+  return best
+
+
+class ClockSync:
+  """
+  Maps the panda's microsecond timer (get_microsecond_timer, wraps at 2**32) to time.monotonic().
+
+  Every sample is the timer read with the shortest round trip out of a burst, taken to be
+  read halfway through it. A line host_time = a + b * timer_us is fit over the last samples,
+  b is 1e-6 apart from the drift between the two clocks. Timer values are unwrapped against
+  the last sample, so they have to be within 2**31 us (35 minutes) of it.
+  """
+  def __init__(self, read_timer, clock=time.monotonic, burst=CLOCK_SYNC_BURST, window=CLOCK_SYNC_WINDOW):
+    self._read_timer = read_timer
+    self._clock = clock
+    self._burst = burst
+    self._samples = deque(maxlen=window)  # (unwrapped timer us, host time, round trip)
+    self._lock = threading.Lock()
+    self._model = None
+    self._thread = None
+    self._stop = threading.Event()
+
+  def sample(self):
+    """Takes a sample and updates the model"""
+    timer_us, host_time, rtt = read_min_rtt(self._read_timer, self._clock, self._burst)
+    with self._lock:
+      if len(self._samples) > 0:
+        timer_us = unwrap_timer(timer_us, self._samples[-1][0])
+      self._samples.append((timer_us, host_time, rtt))
+      self._fit()
+
+  def _fit(self):
+    # samples with a long round trip are off by up to half of it, only the good ones are fit
+    rtt_min = min(s[2] for s in self._samples)
+    samples = [s for s in self._samples if s[2] <= 2 * rtt_min + 50e-6]
+    ref = samples[-1][0]
+    intercept, slope, residual_max, slope_err, x_mean = fit_line([s[0] - ref for s in samples], [s[1] for s in samples], 1e-6)
+    self._model = (ref, intercept, slope, residual_max + rtt_min / 2, slope_err, x_mean)
+
+  @property
+  def synced(self):
+    return self._model is not None
+
+  @property
+  def drift_ppm(self):
+    """How much faster the panda's timer runs than the host clock"""
+    slope = self._get_model()[2]
+    return (1e-6 / slope - 1) * 1e6
+
+  def _get_model(self):
+    with self._lock:
+      if self._model is None:
+        raise RuntimeError("clock not synced yet, call sample()")
+      return self._model
+
+  def to_host(self, timer_us):
+    """Returns (host time, error bound) in seconds of a panda microsecond timer value"""
+    ref, intercept, slope, err, slope_err, x_mean = self._get_model()
+    x = unwrap_timer(timer_us, ref) - ref
+    return intercept + slope * x, err + slope_err * abs(x - x_mean)
+
+  def to_timer(self, host_time):
+    """The panda microsecond timer value at a host time, as used by Panda.can_send_at"""
+    ref, intercept, slope, _, _, _ = self._get_model()
+    return round(ref + (host_time - intercept) / slope) % TIMER_WRAP
+
+  def start(self, interval=CLOCK_SYNC_INTERVAL_S):
+    """Keeps sampling on a thread of its own"""
+    if self._thread is None:
+      self._stop.clear()
+      self._thread = threading.Thread(target=self._run, args=(interval, ), name="panda-clock-sync", daemon=True)
+      self._thread.start()
+
+  def stop(self):
+    if self._thread is not None:
+      self._stop.set()
+      self._thread.join()
+      self._thread = None
+
+  def _run(self, interval):
+    while not self._stop.is_set():
+      try:
+        self.sample()
+      except Exception:
+        logger.exception("clock sync: reading the panda's timer failed")
+      self._stop.wait(interval)
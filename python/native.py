@@ -0,0 +1,295 @@
+import os
+import ctypes
+import usb1
+import numpy as np
+
+from .base import BaseHandle, TIMEOUT
+from .constants import BASEDIR
+from .utils import logger
+
+# Optional native libraries from host/, the python implementations are used without them.
+# libpanda_can.so packs and parses CAN packets, see host/can_parser.h.
+# libpanda_host.so is the USB handle, see host/panda_host.h, PANDA_NATIVE_USB=0 forces the python-libusb1 one.
+# libpanda_spi.so does the SPI transfers of PandaSpiHandle, see host/panda_spi.h, PANDA_NATIVE_SPI=0 forces spidev.
+LIBPANDA_CAN_PATH = os.path.join(BASEDIR, "host/libpanda_can.so")
+LIBPANDA_HOST_PATH = os.path.join(BASEDIR, "host/libpanda_host.so")
+LIBPANDA_SPI_PATH = os.path.join(BASEDIR, "host/libpanda_spi.so")
+
+CAN_RX_TRANSFER_CNT = 8  # bulk IN transfers kept in flight
+CAN_RECV_BATCH = 4096
+CAN_RECV_WAIT_MS = 1  # about the round trip of a bulk read with nothing to send
+CAN_RX_ERROR_DESYNC = -1000  # panda::CAN_RX_ERROR_DESYNC
+
+# libusb error codes
+_USB_ERRORS = {
+  -1: "USBErrorIO",
+  -4: "USBErrorNoDevice",
+  -6: "USBErrorBusy",
+  -7: "USBErrorTimeout",
+  -8: "USBErrorOverflow",
+  -9: "USBErrorPipe",
+}
+
+# panda::CanMessage in host/can_parser.h
+CAN_FLAG_REJECTED = 0x1
+CAN_FLAG_RETURNED = 0x2
+CAN_FLAG_EXTENDED = 0x4
+CAN_FLAG_FD = 0x8
+CAN_MESSAGE_DTYPE = np.dtype([
+  ("addr", "<u4"),
+  ("timestamp", "<u4"),
+  ("bus", "u1"),
+  ("flags", "u1"),
+  ("dlc", "u1"),
+  ("reserved", "u1"),
+  ("data", "u1", (64,)),
+])
+CANPACKET_SIZE_MAX = 6 + 4 + 64
+DLC_TO_LEN = np.array([0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64], dtype=np.uint8)
+LEN_TO_DLC = np.full(65, 0xFF, dtype=np.uint8)
+LEN_TO_DLC[DLC_TO_LEN] = np.arange(len(DLC_TO_LEN))
+
+
+class CanRxDesyncError(AssertionError):
+  """A bad checksum in the CAN stream, the same error unpack_can_buffer raises"""
+
+
+def _check(ret):
+  if ret < 0:
+    raise getattr(usb1, _USB_ERRORS.get(ret, "USBError"), usb1.USBError)(ret)
+  return ret
+
+
+def _load(path, signatures):
+  try:
+    lib = ctypes.CDLL(path)
+  except OSError:
+    logger.exception("failed to load %s", path)
+    return None
+  for name, (restype, argtypes) in signatures.items():
+    fn = getattr(lib, name)
+    fn.restype = restype
+    fn.argtypes = argtypes
+  return lib
+
+_h, _u8, _u16, _i, _ui, _buf, _ptr = ctypes.c_void_p, ctypes.c_uint8, ctypes.c_uint16, ctypes.c_int, ctypes.c_uint, ctypes.c_char_p, ctypes.c_void_p
+_bool = ctypes.c_bool
+_ip = ctypes.POINTER(ctypes.c_int)
+_u64p = ctypes.POINTER(ctypes.c_uint64)
+
+_can_lib = None
+_host_lib = None
+_spi_lib = None
+
+def load_can_library():
+  global _can_lib
+  if _can_lib is None and os.path.isfile(LIBPANDA_CAN_PATH):
+    _can_lib = _load(LIBPANDA_CAN_PATH, {
+      "panda_can_unpack": (_i, [_buf, _i, _bool, _ptr, _i, _ip]),
+      "panda_can_pack": (_i, [_ptr, _i, _bool, _i, _ptr, _ptr, _ip]),
+      "panda_can_parser_new": (_h, [_bool]),
+      "panda_can_parser_free": (None, [_h]),
+      "panda_can_parser_feed": (_i, [_h, _buf, _i, _ptr, _i]),
+    })
+  return _can_lib
+
+def load_library():
+  global _host_lib
+  if _host_lib is None and os.getenv("PANDA_NATIVE_USB", "1") != "0" and os.path.isfile(LIBPANDA_HOST_PATH):
+    _host_lib = _load(LIBPANDA_HOST_PATH, {
+      "panda_host_new": (_h, []),
+      "panda_host_free": (None, [_h]),
+      "panda_host_open": (_i, [_h, _buf, _bool]),
+      "panda_host_serial": (_i, [_h, _buf, _i]),
+      "panda_host_product_id": (_i, [_h]),
+      "panda_host_control_write": (_i, [_h, _u8, _u8, _u16, _u16, _buf, _u16, _ui]),
+      "panda_host_control_read": (_i, [_h, _u8, _u8, _u16, _u16, _buf, _u16, _ui]),
+      "panda_host_bulk_write": (_i, [_h, _u8, _buf, _i, _ui]),
+      "panda_host_bulk_read": (_i, [_h, _u8, _buf, _i, _ui]),
+      "panda_host_interrupt_read": (_i, [_h, _u8, _buf, _i, _ui]),
+      "panda_host_set_interface_alt_setting": (_i, [_h, _i, _i]),
+      "panda_host_can_rx_start": (_i, [_h, _i]),
+      "panda_host_can_rx_reset": (None, [_h, _bool]),
+      "panda_host_can_recv": (_i, [_h, _ptr, _i, _ui]),
+      "panda_host_can_rx_stats": (None, [_h, _u64p, _u64p, _u64p]),
+    })
+  return _host_lib
+
+def load_spi_library():
+  global _spi_lib
+  if _spi_lib is None and os.getenv("PANDA_NATIVE_SPI", "1") != "0" and os.path.isfile(LIBPANDA_SPI_PATH):
+    _spi_lib = _load(LIBPANDA_SPI_PATH, {
+      "panda_spi_new": (_h, [_i]),
+      "panda_spi_new_with_xfer": (_h, [_ptr, _ptr]),
+      "panda_spi_free": (None, [_h]),
+      "panda_spi_transfer": (_i, [_h, _u8, _buf, _u16, _buf, _u16, _ui, _bool]),
+      "panda_spi_exchange": (_i, [_h, _buf, _u16, _buf, ctypes.POINTER(_u8)]),
+    })
+  return _spi_lib
+
+
+def _can_library():
+  lib = load_can_library()
+  if lib is None:
+    raise RuntimeError(f"{LIBPANDA_CAN_PATH} not built, run scons")
+  return lib
+
+
+def unpack_can_records(dat, timestamps=False):
+  """
+  Parses the packets of the CAN bulk IN endpoint into a CAN_MESSAGE_DTYPE array.
+  Returns (records, rest), rest is the start of a packet continued in the next transfer.
+  """
+  dat = bytes(dat)
+  out = np.empty(len(dat) // 6, dtype=CAN_MESSAGE_DTYPE)
+  consumed = ctypes.c_int()
+  cnt = _can_library().panda_can_unpack(dat, len(dat), timestamps, out.ctypes.data, len(out), ctypes.byref(consumed))
+  assert cnt >= 0, "CAN packet checksum incorrect"
+  return out[:cnt], dat[consumed.value:]
+
+
+def pack_can_records(records, chunk_size=0, tx_timestamps=False):
+  """
+  Packs a CAN_MESSAGE_DTYPE array for the CAN bulk OUT endpoint, timestamp is the target
+  to send at with tx_timestamps. With a chunk_size, a new buffer is started once one is
+  over that many bytes.
+  """
+  records = np.ascontiguousarray(records, dtype=CAN_MESSAGE_DTYPE)
+  out = np.empty(len(records) * CANPACKET_SIZE_MAX, dtype=np.uint8)
+  ends = np.empty(len(records) + 1, dtype=np.intc)
+  chunk_cnt = ctypes.c_int()
+  _can_library().panda_can_pack(records.ctypes.data, len(records), tx_timestamps, chunk_size, out.ctypes.data, ends.ctypes.data, ctypes.byref(chunk_cnt))
+  ends = ends[:chunk_cnt.value].tolist()
+  return [bytearray(out[s:e]) for s, e in zip([0, *ends[:-1]], ends, strict=True)]
+
+
+def can_records_to_tuples(records, timestamps=False):
+  """The (address, data, bus[, timestamp]) tuples of unpack_can_buffer"""
+  flags = records["flags"]
+  bus = records["bus"].astype(np.int32) + 128 * ((flags & CAN_FLAG_RETURNED) != 0) + 192 * ((flags & CAN_FLAG_REJECTED) != 0)
+  raw = records["data"].tobytes()
+  data = [raw[j * 64:j * 64 + n] for j, n in enumerate(DLC_TO_LEN[records["dlc"]].tolist())]
+  if timestamps:
+    return list(zip(records["addr"].tolist(), data, bus.tolist(), records["timestamp"].tolist(), strict=True))
+  return list(zip(records["addr"].tolist(), data, bus.tolist(), strict=True))
+
+
+def can_records_from_tuples(arr, fd=False):
+  """CAN_MESSAGE_DTYPE array of the (address, data, bus[, target]) messages of pack_can_buffer"""
+  records = np.zeros(len(arr), dtype=CAN_MESSAGE_DTYPE)
+  if len(arr) == 0:
+    return records
+  addr = np.fromiter((m[0] for m in arr), dtype=np.uint32, count=len(arr))
+  lens = np.fromiter((len(m[1]) for m in arr), dtype=np.intp, count=len(arr))
+  dlc = LEN_TO_DLC[lens]
+  if np.any(dlc == 0xFF):
+    raise KeyError("invalid CAN data length")
+  records["addr"] = addr
+  records["timestamp"] = np.fromiter(((m[3] if len(m) > 3 else 0) for m in arr), dtype=np.uint32, count=len(arr))
+  records["bus"] = np.fromiter((m[2] for m in arr), dtype=np.uint8, count=len(arr))
+  records["flags"] = np.where(addr >= 0x800, CAN_FLAG_EXTENDED, 0) | (CAN_FLAG_FD if fd else 0)
+  records["dlc"] = dlc
+
+  # scatter the data of all messages at once
+  flat = np.frombuffer(b"".join(bytes(m[1]) for m in arr), dtype=np.uint8)
+  rows = np.repeat(np.arange(len(arr)), lens)
+  cols = np.arange(len(flat)) - np.repeat(np.cumsum(lens) - lens, lens)
+  records["data"][rows, cols] = flat
+  return records
+
+
+class PandaNativeHandle(BaseHandle):
+  def __init__(self, lib, handle):
+    self._lib = lib
+    self._h = handle
+    self._can_rx_started = False
+    self._can_rx_buf = np.empty(CAN_RECV_BATCH, dtype=CAN_MESSAGE_DTYPE)
+
+  @classmethod
+  def open(cls, serial, claim=True):
+    """Returns (handle, serial, bootstub), or None if there's no native library or matching panda"""
+    lib = load_library()
+    if lib is None:
+      return None
+    h = lib.panda_host_new()
+    if lib.panda_host_open(h, serial.encode() if serial is not None else None, claim) < 0:
+      lib.panda_host_free(h)
+      return None
+    buf = ctypes.create_string_buffer(64)
+    lib.panda_host_serial(h, buf, len(buf))
+    return cls(lib, h), buf.value.decode(), (lib.panda_host_product_id(h) & 0xF0) == 0xe0
+
+  def close(self):
+    if self._h is not None:
+      self._lib.panda_host_free(self._h)
+      self._h = None
+
+  def controlWrite(self, request_type: int, request: int, value: int, index: int, data, timeout: int = TIMEOUT, expect_disconnect: bool = False):
+    data = bytes(data)
+    return _check(self._lib.panda_host_control_write(self._h, request_type, request, value, index, data, len(data), timeout))
+
+  def controlRead(self, request_type: int, request: int, value: int, index: int, length: int, timeout: int = TIMEOUT) -> bytes:
+    buf = ctypes.create_string_buffer(length)
+    ret = _check(self._lib.panda_host_control_read(self._h, request_type, request, value, index, buf, length, timeout))
+    return buf.raw[:ret]
+
+  def bulkWrite(self, endpoint: int, data: bytes, timeout: int = TIMEOUT) -> int:
+    data = bytes(data)
+    return _check(self._lib.panda_host_bulk_write(self._h, endpoint, data, len(data), timeout))
+
+  def bulkRead(self, endpoint: int, length: int, timeout: int = TIMEOUT) -> bytes:
+    buf = ctypes.create_string_buffer(length)
+    ret = _check(self._lib.panda_host_bulk_read(self._h, endpoint, buf, length, timeout))
+    return buf.raw[:ret]
+
+  def interruptRead(self, endpoint: int, length: int, timeout: int = TIMEOUT) -> bytes:
+    buf = ctypes.create_string_buffer(length)
+    ret = _check(self._lib.panda_host_interrupt_read(self._h, endpoint, buf, length, timeout))
+    return buf.raw[:ret]
+
+  def setInterfaceAltSetting(self, interface: int, alt_setting: int) -> None:
+    _check(self._lib.panda_host_set_interface_alt_setting(self._h, interface, alt_setting))
+
+  def can_recv_records(self, timestamps: bool = False):
+    """Messages received by the transfer pool, it's started on the first call and the CAN endpoint can't be bulkRead after"""
+    if not self._can_rx_started:
+      self._lib.panda_host_can_rx_reset(self._h, timestamps)
+      _check(self._lib.panda_host_can_rx_start(self._h, CAN_RX_TRANSFER_CNT))
+      self._can_rx_started = True
+    ret = self._lib.panda_host_can_recv(self._h, self._can_rx_buf.ctypes.data, CAN_RECV_BATCH, CAN_RECV_WAIT_MS)
+    if ret == CAN_RX_ERROR_DESYNC:
+      # nothing is decoded anymore until can_rx_reset
+      raise CanRxDesyncError(f"CAN packet checksum incorrect, {self.can_rx_stats()[1]} so far")
+    cnt = _check(ret)
+    return self._can_rx_buf[:cnt].copy()
+
+  def can_recv(self, timestamps: bool = False):
+    return can_records_to_tuples(self.can_recv_records(timestamps), timestamps)
+
+  def can_rx_reset(self, timestamps: bool = False):
+    self._lib.panda_host_can_rx_reset(self._h, timestamps)
+
+  def can_rx_stats(self):
+    """Messages dropped with a full ring, checksum errors, failed transfers"""
+    stats = [ctypes.c_uint64() for _ in range(3)]
+    self._lib.panda_host_can_rx_stats(self._h, *[ctypes.byref(s) for s in stats])
+    return tuple(s.value for s in stats)
+
+
+class CanParser:
+  """The streaming parser of the transfer pool, same results as unpack_can_buffer"""
+  def __init__(self, timestamps=False):
+    self._lib = _can_library()
+    self._timestamps = timestamps
+    self._p = self._lib.panda_can_parser_new(timestamps)
+    self._buf = np.empty(CAN_RECV_BATCH, dtype=CAN_MESSAGE_DTYPE)
+
+  def __del__(self):
+    if getattr(self, "_p", None) is not None:
+      self._lib.panda_can_parser_free(self._p)
+
+  def feed(self, dat):
+    dat = bytes(dat)
+    cnt = self._lib.panda_can_parser_feed(self._p, dat, len(dat), self._buf.ctypes.data, CAN_RECV_BATCH)
+    assert cnt >= 0, "CAN packet checksum incorrect"
+    return can_records_to_tuples(self._buf[:cnt], self._timestamps)
@@ -0,0 +1,184 @@
+import atexit
+import os
+import socket
+import struct
+import subprocess
+import threading
+import time
+
+import usb1
+
+from .base import BaseHandle, TIMEOUT
+from .constants import BASEDIR
+from .native import _check
+from .utils import logger
+
+# The virtual panda, see tests/sim/sim.h: the firmware's comms stack on a fake FDCAN backend, served
+# on a Unix socket. Panda(SIM_SERIAL) connects to it, and starts it when it isn't running yet.
+SIM_PATH = os.path.join(BASEDIR, "tests/sim/panda_sim")
+SIM_SOCKET = os.getenv("PANDA_SIM_SOCKET", "/tmp/panda_sim.sock")
+SIM_SERIAL = "sim"
+SIM_START_TIMEOUT = 5.0
+
+# requests, sim_request_t and the other structs in tests/sim/sim.h
+SIM_CONTROL_READ = 0
+SIM_CONTROL_WRITE = 1
+SIM_BULK_READ = 2
+SIM_BULK_WRITE = 3
+SIM_TRAFFIC = 4
+SIM_TRAFFIC_CLEAR = 5
+SIM_STATS = 6
+SIM_REQUEST = struct.Struct("<BBHHII")
+SIM_RESPONSE = struct.Struct("<i")
+SIM_TRAFFIC_STRUCT = struct.Struct("<BBBxIII64s")
+SIM_STATS_STRUCT = struct.Struct("<9I")
+SIM_TRAFFIC_FLAG_EXTENDED = 0x1
+SIM_TRAFFIC_FLAG_FD = 0x2
+SIM_TRAFFIC_FLAG_BRS = 0x4
+SIM_TRAFFIC_FLAG_COUNTER = 0x8
+
+DLC_TO_LEN = [0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64]
+
+
+class PandaSim:
+  """A panda_sim process, stopped on stop() or at the end of a with block"""
+  def __init__(self, path: str = SIM_SOCKET, binary: str = SIM_PATH):
+    self.path = path
+    self.binary = binary
+    self._proc: subprocess.Popen | None = None
+
+  def __enter__(self):
+    self.start()
+    return self
+
+  def __exit__(self, *args):
+    self.stop()
+
+  def start(self) -> None:
+    if not os.path.isfile(self.binary):
+      raise FileNotFoundError(f"{self.binary} not found, build it with scons")
+    if os.path.exists(self.path):
+      os.unlink(self.path)
+    self._proc = subprocess.Popen([self.binary, self.path], stdout=subprocess.DEVNULL)
+    atexit.register(self.stop)
+    start = time.monotonic()
+    while not self._listening():
+      if self._proc.poll() is not None or (time.monotonic() - start) > SIM_START_TIMEOUT:
+        self.stop()
+        raise RuntimeError(f"{self.binary} didn't start")
+      time.sleep(0.01)
+
+  def _listening(self) -> bool:
+    # the path is there from bind(), connections are refused until listen()
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+      try:
+        sock.connect(self.path)
+      except OSError:
+        return False
+    return True
+
+  def stop(self) -> None:
+    if self._proc is not None:
+      atexit.unregister(self.stop)
+      self._proc.terminate()
+      self._proc.wait()
+      self._proc = None
+
+  def connect(self) -> "PandaSimHandle":
+    return PandaSimHandle(self.path)
+
+
+class PandaSimHandle(BaseHandle):
+  """
+    Talks to the virtual panda like to a USB one. Other connections to the same sim can drive the
+    buses with add_traffic(), like the car would.
+  """
+  def __init__(self, path: str = SIM_SOCKET):
+    self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+      self._sock.connect(path)
+    except OSError:
+      self._sock.close()
+      raise
+    self._lock = threading.Lock()
+    self._sim: PandaSim | None = None
+
+  @classmethod
+  def open(cls, path: str | None = None):
+    """Returns a handle to the sim on path, started here if there's no socket"""
+    path = SIM_SOCKET if path is None else path
+    # a sim that's resetting has its socket back up in a moment
+    if os.path.exists(path):
+      return cls(path)
+
+    sim = PandaSim(path)
+    sim.start()
+    handle = cls(path)
+    handle._sim = sim
+    return handle
+
+  def close(self):
+    self._sock.close()
+    # the sim is reset along with its owner's connection
+    if self._sim is not None:
+      self._sim.stop()
+      self._sim = None
+
+  def _recv(self, length: int) -> bytes:
+    dat = self._sock.recv(length, socket.MSG_WAITALL) if length > 0 else b''
+    if len(dat) != length:
+      raise usb1.USBErrorNoDevice(usb1.libusb1.LIBUSB_ERROR_NO_DEVICE)
+    return dat
+
+  def _request(self, kind: int, request: int, value: int, index: int, length: int, data: bytes = b'', timeout: int = 0, read: bool = False):
+    with self._lock:
+      try:
+        self._sock.sendall(SIM_REQUEST.pack(kind, request, value, index, length, timeout) + data)
+        ret = SIM_RESPONSE.unpack(self._recv(SIM_RESPONSE.size))[0]
+        return _check(ret), (self._recv(ret) if read else b'')
+      except OSError as e:
+        raise usb1.USBErrorNoDevice(usb1.libusb1.LIBUSB_ERROR_NO_DEVICE) from e
+
+  def controlWrite(self, request_type: int, request: int, value: int, index: int, data, timeout: int = TIMEOUT, expect_disconnect: bool = False):
+    data = bytes(data)
+    try:
+      return self._request(SIM_CONTROL_WRITE, request, value, index, len(data), data)[0]
+    except usb1.USBErrorNoDevice:
+      if not expect_disconnect:
+        raise
+      logger.debug("sim disconnected as expected")
+      return 0
+
+  def controlRead(self, request_type: int, request: int, value: int, index: int, length: int, timeout: int = TIMEOUT) -> bytes:
+    return self._request(SIM_CONTROL_READ, request, value, index, length, read=True)[1]
+
+  def bulkWrite(self, endpoint: int, data: bytes, timeout: int = TIMEOUT) -> int:
+    data = bytes(data)
+    return self._request(SIM_BULK_WRITE, endpoint, 0, 0, len(data), data, timeout=timeout)[0]
+
+  def bulkRead(self, endpoint: int, length: int, timeout: int = TIMEOUT) -> bytes:
+    return self._request(SIM_BULK_READ, endpoint, 0, 0, length, read=True)[1]
+
+  # **** bus traffic ****
+
+  def add_traffic(self, bus: int, addr: int, dat: bytes, period_us: int, count: int = 0, fd: bool = False, brs: bool = False,
+                  counter: bool = True, extended: bool | None = None) -> int:
+    """
+      Receives addr on bus every period_us, count times or until clear_traffic(). With counter,
+      the first up to 4 data bytes are a little endian frame counter. Returns the generator's index.
+    """
+    dlc = DLC_TO_LEN.index(len(dat))
+    extended = (addr >= 0x800) if extended is None else extended
+    flags = (SIM_TRAFFIC_FLAG_EXTENDED if extended else 0) | (SIM_TRAFFIC_FLAG_FD if fd else 0) | \
+            (SIM_TRAFFIC_FLAG_BRS if brs else 0) | (SIM_TRAFFIC_FLAG_COUNTER if counter else 0)
+    cfg = SIM_TRAFFIC_STRUCT.pack(bus, dlc, flags, addr, period_us, count, dat)
+    return self._request(SIM_TRAFFIC, 0, 0, 0, len(cfg), cfg)[0]
+
+  def clear_traffic(self) -> None:
+    self._request(SIM_TRAFFIC_CLEAR, 0, 0, 0, 0)
+
+  def stats(self) -> dict[str, list[int]]:
+    """Frames received from the traffic and sent on each bus, and the bus load of the last second in per mille"""
+    dat = self._request(SIM_STATS, 0, 0, 0, SIM_STATS_STRUCT.size, read=True)[1]
+    a = SIM_STATS_STRUCT.unpack(dat)
+    return {"rx_cnt": list(a[0:3]), "tx_cnt": list(a[3:6]), "bus_load": list(a[6:9])}
@@ -0,0 +1,133 @@
+import time
+from collections import deque
+
+from .clock_sync import TIMER_WRAP, fit_line, unwrap_timer
+
+FRAME_WRAP = 2**11  # SOF frame numbers are 11 bits
+FRAME_S = 1e-3  # full speed frames
+
+SOF_SYNC_HOST_WINDOW = 64  # host frame samples the host model is fit over
+SOF_SYNC_DEVICE_WINDOW = 256  # latches the device model is fit over
+SOF_SYNC_OUTLIER_US = 50  # latches further than this off the first fit are left out, e.g. the ISR was held off
+
+
+def unwrap_frame(frame, ref_frame, elapsed_frames):
+  """Unwraps an 11 bit frame number against an unwrapped one, the number of wraps in between comes from the elapsed time"""
+  d = (frame - ref_frame) % FRAME_WRAP
+  return ref_frame + d + FRAME_WRAP * round((elapsed_frames - d) / FRAME_WRAP)
+
+
+class SofSync:
+  """
+  Maps the panda's microsecond timer to host time through the USB frames, both ends see the same SOF.
+
+  The panda latches its timer at every SOF for a while after Panda.get_usb_sof_latches asks for them.
+  host_frame() gives (frame number, host time at the start of that frame) from the host controller,
+  libusb has no call for it so it comes from the platform, e.g. WinUsb_GetCurrentFrameNumber or
+  IOUSBDevice::GetBusFrameNumberWithTime. Both are fit against one unwrapped frame count, a line
+  per clock, and a timer value goes through frames to host time. Unlike ClockSync there's no round trip
+  in there, what's left is the SOF interrupt latency and how well the host knows its frame times.
+
+  Both the frame numbers and the timer wrap, they are unwrapped against the last sample so the gaps
+  between samples have to be shorter than half a timer wrap (35 minutes).
+  """
+  def __init__(self, read_latches, host_frame, clock=time.monotonic,
+               host_window=SOF_SYNC_HOST_WINDOW, device_window=SOF_SYNC_DEVICE_WINDOW):
+    self._read_latches = read_latches
+    self._host_frame = host_frame
+    self._clock = clock
+    self._host = deque(maxlen=host_window)  # (unwrapped frame, host time)
+    self._device = deque(maxlen=device_window)  # (unwrapped frame, unwrapped timer us)
+    self._host_model = None
+    self._device_model = None
+
+  def sample(self):
+    """Reads a host frame and the panda's latest latches, then updates the models"""
+    self.add_host_frame(*self._host_frame())
+    latches = self._read_latches()
+    self.add_device_latches(latches, self._clock())
+
+  def add_host_frame(self, frame, host_time):
+    if len(self._host) == 0:
+      unwrapped = frame % FRAME_WRAP
+    else:
+      ref_frame, ref_time = self._host[-1]
+      unwrapped = unwrap_frame(frame, ref_frame, (host_time - ref_time) / FRAME_S)
+    self._host.append((unwrapped, host_time))
+
+    ref = self._host[-1][0]
+    self._host_model = (ref, ) + fit_line([f - ref for f, _ in self._host], [t for _, t in self._host], FRAME_S)
+
+  def add_device_latches(self, latches, read_time):
+    """
+    Adds (frame number, timer us) latches, oldest first, as returned by Panda.get_usb_sof_latches.
+    read_time is a host time shortly after the read, it picks the frame wrap of the first latches.
+    """
+    if len(latches) == 0:
+      return
+    if self._host_model is None:
+      raise RuntimeError("SOF sync needs a host frame first, call add_host_frame()")
+
+    if len(self._device) > 0:
+      ref_frame, ref_us = self._device[-1]
+      last_frame = ref_frame
+    else:
+      # the newest latch is from the last frame or so before the read
+      frame, ref_us = latches[-1]
+      ref, intercept, slope = self._host_model[:3]
+      ref_frame = unwrap_frame(frame, ref, (read_time - intercept) / slope - 1)
+      last_frame = None
+
+    for frame, us in latches:
+      us = unwrap_timer(us, ref_us)
+      unwrapped = unwrap_frame(frame, ref_frame, (us - ref_us) / (FRAME_S * 1e6))
+      # consecutive reads return some of the same latches
+      if last_frame is None or unwrapped > last_frame:
+        self._device.append((unwrapped, us))
+        ref_frame, ref_us, last_frame = unwrapped, us, unwrapped
+
+    self._fit_device()
+
+  def _fit_device(self):
+    ref = self._device[-1][0]
+    xs = [f - ref for f, _ in self._device]
+    ys = [us for _, us in self._device]
+    model = fit_line(xs, ys, FRAME_S * 1e6)
+    intercept, slope = model[:2]
+    kept = [(x, y) for x, y in zip(xs, ys, strict=True) if abs(y - (intercept + slope * x)) <= SOF_SYNC_OUTLIER_US]
+    if 0 < len(kept) < len(xs):
+      model = fit_line([x for x, _ in kept], [y for _, y in kept], FRAME_S * 1e6)
+    self._device_model = (ref, ) + model
+
+  @property
+  def synced(self):
+    return self._host_model is not None and self._device_model is not None
+
+  def _get_models(self):
+    if not self.synced:
+      raise RuntimeError("SOF sync has no latches yet, call sample()")
+    return self._host_model, self._device_model
+
+  @property
+  def drift_ppm(self):
+    """How much faster the panda's timer runs than the host clock"""
+    host, device = self._get_models()
+    return (device[2] * 1e-6 / host[2] - 1) * 1e6
+
+  def to_host(self, timer_us):
+    """Returns (host time, error bound) in seconds of a panda microsecond timer value"""
+    (h_ref, h_intercept, h_slope, h_res, h_slope_err, h_x_mean), \
+      (d_ref, d_intercept, d_slope, d_res, d_slope_err, d_x_mean) = self._get_models()
+
+    us = unwrap_timer(timer_us, self._device[-1][1])
+    frame = d_ref + (us - d_intercept) / d_slope
+    x = frame - h_ref
+    d_err = (d_res + d_slope_err * abs(frame - d_ref - d_x_mean)) / d_slope
+    h_err = h_res + h_slope_err * abs(x - h_x_mean)
+    return h_intercept + h_slope * x, h_err + d_err * h_slope
+
+  def to_timer(self, host_time):
+    """The panda microsecond timer value at a host time, as used by Panda.can_send_at"""
+    (h_ref, h_intercept, h_slope, _, _, _), (d_ref, d_intercept, d_slope, _, _, _) = self._get_models()
+    frame = h_ref + (host_time - h_intercept) / h_slope
+    return round(d_intercept + d_slope * (frame - d_ref)) % TIMER_WRAP
@@ -1,4 +1,5 @@
 import binascii
+import ctypes
 import os
 import math
 import time
@@ -9,6 +10,7 @@ from functools import reduce
 
 from .base import BaseHandle, BaseSTBootloaderHandle, TIMEOUT
 from .constants import McuType, MCU_TYPE_BY_IDCODE, USBPACKET_MAX_SIZE
+from .native import load_spi_library
 from .utils import logger
 
 # No fcntl on Windows
@@ -36,6 +38,13 @@ MAX_XFER_RETRY_COUNT = 5
 SPI_BUF_SIZE = 4096  # from panda/board/drivers/spi.h
 XFER_SIZE = SPI_BUF_SIZE - 0x40 # give some room for SPI protocol overhead
 
+# CAN exchange, CAN packets both ways in one full-duplex transfer after the header ACK
+XCHG_ENDPOINT = 5
+XCHG_HEADER = struct.Struct("<BBH")  # DACK, status, RX length
+XCHG_PREREAD = USBPACKET_MAX_SIZE  # RX data read along with the response header, the rest is read after
+XCHG_STATUS_TX_ACCEPTED = 0x1
+XCHG_STATUS_LAST_TX_DROPPED = 0x2
+
 DEV_PATH = "/dev/spidev0.0"
 
 
@@ -74,6 +83,59 @@ class PandaSpiBadChecksum(PandaSpiException):
 class PandaSpiTransferFailed(PandaSpiException):
   pass
 
+# error returns of host/panda_spi.h
+NATIVE_ERRORS = {
+  -1: PandaSpiNackResponse,
+  -2: PandaSpiMissingAck,
+  -3: PandaSpiBadChecksum,
+  -4: PandaSpiException,
+  -5: PandaSpiTransferFailed,
+}
+
+
+class NativeSpi:
+  """
+  One try of a transfer or CAN exchange in host/libpanda_spi.so, ACK polls and checksums included.
+  The GIL is released while it runs. xfer is the SPI_IOC_MESSAGE ioctl on fd, or a function
+  standing in for it as int(ctx, struct spi_ioc_transfer *, count).
+  """
+  def __init__(self, lib, fd=None, xfer=None):
+    self._lib = lib
+    self._xfer = xfer  # the function pointer has to outlive the handle
+    self._with_xfer = xfer is not None
+    self._h = lib.panda_spi_new(fd) if xfer is None else lib.panda_spi_new_with_xfer(ctypes.cast(xfer, ctypes.c_void_p), None)
+    self._rx = ctypes.create_string_buffer(SPI_BUF_SIZE)
+    self._status = ctypes.c_uint8()
+
+  def close(self):
+    if self._h is not None:
+      self._lib.panda_spi_free(self._h)
+      self._h = None
+    self._xfer = None
+
+  def __del__(self):
+    # only a fallback for handles that weren't closed, at teardown the xfer callback may be gone already
+    if (getattr(self, "_h", None) is not None) and (self._xfer is not None or not self._with_xfer):
+      self.close()
+
+  def _check(self, ret):
+    if ret < 0:
+      raise NATIVE_ERRORS.get(ret, PandaSpiException)()
+    return ret
+
+  def transfer(self, endpoint: int, data, timeout: int, max_rx_len: int, expect_disconnect: bool) -> bytes:
+    data = bytes(data)
+    max_rx_len = max(USBPACKET_MAX_SIZE, max_rx_len)
+    if len(self._rx) < max_rx_len:
+      self._rx = ctypes.create_string_buffer(max_rx_len)
+    n = self._check(self._lib.panda_spi_transfer(self._h, endpoint, data, len(data), self._rx, max_rx_len, timeout, expect_disconnect))
+    return self._rx.raw[:n]
+
+  def exchange(self, data) -> tuple[int, bytes]:
+    data = bytes(data)
+    n = self._check(self._lib.panda_spi_exchange(self._h, data, len(data), self._rx, ctypes.byref(self._status)))
+    return self._status.value, self._rx.raw[:n]
+
 
 SPI_LOCK = threading.Lock()
 SPI_DEVICES = {}
@@ -109,6 +171,11 @@ class SpiDevice:
       fcntl.flock(self._spidev, fcntl.LOCK_UN)
       SPI_LOCK.release()
 
+  def native(self):
+    """The native transfers on this device, None without host/libpanda_spi.so"""
+    lib = load_spi_library()
+    return None if lib is None else NativeSpi(lib, fd=self._spidev.fileno())
+
   def close(self):
     pass
 
@@ -118,12 +185,16 @@ class PandaSpiHandle(BaseHandle):
   A class that mimics a libusb1 handle for panda SPI communications.
   """
 
-  PROTOCOL_VERSION = 2
+  PROTOCOL_VERSION = 3
   HEADER = struct.Struct("<BBHH")
 
   def __init__(self) -> None:
     self.dev = SpiDevice()
+    self.native = self.dev.native()
     self.no_retry = "NO_RETRY" in os.environ
+    self._can_rx = b""  # received by CAN exchanges that were for sending
+    self._can_tx_accepted = b""  # data of the last accepted exchange, until it's known to be written
+    self._can_tx_resend = None
 
   # helpers
   def _calc_checksum(self, data: bytes) -> int:
@@ -184,10 +255,48 @@ class PandaSpiHandle(BaseHandle):
 
       return dat[3:-1]
 
+  def _exchange_spidev(self, spi, data) -> tuple[int, bytes]:
+    logger.debug("- send exchange header")
+    packet = self.HEADER.pack(SYNC, XCHG_ENDPOINT, len(data), XFER_SIZE)
+    packet += bytes([self._calc_checksum(packet), ])
+    spi.xfer2(packet)
+
+    # the poll that gets the HACK is the first byte of the panda's data DMA
+    logger.debug("- waiting for exchange HACK")
+    self._wait_for_ack(spi, HACK, MIN_ACK_TIMEOUT_MS, 0x11)
+
+    # the panda staged its response before the header came in, it comes back with the data
+    logger.debug("- exchanging data")
+    packet = bytes([*data, self._calc_checksum(data)])
+    length = max(len(packet), XCHG_HEADER.size + XCHG_PREREAD + 1)
+    dat = bytes(spi.xfer2(packet + bytes(length - len(packet))))
+    if dat[0] == NACK:
+      raise PandaSpiNackResponse
+    elif dat[0] != DACK:
+      raise PandaSpiMissingAck
+
+    _, status, response_len = XCHG_HEADER.unpack(dat[:XCHG_HEADER.size])
+    if response_len > XFER_SIZE:
+      raise PandaSpiException(f"response length greater than max ({XFER_SIZE} {response_len})")
+
+    remaining = (XCHG_HEADER.size + response_len + 1) - len(dat)
+    if remaining > 0:
+      dat += bytes(spi.readbytes(remaining))
+
+    dat = dat[:XCHG_HEADER.size + response_len + 1]
+    if self._calc_checksum(dat) != 0:
+      raise PandaSpiBadChecksum
+
+    return status, dat[XCHG_HEADER.size:-1]
+
   def _transfer(self, endpoint: int, data, timeout: int, max_rx_len: int = 1000, expect_disconnect: bool = False) -> bytes:
     logger.debug("starting transfer: endpoint=%d, max_rx_len=%d", endpoint, max_rx_len)
     logger.debug("==============================================")
+    if self.native is not None:
+      return self._retry(lambda _: self.native.transfer(endpoint, data, timeout, max_rx_len, expect_disconnect), timeout)
+    return self._retry(lambda spi: self._transfer_spidev(spi, endpoint, data, timeout, max_rx_len, expect_disconnect), timeout)
 
+  def _retry(self, transfer, timeout: int):
     n = 0
     start_time = time.monotonic()
     exc = PandaSpiException()
@@ -196,7 +305,7 @@ class PandaSpiHandle(BaseHandle):
       logger.debug("\ntry #%d", n)
       with self.dev.acquire() as spi:
         try:
-          return self._transfer_spidev(spi, endpoint, data, timeout, max_rx_len, expect_disconnect)
+          return transfer(spi)
         except PandaSpiException as e:
           exc = e
           logger.debug("SPI transfer failed, retrying", exc_info=True)
@@ -255,27 +364,79 @@ class PandaSpiHandle(BaseHandle):
 
   # libusb1 functions
   def close(self):
+    if self.native is not None:
+      self.native.close()
     self.dev.close()
 
   def controlWrite(self, request_type: int, request: int, value: int, index: int, data, timeout: int = TIMEOUT, expect_disconnect: bool = False):
+    if request == 0xc0:
+      # CAN communications reset, the panda drops what it staged for the next exchange too
+      self._can_rx = b""
+      self._can_tx_resend = None
     return self._transfer(0, struct.pack("<BHHH", request, value, index, 0), timeout, expect_disconnect=expect_disconnect)
 
   def controlRead(self, request_type: int, request: int, value: int, index: int, length: int, timeout: int = TIMEOUT):
     return self._transfer(0, struct.pack("<BHHH", request, value, index, length), timeout, max_rx_len=length)
 
+  def can_exchange(self, data=b"", timeout: int = TIMEOUT) -> tuple[bytes, bool]:
+    """
+    Sends up to XFER_SIZE bytes of CAN packets and receives the queued ones in the same transfer.
+    Returns (received data, whether the sent data was taken), it isn't when the panda's TX queues are full.
+    """
+    logger.debug("starting CAN exchange: tx=%d", len(data))
+    if self.native is not None:
+      status, rx = self._retry(lambda _: self.native.exchange(data), timeout)
+    else:
+      status, rx = self._retry(lambda spi: self._exchange_spidev(spi, data), timeout)
+    if status & XCHG_STATUS_LAST_TX_DROPPED:
+      # the data arrived corrupted, the panda takes nothing until it's sent again
+      self._can_tx_resend = self._can_tx_accepted
+    if status & XCHG_STATUS_TX_ACCEPTED:
+      self._can_tx_accepted = bytes(data)
+    return rx, bool(status & XCHG_STATUS_TX_ACCEPTED)
+
+  def _can_exchange_send(self, data, timeout: int) -> None:
+    start_time = time.monotonic()
+    while True:
+      resend = self._can_tx_resend is not None
+      rx, accepted = self.can_exchange(self._can_tx_resend if resend else data, timeout)
+      self._can_rx += rx
+      if accepted and resend:
+        self._can_tx_resend = None
+      elif (accepted or len(data) == 0) and self._can_tx_resend is None:
+        return
+
+      if (timeout != 0) and (time.monotonic() - start_time) > timeout*1e-3:
+        raise PandaSpiNackResponse("CAN TX queues full")
+
   def bulkWrite(self, endpoint: int, data: bytes, timeout: int = TIMEOUT) -> int:
     mv = memoryview(data)
     for x in range(math.ceil(len(data) / XFER_SIZE)):
-      self._transfer(endpoint, mv[XFER_SIZE*x:XFER_SIZE*(x+1)], timeout)
+      if endpoint == 3:
+        self._can_exchange_send(mv[XFER_SIZE*x:XFER_SIZE*(x+1)], timeout)
+      else:
+        self._transfer(endpoint, mv[XFER_SIZE*x:XFER_SIZE*(x+1)], timeout)
     return len(data)
 
   def bulkRead(self, endpoint: int, length: int, timeout: int = TIMEOUT) -> bytes:
-    ret = b""
+    if endpoint == 1:
+      # CAN data received while sending comes first, the whole of it
+      ret, self._can_rx = self._can_rx, b""
+    else:
+      ret = b""
+
     for _ in range(math.ceil(length / XFER_SIZE)):
-      d = self._transfer(endpoint, [], timeout, max_rx_len=XFER_SIZE)
+      if endpoint == 1:
+        d, _ = self.can_exchange(b"", timeout)
+      else:
+        d = self._transfer(endpoint, [], timeout, max_rx_len=XFER_SIZE)
       ret += d
       if len(d) < XFER_SIZE:
         break
+
+    if endpoint == 1 and self._can_tx_resend is not None:
+      self._can_exchange_send(b"", timeout)
+      ret, self._can_rx = ret + self._can_rx, b""
     return ret
 
 
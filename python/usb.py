@@ -22,6 +22,12 @@ class PandaUsbHandle(BaseHandle):
   def bulkRead(self, endpoint: int, length: int, timeout: int = TIMEOUT) -> bytes:
     return self._libusb_handle.bulkRead(endpoint, length, timeout)  # type: ignore
 
+  def interruptRead(self, endpoint: int, length: int, timeout: int = TIMEOUT) -> bytes:
+    return self._libusb_handle.interruptRead(endpoint, length, timeout)  # type: ignore
+
+  def setInterfaceAltSetting(self, interface: int, alt_setting: int) -> None:
+    self._libusb_handle.setInterfaceAltSetting(interface, alt_setting)
+
 
 
 class STBootloaderUSBHandle(BaseSTBootloaderHandle):
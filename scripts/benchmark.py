@@ -5,8 +5,10 @@ import time
 import pstats
 import cProfile
 from contextlib import contextmanager
+from unittest.mock import patch
 
-from panda import Panda, PandaDFU
+from panda import Panda, PandaDFU, pack_can_buffer, unpack_can_buffer
+from panda.python.native import load_can_library
 from panda.tests.hitl.helpers import get_random_can_messages
 
 
@@ -29,7 +31,32 @@ def print_time(desc):
     print(s.getvalue())
 
 
+def benchmark_can_buffer():
+  impls = [("python", patch("panda.python.load_can_library", return_value=None))]
+  if load_can_library() is not None:
+    impls.append(("native", patch("panda.python.load_can_library", load_can_library)))
+
+  for n in range(2, 7):
+    msgs = get_random_can_messages(int(10**n))
+    for name, impl in impls:
+      with impl:
+        start = time.perf_counter()
+        dat = b"".join(pack_can_buffer(msgs))
+        packed = time.perf_counter()
+        # in bulk IN transfer sized pieces, like Panda.can_recv
+        unpacked, rest = [], b""
+        for i in range(0, len(dat), 16384):
+          m, rest = unpack_can_buffer(rest + dat[i:i + 16384])
+          unpacked += m
+        end = time.perf_counter()
+      assert len(unpacked) == len(msgs)
+      pack_rate, unpack_rate = len(msgs) / (packed - start), len(msgs) / (end - packed)
+      print(f"{name:>6} - {len(msgs):>7} msgs - pack_can_buffer() {pack_rate:>10.0f} msgs/s, unpack_can_buffer() {unpack_rate:>10.0f} msgs/s")
+
+
 if __name__ == "__main__":
+  benchmark_can_buffer()
+
   with print_time("Panda()"):
     p = Panda()
 
@@ -13,3 +13,7 @@ scons
 # *** lint + test ***
 ruff check .
 pytest
+
+# *** benchmarks ***
+# report-only until the gate holds across repeated runs of unchanged code on CI
+tests/benchmark/benchmark.sh --report
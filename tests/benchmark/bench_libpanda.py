@@ -0,0 +1,216 @@
+#!/usr/bin/env python3
+# Throughput of the firmware's CAN comms and checksum paths in libpanda, for pytest-benchmark.
+# Not collected by the regular test run, tests/benchmark/benchmark.sh runs these on the -O2 build
+# of libpanda and compares them against baseline.json.
+import random
+import statistics
+import time
+
+import pytest
+from opendbc.car.structs import CarParams
+
+from panda import pack_can_buffer
+from panda.python.spi import XFER_SIZE
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+TX_QUEUES = (lpp.tx1_q, lpp.tx2_q, lpp.tx3_q)
+FRAMES = 1200  # a third of them fit in each TX queue
+ROUNDS = 100
+WARMUP_ROUNDS = 2
+READ_CHUNKS = (64, 63, 1000)  # USB packets, and sizes that split frames between reads
+USB_EP1_XFER_MAX = 0x800  # board/drivers/usb.h
+RX_BURST = 400  # frames received in a round, fits in the RX rings
+RX_BATCH = 16  # frames in RX FIFO 0 per interrupt
+KERNEL_CALLS = 100  # calls of the checksum kernels in a round
+REFERENCE_CALLS = 200
+REFERENCE_LEN = 256
+PAYLOADS = {
+  "8": [8],
+  "64": [64],
+  "mixed": [8, 8, 8, 64],  # mostly classic CAN with some CAN FD
+}
+
+
+def can_messages(lengths):
+  rnd = random.Random(0)
+  return [(rnd.randint(1, 0x7FF), rnd.randbytes(rnd.choice(lengths)), i % 3) for i in range(FRAMES)]
+
+
+def drain_tx():
+  pkt = ffi.new("CANPacket_t *")
+  for q in TX_QUEUES:
+    while lpp.can_pop(q, pkt):
+      pass
+
+
+REFERENCE_BUF = ffi.from_buffer(random.Random(0).randbytes(REFERENCE_LEN))
+
+
+def time_reference():
+  # a fixed C loop behind cffi calls, like the benchmarks
+  start = time.perf_counter()
+  for _ in range(REFERENCE_CALLS):
+    lpp.bench_reference(REFERENCE_BUF, REFERENCE_LEN)
+  return time.perf_counter() - start
+
+
+def run(benchmark, fn, setup=None, rounds=ROUNDS):
+  # compare.py's yardstick is timed right before every round, so each round is measured against it
+  # under the same machine load. The median of those ratios is what's compared
+  references = []
+  ratios = []
+
+  def setup_round():
+    if setup is not None:
+      setup()
+    references.append(time_reference())
+
+  def timed():
+    start = time.perf_counter()
+    fn()
+    ratios.append((time.perf_counter() - start) / references[-1])
+
+  benchmark.pedantic(timed, setup=setup_round, rounds=rounds, warmup_rounds=WARMUP_ROUNDS)
+  benchmark.extra_info["reference"] = statistics.median(references[WARMUP_ROUNDS:])
+  benchmark.extra_info["relative"] = statistics.median(ratios[WARMUP_ROUNDS:])
+
+
+def run_kernel(benchmark, fn, *args):
+  def calls():
+    for _ in range(KERNEL_CALLS):
+      fn(*args)
+
+  benchmark.extra_info["calls"] = KERNEL_CALLS
+  run(benchmark, calls)
+
+
+@pytest.fixture(autouse=True)
+def comms():
+  lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+  lpp.comms_can_reset(0)
+  lpp.can_rx_clear()
+  drain_tx()
+  yield
+  lpp.can_rx_clear()
+  drain_tx()
+
+
+def test_can_push_pop(benchmark):
+  q = lpp.tx1_q
+  pkts = [libpanda_py.make_CANPacket(addr, 0, dat) for addr, dat, _ in can_messages([8])[:q.fifo_size - 1]]
+  pkt = ffi.new("CANPacket_t *")
+
+  def push_pop():
+    for p in pkts:
+      lpp.can_push(q, p)
+    while lpp.can_pop(q, pkt):
+      pass
+
+  benchmark.extra_info["frames"] = len(pkts)
+  run(benchmark, push_pop)
+
+
+@pytest.mark.parametrize("payload", PAYLOADS.keys())
+def test_comms_can_write(benchmark, payload):
+  # SPI sized writes, the USB endpoint takes 64 bytes at a time
+  buf = b"".join(pack_can_buffer(can_messages(PAYLOADS[payload])))
+  chunks = [ffi.from_buffer(buf[i:i + XFER_SIZE]) for i in range(0, len(buf), XFER_SIZE)]
+
+  def write():
+    for c in chunks:
+      lpp.comms_can_write(c, len(c))
+
+  benchmark.extra_info["frames"] = FRAMES
+  run(benchmark, write, setup=drain_tx)
+  assert sum(lpp.can_slots_empty(q) for q in TX_QUEUES) == sum(q.fifo_size - 1 for q in TX_QUEUES) - FRAMES
+
+
+@pytest.mark.parametrize("chunk", READ_CHUNKS)
+def test_comms_can_read(benchmark, chunk):
+  msgs = can_messages(PAYLOADS["mixed"])
+  pkts = [libpanda_py.make_CANPacket(addr, bus, dat) for addr, dat, bus in msgs]
+  dat = ffi.new(f"uint8_t[{chunk}]")
+  nbytes = sum(6 + len(m[1]) for m in msgs)
+
+  def fill():
+    for i, p in enumerate(pkts):
+      lpp.can_rx_push(i % 3, p, i)
+
+  def read():
+    total = 0
+    while (rx_len := lpp.comms_can_read(dat, chunk)) > 0:
+      total += rx_len
+    assert total == nbytes
+
+  benchmark.extra_info["frames"] = FRAMES
+  run(benchmark, read, setup=fill)
+
+
+def test_comms_can_read_one_bus(benchmark):
+  # a single busy bus, its frames are copied out of the ring in runs
+  pkts = [libpanda_py.make_CANPacket(addr, 0, dat) for addr, dat, _ in can_messages(PAYLOADS["mixed"])]
+  dat = ffi.new(f"uint8_t[{USB_EP1_XFER_MAX}]")
+
+  def fill():
+    for i, p in enumerate(pkts):
+      lpp.can_rx_push(0, p, i)
+
+  def read():
+    while lpp.comms_can_read(dat, USB_EP1_XFER_MAX) > 0:
+      pass
+
+  benchmark.extra_info["frames"] = FRAMES
+  run(benchmark, read, setup=fill)
+
+
+@pytest.mark.skipif(lpp.fdcan_emu_ram == ffi.NULL, reason="FDCAN message RAM address not available")
+@pytest.mark.parametrize("path", ("rx", "forward"))
+@pytest.mark.parametrize("length", (8, 64))
+def test_fdcan_rx(benchmark, length, path):
+  # can_rx() on the emulated cores, forwarding adds process_can() and the echoes of the TX events
+  forward = path == "forward"
+  lpp.can_silent = False
+  lpp.fdcan_emu_reset()
+  for i in range(3):
+    lpp.bus_config[i].forwarding_bus = 2 if (forward and i == 0) else -1
+    lpp.can_init(i)
+
+  frames = ffi.new(f"fdcan_emu_frame_t[{RX_BURST}]")
+  for i in range(RX_BURST):
+    frames[i] = libpanda_py.make_fdcan_frame(0x100 + (i % 0x100), bytes(length), fd=(length > 8), brs=(length > 8))[0]
+
+  def rx():
+    assert lpp.fdcan_emu_rx_burst(0, frames, RX_BURST, RX_BATCH) == (RX_BURST if forward else 0)
+
+  benchmark.extra_info["frames"] = RX_BURST
+  try:
+    run(benchmark, rx, setup=lpp.can_rx_clear, rounds=ROUNDS * 4)
+  finally:
+    lpp.fdcan_emu_deinit()
+    lpp.can_silent = True
+    for i in range(3):
+      lpp.bus_config[i].forwarding_bus = -1
+
+
+@pytest.mark.parametrize("length", (14, 70, XFER_SIZE))
+def test_calculate_checksum(benchmark, length):
+  # a classic CAN and a CAN FD packet, and a whole SPI transfer's worth
+  buf = ffi.from_buffer(random.Random(0).randbytes(length))
+  run_kernel(benchmark, lpp.calculate_checksum, buf, length)
+
+
+@pytest.mark.parametrize("length", (7, XFER_SIZE + 1))
+def test_spi_checksum(benchmark, length):
+  # the header, and the data of a full transfer with its checksum byte
+  buf = ffi.from_buffer(random.Random(0).randbytes(length))
+  run_kernel(benchmark, lpp.spi_validate_checksum, buf, length)
+
+
+@pytest.mark.parametrize("length", (64, 1024))
+def test_crc8_spi(benchmark, length):
+  # the CRC8 of the SPI control and bulk responses
+  buf = ffi.from_buffer(random.Random(0).randbytes(length))
+  run_kernel(benchmark, lpp.crc8_spi, buf, length)
@@ -0,0 +1,13 @@
+#!/usr/bin/env bash
+set -e
+
+# usage: benchmark.sh [compare.py options], --update takes a new baseline
+DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" >/dev/null && pwd)"
+cd $DIR
+
+TMP=$(mktemp -d)
+trap "rm -rf $TMP" EXIT
+
+# pytest-benchmark doesn't time anything with xdist. The -O2 build of libpanda, so it's the C code that's timed
+LIBPANDA=libpanda_bench.so pytest -n0 bench_libpanda.py --benchmark-json=$TMP/run.json --benchmark-storage=$TMP --benchmark-columns=min,median,rounds
+./compare.py $TMP/run.json "$@"
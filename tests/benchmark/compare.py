@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+# Compares a pytest-benchmark JSON with baseline.json, fails when a benchmark got slower than the threshold.
+# Every round of a benchmark is timed relative to a reference kernel run right before it, under the same
+# machine load, and the median of those is compared. So the gate holds on any machine, not just the one
+# the baseline was taken on, and one noisy sample doesn't move it.
+import argparse
+import json
+import os
+import statistics
+import sys
+
+BASELINE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "baseline.json")
+STAT = "min"  # the least noisy for these short CPU bound loops
+
+
+def machine(info):
+  return f"{info['cpu'].get('brand_raw', info['processor'])}, {info['python_implementation']} {info['python_version']}"
+
+
+def load_run(fn):
+  with open(fn) as f:
+    run = json.load(f)
+  benchmarks = {b["name"]: {"time": b["stats"][STAT], "relative": b["extra_info"]["relative"], "frames": b["extra_info"].get("frames")}
+                for b in run["benchmarks"]}
+  reference = statistics.median(b["extra_info"]["reference"] for b in run["benchmarks"])
+  return {"machine": machine(run["machine_info"]), "reference": reference, "benchmarks": benchmarks}
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser()
+  parser.add_argument("run", help="output of pytest --benchmark-json")
+  parser.add_argument("--baseline", default=BASELINE)
+  parser.add_argument("--threshold", type=float, default=0.25, help="allowed slowdown, 0.25 is 25%%")
+  parser.add_argument("--update", action="store_true", help="make the run the new baseline")
+  parser.add_argument("--report", action="store_true", help="only report slowdowns, don't fail")
+  args = parser.parse_args()
+
+  run = load_run(args.run)
+  if args.update:
+    with open(args.baseline, "w") as f:
+      json.dump(run, f, indent=2, sort_keys=True)
+      f.write("\n")
+    print(f"baseline updated, {run['machine']}")
+    sys.exit(0)
+
+  with open(args.baseline) as f:
+    baseline = json.load(f)
+  scale = run["reference"] / baseline["reference"]
+  print(f"baseline from {baseline['machine']}, this is {run['machine']}: reference runs {scale:.2f}x the baseline time")
+  print("run and baseline times, and the change of the time relative to the reference")
+
+  slower = []
+  for name, b in sorted(run["benchmarks"].items()):
+    per_frame = f"{b['time'] * 1e9 / b['frames']:8.1f} ns/frame" if b["frames"] else " " * 17
+    base = baseline["benchmarks"].get(name)
+    if base is None:
+      print(f"{b['time'] * 1e6:10.2f} us {per_frame}              new  {name}")
+      continue
+    ratio = b["relative"] / base["relative"]
+    if ratio > 1 + args.threshold:
+      slower.append(name)
+    print(f"{b['time'] * 1e6:10.2f} us {per_frame}  {base['time'] * 1e6:10.2f} us {ratio:5.2f}x  {name}")
+
+  if slower:
+    print(f"slower than the baseline, relative to the reference, by more than {args.threshold:.0%}: {', '.join(slower)}")
+    sys.exit(0 if args.report else 1)
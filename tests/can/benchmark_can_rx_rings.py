@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+# Buffering density and host throughput of the RX byte rings.
+# ENTER_CRITICAL() is a no-op on PC, so the queue comparison covers the queue logic only; on the panda
+# the rings additionally save disabling interrupts for every packet.
+import time
+
+from panda import USBPACKET_MAX_SIZE, Panda
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+N = 4000
+RX_RING_CNT = len(lpp.can_rx_rings)
+CANPACKET_T_SIZE = 72  # the fixed slots the RX queue used to have
+
+
+def bench(desc, fn, frames=N):
+  start = time.perf_counter()
+  nbytes = fn()
+  dt = time.perf_counter() - start
+  rate = f", {nbytes / dt / 1e6:6.2f} MB/s" if nbytes is not None else ""
+  print(f"{frames / dt / 1e3:8.1f} kframes/s{rate} - {desc}")
+
+
+def frames_per_kb(data_len):
+  lpp.can_rx_clear()
+  size = lpp.can_rx_rings[0].size
+  pkt = libpanda_py.make_CANPacket(0x100, 0, b"\x00" * data_len)
+  cnt = 0
+  while lpp.can_rx_push(0, pkt, cnt):
+    cnt += 1
+  lpp.can_rx_clear()
+  print(f"{cnt * 1024 / size:6.1f} frames/KB ({1024 / CANPACKET_T_SIZE:.1f} with fixed slots) - {data_len} byte frames")
+
+
+if __name__ == "__main__":
+  for data_len in (8, 64):
+    frames_per_kb(data_len)
+
+  packets = [libpanda_py.make_CANPacket(0x100 + (i % 0x100), 0, b"\x00" * 8) for i in range(N)]
+  pkt = ffi.new('CANPacket_t *')
+  dat = ffi.new(f"uint8_t[{USBPACKET_MAX_SIZE}]")
+
+  # the TX queues are the same critical section can_ring the RX queue used to be
+  queue = lpp.tx1_q
+  batch = queue.fifo_size - 1
+
+  def queue_push_pop():
+    for i in range(0, N, batch):
+      for p in packets[i:i+batch]:
+        lpp.can_push(queue, p)
+      while lpp.can_pop(queue, pkt):
+        pass
+  bench("can_push + can_pop, critical section queue", queue_push_pop)
+
+  for flags in (0, Panda.CAN_COMMS_FLAG_TIMESTAMPS):
+    lpp.comms_can_reset(flags)
+    for rings in (1, RX_RING_CNT):
+      lpp.can_rx_clear()
+      frames = sum(lpp.can_rx_push(i % rings, p, i) for i, p in enumerate(packets))
+      def rx_drain():
+        nbytes = 0
+        while (rx_len := lpp.comms_can_read(dat, USBPACKET_MAX_SIZE)) > 0:
+          nbytes += rx_len
+        return nbytes
+      bench(f"comms_can_read, merging {rings} ring(s), timestamps {'on' if flags else 'off'}", rx_drain, frames=frames)
+
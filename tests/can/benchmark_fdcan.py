@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+# Cost of the CAN interrupt handlers on the emulated FDCAN cores: can_rx() for every received frame,
+# with forwarding also process_can() refilling the TX buffers and echoing from the TX events.
+# This runs on PC and includes the emulation, so compare the numbers between changes on one machine.
+import time
+
+from opendbc.car.structs import CarParams
+
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+N = 1_000_000
+BATCH = 16  # frames in RX FIFO 0 per interrupt
+BURST = 400  # fits in the RX rings, they're cleared between bursts
+
+
+def bench(desc, length, forward):
+  lpp.fdcan_emu_reset()
+  for i in range(3):
+    lpp.bus_config[i].forwarding_bus = 2 if (forward and i == 0) else -1
+    lpp.can_init(i)
+
+  frames = ffi.new(f"fdcan_emu_frame_t[{BURST}]")
+  for i in range(BURST):
+    frames[i] = libpanda_py.make_fdcan_frame(0x100 + (i % 0x100), bytes(length), fd=(length > 8), brs=(length > 8))[0]
+
+  elapsed = 0.
+  sent = 0
+  for _ in range(N // BURST):
+    lpp.can_rx_clear()
+    start = time.perf_counter_ns()
+    sent += lpp.fdcan_emu_rx_burst(0, frames, BURST, BATCH)
+    elapsed += time.perf_counter_ns() - start
+  assert sent == (N if forward else 0)
+  print(f"{elapsed / N:7.1f} ns/frame - {length:2d} byte frames, {desc}")
+
+
+if __name__ == "__main__":
+  lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+  lpp.can_silent = False
+  for length in (8, 64):
+    bench("rx", length, False)
+    bench("rx + forward + echo", length, True)
+  lpp.fdcan_emu_deinit()
@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+import random
+import unittest
+
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+EXT_RANGE_MAX = 16
+
+
+class TestCANFilter(unittest.TestCase):
+  def setUp(self):
+    self.filter = ffi.new('can_filter_t *')
+    lpp.can_filter_clear(self.filter)
+
+  def _set(self, std_ids=(), ext_ranges=()):
+    for addr in std_ids:
+      self.assertTrue(lpp.can_filter_add_std(self.filter, addr))
+    for start, end in ext_ranges:
+      self.assertTrue(lpp.can_filter_add_ext_range(self.filter, start, end))
+    self.filter.enabled = True
+
+  def _check(self, std_ids, ext_ranges):
+    for addr in range(0x800):
+      self.assertEqual(lpp.can_filter_match(self.filter, addr, False), addr in std_ids, hex(addr))
+    addrs = [random.randint(0, 0x1FFFFFFF) for _ in range(5000)] + [a for r in ext_ranges for a in (r[0] - 1, *r, r[1] + 1)]
+    for addr in addrs:
+      if 0 <= addr <= 0x1FFFFFFF:
+        expected = any(start <= addr <= end for start, end in ext_ranges)
+        self.assertEqual(lpp.can_filter_match(self.filter, addr, True), expected, hex(addr))
+
+  def test_disabled_matches_all(self):
+    for addr in (0, 0x7FF):
+      self.assertTrue(lpp.can_filter_match(self.filter, addr, False))
+    self.assertTrue(lpp.can_filter_match(self.filter, 0x1FFFFFFF, True))
+
+  def test_enabled_empty_matches_nothing(self):
+    self._set()
+    self.assertFalse(lpp.can_filter_match(self.filter, 0x100, False))
+    self.assertFalse(lpp.can_filter_match(self.filter, 0x18DAF110, True))
+
+  def test_invalid_ids(self):
+    self.assertFalse(lpp.can_filter_add_std(self.filter, 0x800))
+    self.assertFalse(lpp.can_filter_add_ext_range(self.filter, 0x200, 0x100))
+    self.assertFalse(lpp.can_filter_add_ext_range(self.filter, 0, 0x20000000))
+    self.assertEqual(self.filter.ext_range_cnt, 0)
+
+  def test_ids_and_ranges(self):
+    std_ids = [0x100, 0x101, 0x102, 0x200, 0x300, 0x7FF]
+    ext_ranges = [(0x18DA00F1, 0x18DAFFF1)]
+    self._set(std_ids, ext_ranges)
+    self._check(std_ids, ext_ranges)
+
+  def test_random(self):
+    for _ in range(20):
+      lpp.can_filter_clear(self.filter)
+      std_ids = random.sample(range(0x800), random.randint(0, 0x800))
+      ext_ranges = []
+      for _ in range(random.randint(0, EXT_RANGE_MAX)):
+        start = random.randint(0, 0x1FFFFFFF)
+        ext_ranges.append((start, random.randint(start, min(start + 0x1000, 0x1FFFFFFF))))
+      self._set(std_ids, ext_ranges)
+      self._check(set(std_ids), ext_ranges)
+
+  def test_ext_overflow(self):
+    ranges = [(i * 0x100, i * 0x100 + 0x10) for i in range(EXT_RANGE_MAX)]
+    self._set([], ranges)
+    self.assertTrue(lpp.can_filter_match(self.filter, 0x410, True))
+    self.assertFalse(lpp.can_filter_match(self.filter, 0x411, True))
+
+    # past the limit everything extended gets through
+    self.assertFalse(lpp.can_filter_match(self.filter, 0x1F000, True))
+    self.assertFalse(lpp.can_filter_add_ext_range(self.filter, 0x1F000, 0x1F000))
+    self.assertTrue(lpp.can_filter_match(self.filter, 0x1FFFFFFF, True))
+    self.assertFalse(lpp.can_filter_match(self.filter, 0x123, False))
+
+
+if __name__ == "__main__":
+  unittest.main()
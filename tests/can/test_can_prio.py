@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+import unittest
+
+from panda import USBPACKET_MAX_SIZE, Panda, unpack_can_buffer
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+PRIO_ID_CNT = 16
+BULK_READ_SIZE = 0x800
+
+
+class TestCANPrio(unittest.TestCase):
+  def setUp(self):
+    lpp.comms_can_reset(0)
+    lpp.can_rx_clear()
+    lpp.can_prio_clear()
+    lpp.can_prio_set_active(True)
+    self.dat = ffi.new(f"uint8_t[{BULK_READ_SIZE}]")
+
+  def tearDown(self):
+    lpp.can_prio_set_active(False)
+    lpp.can_prio_clear()
+    lpp.can_rx_clear()
+
+  def _set(self, idx, bus, addr, extended=False, enabled=True):
+    entry = ffi.new('can_prio_id_t *', {'addr': addr, 'bus': bus, 'extended': extended, 'enabled': enabled})
+    return lpp.can_prio_set(idx, entry)
+
+  def _rx(self, addr, bus, dat, ts=0):
+    # what can_rx() does with a received frame
+    pkt = libpanda_py.make_CANPacket(addr, bus, dat)
+    if not lpp.can_prio_rx_push(bus, pkt, ts):
+      self.assertTrue(lpp.can_rx_push(bus, pkt, ts))
+
+  def _read_bulk(self):
+    buf = b""
+    while (rx_len := lpp.comms_can_read(self.dat, BULK_READ_SIZE)) > 0:
+      buf += bytes(self.dat[0:rx_len])
+    msgs, overflow = unpack_can_buffer(buf)
+    self.assertEqual(overflow, b"")
+    return msgs
+
+  def _read_prio(self, timestamps=False):
+    # one packet per poll of the interrupt endpoint
+    buf = b""
+    while (rx_len := lpp.comms_can_prio_read(self.dat, USBPACKET_MAX_SIZE)) > 0:
+      self.assertLessEqual(rx_len, USBPACKET_MAX_SIZE)
+      buf += bytes(self.dat[0:rx_len])
+    msgs, overflow = unpack_can_buffer(buf, timestamps=timestamps)
+    self.assertEqual(overflow, b"")
+    return msgs
+
+  def test_routing(self):
+    self.assertTrue(self._set(0, 0, 0x1A0))
+    self.assertTrue(self._set(3, 2, 0x18DAF110, extended=True))
+    frames = [(0x1A0, b"\x01", 0), (0x1A0, b"\x02", 1), (0x1A1, b"\x03", 0), (0x18DAF110, b"\x04" * 8, 2), (0x110, b"\x05", 2)]
+    for i, (addr, dat, bus) in enumerate(frames):
+      self._rx(addr, bus, dat, i)
+
+    self.assertEqual(self._read_prio(), [frames[0], frames[3]])
+    self.assertEqual(self._read_bulk(), [frames[1], frames[2], frames[4]])
+
+  def test_inactive_goes_to_bulk(self):
+    self.assertTrue(self._set(0, 0, 0x1A0))
+    lpp.can_prio_set_active(False)
+    self._rx(0x1A0, 0, b"\x01")
+    self.assertEqual(self._read_prio(), [])
+    self.assertEqual(self._read_bulk(), [(0x1A0, b"\x01", 0)])
+
+  def test_disabled_entry(self):
+    self.assertTrue(self._set(0, 0, 0x1A0, enabled=False))
+    self._rx(0x1A0, 0, b"\x01")
+    self.assertEqual(self._read_bulk(), [(0x1A0, b"\x01", 0)])
+
+  def test_full_falls_back_to_bulk(self):
+    self.assertTrue(self._set(0, 1, 0x200))
+    frames = [(0x200, i.to_bytes(8, "little"), 1) for i in range(400)]
+    for addr, dat, bus in frames:
+      self._rx(addr, bus, dat)
+
+    prio = self._read_prio()
+    self.assertGreater(len(prio), 0)
+    self.assertEqual(prio + self._read_bulk(), frames)
+
+  def test_split_across_packets(self):
+    lpp.comms_can_reset(Panda.CAN_COMMS_FLAG_TIMESTAMPS)
+    self.assertTrue(self._set(0, 0, 0x300))
+    frames = [(0x300, bytes(range(64)), 0, 1000), (0x300, b"\xaa" * 8, 0, 2000), (0x300, bytes(48), 0, 3000)]
+    for addr, dat, bus, ts in frames:
+      self._rx(addr, bus, dat, ts)
+    self.assertEqual(self._read_prio(timestamps=True), frames)
+
+  def test_invalid(self):
+    self.assertFalse(self._set(PRIO_ID_CNT, 0, 0x100))
+    self.assertFalse(self._set(0, 3, 0x100))
+    self.assertFalse(self._set(0, 0, 0x800))
+    self.assertFalse(self._set(0, 0, 0x20000000, extended=True))
+    self.assertTrue(self._set(PRIO_ID_CNT - 1, 2, 0x1FFFFFFF, extended=True))
+    self.assertTrue(lpp.can_prio_match(2, 0x1FFFFFFF, True))
+    self.assertFalse(lpp.can_prio_match(2, 0x1FFFFFFF, False))
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+import random
+import struct
+import threading
+import unittest
+
+from panda import Panda, USBPACKET_MAX_SIZE, unpack_can_buffer
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+RX_RING_CNT = len(lpp.can_rx_rings)
+
+
+def make_packet(ring, seq):
+  return libpanda_py.make_CANPacket(0x100 + ring, ring % 4, struct.pack("<BI", ring, seq))
+
+
+class TestCANRxRings(unittest.TestCase):
+  def setUp(self):
+    lpp.comms_can_reset(Panda.CAN_COMMS_FLAG_TIMESTAMPS)
+    lpp.can_rx_clear()
+
+  def _read_all(self, max_len=USBPACKET_MAX_SIZE):
+    dat = ffi.new(f"uint8_t[{max_len}]")
+    buf = b""
+    while (rx_len := lpp.comms_can_read(dat, max_len)) > 0:
+      buf += bytes(dat[0:rx_len])
+    return buf
+
+  def _pop_all(self):
+    msgs, overflow = unpack_can_buffer(self._read_all(), timestamps=True)
+    self.assertEqual(overflow, b"")
+    return [(*struct.unpack("<BI", dat[0:5]), ts) for _, dat, _, ts in msgs]
+
+  def test_merge_order(self):
+    # timestamps wrap around in the middle
+    timestamps = sorted(random.sample(range(2**32 - 1000, 2**32 + 1000), 500))
+    pushed = []
+    for seq, ts in enumerate(timestamps):
+      ring = random.randrange(RX_RING_CNT)
+      self.assertTrue(lpp.can_rx_push(ring, make_packet(ring, seq), ts % 2**32))
+      pushed.append((ring, seq, ts % 2**32))
+    self.assertEqual(self._pop_all(), pushed)
+
+  def test_ring_full(self):
+    # 6 byte header, 4 byte timestamp and 5 bytes of data, one byte always stays free
+    cnt = (lpp.can_rx_rings[0].size - 1) // 15
+    for seq in range(cnt):
+      self.assertTrue(lpp.can_rx_push(0, make_packet(0, seq), seq))
+    self.assertFalse(lpp.can_rx_push(0, make_packet(0, cnt), cnt))
+    # other rings are unaffected
+    self.assertTrue(lpp.can_rx_push(1, make_packet(1, 0), cnt))
+    self.assertEqual(len(self._pop_all()), cnt + 1)
+
+  def test_wraparound(self):
+    # packets of varying length wrap around the end of the ring several times
+    size = lpp.can_rx_rings[0].size
+    seq = 0
+    while seq * 30 < 3 * size:
+      pushed = []
+      for _ in range(random.randint(1, 500)):
+        dat = struct.pack("<BI", 0, seq) + b"\xaa" * random.choice((0, 3, 27, 59))
+        self.assertTrue(lpp.can_rx_push(0, libpanda_py.make_CANPacket(0x100, 0, dat), seq))
+        pushed.append((0, seq, seq))
+        seq += 1
+      self.assertEqual(self._pop_all(), pushed)
+    self.assertEqual(lpp.can_rx_pending(ffi.addressof(lpp.can_rx_rings[0])), 0)
+
+  def test_without_timestamps(self):
+    # the timestamp is cut out while reading, across read boundaries
+    lpp.comms_can_reset(0)
+    for max_len in (1, 7, USBPACKET_MAX_SIZE):
+      pushed = []
+      for seq in range(100):
+        ring = seq % RX_RING_CNT
+        self.assertTrue(lpp.can_rx_push(ring, make_packet(ring, seq), 0xFFFFFF00 + seq))
+        pushed.append((0x100 + ring, struct.pack("<BI", ring, seq), ring % 4))
+      msgs, overflow = unpack_can_buffer(self._read_all(max_len))
+      self.assertEqual(overflow, b"")
+      self.assertEqual(msgs, pushed)
+
+  def test_clear_keeps_partial_packet(self):
+    for ring in range(RX_RING_CNT):
+      self.assertTrue(lpp.can_rx_push(ring, make_packet(ring, 0), ring))
+    dat = ffi.new("uint8_t[8]")
+    self.assertEqual(lpp.comms_can_read(dat, 8), 8)
+    lpp.can_rx_clear()
+    # the rest of the first packet still follows, and then new packets
+    self.assertTrue(lpp.can_rx_push(2, make_packet(2, 1), 100))
+    msgs, overflow = unpack_can_buffer(bytes(dat) + self._read_all(), timestamps=True)
+    self.assertEqual(overflow, b"")
+    self.assertEqual([(*struct.unpack("<BI", d[0:5]), ts) for _, d, _, ts in msgs], [(0, 0, 0), (2, 1, 100)])
+
+  def test_clear(self):
+    for ring in range(RX_RING_CNT):
+      self.assertTrue(lpp.can_rx_push(ring, make_packet(ring, 0), 0))
+    lpp.can_rx_clear()
+    self.assertEqual(self._pop_all(), [])
+
+  def test_threaded_stress(self):
+    # every ring gets its own producer thread, comms_can_read is the consumer
+    N = 10000
+    timestamp_lock = threading.Lock()
+    timestamp = [0]
+    done = threading.Event()
+
+    def producer(ring):
+      for seq in range(N):
+        pkt = make_packet(ring, seq)
+        with timestamp_lock:
+          timestamp[0] += 1
+          ts = timestamp[0]
+        while not lpp.can_rx_push(ring, pkt, ts):
+          pass
+
+    received = []
+    def consumer():
+      dat = ffi.new(f"uint8_t[{USBPACKET_MAX_SIZE}]")
+      overflow = b""
+      while True:
+        finished = done.is_set()
+        rx_len = lpp.comms_can_read(dat, random.randint(1, USBPACKET_MAX_SIZE))
+        msgs, overflow = unpack_can_buffer(overflow + bytes(dat[0:rx_len]), timestamps=True)
+        received.extend(msgs)
+        if finished and rx_len == 0:
+          break
+      self.assertEqual(overflow, b"")
+
+    producers = [threading.Thread(target=producer, args=(ring, )) for ring in range(RX_RING_CNT)]
+    consumer_thread = threading.Thread(target=consumer)
+    consumer_thread.start()
+    for t in producers:
+      t.start()
+    for t in producers:
+      t.join()
+    done.set()
+    consumer_thread.join()
+
+    # nothing lost or duplicated, and every ring stays in order
+    self.assertEqual(len(received), N * RX_RING_CNT)
+    next_seq = [0] * RX_RING_CNT
+    last_ts = [0] * RX_RING_CNT
+    for addr, dat, bus, ts in received:
+      ring, seq = struct.unpack("<BI", dat[0:5])
+      self.assertEqual(addr, 0x100 + ring)
+      self.assertEqual(bus, ring % 4)
+      self.assertEqual(seq, next_seq[ring])
+      self.assertGreater(ts, last_ts[ring])
+      next_seq[ring] += 1
+      last_ts[ring] = ts
+
+
+if __name__ == "__main__":
+  unittest.main()
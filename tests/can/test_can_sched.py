@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+import random
+import unittest
+
+from opendbc.car.structs import CarParams
+from panda import DLC_TO_LEN, LEN_TO_DLC, Panda
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+TX_QUEUES = (lpp.tx1_q, lpp.tx2_q, lpp.tx3_q)
+PERIOD_MIN_US = 1000
+
+
+def make_entry(bus, addr, dat, period_us, counter=None, checksum=Panda.CAN_PERIODIC_CHECKSUM_NONE):
+  entry = ffi.new('can_sched_entry_t *')
+  entry.pkt.bus = bus
+  entry.pkt.addr = addr
+  entry.pkt.extended = addr >= 0x800
+  entry.pkt.data_len_code = LEN_TO_DLC[len(dat)]
+  entry.pkt.data = bytes(dat)
+  entry.period_us = period_us
+  if counter is not None:
+    entry.counter_enabled = True
+    entry.counter_byte, entry.counter_shift, entry.counter_width = counter
+  entry.checksum = checksum
+  return entry
+
+
+class TestCANSched(unittest.TestCase):
+  def setUp(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+    lpp.can_sched_clear()
+    self._drain()
+    self.now = random.randint(0, 0xFFFFFFFF)
+    lpp.MICROSECOND_TIMER.CNT = self.now
+
+  def _drain(self):
+    sent = []
+    pkt = ffi.new('CANPacket_t *')
+    for bus, q in enumerate(TX_QUEUES):
+      while lpp.can_pop(q, pkt):
+        sent.append((pkt.addr, bytes(pkt.data[0:DLC_TO_LEN[pkt.data_len_code]]), bus))
+    return sent
+
+  def _set(self, idx, *args, **kwargs):
+    return lpp.can_sched_set(idx, make_entry(*args, **kwargs), self.now & 0xFFFFFFFF)
+
+  def _run(self, duration_us, max_latency_us=0):
+    # the timer compare interrupt fires at the next deadline, handled after some latency
+    frames = []
+    nxt = ffi.new('uint32_t *')
+    end = self.now + duration_us
+    scheduled = lpp.can_sched_run(self.now & 0xFFFFFFFF, nxt)
+    frames += [(self.now, f) for f in self._drain()]
+    while scheduled:
+      deadline = self.now + ((nxt[0] - self.now) & 0xFFFFFFFF)
+      if deadline >= end:
+        break
+      self.now = deadline + random.randint(0, max_latency_us)
+      lpp.MICROSECOND_TIMER.CNT = self.now & 0xFFFFFFFF
+      scheduled = lpp.can_sched_run(lpp.MICROSECOND_TIMER.CNT, nxt)
+      frames += [(self.now, f) for f in self._drain()]
+    return frames
+
+  def test_period(self):
+    start = self.now
+    self.assertTrue(self._set(0, 0, 0x100, b'\x01\x02', 10000))
+    self.assertTrue(self._set(1, 2, 0x18DAF110, b'\xaa' * 8, 20000))
+    frames = self._run(1000000 - 1)
+
+    for idx, (addr, bus, period) in enumerate(((0x100, 0, 10000), (0x18DAF110, 2, 20000))):
+      times = [t for t, (a, _, b) in frames if a == addr and b == bus]
+      self.assertEqual(times, [start + i * period for i in range(1000000 // period)])
+      self.assertEqual(lpp.can_sched_stats[idx].sent_cnt, len(times))
+      self.assertEqual(lpp.can_sched_stats[idx].miss_cnt, 0)
+      self.assertEqual(lpp.can_sched_stats[idx].max_jitter_us, 0)
+
+  def test_jitter(self):
+    start = self.now
+    self.assertTrue(self._set(5, 1, 0x200, b'\x00' * 4, 5000))
+    frames = self._run(500000, max_latency_us=300)
+
+    # latency doesn't accumulate, every send is relative to the original schedule
+    self.assertEqual(len(frames), 100)
+    jitter = []
+    for i, (t, (addr, _, bus)) in enumerate(frames):
+      self.assertEqual((addr, bus), (0x200, 1))
+      self.assertTrue(0 <= t - (start + i * 5000) <= 300)
+      jitter.append(t - (start + i * 5000))
+
+    stats = lpp.can_sched_stats[5]
+    self.assertEqual(stats.sent_cnt, 100)
+    self.assertEqual(stats.miss_cnt, 0)
+    self.assertEqual(stats.max_jitter_us, max(jitter))
+    self.assertEqual(stats.last_jitter_us, jitter[-1])
+
+  def test_missed(self):
+    self.assertTrue(self._set(0, 0, 0x100, b'\x00', 10000))
+    self._run(0)
+
+    # the interrupt was held off for 3.5 periods
+    self.now += 35000
+    lpp.MICROSECOND_TIMER.CNT = self.now & 0xFFFFFFFF
+    nxt = ffi.new('uint32_t *')
+    self.assertTrue(lpp.can_sched_run(lpp.MICROSECOND_TIMER.CNT, nxt))
+    self.assertEqual(len(self._drain()), 1)
+    self.assertEqual(lpp.can_sched_stats[0].sent_cnt, 2)
+    self.assertEqual(lpp.can_sched_stats[0].miss_cnt, 2)
+    self.assertEqual(lpp.can_sched_stats[0].last_jitter_us, 5000)
+    self.assertEqual(nxt[0], (self.now + 5000) & 0xFFFFFFFF)
+
+  def test_timer_wraparound(self):
+    self.now = 0xFFFFFFFF - 25000
+    lpp.MICROSECOND_TIMER.CNT = self.now
+    self.assertTrue(self._set(0, 0, 0x100, b'\x00', 10000))
+    frames = self._run(100000 - 1)
+    self.assertEqual([t - frames[0][0] for t, _ in frames], list(range(0, 100000, 10000)))
+    self.assertEqual(lpp.can_sched_stats[0].miss_cnt, 0)
+
+  def test_counter_and_checksum(self):
+    self.assertTrue(self._set(0, 0, 0x2E4, bytes(8), 10000, counter=(6, 4, 2), checksum=Panda.CAN_PERIODIC_CHECKSUM_SUM))
+    self.assertTrue(self._set(1, 0, 0x123, b'\x11\x22\x33\x00', 10000, counter=(0, 0, 4), checksum=Panda.CAN_PERIODIC_CHECKSUM_XOR))
+    frames = self._run(320000 - 1)
+
+    sum_frames = [d for _, (a, d, _) in frames if a == 0x2E4]
+    xor_frames = [d for _, (a, d, _) in frames if a == 0x123]
+    self.assertEqual(len(sum_frames), 32)
+    for i, dat in enumerate(sum_frames):
+      self.assertEqual(dat[6] >> 4, i % 4)
+      self.assertEqual(dat[7], (0x2E4 & 0xFF) + (0x2E4 >> 8) + 8 + sum(dat[:7]) & 0xFF)
+    for i, dat in enumerate(xor_frames):
+      self.assertEqual(dat[0], 0x10 | (i % 16))
+      self.assertEqual(dat[3], dat[0] ^ dat[1] ^ dat[2])
+
+  def test_safety_applies(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.silent, 0)
+    self.assertTrue(self._set(0, 0, 0x100, b'\x00', 10000))
+    self.assertEqual(self._run(100000), [])
+    self.assertGreater(lpp.can_sched_stats[0].sent_cnt, 0)
+
+  def test_disable(self):
+    self.assertTrue(self._set(0, 0, 0x100, b'\x00', 10000))
+    self.assertEqual(len(self._run(100000 - 1)), 10)
+    self.assertTrue(self._set(0, 0, 0x100, b'\x00', 0))
+    self.assertFalse(lpp.can_sched_entries[0].enabled)
+    self.assertEqual(self._run(100000), [])
+
+  def test_invalid(self):
+    self.assertFalse(self._set(32, 0, 0x100, b'\x00', 10000))
+    self.assertFalse(self._set(0, 3, 0x100, b'\x00', 10000))
+    self.assertFalse(self._set(0, 0, 0x100, b'\x00', PERIOD_MIN_US - 1))
+    self.assertFalse(self._set(0, 0, 0x100, b'\x00', 10000, counter=(1, 0, 4)))
+    self.assertFalse(self._set(0, 0, 0x100, b'\x00', 10000, counter=(0, 6, 4)))
+    self.assertFalse(self._set(0, 0, 0x100, b'', 10000, checksum=Panda.CAN_PERIODIC_CHECKSUM_XOR))
+    self.assertFalse(self._set(0, 0, 0x100, b'\x00', 10000, checksum=3))
+    self.assertTrue(self._set(0, 0, 0x100, b'\x00', PERIOD_MIN_US))
+    self.assertEqual(lpp.can_sched_entries[0].period_us, PERIOD_MIN_US)
+
+
+if __name__ == "__main__":
+  unittest.main()
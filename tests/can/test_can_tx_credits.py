@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+import struct
+import unittest
+from unittest.mock import patch
+
+from opendbc.car.structs import CarParams
+from panda import DLC_TO_LEN, USBPACKET_MAX_SIZE, Panda
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+TX_QUEUES = (lpp.tx1_q, lpp.tx2_q, lpp.tx3_q)
+MAX_MSGS_PER_USB_BULK_TRANSFER = 51
+
+
+class LibpandaHandle:
+  """USB handle going straight into the firmware's CAN comms"""
+  def __init__(self):
+    self.credit_reads = 0
+
+  def controlRead(self, request_type, request, value, index, length, timeout=0):
+    assert request == 0xc7
+    self.credit_reads += 1
+    resp = ffi.new('uint8_t[64]')
+    return bytes(resp[0:lpp.can_tx_credits_get(resp)])[:length]
+
+  def bulkWrite(self, endpoint, data, timeout=0):
+    # the device NAKs EP3 until the transfer can be taken
+    assert lpp.can_tx_comms_writable(MAX_MSGS_PER_USB_BULK_TRANSFER)
+    for i in range(0, len(data), USBPACKET_MAX_SIZE):
+      chunk = bytes(data[i:i + USBPACKET_MAX_SIZE])
+      lpp.comms_can_write(chunk, len(chunk))
+    return len(data)
+
+
+class TestCANTxCredits(unittest.TestCase):
+  def setUp(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+    lpp.comms_can_reset(Panda.CAN_COMMS_FLAG_TX_CREDITS)
+    self._drain(range(3))
+    self.queue_size = lpp.can_slots_empty(TX_QUEUES[0])
+
+    with patch.object(Panda, "connect"):
+      self.panda = Panda("libpanda", cli=False, can_tx_credits=True)
+    self.panda._handle = LibpandaHandle()
+    self.panda.can_version = Panda.CAN_PACKET_VERSION
+
+  def tearDown(self):
+    self._drain(range(3))
+    lpp.comms_can_reset(0)
+
+  def _drain(self, buses):
+    sent = {bus: [] for bus in buses}
+    pkt = ffi.new('CANPacket_t *')
+    for bus in buses:
+      while lpp.can_pop(TX_QUEUES[bus], pkt):
+        sent[bus].append((pkt.addr, bytes(pkt.data[0:DLC_TO_LEN[pkt.data_len_code]])))
+    return sent
+
+  def test_credits(self):
+    self.panda.can_send_many([(0x100, b'\x01', 0)] * 10 + [(0x200, b'\x02', 2)] * 3)
+    tx_credits = self.panda.get_can_tx_credits()
+    self.assertEqual(tx_credits[:3], (self.queue_size - 10, self.queue_size, self.queue_size - 3))
+    self.assertEqual(tx_credits[3], lpp.can_tx_timed_slots_empty())
+
+  def test_full_bus_keeps_others_flowing(self):
+    # bus 0 gets nothing acked, its queue fills up and stays full
+    bus0 = [(0x100, struct.pack("<I", i)) for i in range(self.queue_size + 200)]
+    others = {1: [], 2: []}
+    sent = {1: [], 2: []}
+    for i in range(0, len(bus0), 20):
+      self.panda.can_send_many([(addr, dat, 0) for addr, dat in bus0[i:i + 20]])
+      for bus in (1, 2):
+        msgs = [(0x200 + bus, struct.pack("<HH", i, j)) for j in range(20)]
+        others[bus] += msgs
+        self.panda.can_send_many([(addr, dat, bus) for addr, dat in msgs])
+      for bus, frames in self._drain((1, 2)).items():
+        sent[bus] += frames
+
+    self.assertEqual(sent, others)
+    self.assertEqual(lpp.can_slots_empty(TX_QUEUES[0]), 0)
+    self.assertEqual(self.panda.can_tx_pending(), [200, 0, 0])
+    self.assertTrue(lpp.can_tx_comms_writable(MAX_MSGS_PER_USB_BULK_TRANSFER))
+
+    # the held frames go out in order once the bus drains
+    frames = self._drain((0,))[0]
+    self.panda.can_send_many([])
+    frames += self._drain((0,))[0]
+    self.assertEqual(frames, bus0)
+    self.assertEqual(self.panda.can_tx_pending(), [0, 0, 0])
+
+  def test_credits_cached(self):
+    # the credits are only read again once the ones left run out
+    for _ in range(10):
+      self.panda.can_send(0x100, b'\x01', 0)
+    self.assertEqual(self.panda._handle.credit_reads, 1)
+
+    self.panda.can_send_many([(0x100, b'\x01', 0)] * self.queue_size)
+    self.assertEqual(self.panda._handle.credit_reads, 2)
+    self.assertEqual(self.panda.can_tx_pending(), [10, 0, 0])
+    self.assertEqual(lpp.can_slots_empty(TX_QUEUES[0]), 0)
+
+  def test_invalid_bus(self):
+    for bus in (-1, 3, 4):
+      with self.assertRaises(ValueError):
+        self.panda.can_send_many([(0x100, b'\x01', 0), (0x100, b'\x01', bus)])
+    self.assertEqual(self.panda.can_tx_pending(), [0, 0, 0])
+    self.assertEqual(lpp.can_slots_empty(TX_QUEUES[0]), self.queue_size)
+
+  def test_all_queues_needed_without_credits(self):
+    for _ in range(self.queue_size - MAX_MSGS_PER_USB_BULK_TRANSFER + 1):
+      pkt = ffi.new('CANPacket_t *')
+      pkt.addr = 0x100
+      lpp.can_push(TX_QUEUES[1], pkt)
+    self.assertTrue(lpp.can_tx_comms_writable(MAX_MSGS_PER_USB_BULK_TRANSFER))
+    lpp.comms_can_reset(0)
+    self.assertFalse(lpp.can_tx_comms_writable(MAX_MSGS_PER_USB_BULK_TRANSFER))
+
+  def test_reset_drops_held(self):
+    self.panda.can_send_many([(0x100, b'\x01', 0)] * (self.queue_size + 5))
+    self.assertEqual(self.panda.can_tx_pending(), [5, 0, 0])
+    with patch.object(self.panda, "_handle"):
+      self.panda.can_reset_communications()
+    self.assertEqual(self.panda.can_tx_pending(), [0, 0, 0])
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+import random
+import unittest
+
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+NONE = 0xFF
+
+
+def arbitration_key(addr, extended):
+  # base ID, then standard before extended, then the extended ID bits
+  return ((addr >> 18) & 0x7FF, 1, addr & 0x3FFFF) if extended else (addr & 0x7FF, 0, 0)
+
+
+def make_echo(addr, extended, dat=b''):
+  ret = ffi.new('CANPacket_t *')
+  ret.addr = addr
+  ret.extended = extended
+  ret.data_len_code = len(dat)
+  ret.data = dat
+  return ret
+
+
+class TestCANTxSlots(unittest.TestCase):
+  def setUp(self):
+    self.slots = ffi.new('can_tx_slots_t *')
+
+  def _init(self, cnt):
+    lpp.can_tx_slots_init(self.slots, cnt)
+    self.pending = 0
+
+  def _load(self, addr, extended, in_order, ts=0):
+    idx = lpp.can_tx_slot_alloc(self.slots, self.pending, addr, extended, in_order)
+    if idx != NONE:
+      self.assertEqual(self.pending & (1 << idx), 0)
+      lpp.can_tx_slot_set(self.slots, idx, make_echo(addr, extended), ts)
+      self.pending |= 1 << idx
+    return idx
+
+  def _send_one(self):
+    # the FDCAN core sends the pending buffer that wins arbitration, lowest number on equal IDs
+    pending = [i for i in range(self.slots.cnt) if self.pending & (1 << i)]
+    idx = min(pending, key=lambda i: (arbitration_key(self.slots.slot[i].addr, self.slots.slot[i].extended), i))
+    self.pending &= ~(1 << idx)
+    echo = ffi.new('CANPacket_t *')
+    self.assertTrue(lpp.can_tx_slot_complete(self.slots, self.slots.slot[idx].marker, echo))
+    return (echo.addr, bool(echo.extended))
+
+  def _run(self, frames, in_order):
+    sent = []
+    queue = list(frames)
+    while queue or self.pending:
+      while queue and self._load(*queue[0], in_order) != NONE:
+        queue.pop(0)
+      if self.pending:
+        sent.append(self._send_one())
+    return sent
+
+  def test_unordered_uses_all_slots(self):
+    self._init(4)
+    for addr in (0x300, 0x100, 0x200, 0x100):
+      self.assertNotEqual(self._load(addr, False, False), NONE)
+    self.assertEqual(self._load(0x50, False, False), NONE)
+    self.assertEqual(self.pending, 0xF)
+
+  def test_in_order_blocks_higher_priority(self):
+    self._init(4)
+    self.assertEqual(self._load(0x200, False, True), 0)
+    # 0x100 would overtake 0x200
+    self.assertEqual(self._load(0x100, False, True), NONE)
+    # same ID only after it, lower priority anywhere
+    self.assertEqual(self._load(0x200, False, True), 1)
+    self.assertEqual(self._load(0x300, False, True), 2)
+    # extended frame with the same base ID loses against the standard one
+    self.assertEqual(self._load(0x300 << 18, True, True), 3)
+
+  def test_in_order_same_id_after_free_slot(self):
+    self._init(3)
+    self.pending = 0b010
+    lpp.can_tx_slot_set(self.slots, 1, make_echo(0x123, False), 0)
+    # slot 0 is free but would go out first
+    self.assertEqual(self._load(0x123, False, True), 2)
+
+  def test_random_order_kept(self):
+    for cnt in (1, 2, 5, 32):
+      self._init(cnt)
+      frames = []
+      for _ in range(500):
+        extended = random.random() < 0.3
+        addr = random.randint(0, 0x1FFFFFFF) if extended else random.choice((0x100, 0x200, 0x7FF, random.randint(0, 0x7FF)))
+        frames.append((addr, extended))
+      self.assertEqual(self._run(frames, True), frames)
+
+  def test_match(self):
+    self._init(4)
+    for i, (addr, ts) in enumerate([(0x100, 1000), (0x200, 2000), (0x100, 3000), (0x300, 0xFFFFFF00)]):
+      lpp.can_tx_slot_set(self.slots, i, make_echo(addr, False), ts)
+    pending = 0b1111
+    self.assertEqual(lpp.can_tx_slots_match(self.slots, pending, False, 0, 0, 3000), 0b1111)
+    self.assertEqual(lpp.can_tx_slots_match(self.slots, pending, True, 0x100, 0, 3000), 0b0101)
+    self.assertEqual(lpp.can_tx_slots_match(self.slots, 0b1011, True, 0x100, 0, 3000), 0b0001)
+    # slot 3 was queued before the timer wrapped around
+    self.assertEqual(lpp.can_tx_slots_match(self.slots, pending, False, 0, 1500, 3000), 0b1001)
+    self.assertEqual(lpp.can_tx_slots_match(self.slots, pending, True, 0x100, 1500, 3000), 0b0001)
+    # ages are wraparound safe
+    self.assertEqual(lpp.can_tx_slots_match(self.slots, 0b1000, False, 0, 0x200, 0x100), 0b1000)
+    self.assertEqual(lpp.can_tx_slots_match(self.slots, 0b1000, False, 0, 0x201, 0x100), 0)
+
+  def test_completion(self):
+    self._init(4)
+    markers = [lpp.can_tx_slot_set(self.slots, i, make_echo(0x100 + i, False, bytes([i])), 0) for i in range(4)]
+    self.assertEqual([m & 0x1F for m in markers], [0, 1, 2, 3])
+
+    # sent but not completed yet, the slot stays taken
+    self.assertEqual(lpp.can_tx_slot_alloc(self.slots, 0b0000, 0x100, False, False), NONE)
+
+    echo = ffi.new('CANPacket_t *')
+    self.assertTrue(lpp.can_tx_slot_complete(self.slots, markers[2], echo))
+    self.assertEqual((echo.addr, echo.data[0]), (0x102, 2))
+    self.assertFalse(lpp.can_tx_slot_complete(self.slots, markers[2], echo))
+    self.assertEqual(lpp.can_tx_slot_alloc(self.slots, 0b0000, 0x100, False, False), 2)
+
+    # a stale event of the previous frame in a reused slot doesn't match
+    new_marker = lpp.can_tx_slot_set(self.slots, 2, make_echo(0x200, False), 0)
+    self.assertNotEqual(new_marker, markers[2])
+    self.assertFalse(lpp.can_tx_slot_complete(self.slots, markers[2], echo))
+    self.assertTrue(lpp.can_tx_slot_complete(self.slots, new_marker, echo))
+    self.assertEqual(echo.addr, 0x200)
+
+    # unknown slots
+    self.assertFalse(lpp.can_tx_slot_complete(self.slots, 0x1F, echo))
+
+  def test_marker_generations(self):
+    self._init(1)
+    echo = ffi.new('CANPacket_t *')
+    seen = set()
+    for _ in range(8):
+      marker = lpp.can_tx_slot_set(self.slots, 0, make_echo(0x100, False), 0)
+      seen.add(marker)
+      self.assertTrue(lpp.can_tx_slot_complete(self.slots, marker, echo))
+    self.assertEqual(len(seen), 8)
+
+  def test_drop(self):
+    self._init(4)
+    for i in range(3):
+      lpp.can_tx_slot_set(self.slots, i, make_echo(0x100, False), 0)
+    self.assertEqual(lpp.can_tx_slots_drop(self.slots, 0b1010), 1)
+    self.assertEqual(self.slots.awaiting, 0b0101)
+    self.assertEqual(lpp.can_tx_slots_drop(self.slots, 0xFFFFFFFF), 2)
+    self.assertEqual(self.slots.awaiting, 0)
+
+  def test_event_timestamp(self):
+    # 500 kbps: 2 us per bit
+    self.assertEqual(lpp.can_tx_event_timestamp(10000, 150, 100, 5000), 10000 - 100)
+    # counter wraparound
+    self.assertEqual(lpp.can_tx_event_timestamp(10000, 10, 0xFFF0, 5000), 10000 - 52)
+    # microsecond timer wraparound, 1 Mbps
+    self.assertEqual(lpp.can_tx_event_timestamp(5, 1000, 990, 10000), 0xFFFFFFFF - 4)
+    self.assertEqual(lpp.can_tx_event_timestamp(1000, 7, 7, 1000), 1000)
+
+  def test_init_clamps(self):
+    lpp.can_tx_slots_init(self.slots, 0xFF)
+    self.assertEqual(self.slots.cnt, 32)
+    self.assertEqual(lpp.can_tx_slot_alloc(self.slots, 0xFFFFFFFF, 0x100, False, False), NONE)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+import random
+import unittest
+
+from opendbc.car.structs import CarParams
+from panda import DLC_TO_LEN, USBPACKET_MAX_SIZE, Panda, pack_can_buffer
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+TX_QUEUES = (lpp.tx1_q, lpp.tx2_q, lpp.tx3_q)
+HEAP_SIZE = 256
+
+
+class TestCANTxTimed(unittest.TestCase):
+  def setUp(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+    lpp.comms_can_reset(Panda.CAN_COMMS_FLAG_TX_TIMESTAMPS)
+    self._drain()
+    self.now = random.randint(0, 0xFFFFFFFF)
+    lpp.MICROSECOND_TIMER.CNT = self.now
+
+  def tearDown(self):
+    lpp.comms_can_reset(0)
+
+  def _drain(self):
+    sent = []
+    pkt = ffi.new('CANPacket_t *')
+    for bus, q in enumerate(TX_QUEUES):
+      while lpp.can_pop(q, pkt):
+        sent.append((pkt.addr, bytes(pkt.data[0:DLC_TO_LEN[pkt.data_len_code]]), bus))
+    return sent
+
+  def _write(self, msgs):
+    # simulate USB bulk chunks
+    for buf in pack_can_buffer(msgs, tx_timestamps=True):
+      for i in range(0, len(buf), USBPACKET_MAX_SIZE):
+        chunk = bytes(buf[i:i + USBPACKET_MAX_SIZE])
+        lpp.comms_can_write(chunk, len(chunk))
+
+  def _run(self, duration_us, max_latency_us=0):
+    # the timer compare interrupt fires at the earliest target, handled after some latency
+    frames = []
+    nxt = ffi.new('uint32_t *')
+    end = self.now + duration_us
+    held = lpp.can_tx_timed_run(self.now & 0xFFFFFFFF, nxt)
+    frames += [(self.now, f) for f in self._drain()]
+    while held:
+      deadline = self.now + ((nxt[0] - self.now) & 0xFFFFFFFF)
+      if deadline >= end:
+        break
+      self.now = deadline + random.randint(0, max_latency_us)
+      lpp.MICROSECOND_TIMER.CNT = self.now & 0xFFFFFFFF
+      held = lpp.can_tx_timed_run(lpp.MICROSECOND_TIMER.CNT, nxt)
+      frames += [(self.now, f) for f in self._drain()]
+    return frames
+
+  def test_untimed_sent_right_away(self):
+    msgs = [(0x100, b'\x01\x02', 0), (0x18DAF110, b'\x03' * 8, 1), (0x200, b'', 2)]
+    self._write(msgs)
+    self.assertEqual(self._drain(), [(addr, dat, bus) for addr, dat, bus in msgs])
+    self.assertEqual(lpp.can_tx_timed_slots_empty(), HEAP_SIZE)
+
+  def test_past_sent_right_away(self):
+    self._write([(0x100, b'\x01', 0, (self.now - 1000) & 0xFFFFFFFF), (0x101, b'\x02', 0, self.now)])
+    self.assertEqual(self._drain(), [(0x100, b'\x01', 0), (0x101, b'\x02', 0)])
+
+  def test_release_order_and_time(self):
+    start = self.now
+    msgs = []
+    for i in range(200):
+      offset = random.randint(1, 1000000)
+      dat = bytes(random.getrandbits(8) for _ in range(DLC_TO_LEN[random.randrange(len(DLC_TO_LEN))]))
+      msgs.append((random.randint(1, 0x7FF), dat, random.randint(0, 2), (start + offset) & 0xFFFFFFFF, offset, i))
+    self._write([m[:4] for m in msgs])
+    self.assertEqual(self._drain(), [])
+    self.assertEqual(lpp.can_tx_timed_slots_empty(), HEAP_SIZE - len(msgs))
+
+    frames = self._run(2000000, max_latency_us=50)
+    self.assertEqual(lpp.can_tx_timed_slots_empty(), HEAP_SIZE)
+
+    # released in target order, same targets in the order they were written, never early
+    expected = sorted(msgs, key=lambda m: (m[4], m[5]))
+    for bus in range(3):
+      bus_frames = [(t, f) for t, f in frames if f[2] == bus]
+      bus_expected = [m for m in expected if m[2] == bus]
+      self.assertEqual([f for _, f in bus_frames], [m[:3] for m in bus_expected])
+      for (t, _), m in zip(bus_frames, bus_expected, strict=True):
+        self.assertTrue(0 <= t - (start + m[4]) <= 50)
+
+  def test_same_target_kept_in_order(self):
+    start = self.now
+    msgs = [(0x100 + (i % 7), bytes([i]), 0, (start + 5000) & 0xFFFFFFFF) for i in range(50)]
+    self._write(msgs)
+    frames = self._run(10000)
+    self.assertEqual([f for _, f in frames], [m[:3] for m in msgs])
+    self.assertEqual({t for t, _ in frames}, {start + 5000})
+
+  def test_timer_wraparound(self):
+    self.now = 0xFFFFFFFF - 500
+    lpp.MICROSECOND_TIMER.CNT = self.now
+    self._write([(0x300, b'\x03', 0, 1000), (0x100, b'\x01', 0, 0xFFFFFFFF - 100), (0x200, b'\x02', 0, 200)])
+    frames = self._run(5000)
+    self.assertEqual([f[0] for _, f in frames], [0x100, 0x200, 0x300])
+    self.assertEqual([t & 0xFFFFFFFF for t, _ in frames], [0xFFFFFFFF - 100, 200, 1000])
+
+  def test_full(self):
+    target = (self.now + 10000) & 0xFFFFFFFF
+    for i in range(HEAP_SIZE + 10):
+      self._write([(0x100, i.to_bytes(2, 'little'), 0, target)])
+    self.assertEqual(lpp.can_tx_timed_slots_empty(), 0)
+    frames = self._run(20000)
+    self.assertEqual([f[1] for _, f in frames], [i.to_bytes(2, 'little') for i in range(HEAP_SIZE)])
+
+  def test_safety_applies_at_release(self):
+    self._write([(0x100, b'\x01', 0, (self.now + 1000) & 0xFFFFFFFF)])
+    lpp.set_safety_hooks(CarParams.SafetyModel.silent, 0)
+    self.assertEqual(self._run(5000), [])
+
+  def test_reset_drops_held(self):
+    self._write([(0x100, b'\x01', 0, (self.now + 1000) & 0xFFFFFFFF)])
+    lpp.comms_can_reset(Panda.CAN_COMMS_FLAG_TX_TIMESTAMPS)
+    self.assertEqual(lpp.can_tx_timed_slots_empty(), HEAP_SIZE)
+    self.assertEqual(self._run(5000), [])
+
+
+if __name__ == "__main__":
+  unittest.main()
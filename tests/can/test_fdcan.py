@@ -0,0 +1,255 @@
+#!/usr/bin/env python3
+import unittest
+
+from opendbc.car.structs import CarParams
+from panda import DLC_TO_LEN, unpack_can_buffer
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+TX_QUEUES = (lpp.tx1_q, lpp.tx2_q, lpp.tx3_q)
+RX_FIFO_0_EL_CNT = 45  # default message RAM split
+
+# board/fake_fdcan.h
+FDCAN_PSR_EP = 0x20
+FDCAN_PSR_EW = 0x40
+FDCAN_IR_RF0L = 0x8
+FDCAN_IR_EP = 0x800000
+CAN_ACK_ERROR = 3
+
+
+def read_all():
+  dat = ffi.new("uint8_t[4096]")
+  msgs = []
+  overflow = b""
+  while (rx_len := lpp.comms_can_read(dat, 4096)) > 0:
+    new_msgs, overflow = unpack_can_buffer(overflow + bytes(dat[0:rx_len]))
+    msgs += new_msgs
+  assert overflow == b""
+  return msgs
+
+
+def tx_all(can_number):
+  frames = []
+  frame = ffi.new("fdcan_emu_frame_t *")
+  while lpp.fdcan_emu_tx(can_number, frame):
+    frames.append((frame.addr, bytes(frame.data[0:DLC_TO_LEN[frame.data_len_code]])))
+    lpp.fdcan_emu_irq(can_number)
+  return frames
+
+
+@unittest.skipIf(lpp.fdcan_emu_ram == ffi.NULL, "FDCAN message RAM address not available")
+class TestFDCAN(unittest.TestCase):
+  def setUp(self):
+    lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+    lpp.comms_can_reset(0)
+    lpp.can_rx_clear()
+    pkt = ffi.new("CANPacket_t *")
+    for q in TX_QUEUES:
+      while lpp.can_pop(q, pkt):
+        pass
+    for i in range(3):
+      lpp.can_health[i] = ffi.new("can_health_t *")[0]
+      lpp.bus_config[i].forwarding_bus = -1
+      lpp.can_filter_clear(ffi.addressof(lpp.can_filters[i]))
+      lpp.bus_config[i].canfd_enabled = False
+      lpp.bus_config[i].brs_enabled = False
+      lpp.bus_config[i].tx_fifo_el_cnt = 1
+      lpp.bus_config[i].tx_queue_mode = False
+    lpp.rx_buffer_overflow = 0
+    lpp.can_silent = False
+    lpp.can_loopback = False
+    self._init()
+
+  def tearDown(self):
+    lpp.fdcan_emu_deinit()
+    lpp.can_silent = True
+    lpp.can_loopback = False
+    lpp.can_rx_clear()
+
+  def _init(self):
+    lpp.fdcan_emu_reset()
+    for i in range(3):
+      lpp.can_init(i)
+
+  def _send(self, bus, addr, dat):
+    lpp.can_push(TX_QUEUES[bus], libpanda_py.make_CANPacket(addr, bus, dat))
+    lpp.process_can(bus)
+
+  def test_rx(self):
+    expected = []
+    for bus in range(3):
+      for addr, dat in ((0x100 + bus, bytes([bus]) * 8), (0x18DAF110 + bus, bytes(range(64)))):
+        self.assertTrue(lpp.fdcan_emu_rx(bus, libpanda_py.make_fdcan_frame(addr, dat, fd=len(dat) > 8, brs=True)))
+        expected.append((addr, dat, bus))
+      self.assertEqual(lpp.fdcan_emu_irq(bus), 1)
+
+    self.assertEqual(sorted(read_all()), sorted(expected))
+    for bus in range(3):
+      self.assertEqual(lpp.can_health[bus].total_rx_cnt, 2)
+      self.assertEqual(lpp.can_health[bus].total_rx_lost_cnt, 0)
+      self.assertTrue(lpp.bus_config[bus].canfd_enabled)
+      self.assertTrue(lpp.bus_config[bus].brs_enabled)
+
+  def test_rx_fifo_wraps(self):
+    # the indexes wrap around the FIFO several times
+    for i in range(RX_FIFO_0_EL_CNT * 3):
+      lpp.fdcan_emu_rx(0, libpanda_py.make_fdcan_frame(0x200, i.to_bytes(8, "little")))
+      lpp.fdcan_emu_irq(0)
+    self.assertEqual([int.from_bytes(m[1], "little") for m in read_all()], list(range(RX_FIFO_0_EL_CNT * 3)))
+    self.assertEqual(lpp.can_health[0].total_rx_lost_cnt, 0)
+
+  def test_rx_overwrite(self):
+    # the FIFO is in overwrite mode, the oldest frames are lost when the interrupt is late
+    cnt = RX_FIFO_0_EL_CNT + 5
+    for i in range(cnt):
+      self.assertTrue(lpp.fdcan_emu_rx(0, libpanda_py.make_fdcan_frame(0x200, i.to_bytes(8, "little"))))
+    lpp.fdcan_emu_irq(0)
+
+    received = [int.from_bytes(m[1], "little") for m in read_all()]
+    self.assertEqual(received, list(range(cnt - RX_FIFO_0_EL_CNT + 1, cnt)))
+    self.assertEqual(lpp.can_health[0].total_rx_lost_cnt, 1)
+
+  def test_tx_echo(self):
+    for bus in range(3):
+      self._send(bus, 0x300 + bus, bytes([bus]) * 8)
+    self.assertEqual(read_all(), [])
+
+    for bus in range(3):
+      self.assertEqual(tx_all(bus), [(0x300 + bus, bytes([bus]) * 8)])
+      self.assertEqual(lpp.can_health[bus].total_tx_cnt, 1)
+    self.assertEqual(sorted(read_all()), [(0x300 + bus, bytes([bus]) * 8, bus + 128) for bus in range(3)])
+
+  def test_tx_refill(self):
+    # the TX event interrupt sends the rest of the queue, in order
+    for i in range(50):
+      lpp.can_push(TX_QUEUES[0], libpanda_py.make_CANPacket(0x400, 0, i.to_bytes(8, "little")))
+    lpp.process_can(0)
+
+    sent = tx_all(0)
+    self.assertEqual([int.from_bytes(d, "little") for _, d in sent], list(range(50)))
+    self.assertEqual(len(read_all()), 50)
+
+  def test_tx_arbitration(self):
+    # with several TX buffers the lowest ID goes out first, extended IDs by their 11 bit base ID
+    lpp.bus_config[0].tx_fifo_el_cnt = 4
+    lpp.bus_config[0].tx_queue_mode = True
+    self._init()
+    for addr in (0x7FF, 0x18DAF110, 0x100, 0x400):
+      lpp.can_push(TX_QUEUES[0], libpanda_py.make_CANPacket(addr, 0, b"\x00" * 8))
+    lpp.process_can(0)
+
+    self.assertEqual([addr for addr, _ in tx_all(0)], [0x100, 0x400, 0x18DAF110, 0x7FF])
+
+  def test_cancel(self):
+    self._send(0, 0x500, b"\x01" * 8)
+    self.assertEqual(lpp.can_cancel_send(0, False, 0, 0, False), 1)
+    self.assertEqual(lpp.fdcan_emu_irq(0), 2)
+
+    self.assertEqual(tx_all(0), [])
+    self.assertEqual(read_all(), [])
+    self.assertEqual(lpp.can_health[0].total_tx_lost_cnt, 1)
+    self.assertEqual(lpp.can_health[0].total_tx_cancelled_cnt, 0)
+
+    # the buffer is free again
+    self._send(0, 0x501, b"\x02" * 8)
+    self.assertEqual(tx_all(0), [(0x501, b"\x02" * 8)])
+
+  def test_cancel_by_host(self):
+    # what the host cancels is counted apart from what got lost
+    lpp.bus_config[0].tx_fifo_el_cnt = 4
+    lpp.bus_config[0].tx_queue_mode = True
+    self._init()
+    for addr in (0x500, 0x501):
+      lpp.can_push(TX_QUEUES[0], libpanda_py.make_CANPacket(addr, 0, b"\x01" * 8))
+    lpp.process_can(0)
+    self.assertEqual(lpp.can_cancel_send(0, True, 0x501, 0, True), 1)
+    lpp.fdcan_emu_irq(0)
+
+    self.assertEqual(tx_all(0), [(0x500, b"\x01" * 8)])
+    self.assertEqual(lpp.can_health[0].total_tx_cancelled_cnt, 1)
+    self.assertEqual(lpp.can_health[0].total_tx_lost_cnt, 0)
+
+    # a later internal cancel is still counted as lost
+    self._send(0, 0x502, b"\x02" * 8)
+    self.assertEqual(lpp.can_cancel_send(0, False, 0, 0, False), 1)
+    lpp.fdcan_emu_irq(0)
+    self.assertEqual(lpp.can_health[0].total_tx_cancelled_cnt, 1)
+    self.assertEqual(lpp.can_health[0].total_tx_lost_cnt, 1)
+
+  def test_forwarding(self):
+    lpp.bus_config[0].forwarding_bus = 2
+    lpp.fdcan_emu_rx(0, libpanda_py.make_fdcan_frame(0x600, b"\x03" * 8))
+    lpp.fdcan_emu_irq(0)
+
+    self.assertEqual(tx_all(2), [(0x600, b"\x03" * 8)])
+    self.assertEqual(lpp.can_health[0].total_fwd_cnt, 1)
+    # the forwarded frame isn't echoed
+    self.assertEqual(read_all(), [(0x600, b"\x03" * 8, 0), (0x600, b"\x03" * 8, 130)])
+
+  def test_filtered_frames_reach_hooks(self):
+    # outside car safety modes too, the host's filter only decides what's queued for the host
+    lpp.bus_config[0].forwarding_bus = 2
+    lpp.can_filter_clear(ffi.addressof(lpp.can_filters[0]))
+    lpp.can_filter_add_std(ffi.addressof(lpp.can_filters[0]), 0x600)
+    lpp.can_filters[0].enabled = True
+    for addr in (0x600, 0x601):
+      lpp.fdcan_emu_rx(0, libpanda_py.make_fdcan_frame(addr, b"\x03" * 8))
+    lpp.fdcan_emu_irq(0)
+
+    self.assertEqual(tx_all(2), [(0x600, b"\x03" * 8), (0x601, b"\x03" * 8)])
+    self.assertEqual(lpp.can_health[0].total_fwd_cnt, 2)
+    self.assertEqual(lpp.can_health[0].total_rx_filtered_cnt, 1)
+    self.assertEqual([m for m in read_all() if m[2] == 0], [(0x600, b"\x03" * 8, 0)])
+
+  def test_silent(self):
+    lpp.can_silent = True
+    self._init()
+    self._send(0, 0x700, b"\x04" * 8)
+    self.assertEqual(tx_all(0), [])
+
+  def test_loopback(self):
+    lpp.can_loopback = True
+    self._init()
+    self._send(0, 0x700, b"\x05" * 8)
+    self.assertEqual(tx_all(0), [])
+    lpp.fdcan_emu_irq(0)
+    self.assertEqual(sorted(read_all()), [(0x700, b"\x05" * 8, 0), (0x700, b"\x05" * 8, 128)])
+
+  def test_errors(self):
+    # error passive with ACK errors, the pending frames are dropped
+    self._send(0, 0x800, b"\x06" * 8)
+    lpp.fdcan_emu_error(0, FDCAN_PSR_EP | FDCAN_PSR_EW | CAN_ACK_ERROR, 200, FDCAN_IR_EP)
+    self.assertEqual(lpp.fdcan_emu_irq(0), 1)
+    lpp.fdcan_emu_irq(0)
+
+    health = lpp.can_health[0]
+    self.assertEqual(health.error_passive, 1)
+    self.assertEqual(health.error_warning, 1)
+    self.assertEqual(health.last_error, CAN_ACK_ERROR)
+    self.assertEqual(health.transmit_error_cnt, 200)
+    self.assertEqual(health.total_error_cnt, 1)
+    self.assertEqual(health.total_tx_lost_cnt, 1)
+    self.assertEqual(tx_all(0), [])
+
+  def test_rx_lost(self):
+    # RX FIFO 0 message lost is counted with the errors
+    lpp.fdcan_emu_error(0, 0, 0, FDCAN_IR_RF0L)
+    lpp.fdcan_emu_irq(0)
+    self.assertEqual(lpp.can_health[0].total_rx_lost_cnt, 1)
+    self.assertEqual(lpp.can_health[0].total_error_cnt, 1)
+
+  def test_burst(self):
+    lpp.bus_config[0].forwarding_bus = 1
+    frames = ffi.new("fdcan_emu_frame_t[100]")
+    for i in range(100):
+      frames[i] = libpanda_py.make_fdcan_frame(0x100 + i, bytes(64), fd=True)[0]
+    self.assertEqual(lpp.fdcan_emu_rx_burst(0, frames, 100, 10), 100)
+    self.assertEqual(lpp.can_health[0].total_rx_cnt, 100)
+    self.assertEqual(lpp.can_health[1].total_tx_cnt, 100)
+    self.assertEqual(len(read_all()), 200)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+import unittest
+
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+MSG_RAM_SIZE = 3384  # bytes for each FDCAN module
+EL_W_SIZE = 18  # RX and TX elements hold 64 bytes of data
+EVENT_EL_W_SIZE = 2
+TX_EL_MAX = 32
+RX_EL_MAX = 64
+
+
+class TestFDCANLayout(unittest.TestCase):
+  def _layout(self, tx_cnt):
+    layout = ffi.new('fdcan_msg_ram_layout_t *')
+    ok = lpp.fdcan_msg_ram_layout(tx_cnt, layout)
+    return layout if ok else None
+
+  def test_default(self):
+    layout = self._layout(1)
+    self.assertEqual(layout.rx_fifo_0_el_cnt, 45)
+    self.assertEqual(layout.tx_fifo_el_cnt, 1)
+    self.assertEqual(layout.tx_event_fifo_el_cnt, 1)
+
+  def test_all_splits_fit(self):
+    for tx_cnt in range(1, TX_EL_MAX + 1):
+      with self.subTest(tx_cnt=tx_cnt):
+        layout = self._layout(tx_cnt)
+        self.assertIsNotNone(layout)
+        self.assertLessEqual(layout.size_w * 4, MSG_RAM_SIZE)
+        self.assertTrue(0 < layout.rx_fifo_0_el_cnt <= RX_EL_MAX)
+
+        # regions follow each other without overlap
+        self.assertEqual(layout.rx_fifo_0_offset, 0)
+        self.assertEqual(layout.tx_event_fifo_el_cnt, tx_cnt)
+        self.assertEqual(layout.tx_event_fifo_offset, layout.rx_fifo_0_offset + layout.rx_fifo_0_el_cnt * EL_W_SIZE)
+        self.assertEqual(layout.tx_fifo_offset, layout.tx_event_fifo_offset + tx_cnt * EVENT_EL_W_SIZE)
+        self.assertEqual(layout.size_w, layout.tx_fifo_offset + tx_cnt * EL_W_SIZE)
+
+        # RX gets everything that's left
+        self.assertLess(MSG_RAM_SIZE - layout.size_w * 4, EL_W_SIZE * 4)
+
+  def test_invalid(self):
+    for tx_cnt in (0, TX_EL_MAX + 1, 0xFF, 0xFFFFFFFF):
+      self.assertIsNone(self._layout(tx_cnt))
+
+
+if __name__ == "__main__":
+  unittest.main()
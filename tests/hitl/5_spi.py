@@ -1,13 +1,24 @@
 import binascii
 import pytest
 import random
+import threading
+import time
 from unittest.mock import patch
 
+from opendbc.car.structs import CarParams
 from panda import Panda
-from panda.python.spi import PandaProtocolMismatch, PandaSpiNackResponse
+from panda.python.spi import XCHG_ENDPOINT, PandaProtocolMismatch, PandaSpiNackResponse
+from panda.tests.hitl.helpers import clear_can_buffers, get_random_can_messages
 
 
 class TestSpi:
+  @pytest.fixture(autouse=True)
+  def python_transfers(self, p):
+    # the spies and patches are on the python transfers, not host/libpanda_spi.so
+    native, p._handle.native = getattr(p._handle, "native", None), None
+    yield
+    p._handle.native = native
+
   def _ping(self, mocker, panda):
     # should work with no retries
     spy = mocker.spy(panda._handle, '_wait_for_ack')
@@ -48,10 +59,42 @@ class TestSpi:
     p.can_clear(0)
     assert spy.call_count == 2*2
 
-    # bulkRead + bulkWrite
+    # bulkRead + bulkWrite, CAN exchanges only wait for the header ACK
     p.can_recv()
     p.can_send(0x123, b"somedata", 0)
-    assert spy.call_count == 2*4
+    assert spy.call_count == 2*2 + 2
+
+  @pytest.mark.timeout(60)
+  def test_exchange_under_load(self, p, panda_jungle):
+    # the jungle floods all buses while the panda sends as much back, so the header interrupt
+    # waits behind the CAN interrupts and the exchanges poll longer for the HACK
+    NUM_MESSAGES = 3000
+    p.set_safety_mode(CarParams.SafetyModel.allOutput)
+    clear_can_buffers(p)
+    clear_can_buffers(panda_jungle)
+    spi_errors = p.health()['spi_error_count']
+
+    to_panda = get_random_can_messages(NUM_MESSAGES)
+    to_jungle = get_random_can_messages(NUM_MESSAGES)
+    flood = threading.Thread(target=panda_jungle.can_send_many, args=(to_panda, ), kwargs={'timeout': 0})
+    flood.start()
+
+    rx = []
+    for i in range(0, NUM_MESSAGES, 100):
+      p.can_send_many(to_jungle[i:i+100], timeout=0)
+      rx.extend(p.can_recv())
+    flood.join()
+    start_time = time.monotonic()
+    while len(rx) < 2*NUM_MESSAGES and (time.monotonic() - start_time) < 10:
+      rx.extend(p.can_recv())
+
+    # nothing lost or corrupted either way, the echoes are what went out on the bus
+    def on_bus(msgs, bus):
+      return sorted((addr, bytes(dat)) for addr, dat, b in msgs if b == bus)
+    for bus in range(3):
+      assert on_bus(rx, bus) == on_bus(to_panda, bus)
+      assert on_bus(rx, 0x80 | bus) == on_bus(to_jungle, bus)
+    assert p.health()['spi_error_count'] == spi_errors
 
   def test_bad_header(self, mocker, p):
     with patch('panda.python.spi.SYNC', return_value=0):
@@ -69,7 +112,7 @@ class TestSpi:
 
   def test_non_existent_endpoint(self, mocker, p):
     for _ in range(10):
-      ep = random.randint(4, 20)
+      ep = random.choice([ep for ep in range(4, 21) if ep != XCHG_ENDPOINT])
       with pytest.raises(PandaSpiNackResponse):
         p._handle.bulkRead(ep, random.randint(1, 1000), timeout=50)
 
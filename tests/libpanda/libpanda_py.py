@@ -5,7 +5,8 @@ from typing import Any, Protocol
 from panda import LEN_TO_DLC
 
 libpanda_dir = os.path.dirname(os.path.abspath(__file__))
-libpanda_fn = os.path.join(libpanda_dir, "libpanda.so")
+# LIBPANDA=libpanda_bench.so loads the optimized build, for the benchmarks
+libpanda_fn = os.path.join(libpanda_dir, os.getenv("LIBPANDA", "libpanda.so"))
 
 ffi = FFI()
 
@@ -35,18 +36,268 @@ typedef struct {
   CANPacket_t *elems;
 } can_ring;
 
-extern can_ring *rx_q;
 extern can_ring *tx1_q;
 extern can_ring *tx2_q;
 extern can_ring *tx3_q;
 
 bool can_pop(can_ring *q, CANPacket_t *elem);
 bool can_push(can_ring *q, CANPacket_t *elem);
-void can_set_checksum(CANPacket_t *packet);
+
+typedef struct {
+  volatile uint32_t w_ptr;
+  volatile uint32_t r_ptr;
+  uint32_t size;
+  uint8_t *buf;
+  uint32_t read_offset;
+  uint32_t clear_ptr;
+} can_rx_ring;
+
+extern can_rx_ring can_rx_rings[7];
+bool can_rx_push(uint8_t ring, CANPacket_t *elem, uint32_t timestamp);
+uint32_t can_rx_pending(can_rx_ring *q);
+void can_rx_clear(void);
+
+uint8_t calculate_checksum(const uint8_t *dat, uint32_t len);
 int comms_can_read(uint8_t *data, uint32_t max_len);
 void comms_can_write(uint8_t *data, uint32_t len);
-void comms_can_reset(void);
+void comms_can_reset(uint16_t flags);
 uint32_t can_slots_empty(can_ring *q);
+bool can_tx_comms_writable(uint32_t max_msgs);
+uint32_t can_tx_credits_get(uint8_t *resp);
+""")
+
+ffi.cdef("""
+typedef struct {
+  uint32_t addr;
+  uint32_t timestamp;
+  bool extended;
+  uint8_t marker;
+  uint8_t echo_align[2];  // CANPacket_t is aligned(4) in C, but packed here
+  CANPacket_t echo;
+} can_tx_slot_t;
+
+typedef struct {
+  uint8_t cnt;
+  uint32_t awaiting;
+  uint32_t host_cancelled;
+  can_tx_slot_t slot[32];
+} can_tx_slots_t;
+
+void can_tx_slots_init(can_tx_slots_t *slots, uint8_t cnt);
+uint8_t can_tx_slot_alloc(const can_tx_slots_t *slots, uint32_t pending, uint32_t addr, bool extended, bool in_order);
+uint8_t can_tx_slot_set(can_tx_slots_t *slots, uint8_t idx, const CANPacket_t *echo, uint32_t timestamp);
+bool can_tx_slot_complete(can_tx_slots_t *slots, uint8_t marker, CANPacket_t *echo);
+uint32_t can_tx_slots_drop(can_tx_slots_t *slots, uint32_t mask);
+uint32_t can_tx_slots_match(const can_tx_slots_t *slots, uint32_t pending, bool match_addr, uint32_t addr, uint32_t older_than_us, uint32_t now);
+uint32_t can_tx_event_timestamp(uint32_t now, uint16_t tsc_now, uint16_t tsc_event, uint32_t can_speed);
+""")
+
+ffi.cdef("""
+typedef struct {
+  uint32_t rx_fifo_0_el_cnt;
+  uint32_t tx_fifo_el_cnt;
+  uint32_t tx_event_fifo_el_cnt;
+  uint32_t rx_fifo_0_offset;
+  uint32_t tx_event_fifo_offset;
+  uint32_t tx_fifo_offset;
+  uint32_t size_w;
+} fdcan_msg_ram_layout_t;
+
+bool fdcan_msg_ram_layout(uint32_t tx_fifo_el_cnt, fdcan_msg_ram_layout_t *layout);
+""")
+
+ffi.cdef("""
+typedef struct {
+  bool enabled;
+  bool ext_overflow;
+  uint32_t std_bitmap[64];
+  uint8_t ext_range_cnt;
+  uint32_t ext_range_start[16];
+  uint32_t ext_range_end[16];
+} can_filter_t;
+
+extern can_filter_t can_filters[3];
+
+void can_filter_clear(can_filter_t *filter);
+bool can_filter_add_std(can_filter_t *filter, uint32_t addr);
+bool can_filter_add_ext_range(can_filter_t *filter, uint32_t start, uint32_t end);
+bool can_filter_match(const can_filter_t *filter, uint32_t addr, bool extended);
+""")
+
+ffi.cdef("""
+typedef struct {
+  uint32_t addr;
+  uint8_t bus;
+  bool extended;
+  bool enabled;
+} can_prio_id_t;
+
+extern can_prio_id_t can_prio_ids[16];
+void can_prio_clear(void);
+bool can_prio_set(uint8_t idx, const can_prio_id_t *id);
+bool can_prio_match(uint8_t bus, uint32_t addr, bool extended);
+void can_prio_set_active(bool active);
+bool can_prio_rx_push(uint8_t bus, const CANPacket_t *pkt, uint32_t timestamp);
+int comms_can_prio_read(uint8_t *data, uint32_t max_len);
+
+extern const uint8_t usb_configuration_desc[106];
+""")
+
+ffi.cdef("""
+typedef struct {
+  uint32_t CNT;
+} TIM_TypeDef;
+
+extern TIM_TypeDef *MICROSECOND_TIMER;
+
+typedef struct {
+  CANPacket_t pkt;
+  uint32_t period_us;
+  uint32_t next;
+  bool enabled;
+  bool counter_enabled;
+  uint8_t counter_byte;
+  uint8_t counter_shift;
+  uint8_t counter_width;
+  uint8_t counter;
+  uint8_t checksum;
+} can_sched_entry_t;
+
+typedef struct {
+  uint32_t sent_cnt;
+  uint32_t miss_cnt;
+  uint32_t last_jitter_us;
+  uint32_t max_jitter_us;
+} can_sched_stats_t;
+
+extern can_sched_entry_t can_sched_entries[32];
+extern can_sched_stats_t can_sched_stats[32];
+
+void can_sched_clear(void);
+bool can_sched_set(uint8_t idx, const can_sched_entry_t *entry, uint32_t now);
+bool can_sched_run(uint32_t now, uint32_t *next);
+""")
+
+ffi.cdef("""
+void can_tx_timed_clear(void);
+uint32_t can_tx_timed_slots_empty(void);
+bool can_tx_timed_push(const CANPacket_t *pkt, uint32_t target);
+bool can_tx_timed_run(uint32_t now, uint32_t *next);
+""")
+
+ffi.cdef("""
+extern uint8_t *spi_mosi_addr;
+extern int spi_mosi_len;
+extern const uint8_t *spi_miso_addr;
+extern int spi_miso_len;
+extern bool spi_stage_kicked;
+extern uint16_t spi_error_count;
+
+void spi_init(void);
+void spi_rx_done(void);
+void spi_tx_done(bool reset);
+void spi_stage_fill(void);
+void llspi_stage_kick(void);
+void refresh_can_tx_slots_available(void);
+bool spi_validate_checksum(const uint8_t *data, uint16_t len);
+uint32_t bench_reference(const uint8_t *dat, uint32_t len);
+uint8_t checksum_xor(uint8_t init, const uint8_t *dat, uint32_t len);
+uint8_t crc8_spi(const uint8_t *dat, uint32_t len);
+""")
+
+ffi.cdef("""
+typedef struct {
+  uint32_t GINTSTS;
+  uint32_t GINTMSK;
+} USB_OTG_GlobalTypeDef;
+typedef struct {
+  uint32_t DSTS;
+} USB_OTG_DeviceTypeDef;
+extern USB_OTG_GlobalTypeDef usb_otg;
+extern USB_OTG_DeviceTypeDef usb_otg_device;
+
+void usb_sof_irq(uint32_t gintsts);
+uint8_t usb_sof_latches_get(uint8_t *resp);
+""")
+
+ffi.cdef("""
+typedef struct {
+  uint8_t bus_lookup;
+  uint8_t can_num_lookup;
+  int8_t forwarding_bus;
+  uint32_t can_speed;
+  uint32_t can_data_speed;
+  bool canfd_auto;
+  bool canfd_enabled;
+  bool brs_enabled;
+  bool canfd_non_iso;
+  uint8_t tx_fifo_el_cnt;
+  bool tx_queue_mode;
+} bus_config_t;
+""")
+
+ffi.cdef("""
+typedef struct {
+  uint8_t bus_off;
+  uint32_t bus_off_cnt;
+  uint8_t error_warning;
+  uint8_t error_passive;
+  uint8_t last_error;
+  uint8_t last_stored_error;
+  uint8_t last_data_error;
+  uint8_t last_data_stored_error;
+  uint8_t receive_error_cnt;
+  uint8_t transmit_error_cnt;
+  uint32_t total_error_cnt;
+  uint32_t total_tx_lost_cnt;
+  uint32_t total_rx_lost_cnt;
+  uint32_t total_tx_cnt;
+  uint32_t total_rx_cnt;
+  uint32_t total_fwd_cnt;
+  uint32_t total_tx_checksum_error_cnt;
+  uint16_t can_speed;
+  uint16_t can_data_speed;
+  uint8_t canfd_enabled;
+  uint8_t brs_enabled;
+  uint8_t canfd_non_iso;
+  uint16_t irq0_call_rate;
+  uint16_t irq1_call_rate;
+  uint32_t total_rx_filtered_cnt;
+  uint32_t can_core_reset_cnt;
+  uint32_t total_tx_cancelled_cnt;
+} can_health_t;
+""", packed=True)
+
+ffi.cdef("""
+extern bus_config_t bus_config[3];
+extern can_health_t can_health[3];
+extern bool can_silent;
+extern bool can_loopback;
+extern uint32_t rx_buffer_overflow;
+extern uint32_t tx_buffer_overflow;
+
+bool can_init(uint8_t can_number);
+void can_rx(uint8_t can_number);
+void process_can(uint8_t can_number);
+uint32_t can_cancel_send(uint8_t can_number, bool match_addr, uint32_t addr, uint32_t older_than_us, bool by_host);
+
+typedef struct {
+  uint32_t addr;
+  bool extended;
+  bool fd;
+  bool brs;
+  uint8_t data_len_code;
+  uint8_t data[64];
+} fdcan_emu_frame_t;
+
+extern volatile uint32_t *fdcan_emu_ram;
+void fdcan_emu_reset(void);
+void fdcan_emu_deinit(void);
+bool fdcan_emu_rx(uint8_t can_number, const fdcan_emu_frame_t *frame);
+bool fdcan_emu_tx(uint8_t can_number, fdcan_emu_frame_t *frame);
+void fdcan_emu_error(uint8_t can_number, uint32_t psr, uint32_t ecr, uint32_t ir);
+uint8_t fdcan_emu_irq(uint8_t can_number);
+uint32_t fdcan_emu_rx_burst(uint8_t can_number, const fdcan_emu_frame_t *frames, uint32_t cnt, uint32_t batch);
 """)
 
 class CANPacket:
@@ -64,7 +315,6 @@ class Panda(Protocol):
   tx1_q: Any
   tx2_q: Any
   tx3_q: Any
-  def can_set_checksum(self, p: CANPacket) -> None: ...
 
   # safety
   def set_safety_hooks(self, mode: int, param: int) -> int: ...
@@ -82,6 +332,15 @@ def make_CANPacket(addr: int, bus: int, dat):
   ret[0].data_len_code = LEN_TO_DLC[len(dat)]
   ret[0].bus = bus
   ret[0].data = bytes(dat)
-  libpanda.can_set_checksum(ret)
 
   return ret
+
+def make_fdcan_frame(addr: int, dat, fd: bool = False, brs: bool = False):
+  ret = ffi.new('fdcan_emu_frame_t *')
+  ret[0].extended = addr >= 0x800
+  ret[0].addr = addr
+  ret[0].fd = fd
+  ret[0].brs = brs
+  ret[0].data_len_code = LEN_TO_DLC[len(dat)]
+  ret[0].data = bytes(dat)
+  return ret
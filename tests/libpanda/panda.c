@@ -1,15 +1,15 @@
 #include "fake_stm.h"
+#include "fake_fdcan.h"
 #include "config.h"
 #include "can.h"
 
-bool can_init(uint8_t can_number) { return true; }
-void process_can(uint8_t can_number) { }
 //int safety_tx_hook(CANPacket_t *to_send) { return 1; }
 
 typedef struct harness_configuration harness_configuration;
 void refresh_can_tx_slots_available(void);
 void can_tx_comms_resume_usb(void) { };
-void can_tx_comms_resume_spi(void) { };
+void can_tx_timed_timer_kick(void) { };
+void can_prio_comms_resume_usb(void) { };
 
 #include "health.h"
 #include "sys/faults.h"
@@ -17,12 +17,110 @@ void can_tx_comms_resume_spi(void) { };
 #include "boards/board_declarations.h"
 #include "opendbc/safety/safety.h"
 #include "main_definitions.h"
+#include "comms_definitions.h"
 #include "drivers/can_common.h"
+#include "drivers/can_filter.h"
+#include "drivers/can_prio.h"
+#include "drivers/can_tx_slots.h"
+#include "drivers/can_sched.h"
+#include "drivers/can_tx_timed.h"
+#include "stm32h7/llfdcan_layout.h"
+#include "drivers/usb_desc.h"
 
-can_ring *rx_q = &can_rx_q;
 can_ring *tx1_q = &can_tx1_q;
 can_ring *tx2_q = &can_tx2_q;
 can_ring *tx3_q = &can_tx3_q;
 
-#include "comms_definitions.h"
 #include "can_comms.h"
+
+// the FDCAN drivers on the emulated cores
+#define CAN_INTERRUPT_RATE 16000U
+interrupt interrupts[NUM_INTERRUPTS];
+#define LED_BLUE 2U
+void led_set(uint8_t color, bool enabled) { }
+#include "stm32h7/llfdcan.h"
+#include "drivers/fdcan.h"
+
+// until can_init() nothing is sent, so the queues keep what the tests put in them
+void fdcan_emu_deinit(void) {
+  for (uint8_t i = 0U; i < PANDA_CAN_CNT; i++) {
+    can_tx_slots_init(&can_tx_slots[i], 0U);
+  }
+  fdcan_emu_reset();
+}
+
+// SPI protocol state machine, the test plays the host and the DMA
+static uint8_t fake_uid[12] = {0x0AU, 0x0BU, 0x0CU, 0x0DU};
+#define UID_BASE fake_uid
+
+uint8_t *spi_mosi_addr = NULL;
+int spi_mosi_len = 0;
+const uint8_t *spi_miso_addr = NULL;
+int spi_miso_len = 0;
+
+void llspi_init(void) { }
+void llspi_mosi_dma(uint8_t *addr, int len) {
+  spi_mosi_addr = addr;
+  spi_mosi_len = len;
+}
+void llspi_miso_dma(const uint8_t *addr, int len) {
+  spi_miso_addr = addr;
+  spi_miso_len = len;
+}
+void llspi_xchg_dma(uint8_t *mosi_addr, int mosi_len, const uint8_t *miso_addr, int miso_len) {
+  llspi_mosi_dma(mosi_addr, mosi_len);
+  llspi_miso_dma(miso_addr, miso_len);
+}
+// the low priority interrupt is up to the test, it calls spi_stage_fill
+bool spi_stage_kicked = false;
+void llspi_stage_kick(void) {
+  spi_stage_kicked = true;
+}
+
+// only what the SPI tests use
+void comms_endpoint2_write(const uint8_t *data, uint32_t len) { }
+int comms_control_handler(ControlPacket_t *req, uint8_t *resp) {
+  int resp_len = 0;
+  if (req->request == 0xc0U) {
+    comms_can_reset(req->param1);
+  } else if (req->request == 0xc7U) {
+    resp_len = can_tx_credits_get(resp);
+  }
+  return resp_len;
+}
+
+#include "drivers/spi.h"
+
+// validate_checksum() is static, the benchmarks time it through this
+bool spi_validate_checksum(const uint8_t *data, uint16_t len) {
+  return validate_checksum(data, len);
+}
+
+// the benchmarks' yardstick, every round of them is timed relative to this. It's not firmware
+// code so it only changes with the machine, keep it as it is
+uint32_t bench_reference(const uint8_t *dat, uint32_t len) {
+  uint32_t hash = 2166136261U;
+  for (uint32_t i = 0U; i < len; i++) {
+    hash = (hash ^ dat[i]) * 16777619U;
+  }
+  return hash;
+}
+
+// USB SOF latches on the few OTG registers they use, the test plays the interrupt
+typedef struct {
+  uint32_t GINTSTS;
+  uint32_t GINTMSK;
+} USB_OTG_GlobalTypeDef;
+typedef struct {
+  uint32_t DSTS;
+} USB_OTG_DeviceTypeDef;
+USB_OTG_GlobalTypeDef usb_otg;
+USB_OTG_DeviceTypeDef usb_otg_device;
+#define USBx (&usb_otg)
+#define USBx_DEVICE (&usb_otg_device)
+#define USB_OTG_GINTSTS_SOF (1UL << 3)
+#define USB_OTG_GINTMSK_SOFM (1UL << 3)
+#define USB_OTG_DSTS_FNSOF_Pos 8U
+#define USB_OTG_DSTS_FNSOF (0x3FFFUL << USB_OTG_DSTS_FNSOF_Pos)
+
+#include "drivers/usb_sof.h"
@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+# End-to-end CAN throughput of the host stack against the virtual panda: python, the comms
+# framing and the firmware's queues, with the buses at 5Mbps so they aren't the limit.
+# The sim runs on PC, so the rates are relative; compare them between changes on one machine.
+import os
+import tempfile
+import time
+from unittest.mock import patch
+
+from opendbc.car.structs import CarParams
+
+from panda import Panda
+from panda.python.sim import SIM_SERIAL, PandaSim
+
+FRAMES = 20000
+
+
+def bench_tx(p, length):
+  msgs = [[0x100 + (i % 0x100), bytes(length), i % 3] for i in range(FRAMES)]
+  p.can_recv()
+  echoed = 0
+  start = time.monotonic()
+  for i in range(0, FRAMES, 100):
+    p.can_send_many(msgs[i:i+100], fd=(length > 8), timeout=5000)
+    echoed += len(p.can_recv())
+  while echoed < FRAMES and (time.monotonic() - start) < 30:
+    echoed += len(p.can_recv())
+  return echoed / (time.monotonic() - start)
+
+
+def bench_rx(p, bus, length):
+  p.can_recv()
+  for b in range(3):
+    bus.add_traffic(b, 0x300 + b, bytes(length), 10, count=FRAMES // 3, fd=(length > 8), brs=(length > 8))
+  received = 0
+  start = time.monotonic()
+  while received < (FRAMES // 3) * 3 and (time.monotonic() - start) < 30:
+    received += len(p.can_recv())
+  bus.clear_traffic()
+  return received / (time.monotonic() - start)
+
+
+if __name__ == "__main__":
+  with tempfile.TemporaryDirectory() as tmp:
+    path = os.path.join(tmp, "sim.sock")
+    with PandaSim(path) as sim, patch("panda.python.sim.SIM_SOCKET", path):
+      p = Panda(SIM_SERIAL)
+      bus = sim.connect()
+      p.set_safety_mode(CarParams.SafetyModel.allOutput)
+      for b in range(3):
+        p.set_can_speed_kbps(b, 1000)
+        p.set_can_data_speed_kbps(b, 5000)
+
+      for length in (8, 64):
+        print(f"{length:2d} byte frames: tx+echo {bench_tx(p, length):8.0f} frames/s, rx {bench_rx(p, bus, length):8.0f} frames/s")
+
+      bus.close()
+      p.close()
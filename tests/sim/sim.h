@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Virtual panda: the firmware's comms stack (main_comms.h, can_comms.h, can_common.h and the
+// health packet) and its FDCAN drivers on the emulated cores of board/fake_fdcan.h, served over a Unix socket by sim_server.c.
+// sim_panda.c is built like tests/libpanda with the board's libc, this is all the server sees of it.
+
+// ***************************** socket protocol *****************************
+// Requests are a sim_request_t, followed by length bytes for the writes and SIM_TRAFFIC.
+// Responses are an int32 (bytes returned or accepted, < 0 on error), followed by the data for the reads.
+// python/sim.py is the other end.
+
+#define SIM_SOCKET_DEFAULT "/tmp/panda_sim.sock"
+
+#define SIM_CONTROL_READ 0U
+#define SIM_CONTROL_WRITE 1U
+#define SIM_BULK_READ 2U
+#define SIM_BULK_WRITE 3U
+#define SIM_TRAFFIC 4U    // add a traffic generator, data is a sim_traffic_t. Returns its index
+#define SIM_TRAFFIC_CLEAR 5U
+#define SIM_STATS 6U      // returns a sim_stats_t
+
+#define SIM_ERR_TIMEOUT -7   // LIBUSB_ERROR_TIMEOUT, the bulk write wasn't taken in time
+#define SIM_ERR_INVALID -2   // LIBUSB_ERROR_INVALID_PARAM
+
+#define SIM_XFER_MAX 0x10000U
+
+typedef struct {
+  uint8_t type;
+  uint8_t request;     // control request or bulk endpoint
+  uint16_t param1;
+  uint16_t param2;
+  uint32_t length;
+  uint32_t timeout_ms; // bulk writes, 0 waits forever
+} __attribute__((packed)) sim_request_t;
+
+// frames received on a bus at a fixed rate
+#define SIM_TRAFFIC_CNT 16U
+#define SIM_TRAFFIC_FLAG_EXTENDED 0x1U
+#define SIM_TRAFFIC_FLAG_FD 0x2U
+#define SIM_TRAFFIC_FLAG_BRS 0x4U
+#define SIM_TRAFFIC_FLAG_COUNTER 0x8U  // the first up to 4 data bytes are a little endian frame counter
+
+typedef struct {
+  uint8_t bus;
+  uint8_t data_len_code;
+  uint8_t flags;
+  uint8_t reserved;
+  uint32_t addr;
+  uint32_t period_us;
+  uint32_t count;      // 0 doesn't stop
+  uint8_t data[64];
+} __attribute__((packed)) sim_traffic_t;
+
+typedef struct {
+  uint32_t rx_cnt[3];    // frames received from the traffic generators
+  uint32_t tx_cnt[3];    // frames that went out on the bus
+  uint32_t bus_load[3];  // per mille of the last second
+} __attribute__((packed)) sim_stats_t;
+
+// ***************************** sim_panda.c *****************************
+
+// false when the FDCAN message RAM can't be mapped at its address
+bool sim_init(uint64_t now_us);
+// runs what's due at now_us, returns the us until something is due next
+uint32_t sim_step(uint64_t now_us);
+int sim_control(uint8_t request, uint16_t param1, uint16_t param2, uint16_t length, uint8_t *resp);
+int sim_bulk_read(uint8_t endpoint, uint8_t *data, uint32_t max_len);
+// returns how much was taken before the endpoint NAKed, the rest goes in a later call
+int sim_bulk_write(uint8_t endpoint, const uint8_t *data, uint32_t len);
+int sim_traffic_add(const sim_traffic_t *traffic);
+void sim_traffic_clear(void);
+void sim_stats_get(sim_stats_t *stats);
+// NVIC_SystemReset was called, the server restarts once it's sent the response
+bool sim_reset_requested(void);
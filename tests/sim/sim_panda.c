@@ -0,0 +1,480 @@
+#include "fake_stm.h"
+#include "fake_fdcan.h"
+#include "config.h"
+#include "can.h"
+
+#include "sim.h"
+
+typedef struct harness_configuration harness_configuration;
+void refresh_can_tx_slots_available(void);
+void can_tx_comms_resume_usb(void);
+void can_tx_comms_resume_spi(void) { };
+void llspi_stage_kick(void) { };
+void can_prio_comms_resume_usb(void) { };
+
+#include "health.h"
+#include "sys/faults.h"
+#include "libc.h"
+#include "boards/board_declarations.h"
+#include "opendbc/safety/safety.h"
+#include "main_definitions.h"
+#include "comms_definitions.h"
+#include "drivers/can_common.h"
+#include "drivers/can_filter.h"
+#include "drivers/can_prio.h"
+#include "drivers/can_tx_slots.h"
+#include "drivers/can_sched.h"
+#include "drivers/can_tx_timed.h"
+#include "stm32h7/llfdcan_layout.h"
+
+can_ring *tx1_q = &can_tx1_q;
+can_ring *tx2_q = &can_tx2_q;
+can_ring *tx3_q = &can_tx3_q;
+
+#include "can_comms.h"
+
+// ***************************** FDCAN *****************************
+// the FDCAN drivers on the emulated cores of board/fake_fdcan.h. The sim plays the buses: the frames
+// of a core go out one at a time at the bus' bitrate, the ones from other nodes take the bus after
+// what's on it.
+
+#define CAN_INTERRUPT_RATE 16000U
+interrupt interrupts[NUM_INTERRUPTS];
+#define LED_BLUE 2U
+void led_set(uint8_t color, bool enabled) { UNUSED(color); UNUSED(enabled); }
+#include "stm32h7/llfdcan.h"
+#include "drivers/fdcan.h"
+
+typedef struct {
+  bool sending;               // a frame of the core is on the bus
+  uint64_t sending_until_ns;  // end of the frame of the core
+  uint64_t busy_until_ns;     // end of the last frame on the bus
+  uint64_t busy_ns;           // bus time taken since the last stats update
+  uint32_t tx_cnt;
+  uint32_t rx_cnt;
+  uint32_t load;              // per mille
+} sim_bus_t;
+
+static sim_bus_t sim_buses[PANDA_CAN_CNT];
+static uint64_t sim_now_ns = 0U;
+
+// speeds are in 100 bit/s
+static uint64_t sim_bits_ns(uint32_t bits, uint32_t speed) {
+  return ((uint64_t)bits * 10000000ULL) / MAX(speed, 1U);
+}
+
+// without stuff bits. Arbitration, control and the end of the frame at the nominal bitrate, with BRS
+// the data and CRC at the data bitrate
+static uint64_t sim_frame_ns(uint8_t can_number, const fdcan_emu_frame_t *frame) {
+  const bus_config_t *config = &bus_config[BUS_NUM_FROM_CAN_NUM(can_number)];
+  uint32_t data_bits = 8U * dlc_to_len[frame->data_len_code];
+  uint32_t arb_bits = frame->extended ? 32U : 12U;
+  uint64_t ret;
+
+  if (!frame->fd) {
+    ret = sim_bits_ns(arb_bits + 35U + data_bits, config->can_speed);
+  } else {
+    uint32_t crc_bits = (data_bits > 128U) ? 26U : 22U;
+    uint32_t fast_bits = 8U + data_bits + crc_bits;
+    ret = sim_bits_ns(arb_bits + 16U, config->can_speed) + sim_bits_ns(fast_bits, frame->brs ? config->can_data_speed : config->can_speed);
+  }
+  return ret;
+}
+
+// the interrupts of what happened at at_ns, with the timer the handlers read at that time
+static void sim_can_irq(uint8_t can_number, uint64_t at_ns) {
+  MICROSECOND_TIMER->CNT = (uint32_t)(at_ns / 1000U);
+  while (fdcan_emu_irq(can_number) != 0U) {}
+  MICROSECOND_TIMER->CNT = (uint32_t)(sim_now_ns / 1000U);
+}
+
+// a frame from another node, it takes the bus after what's on it
+static void sim_can_receive(uint8_t can_number, const fdcan_emu_frame_t *frame, uint64_t at_ns) {
+  sim_bus_t *bus = &sim_buses[can_number];
+  uint64_t frame_ns = sim_frame_ns(can_number, frame);
+
+  bus->busy_until_ns = MAX(bus->busy_until_ns, at_ns) + frame_ns;
+  bus->busy_ns += frame_ns;
+  bus->rx_cnt += 1U;
+  (void)fdcan_emu_rx(can_number, frame);
+  sim_can_irq(can_number, at_ns);
+}
+
+// puts the pending TX buffer that wins arbitration on the bus
+static void sim_can_tx_start(uint8_t can_number, uint64_t at_ns) {
+  sim_bus_t *bus = &sim_buses[can_number];
+  fdcan_emu_frame_t frame;
+
+  if (!bus->sending && fdcan_emu_tx_start(can_number, &frame)) {
+    uint64_t frame_ns = sim_frame_ns(can_number, &frame);
+    bus->sending = true;
+    bus->sending_until_ns = MAX(bus->busy_until_ns, at_ns) + frame_ns;
+    bus->busy_until_ns = bus->sending_until_ns;
+    bus->busy_ns += frame_ns;
+  }
+}
+
+// runs the bus up to now, returns when the frame on it is done, 0 when idle
+static uint64_t sim_can_run(uint8_t can_number) {
+  sim_bus_t *bus = &sim_buses[can_number];
+
+  while (bus->sending && (bus->sending_until_ns <= sim_now_ns)) {
+    uint64_t done_ns = bus->sending_until_ns;
+    bus->sending = false;
+    if (fdcan_emu_tx_done(can_number, NULL)) {
+      bus->tx_cnt += 1U;
+    }
+    sim_can_irq(can_number, done_ns);
+    // pending buffers go right after
+    sim_can_tx_start(can_number, done_ns);
+  }
+  // and what was queued since the last step
+  sim_can_tx_start(can_number, sim_now_ns);
+  return bus->sending ? bus->sending_until_ns : 0U;
+}
+
+// ***************************** fake hardware *****************************
+// what main_comms.h uses from the parts of board/drivers/drivers.h that are STM32H7 only
+
+float interrupt_load = 0.0f;
+
+#define HARNESS_STATUS_NORMAL 1U
+struct harness_t {
+  uint8_t status;
+  uint16_t sbu1_voltage_mV;
+  uint16_t sbu2_voltage_mV;
+};
+struct harness_t harness = {.status = HARNESS_STATUS_NORMAL, .sbu1_voltage_mV = 0U, .sbu2_voltage_mV = 0U};
+bool harness_check_ignition(void) { return false; }
+void set_intercept_relay(bool intercept, bool ignition_relay) { UNUSED(intercept); UNUSED(ignition_relay); }
+
+// no serial ports
+typedef struct uart_ring uart_ring;
+uart_ring *get_ring_by_number(int a) { UNUSED(a); return NULL; }
+bool get_char(uart_ring *q, char *elem) { UNUSED(q); UNUSED(elem); return false; }
+bool put_char(uart_ring *q, char elem) { UNUSED(q); UNUSED(elem); return true; }
+
+static uint32_t sim_read_voltage_mV(void) { return 12000U; }
+static uint32_t sim_read_current_mA(void) { return 100U; }
+static void sim_set_ir_power(uint8_t percentage) { UNUSED(percentage); }
+static void sim_set_can_mode(uint8_t mode) { UNUSED(mode); }
+static bool sim_read_som_gpio(void) { return false; }
+static struct board board_sim = {
+  .read_voltage_mV = sim_read_voltage_mV,
+  .read_current_mA = sim_read_current_mA,
+  .set_ir_power = sim_set_ir_power,
+  .set_can_mode = sim_set_can_mode,
+  .read_som_gpio = sim_read_som_gpio,
+};
+
+struct fan_state_t fan_state;
+void fan_set_power(uint8_t percentage) { fan_state.power = percentage; }
+void clock_source_set_timer_params(uint16_t param1, uint16_t param2) { UNUSED(param1); UNUSED(param2); }
+
+bool power_save_enabled = false;
+volatile bool stop_mode_requested = false;
+void set_power_save_state(bool enable) { power_save_enabled = enable; }
+
+uint16_t sound_output_level = 0U;
+uint16_t spi_error_count = 0U;
+bool bootkick_reset_triggered = false;
+
+// no SOFs to latch
+#define USB_SOF_LATCH_CNT 8U
+uint8_t usb_sof_latches_get(uint8_t *resp) { UNUSED(resp); return 0U; }
+
+static uint8_t sim_uid[12] = {0x53U, 0x49U, 0x4DU};
+#define UID_BASE sim_uid
+static uint8_t sim_serial_number[0x10];
+#define DEVICE_SERIAL_NUMBER_ADDRESS sim_serial_number
+static uint8_t sim_provision_chunk[0x20] = {0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU,
+                                            0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU};
+#define PROVISION_CHUNK_ADDRESS sim_provision_chunk
+#include "provision.h"
+
+// no signature after the "code"
+int _app_start[0xc000] = {4};
+
+#define ENTER_BOOTLOADER_MAGIC 0xdeadbeefU
+#define ENTER_SOFTLOADER_MAGIC 0xdeadc0deU
+uint32_t enter_bootloader_mode = 0U;
+static bool sim_reset = false;
+static void NVIC_SystemReset(void) { sim_reset = true; }
+
+const uint8_t gitversion[] = "DEV-sim";
+
+// the timer compares of board/drivers/can_tx_timer.h, run from sim_step()
+static bool sim_sched_active = false;
+static uint32_t sim_sched_next = 0U;
+static bool sim_timed_active = false;
+static uint32_t sim_timed_next = 0U;
+void can_sched_timer_kick(void) {
+  sim_sched_active = true;
+  sim_sched_next = microsecond_timer_get();
+}
+void can_tx_timed_timer_kick(void) {
+  sim_timed_active = true;
+  sim_timed_next = microsecond_timer_get();
+}
+
+// ***************************** main.c *****************************
+
+void set_safety_mode(uint16_t mode, uint16_t param);
+bool is_car_safety_mode(uint16_t mode);
+
+#include "main_comms.h"
+
+#define HEARTBEAT_IGNITION_CNT_OFF 2U
+
+// without the relay and CAN transceiver modes
+void set_safety_mode(uint16_t mode, uint16_t param) {
+  uint16_t mode_copy = mode;
+  if (set_safety_hooks(mode_copy, param) == -1) {
+    print("Error: safety set mode failed. Falling back to SILENT\n");
+    mode_copy = SAFETY_SILENT;
+    (void)set_safety_hooks(mode_copy, 0U);
+  }
+  safety_tx_blocked = 0;
+  safety_rx_invalid = 0;
+
+  can_sched_clear();
+  can_tx_timed_clear();
+
+  if ((mode_copy != SAFETY_SILENT) && (mode_copy != SAFETY_NOOUTPUT)) {
+    heartbeat_counter = 0U;
+    heartbeat_lost = false;
+  }
+  can_silent = (mode_copy == SAFETY_SILENT);
+  can_init_all();
+}
+
+bool is_car_safety_mode(uint16_t mode) {
+  return (mode != SAFETY_SILENT) &&
+         (mode != SAFETY_NOOUTPUT) &&
+         (mode != SAFETY_ALLOUTPUT) &&
+         (mode != SAFETY_ELM327);
+}
+
+// the 1Hz part of tick_handler() that's about comms and safety
+static void sim_tick(void) {
+  if (heartbeat_counter < UINT32_MAX) {
+    heartbeat_counter += 1U;
+  }
+  if (is_car_safety_mode(current_safety_mode)) {
+    heartbeat_disabled = false;
+  }
+  if (!heartbeat_disabled && (heartbeat_counter >= HEARTBEAT_IGNITION_CNT_OFF)) {
+    if (is_car_safety_mode(current_safety_mode)) {
+      heartbeat_lost = true;
+    }
+    heartbeat_engaged = false;
+    if (current_safety_mode != SAFETY_SILENT) {
+      set_safety_mode(SAFETY_SILENT, 0U);
+    }
+    if (!power_save_enabled) {
+      set_power_save_state(true);
+    }
+  }
+  uptime_cnt += 1U;
+  safety_tick(&current_safety_config);
+}
+
+// ***************************** USB *****************************
+
+#define SIM_EP1_XFER_MAX 0x800U  // USB_EP1_XFER_MAX
+#define SIM_EP3_XFER_MAX 0x800U  // what can_tx_comms_resume_usb() arms EP3 for
+
+static bool sim_ep3_armed = true;
+static uint32_t sim_ep3_left = SIM_EP3_XFER_MAX;
+static bool outep3_processing = false;
+
+void can_tx_comms_resume_usb(void) {
+  if (!outep3_processing && !sim_ep3_armed) {
+    sim_ep3_armed = true;
+    sim_ep3_left = SIM_EP3_XFER_MAX;
+  }
+}
+
+int sim_control(uint8_t request, uint16_t param1, uint16_t param2, uint16_t length, uint8_t *resp) {
+  ControlPacket_t req = {.request = request, .param1 = param1, .param2 = param2, .length = length};
+  return comms_control_handler(&req, resp);
+}
+
+// transfers of up to SIM_EP1_XFER_MAX, the host's read ends with a short one
+int sim_bulk_read(uint8_t endpoint, uint8_t *data, uint32_t max_len) {
+  int ret = SIM_ERR_INVALID;
+  if (endpoint == 1U) {
+    uint32_t pos = 0U;
+    uint32_t len;
+    do {
+      len = (uint32_t)comms_can_read(&data[pos], MIN(max_len - pos, SIM_EP1_XFER_MAX));
+      pos += len;
+    } while ((len > 0U) && ((len % USBPACKET_MAX_SIZE) == 0U) && (pos < max_len));
+    ret = (int)pos;
+  }
+  return ret;
+}
+
+// EP3 takes packets until its transfer completes, then NAKs until the TX queues have room again
+int sim_bulk_write(uint8_t endpoint, const uint8_t *data, uint32_t len) {
+  int ret = SIM_ERR_INVALID;
+  if (endpoint == 2U) {
+    for (uint32_t pos = 0U; pos < len; pos += USBPACKET_MAX_SIZE) {
+      comms_endpoint2_write(&data[pos], MIN(len - pos, USBPACKET_MAX_SIZE));
+    }
+    ret = (int)len;
+  } else if (endpoint == 3U) {
+    uint32_t pos = 0U;
+    while ((pos < len) && sim_ep3_armed) {
+      uint32_t pkt = MIN(MIN(len - pos, USBPACKET_MAX_SIZE), sim_ep3_left);
+      outep3_processing = true;
+      comms_can_write(&data[pos], pkt);
+      pos += pkt;
+      sim_ep3_left -= pkt;
+      if ((sim_ep3_left == 0U) || (pkt < USBPACKET_MAX_SIZE)) {
+        sim_ep3_armed = false;
+        outep3_processing = false;
+        refresh_can_tx_slots_available();
+      }
+    }
+    ret = (int)pos;
+  } else {
+  }
+  return ret;
+}
+
+// ***************************** traffic *****************************
+
+typedef struct {
+  bool enabled;
+  sim_traffic_t cfg;
+  uint64_t next_ns;
+  uint32_t sent;
+} sim_traffic_gen_t;
+
+static sim_traffic_gen_t sim_traffic[SIM_TRAFFIC_CNT];
+
+int sim_traffic_add(const sim_traffic_t *traffic) {
+  int ret = SIM_ERR_INVALID;
+  if ((traffic->bus < PANDA_CAN_CNT) && (traffic->data_len_code < 16U) && (traffic->period_us > 0U)) {
+    for (uint8_t i = 0U; i < SIM_TRAFFIC_CNT; i++) {
+      if (!sim_traffic[i].enabled) {
+        sim_traffic[i].enabled = true;
+        sim_traffic[i].cfg = *traffic;
+        sim_traffic[i].next_ns = sim_now_ns;
+        sim_traffic[i].sent = 0U;
+        ret = (int)i;
+        break;
+      }
+    }
+  }
+  return ret;
+}
+
+void sim_traffic_clear(void) {
+  (void)memset(sim_traffic, 0, sizeof(sim_traffic));
+}
+
+static void sim_traffic_run(sim_traffic_gen_t *gen) {
+  const sim_traffic_t *cfg = &gen->cfg;
+  while (gen->enabled && (gen->next_ns <= sim_now_ns)) {
+    fdcan_emu_frame_t frame = {0};
+    frame.extended = (cfg->flags & SIM_TRAFFIC_FLAG_EXTENDED) != 0U;
+    frame.fd = (cfg->flags & SIM_TRAFFIC_FLAG_FD) != 0U;
+    frame.brs = frame.fd && ((cfg->flags & SIM_TRAFFIC_FLAG_BRS) != 0U);
+    frame.addr = cfg->addr;
+    frame.data_len_code = cfg->data_len_code;
+    (void)memcpy(frame.data, cfg->data, dlc_to_len[cfg->data_len_code]);
+    if ((cfg->flags & SIM_TRAFFIC_FLAG_COUNTER) != 0U) {
+      for (uint8_t i = 0U; i < MIN(dlc_to_len[cfg->data_len_code], 4U); i++) {
+        frame.data[i] = (uint8_t)(gen->sent >> (8U * i));
+      }
+    }
+    sim_can_receive(CAN_NUM_FROM_BUS_NUM(cfg->bus), &frame, gen->next_ns);
+
+    gen->sent += 1U;
+    gen->next_ns += (uint64_t)cfg->period_us * 1000U;
+    if ((cfg->count != 0U) && (gen->sent >= cfg->count)) {
+      gen->enabled = false;
+    }
+  }
+}
+
+// ***************************** sim *****************************
+
+static uint64_t sim_tick_next_ns = 0U;
+
+bool sim_init(uint64_t now_us) {
+  bool ret = false;
+  if (fdcan_emu_ram != NULL) {
+    sim_now_ns = now_us * 1000U;
+    MICROSECOND_TIMER->CNT = (uint32_t)now_us;
+    current_board = &board_sim;
+    hw_type = HW_TYPE_RED_PANDA;
+    fdcan_emu_reset();
+    set_safety_mode(SAFETY_SILENT, 0U);
+    sim_tick_next_ns = sim_now_ns + 1000000000ULL;
+    ret = true;
+  }
+  return ret;
+}
+
+static void sim_next(uint64_t *next, uint64_t t) {
+  if ((t != 0U) && (t < *next)) {
+    *next = t;
+  }
+}
+
+uint32_t sim_step(uint64_t now_us) {
+  sim_now_ns = now_us * 1000U;
+  MICROSECOND_TIMER->CNT = (uint32_t)now_us;
+  uint64_t next = sim_tick_next_ns;
+
+  for (uint8_t i = 0U; i < SIM_TRAFFIC_CNT; i++) {
+    sim_traffic_run(&sim_traffic[i]);
+    if (sim_traffic[i].enabled) {
+      sim_next(&next, sim_traffic[i].next_ns);
+    }
+  }
+
+  uint32_t now = microsecond_timer_get();
+  if (sim_sched_active && ((now - sim_sched_next) < 0x80000000U)) {
+    sim_sched_active = can_sched_run(now, &sim_sched_next);
+  }
+  if (sim_timed_active && ((now - sim_timed_next) < 0x80000000U)) {
+    sim_timed_active = can_tx_timed_run(now, &sim_timed_next);
+  }
+  if (sim_sched_active) {
+    sim_next(&next, sim_now_ns + ((uint64_t)(sim_sched_next - now) * 1000U));
+  }
+  if (sim_timed_active) {
+    sim_next(&next, sim_now_ns + ((uint64_t)(sim_timed_next - now) * 1000U));
+  }
+
+  for (uint8_t i = 0U; i < PANDA_CAN_CNT; i++) {
+    sim_next(&next, sim_can_run(i));
+  }
+
+  if (sim_now_ns >= sim_tick_next_ns) {
+    for (uint8_t i = 0U; i < PANDA_CAN_CNT; i++) {
+      sim_buses[i].load = (uint32_t)MIN(sim_buses[i].busy_ns / 1000000U, 1000U);
+      sim_buses[i].busy_ns = 0U;
+    }
+    sim_tick();
+    sim_tick_next_ns += 1000000000ULL;
+  }
+
+  return (uint32_t)((MAX(next, sim_now_ns) - sim_now_ns + 999U) / 1000U);
+}
+
+void sim_stats_get(sim_stats_t *stats) {
+  for (uint8_t i = 0U; i < PANDA_CAN_CNT; i++) {
+    stats->rx_cnt[i] = sim_buses[i].rx_cnt;
+    stats->tx_cnt[i] = sim_buses[i].tx_cnt;
+    stats->bus_load[i] = sim_buses[i].load;
+  }
+}
+
+bool sim_reset_requested(void) {
+  return sim_reset;
+}
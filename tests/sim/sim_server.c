@@ -0,0 +1,296 @@
+// Serves the virtual panda on a Unix socket, see sim.h for the protocol.
+// usage: panda_sim [socket path], PANDA_SIM_SOCKET or SIM_SOCKET_DEFAULT otherwise
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sim.h"
+
+#define CLIENT_CNT 8
+#define STEP_MAX_US 10000U
+
+typedef struct {
+  int fd;
+  // a bulk write the endpoint hasn't taken all of yet
+  bool writing;
+  uint8_t endpoint;
+  uint32_t len;
+  uint32_t pos;
+  uint64_t deadline_us;
+  uint8_t data[SIM_XFER_MAX];
+} client_t;
+
+static client_t clients[CLIENT_CNT];
+static uint8_t resp[SIM_XFER_MAX];
+static volatile sig_atomic_t stop = 0;
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000U) + ((uint64_t)ts.tv_nsec / 1000U);
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+  uint8_t *p = buf;
+  while (len > 0U) {
+    ssize_t n = recv(fd, p, len, MSG_WAITALL);
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR)) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  while (len > 0U) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR)) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool respond(client_t *c, int32_t ret, const uint8_t *data) {
+  bool ok = write_all(c->fd, &ret, sizeof(ret));
+  if (ok && (data != NULL) && (ret > 0)) {
+    ok = write_all(c->fd, data, (size_t)ret);
+  }
+  return ok;
+}
+
+static void client_close(client_t *c) {
+  close(c->fd);
+  c->fd = -1;
+  c->writing = false;
+}
+
+// the rest of a bulk write, as far as the endpoint takes it
+static bool client_write(client_t *c) {
+  int ret = sim_bulk_write(c->endpoint, &c->data[c->pos], c->len - c->pos);
+  bool ok = true;
+  if (ret < 0) {
+    c->writing = false;
+    ok = respond(c, ret, NULL);
+  } else {
+    c->pos += (uint32_t)ret;
+    if (c->pos == c->len) {
+      c->writing = false;
+      ok = respond(c, (int32_t)c->len, NULL);
+    } else if ((c->deadline_us != 0U) && (now_us() >= c->deadline_us)) {
+      c->writing = false;
+      ok = respond(c, SIM_ERR_TIMEOUT, NULL);
+    } else {
+    }
+  }
+  return ok;
+}
+
+static bool client_request(client_t *c) {
+  sim_request_t req;
+  if (!read_all(c->fd, &req, sizeof(req)) || (req.length > SIM_XFER_MAX)) {
+    return false;
+  }
+
+  // everything sent along is read, even when it's not used
+  bool has_data = (req.type == SIM_CONTROL_WRITE) || (req.type == SIM_BULK_WRITE) || (req.type == SIM_TRAFFIC);
+  if (has_data && !read_all(c->fd, c->data, req.length)) {
+    return false;
+  }
+
+  sim_step(now_us());
+  bool ok;
+  switch (req.type) {
+    case SIM_CONTROL_READ:
+    case SIM_CONTROL_WRITE:
+      {
+        // handlers write up to a packet, whatever the request's length
+        int ret = sim_control(req.request, req.param1, req.param2, (uint16_t)req.length, resp);
+        if (req.type == SIM_CONTROL_READ) {
+          ok = respond(c, (ret < (int)req.length) ? ret : (int32_t)req.length, resp);
+        } else {
+          ok = respond(c, (int32_t)req.length, NULL);
+        }
+      }
+      break;
+    case SIM_BULK_READ:
+      ok = respond(c, sim_bulk_read(req.request, resp, req.length), resp);
+      break;
+    case SIM_BULK_WRITE:
+      c->writing = true;
+      c->endpoint = req.request;
+      c->len = req.length;
+      c->pos = 0U;
+      c->deadline_us = (req.timeout_ms != 0U) ? (now_us() + ((uint64_t)req.timeout_ms * 1000U)) : 0U;
+      ok = client_write(c);
+      break;
+    case SIM_TRAFFIC:
+      {
+        sim_traffic_t traffic;
+        if (req.length == sizeof(traffic)) {
+          memcpy(&traffic, c->data, sizeof(traffic));
+          ok = respond(c, sim_traffic_add(&traffic), NULL);
+        } else {
+          ok = respond(c, SIM_ERR_INVALID, NULL);
+        }
+      }
+      break;
+    case SIM_TRAFFIC_CLEAR:
+      sim_traffic_clear();
+      ok = respond(c, 0, NULL);
+      break;
+    case SIM_STATS:
+      {
+        sim_stats_t stats;
+        sim_stats_get(&stats);
+        ok = respond(c, sizeof(stats), (const uint8_t *)&stats);
+      }
+      break;
+    default:
+      ok = respond(c, SIM_ERR_INVALID, NULL);
+      break;
+  }
+  return ok;
+}
+
+static int listen_on(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  unlink(path);
+  if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, CLIENT_CNT) < 0)) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void on_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+int main(int argc, char **argv) {
+  const char *path = (argc > 1) ? argv[1] : getenv("PANDA_SIM_SOCKET");
+  if (path == NULL) {
+    path = SIM_SOCKET_DEFAULT;
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  int listen_fd = listen_on(path);
+  if (listen_fd < 0) {
+    return 1;
+  }
+  for (int i = 0; i < CLIENT_CNT; i++) {
+    clients[i].fd = -1;
+  }
+
+  if (!sim_init(now_us())) {
+    fprintf(stderr, "FDCAN message RAM address not available\n");
+    return 1;
+  }
+  printf("panda sim on %s\n", path);
+  fflush(stdout);
+
+  while (!stop) {
+    uint32_t wait_us = sim_step(now_us());
+
+    struct pollfd fds[CLIENT_CNT + 1];
+    int idx[CLIENT_CNT + 1];
+    nfds_t nfds = 0;
+    fds[nfds] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+    idx[nfds++] = -1;
+    for (int i = 0; i < CLIENT_CNT; i++) {
+      if (clients[i].fd >= 0) {
+        if (clients[i].writing) {
+          // retried after every step
+          if (!client_write(&clients[i])) {
+            client_close(&clients[i]);
+          } else if (clients[i].writing) {
+            wait_us = (wait_us < 100U) ? wait_us : 100U;
+          } else {
+          }
+        }
+        if ((clients[i].fd >= 0) && !clients[i].writing) {
+          fds[nfds] = (struct pollfd){.fd = clients[i].fd, .events = POLLIN};
+          idx[nfds++] = i;
+        }
+      }
+    }
+
+    wait_us = (wait_us < STEP_MAX_US) ? wait_us : STEP_MAX_US;
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = (long)wait_us * 1000L};
+    if (ppoll(fds, nfds, &timeout, NULL) <= 0) {
+      continue;
+    }
+
+    for (nfds_t n = 0; n < nfds; n++) {
+      if ((fds[n].revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+        continue;
+      }
+      if (idx[n] < 0) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        for (int i = 0; (fd >= 0) && (i < CLIENT_CNT); i++) {
+          if (clients[i].fd < 0) {
+            clients[i].fd = fd;
+            clients[i].writing = false;
+            fd = -1;
+          }
+        }
+        if (fd >= 0) {
+          close(fd);
+        }
+      } else if (!client_request(&clients[idx[n]])) {
+        client_close(&clients[idx[n]]);
+      } else {
+      }
+    }
+
+    // like a reset, the clients see the disconnect and the socket comes back up
+    if (sim_reset_requested()) {
+      for (int i = 0; i < CLIENT_CNT; i++) {
+        if (clients[i].fd >= 0) {
+          client_close(&clients[i]);
+        }
+      }
+      close(listen_fd);
+      execv("/proc/self/exe", argv);
+      perror("execv");
+      return 1;
+    }
+  }
+
+  unlink(path);
+  return 0;
+}
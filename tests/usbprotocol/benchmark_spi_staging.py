@@ -0,0 +1,31 @@
+#!/usr/bin/env python3
+# Time from an exchange header's last byte to the response being ready, with the next response
+# pre-staged in the background vs. read from the CAN RX rings on demand in the header interrupt.
+# The interrupt runs on PC here, so the times are relative; the RX ring bytes read in the header
+# interrupt are what it costs on the panda.
+import statistics
+
+from panda.tests.usbprotocol.test_spi import push_rx, random_can_messages, spi_handle
+
+ROUNDS = 200
+
+
+def bench(background, msgs_per_exchange):
+  handle = spi_handle(background)
+  handle.can_exchange()
+  handle.dev.headers.clear()
+  for _ in range(ROUNDS):
+    push_rx(random_can_messages(msgs_per_exchange))
+    handle.can_exchange()
+
+  times = [dt for dt, _ in handle.dev.headers]
+  nbytes = [n for _, n in handle.dev.headers]
+  return statistics.median(times) / 1e3, max(times) / 1e3, statistics.mean(nbytes)
+
+
+if __name__ == "__main__":
+  for msgs in (1, 10, 50, 200):
+    for background in (False, True):
+      median_us, max_us, nbytes = bench(background, msgs)
+      desc = "pre-staged" if background else "on demand "
+      print(f"{median_us:7.2f} us median, {max_us:7.2f} us max, {nbytes:7.1f} ring bytes read - {desc}, {msgs} msgs per exchange")
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+import random
+import threading
+import time
+import unittest
+from unittest.mock import patch
+
+import usb1
+from panda import DLC_TO_LEN, Panda, pack_can_buffer
+from panda.python.base import BaseHandle
+
+
+def random_transfers(n):
+  msgs = []
+  for _ in range(n):
+    dat = bytes(random.getrandbits(8) for _ in range(DLC_TO_LEN[random.randrange(len(DLC_TO_LEN))]))
+    msgs.append((random.randint(1, 0x7FF), dat, random.randint(0, 2)))
+  wire = b"".join(pack_can_buffer(msgs))
+
+  # packets are split across transfers, with empty reads in between
+  transfers = []
+  pos = 0
+  while pos < len(wire):
+    size = random.choice([0, random.randint(1, 16384)])
+    transfers.append(wire[pos:pos + size])
+    pos += size
+  return msgs, transfers
+
+
+class ReplayHandle(BaseHandle):
+  """Replays recorded CAN bulk IN transfers, then reads nothing or raises error"""
+  def __init__(self, transfers, error=None):
+    self._transfers = list(transfers)
+    self._error = error
+    self.done = threading.Event()
+
+  def close(self):
+    pass
+
+  def controlWrite(self, request_type, request, value, index, data, timeout=0, expect_disconnect=False):
+    return 0
+
+  def controlRead(self, request_type, request, value, index, length, timeout=0):
+    return b''
+
+  def bulkWrite(self, endpoint, data, timeout=0):
+    return len(data)
+
+  def bulkRead(self, endpoint, length, timeout=0):
+    assert endpoint == 1
+    if len(self._transfers) == 0:
+      self.done.set()
+      if self._error is not None:
+        raise self._error
+      return b''
+    return self._transfers.pop(0)
+
+
+class TestCanStream(unittest.TestCase):
+  def setUp(self):
+    with patch.object(Panda, "connect"):
+      self.panda = Panda("replay", cli=False)
+    self.panda.can_version = Panda.CAN_PACKET_VERSION
+
+  def tearDown(self):
+    self.panda.close()
+
+  def _start(self, transfers, error=None, **kwargs):
+    self.panda._handle = ReplayHandle(transfers, error)
+    return self.panda.can_stream_start(**kwargs)
+
+  def test_all_received_in_order(self):
+    msgs, transfers = random_transfers(2000)
+    start = time.monotonic()
+    stream = self._start(transfers)
+    entries = []
+    while len(entries) < len(msgs):
+      entries += stream.read(timeout=5)
+    self.assertEqual([msg for _, msg in entries], msgs)
+
+    host_times = [t for t, _ in entries]
+    self.assertEqual(host_times, sorted(host_times))
+    self.assertTrue(start <= host_times[0] <= host_times[-1] <= time.monotonic())
+    self.assertEqual(stream.stats(), {"received": len(msgs), "dropped": 0, "queued": 0})
+
+  def test_stalled_consumer_drops_counted(self):
+    msgs, transfers = random_transfers(1000)
+    stream = self._start(transfers, ring_size=100)
+    self.assertTrue(self.panda._handle.done.wait(5))
+    self.panda.can_stream_stop()
+
+    # the oldest are kept, like the panda's own ring
+    self.assertEqual(stream.stats(), {"received": len(msgs), "dropped": len(msgs) - 100, "queued": 100})
+    self.assertEqual([msg for _, msg in stream.read()], msgs[:100])
+
+  def test_batch_reads(self):
+    msgs, transfers = random_transfers(100)
+    stream = self._start(transfers)
+    self.assertTrue(self.panda._handle.done.wait(5))
+    self.assertEqual(len(stream.read(max_msgs=10, timeout=0)), 10)
+    self.assertEqual(len(stream.read(timeout=0)), 90)
+
+    # non-blocking and timed out reads come back empty
+    self.assertEqual(stream.read(timeout=0), [])
+    t = time.monotonic()
+    self.assertEqual(stream.read(timeout=0.05), [])
+    self.assertGreaterEqual(time.monotonic() - t, 0.05)
+
+  def test_iterator_ends_on_stop(self):
+    msgs, transfers = random_transfers(300)
+    stream = self._start(transfers)
+    received = []
+    for _, msg in stream:
+      received.append(msg)
+      if len(received) == len(msgs):
+        threading.Timer(0.05, self.panda.can_stream_stop).start()
+    self.assertEqual(received, msgs)
+    self.assertFalse(stream.running)
+
+  def test_can_recv_unavailable_while_streaming(self):
+    self._start([])
+    with self.assertRaises(RuntimeError):
+      self.panda.can_recv()
+    with self.assertRaises(RuntimeError):
+      self.panda.can_stream_start()
+    self.panda.can_stream_stop()
+    self.assertEqual(self.panda.can_recv(), [])
+
+  def test_read_error_raised_after_drain(self):
+    msgs, transfers = random_transfers(50)
+    stream = self._start(transfers, error=usb1.USBErrorPipe())
+    entries = []
+    with self.assertRaises(usb1.USBErrorPipe):
+      while True:
+        entries += stream.read(timeout=5)
+    self.assertEqual([msg for _, msg in entries], msgs)
+    self.assertFalse(stream.running)
+
+
+if __name__ == "__main__":
+  unittest.main()
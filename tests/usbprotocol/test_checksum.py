@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+import random
+import unittest
+from functools import reduce
+
+from panda import calculate_checksum
+from panda.python.spi import crc8
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+SPI_CHECKSUM_START = 0xAB  # board/drivers/spi.h
+SPI_BUF_SIZE = 4096
+
+
+def xor(init, dat):
+  return reduce(lambda a, b: a ^ b, dat, init)
+
+
+class TestChecksum(unittest.TestCase):
+  def setUp(self):
+    self.rnd = random.Random(0)
+    # one extra word, for all the alignments of the start
+    self.buf = ffi.new(f"uint8_t[{SPI_BUF_SIZE + 4}]")
+    self.buf[0:SPI_BUF_SIZE + 4] = self.rnd.randbytes(SPI_BUF_SIZE + 4)
+
+  def test_xor_all_lengths_and_alignments(self):
+    dat = bytes(self.buf)
+    for offset in range(4):
+      expected = 0
+      for length in range(SPI_BUF_SIZE + 1):
+        expected ^= dat[offset + length - 1] if length > 0 else 0
+        self.assertEqual(lpp.checksum_xor(0, self.buf + offset, length), expected)
+        self.assertEqual(lpp.calculate_checksum(self.buf + offset, length), expected)
+
+  def test_xor_byte_values(self):
+    # every byte value in every lane of a word, and every init
+    for lane in range(8):
+      for v in range(256):
+        self.buf[0:8] = bytes(8)
+        self.buf[lane] = v
+        for init in (0, SPI_CHECKSUM_START, 0xFF):
+          self.assertEqual(lpp.checksum_xor(init, self.buf, 8), init ^ v)
+
+  def test_xor_matches_host(self):
+    for _ in range(200):
+      dat = self.rnd.randbytes(self.rnd.randrange(0, 80))
+      self.assertEqual(lpp.calculate_checksum(dat, len(dat)), calculate_checksum(dat))
+
+  def test_spi_validate(self):
+    for length in range(1, 300):
+      dat = bytearray(self.rnd.randbytes(length))
+      dat[-1] = xor(SPI_CHECKSUM_START, dat[:-1])
+      self.assertTrue(lpp.spi_validate_checksum(bytes(dat), length))
+      dat[self.rnd.randrange(length)] ^= 1 << self.rnd.randrange(8)
+      self.assertFalse(lpp.spi_validate_checksum(bytes(dat), length))
+
+  def test_crc8_byte_values(self):
+    for v in range(256):
+      self.assertEqual(lpp.crc8_spi(bytes([v]), 1), crc8(bytes([v])))
+    for v in range(0x10000):
+      dat = v.to_bytes(2, "little")
+      self.assertEqual(lpp.crc8_spi(dat, 2), crc8(dat))
+
+  def test_crc8_matches_host(self):
+    dat = bytes(self.buf)
+    for length in list(range(300)) + [SPI_BUF_SIZE]:
+      self.assertEqual(lpp.crc8_spi(dat, length), crc8(dat[:length]))
+
+
+if __name__ == "__main__":
+  unittest.main()
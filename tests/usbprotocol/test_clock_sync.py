@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+import random
+import struct
+import unittest
+from unittest.mock import patch
+
+from panda import Panda
+from panda.python.base import BaseHandle
+
+
+class SimulatedClock:
+  def __init__(self):
+    self.now = 1000.0
+
+  def __call__(self):
+    return self.now
+
+
+class SimulatedPanda(BaseHandle):
+  """Answers the microsecond timer request with a drifting timer, after a jittery USB latency each way"""
+  def __init__(self, clock, drift_ppm, timer_start, latency, jitter):
+    self.clock = clock
+    self.drift_ppm = drift_ppm
+    self.timer_start = timer_start
+    self.latency = latency
+    self.jitter = jitter
+
+  def timer(self, host_time):
+    return int(self.timer_start + (host_time - 1000.0) * 1e6 * (1 + self.drift_ppm * 1e-6)) % 2**32
+
+  def close(self):
+    pass
+
+  def controlWrite(self, request_type, request, value, index, data, timeout=0, expect_disconnect=False):
+    pass
+
+  def controlRead(self, request_type, request, value, index, length, timeout=0):
+    assert request == 0xa8
+    self.clock.now += self.latency + random.uniform(0, self.jitter)
+    t = self.clock.now
+    self.clock.now += self.latency + random.uniform(0, self.jitter)
+    return struct.pack("I", self.timer(t))
+
+  def bulkWrite(self, endpoint, data, timeout=0):
+    pass
+
+  def bulkRead(self, endpoint, length, timeout=0):
+    return b''
+
+
+class TestClockSync(unittest.TestCase):
+  def setUp(self):
+    with patch.object(Panda, "connect"):
+      self.panda = Panda("sim", cli=False)
+    self.clock = SimulatedClock()
+
+  def _sync(self, drift_ppm, timer_start, samples=40, latency=100e-6, jitter=300e-6):
+    self.sim = SimulatedPanda(self.clock, drift_ppm, timer_start, latency, jitter)
+    self.panda._handle = self.sim
+    sync = self.panda.clock_sync(clock=self.clock)
+    for _ in range(samples):
+      sync.sample()
+      self.clock.now += 1.0
+    return sync
+
+  def _check_converges(self, sync, target_error=100e-6):
+    for _ in range(200):
+      host_time = self.clock.now + random.uniform(-30.0, 5.0)
+      est, err = sync.to_host(self.sim.timer(host_time))
+      self.assertLess(abs(est - host_time), target_error)
+      self.assertLessEqual(abs(est - host_time), err + 1e-6)
+      self.assertLess(err, 1e-3)
+      self.assertLessEqual(abs(sync.to_timer(host_time) - self.sim.timer(host_time)), 1 + target_error * 1e6)
+
+  def test_converges(self):
+    for drift_ppm in (-80.0, 0.0, 35.0):
+      sync = self._sync(drift_ppm, random.randrange(2**32 - 2**31))
+      self.assertAlmostEqual(sync.drift_ppm, drift_ppm, delta=3.0)
+      self._check_converges(sync)
+
+  def test_timer_wraparound(self):
+    # wraps halfway through the samples
+    sync = self._sync(50.0, 2**32 - 20_000_000)
+    self.assertAlmostEqual(sync.drift_ppm, 50.0, delta=3.0)
+    self._check_converges(sync)
+
+  def test_not_synced(self):
+    sync = self.panda.clock_sync(clock=self.clock)
+    self.assertFalse(sync.synced)
+    with self.assertRaises(RuntimeError):
+      sync.to_host(0)
+
+  def test_single_sample(self):
+    sync = self._sync(0.0, 5_000_000, samples=1)
+    est, err = sync.to_host(self.sim.timer(self.clock.now - 1.0))
+    self.assertLess(abs(est - (self.clock.now - 1.0)), err)
+    self.assertLess(err, 1e-3)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -1,15 +1,21 @@
 #!/usr/bin/env python3
 import random
 import unittest
+from collections import deque
 
 from opendbc.car.structs import CarParams
-from panda import DLC_TO_LEN, USBPACKET_MAX_SIZE, pack_can_buffer, unpack_can_buffer
+from panda import DLC_TO_LEN, USBPACKET_MAX_SIZE, CANPACKET_HEAD_SIZE, CANPACKET_TIMESTAMP_SIZE, Panda, \
+                  calculate_checksum, pack_can_buffer, unpack_can_buffer
 from panda.tests.libpanda import libpanda_py
 
 lpp = libpanda_py.libpanda
 
 CHUNK_SIZE = USBPACKET_MAX_SIZE
 TX_QUEUES = (lpp.tx1_q, lpp.tx2_q, lpp.tx3_q)
+RX_RING_CNT = len(lpp.can_rx_rings)
+COMMS_FLAG_TIMESTAMPS = Panda.CAN_COMMS_FLAG_TIMESTAMPS
+USB_EP1_XFER_MAX = 0x800  # board/drivers/usb.h
+MAX_TRANSFER_SIZE = 16384
 
 
 def unpackage_can_msg(pkt):
@@ -29,10 +35,42 @@ def random_can_messages(n, bus=None):
   return msgs
 
 
+class USBBulkIn:
+  """
+  Model of the CAN bulk IN endpoint. An IN token the device has nothing loaded for starts a
+  transfer with what comms_can_read() returns, up to USB_EP1_XFER_MAX, sent in max size
+  packets and a short last one, or a zero length packet when nothing is queued. A host read
+  completes on a short packet or when its buffer is full, a transfer that didn't fit is
+  picked up by the next read.
+  """
+  def __init__(self):
+    self.packets = deque()
+    self.xfers = 0
+    self.dat = libpanda_py.ffi.new(f"uint8_t[{USB_EP1_XFER_MAX}]")
+
+  def read(self, max_len=MAX_TRANSFER_SIZE):
+    assert max_len % CHUNK_SIZE == 0
+    buf = b""
+    while len(buf) < max_len:
+      if len(self.packets) == 0:
+        rx_len = lpp.comms_can_read(self.dat, USB_EP1_XFER_MAX)
+        xfer = bytes(self.dat[0:rx_len])
+        self.packets.extend(xfer[i:i + CHUNK_SIZE] for i in range(0, rx_len, CHUNK_SIZE))
+        if rx_len == 0:
+          self.packets.append(b"")
+        self.xfers += 1
+      pkt = self.packets.popleft()
+      buf += pkt
+      if len(pkt) < CHUNK_SIZE:
+        break
+    return buf
+
+
 class TestPandaComms(unittest.TestCase):
   def setUp(self):
     lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
-    lpp.comms_can_reset()
+    lpp.comms_can_reset(0)
+    lpp.can_rx_clear()
 
   def test_tx_queues(self):
     for bus in range(len(TX_QUEUES)):
@@ -51,7 +89,7 @@ class TestPandaComms(unittest.TestCase):
     test_msg = (0x100, b"test", 0)
     for _ in range(100):
       can_pkt_tx = libpanda_py.make_CANPacket(test_msg[0], test_msg[2], test_msg[1])
-      lpp.can_push(lpp.rx_q, can_pkt_tx)
+      lpp.can_rx_push(0, can_pkt_tx, 0)
 
     # read a small chunk such that we have some overflow
     TINY_CHUNK_SIZE = 6
@@ -63,7 +101,7 @@ class TestPandaComms(unittest.TestCase):
     assert len(overflow) > 0, "overflow buffer should not be empty"
 
     # reset the comms to clear the overflow buffer on the panda side
-    lpp.comms_can_reset()
+    lpp.comms_can_reset(0)
 
     # read a large chunk, which should now contain valid messages
     LARGE_CHUNK_SIZE = 512
@@ -86,7 +124,7 @@ class TestPandaComms(unittest.TestCase):
     lpp.comms_can_write(bytes(packed[0][:TINY_CHUNK_SIZE]), TINY_CHUNK_SIZE)
 
     # reset the comms to clear the overflow buffer on the panda side
-    lpp.comms_can_reset()
+    lpp.comms_can_reset(0)
 
     # write a full valid chunk, which should now contain valid messages
     lpp.comms_can_write(bytes(packed[1]), len(packed[1]))
@@ -101,6 +139,30 @@ class TestPandaComms(unittest.TestCase):
     for m in queue_msgs:
       assert m == test_msg, "message buffer should contain valid test messages"
 
+  def test_can_write_bad_checksum(self):
+    # checked once on the way in, a bad packet doesn't reach the TX queue
+    msgs = [(0x100, b"bad", 1), (0x101, b"good", 1)]
+    buf = bytearray(pack_can_buffer(msgs)[0])
+    buf[CANPACKET_HEAD_SIZE] ^= 0x1
+    errors = lpp.can_health[1].total_tx_checksum_error_cnt
+    lpp.comms_can_write(bytes(buf), len(buf))
+
+    queue_msgs = []
+    pkt = libpanda_py.ffi.new('CANPacket_t *')
+    while lpp.can_pop(TX_QUEUES[1], pkt):
+      queue_msgs.append(unpackage_can_msg(pkt))
+    self.assertEqual(queue_msgs, msgs[1:])
+    self.assertEqual(lpp.can_health[1].total_tx_checksum_error_cnt, errors + 1)
+
+  def test_can_receive_ignores_internal_checksum(self):
+    # frames inside the firmware don't carry a checksum, it's set when serialized for the host
+    pkt = libpanda_py.make_CANPacket(0x123, 1, b"\x01\x02")
+    for checksum in (0x00, 0x5A, 0xFF):
+      pkt[0].checksum = checksum
+      lpp.can_rx_push(1, pkt, 0)
+    dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+    rx_len = lpp.comms_can_read(dat, CHUNK_SIZE)
+    self.assertEqual(unpack_can_buffer(bytes(dat[0:rx_len])), ([(0x123, b"\x01\x02", 1)] * 3, b""))
 
   def test_can_send_usb(self):
     for bus in range(3):
@@ -130,23 +192,16 @@ class TestPandaComms(unittest.TestCase):
 
     rx_msgs = []
     overflow_buf = b""
-    while len(packets) > 0:
-      # Push into queue
-      while lpp.can_slots_empty(lpp.rx_q) > 0 and len(packets) > 0:
-        lpp.can_push(lpp.rx_q, packets.pop(0))
-
-      # Simulate USB bulk IN chunks
-      MAX_TRANSFER_SIZE = 16384
-      dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+    pushed = 0
+    while pushed < len(packets):
+      # Push into the RX rings in turn, the timestamps give the order across rings
+      while pushed < len(packets) and lpp.can_rx_push(pushed % RX_RING_CNT, packets[pushed], pushed):
+        pushed += 1
+
+      # Simulate USB bulk IN transfers
+      usb = USBBulkIn()
       while True:
-        buf = b""
-        while len(buf) < MAX_TRANSFER_SIZE:
-          max_size = min(CHUNK_SIZE, MAX_TRANSFER_SIZE - len(buf))
-          rx_len = lpp.comms_can_read(dat, max_size)
-          buf += bytes(dat[0:rx_len])
-          if rx_len < max_size:
-            break
-
+        buf = usb.read()
         if len(buf) == 0:
           break
         unpacked_msgs, overflow_buf = unpack_can_buffer(overflow_buf + buf)
@@ -155,6 +210,85 @@ class TestPandaComms(unittest.TestCase):
     self.assertEqual(len(rx_msgs), len(msgs))
     self.assertEqual(rx_msgs, msgs)
 
+  def test_can_receive_usb_packetization(self):
+    # 14 bytes per packet
+    def push(n):
+      for i in range(n):
+        assert lpp.can_rx_push(0, libpanda_py.make_CANPacket(0x100, 0, i.to_bytes(8, "little")), i)
+      return [(0x100, i.to_bytes(8, "little"), 0) for i in range(n)]
+
+    # a short last packet completes the read
+    usb = USBBulkIn()
+    msgs = push(33)
+    self.assertEqual(unpack_can_buffer(usb.read()), (msgs, b""))
+    self.assertEqual(usb.xfers, 1)
+
+    # a transfer of only max size packets needs the zero length one
+    usb = USBBulkIn()
+    msgs = push(32)
+    self.assertEqual(unpack_can_buffer(usb.read()), (msgs, b""))
+    self.assertEqual(usb.xfers, 2)
+    self.assertEqual(usb.read(), b"")
+    self.assertEqual(usb.xfers, 3)
+
+    # a read spans transfers, one IN token interrupt per USB_EP1_XFER_MAX bytes instead of per packet
+    usb = USBBulkIn()
+    msgs = push(300)
+    self.assertEqual(unpack_can_buffer(usb.read()), (msgs, b""))
+    self.assertEqual(usb.xfers, -(-300 * 14 // USB_EP1_XFER_MAX))
+
+    # the rest of a transfer larger than the read goes with the next one
+    usb = USBBulkIn()
+    msgs = push(100)
+    buf = usb.read(1024)
+    self.assertEqual(len(buf), 1024)
+    buf += usb.read(1024)
+    self.assertEqual(unpack_can_buffer(buf), (msgs, b""))
+    self.assertEqual(usb.xfers, 1)
+
+  def test_can_receive_timestamps(self):
+    lpp.comms_can_reset(COMMS_FLAG_TIMESTAMPS)
+
+    msgs = random_can_messages(5000)
+    timestamps = [random.getrandbits(32) for _ in msgs]
+    packets = [(libpanda_py.make_CANPacket(m[0], m[2], m[1]), ts) for m, ts in zip(msgs, timestamps, strict=True)]
+
+    rx_msgs = []
+    overflow_buf = b""
+    dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+    while True:
+      while len(packets) > 0 and lpp.can_rx_push(0, *packets[0]):
+        packets.pop(0)
+
+      # odd chunk sizes so packets are split across transfers
+      chunk_len = random.randint(1, CHUNK_SIZE)
+      rx_len = lpp.comms_can_read(dat, chunk_len)
+      if rx_len == 0 and len(packets) == 0:
+        break
+      unpacked_msgs, overflow_buf = unpack_can_buffer(overflow_buf + bytes(dat[0:rx_len]), timestamps=True)
+      rx_msgs.extend(unpacked_msgs)
+
+    self.assertEqual(len(overflow_buf), 0)
+    self.assertEqual(rx_msgs, [(*m, ts) for m, ts in zip(msgs, timestamps, strict=True)])
+
+  def test_can_receive_timestamps_wire_format(self):
+    lpp.comms_can_reset(COMMS_FLAG_TIMESTAMPS)
+    lpp.can_rx_push(1, libpanda_py.make_CANPacket(0x123, 1, b"\x01\x02"), 0x11223344)
+
+    dat = libpanda_py.ffi.new(f"uint8_t[{CHUNK_SIZE}]")
+    rx_len = lpp.comms_can_read(dat, CHUNK_SIZE)
+    buf = bytes(dat[0:rx_len])
+    self.assertEqual(rx_len, CANPACKET_HEAD_SIZE + CANPACKET_TIMESTAMP_SIZE + 2)
+    self.assertEqual(buf[CANPACKET_HEAD_SIZE:CANPACKET_HEAD_SIZE + CANPACKET_TIMESTAMP_SIZE], bytes([0x44, 0x33, 0x22, 0x11]))
+    self.assertEqual(buf[-2:], b"\x01\x02")
+    self.assertEqual(calculate_checksum(buf), 0)
+
+    # same packet without timestamps negotiated
+    lpp.comms_can_reset(0)
+    lpp.can_rx_push(1, libpanda_py.make_CANPacket(0x123, 1, b"\x01\x02"), 0x11223344)
+    rx_len = lpp.comms_can_read(dat, CHUNK_SIZE)
+    self.assertEqual(unpack_can_buffer(bytes(dat[0:rx_len])), ([(0x123, b"\x01\x02", 1)], b""))
+
 
 if __name__ == "__main__":
   unittest.main()
@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+import ctypes
+import random
+import struct
+import unittest
+from unittest.mock import patch
+
+import numpy as np
+
+from panda import DLC_TO_LEN, CAN_MESSAGE_DTYPE, Panda, calculate_checksum, pack_can_buffer, pack_can_records, unpack_can_buffer, \
+                  unpack_can_records
+from panda.python.native import CAN_FLAG_EXTENDED, CAN_FLAG_FD, CAN_RX_ERROR_DESYNC, CanParser, CanRxDesyncError, PandaNativeHandle, \
+                                load_can_library
+
+
+def python_impl():
+  return patch("panda.python.load_can_library", return_value=None)
+
+
+def random_rx_packets(n, timestamps):
+  buf = bytearray()
+  for _ in range(n):
+    dlc = random.randrange(len(DLC_TO_LEN))
+    word = (random.randint(1, (1 << 29) - 1) << 3) | (random.getrandbits(1) << 1) | random.getrandbits(1)
+    pkt = bytearray([(dlc << 4) | (random.randint(0, 2) << 1)]) + struct.pack("<I", word) + b"\x00"
+    if timestamps:
+      pkt += struct.pack("<I", random.getrandbits(32))
+    pkt += bytes(random.getrandbits(8) for _ in range(DLC_TO_LEN[dlc]))
+    pkt[5] = calculate_checksum(pkt)
+    buf += pkt
+  return bytes(buf)
+
+
+@unittest.skipIf(load_can_library() is None, "host/libpanda_can.so not built")
+class TestNativeCanParser(unittest.TestCase):
+  def test_same_as_unpack_can_buffer(self):
+    for timestamps in (False, True):
+      dat = random_rx_packets(500, timestamps)
+      expected, rest = unpack_can_buffer(dat, timestamps=timestamps)
+      self.assertEqual(rest, b'')
+
+      # split at random points, like the transfers of the pool
+      parser = CanParser(timestamps)
+      msgs = []
+      pos = 0
+      while pos < len(dat):
+        n = random.randint(1, 300)
+        msgs += parser.feed(dat[pos:pos + n])
+        pos += n
+      self.assertEqual(msgs, expected)
+
+  def test_partial_packet_held(self):
+    dat = random_rx_packets(1, False)
+    parser = CanParser()
+    self.assertEqual(parser.feed(dat[:3]), [])
+    self.assertEqual(parser.feed(dat[3:]), unpack_can_buffer(dat)[0])
+
+  def test_unpack_same_as_python(self):
+    for timestamps in (False, True):
+      dat = random_rx_packets(300, timestamps) + b"\x80\x01\x02\x03\x04\x05\x06"
+      with python_impl():
+        expected = unpack_can_buffer(dat, timestamps=timestamps)
+      self.assertEqual(unpack_can_buffer(dat, timestamps=timestamps), expected)
+      self.assertEqual(len(expected[1]), 7)
+
+  def test_pack_same_as_python(self):
+    msgs = []
+    for _ in range(300):
+      data = bytes(random.getrandbits(8) for _ in range(DLC_TO_LEN[random.randrange(len(DLC_TO_LEN))]))
+      msgs.append((random.randint(1, (1 << 29) - 1), data, random.randint(0, 2), random.getrandbits(32)))
+    for chunk in (False, True):
+      for fd in (False, True):
+        for tx_timestamps in (False, True):
+          with python_impl():
+            expected = pack_can_buffer(msgs, chunk=chunk, fd=fd, tx_timestamps=tx_timestamps)
+          self.assertEqual(pack_can_buffer(msgs, chunk=chunk, fd=fd, tx_timestamps=tx_timestamps), expected)
+    self.assertEqual(pack_can_buffer([]), [bytearray()])
+
+  def test_records_round_trip(self):
+    records = np.zeros(100, dtype=CAN_MESSAGE_DTYPE)
+    records["addr"] = np.random.randint(0, 1 << 29, len(records))
+    records["bus"] = np.random.randint(0, 3, len(records))
+    records["dlc"] = np.random.randint(0, 16, len(records))
+    records["flags"] = np.random.choice([0, CAN_FLAG_EXTENDED, CAN_FLAG_FD | CAN_FLAG_EXTENDED], len(records))
+    records["timestamp"] = np.random.randint(0, 1 << 32, len(records), dtype=np.uint64)
+    for i, dlc in enumerate(records["dlc"]):
+      records["data"][i, :DLC_TO_LEN[dlc]] = np.random.randint(0, 256, DLC_TO_LEN[dlc])
+
+    # the TX and RX wire formats are the same, apart from the returned/rejected flags
+    dat, = pack_can_records(records, tx_timestamps=True)
+    out, rest = unpack_can_records(dat, timestamps=True)
+    self.assertEqual(rest, b'')
+    self.assertEqual(out.tobytes(), records.tobytes())
+
+  def test_bad_checksum(self):
+    dat = bytearray(random_rx_packets(2, False))
+    dat[-1] ^= 0xFF
+    with self.assertRaises(AssertionError):
+      CanParser().feed(dat)
+
+
+class FakeHostLibrary:
+  """libpanda_host.so with transfers of whole packets instead of its transfer pool"""
+  def __init__(self):
+    self.transfers = []
+    self.checksum_errors = 0
+    self._desync = False
+
+  def panda_host_can_rx_reset(self, h, timestamps):
+    self._desync = False
+
+  def panda_host_can_rx_start(self, h, transfer_cnt):
+    return 0
+
+  def panda_host_can_recv(self, h, out, max_msgs, timeout_ms):
+    if self._desync:
+      return CAN_RX_ERROR_DESYNC
+    if len(self.transfers) == 0:
+      return 0
+    try:
+      records, _ = unpack_can_records(self.transfers.pop(0))
+    except AssertionError:
+      self.checksum_errors += 1
+      self._desync = True
+      return CAN_RX_ERROR_DESYNC
+    ctypes.memmove(out, records.ctypes.data, records.nbytes)
+    return len(records)
+
+  def panda_host_can_rx_stats(self, h, dropped, checksum_errors, transfer_errors):
+    checksum_errors._obj.value = self.checksum_errors
+
+
+@unittest.skipIf(load_can_library() is None, "host/libpanda_can.so not built")
+class TestNativeHandleDesync(unittest.TestCase):
+  def setUp(self):
+    self.lib = FakeHostLibrary()
+    with patch.object(Panda, "connect"):
+      self.panda = Panda("native", cli=False)
+    self.panda._handle = PandaNativeHandle(self.lib, 1)
+    self.panda.can_version = Panda.CAN_PACKET_VERSION
+
+  def test_bad_checksum(self):
+    good = random_rx_packets(3, False)
+    bad = bytearray(random_rx_packets(2, False))
+    bad[-1] ^= 0xFF
+    self.lib.transfers = [good, bytes(bad), good]
+
+    with patch.object(self.panda._handle, "controlWrite") as control_write:
+      self.assertEqual(self.panda.can_recv(), unpack_can_buffer(good)[0])
+      with self.assertRaises(CanRxDesyncError):
+        self.panda.can_recv()
+      # both ends start over on a packet boundary
+      control_write.assert_called_once_with(Panda.REQUEST_OUT, 0xc0, 0, 0, b'')
+    self.assertEqual(self.panda.can_rx_stats()[1], 1)
+
+    # and the stream is read again
+    self.assertEqual(self.panda.can_recv(), unpack_can_buffer(good)[0])
+
+
+if __name__ == "__main__":
+  unittest.main()
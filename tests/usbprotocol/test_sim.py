@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+import os
+import tempfile
+import time
+import unittest
+from unittest.mock import patch
+
+import usb1
+from opendbc.car.structs import CarParams
+
+from panda import Panda
+from panda.python.sim import SIM_PATH, SIM_SERIAL, PandaSim
+
+
+def recv_until(p, n, timeout=2.0):
+  msgs = []
+  start = time.monotonic()
+  while len(msgs) < n and (time.monotonic() - start) < timeout:
+    msgs += p.can_recv()
+  return msgs
+
+
+@unittest.skipIf(not os.path.isfile(SIM_PATH), "tests/sim/panda_sim not built")
+class TestPandaSim(unittest.TestCase):
+  def setUp(self):
+    self.tmp = tempfile.TemporaryDirectory()
+    path = os.path.join(self.tmp.name, "sim.sock")
+    self.sim = PandaSim(path)
+    self.sim.start()
+    self.socket_patch = patch("panda.python.sim.SIM_SOCKET", path)
+    self.socket_patch.start()
+
+    self.p = Panda(SIM_SERIAL)
+    self.bus = self.sim.connect()
+
+  def tearDown(self):
+    self.bus.close()
+    self.p.close()
+    self.socket_patch.stop()
+    self.sim.stop()
+    self.tmp.cleanup()
+
+  def test_connect(self):
+    self.assertTrue(self.p.is_connected_usb())
+    self.assertEqual(self.p.get_usb_serial(), SIM_SERIAL)
+    self.assertEqual(self.p.get_type(), Panda.HW_TYPE_RED_PANDA)
+    self.assertTrue(self.p.get_version().startswith("DEV-sim"))
+    self.assertEqual(self.p.health()["safety_mode"], CarParams.SafetyModel.silent)
+
+  def test_silent(self):
+    # the default safety mode doesn't let anything out
+    self.p.can_send(0x123, b"\x01" * 8, 0)
+    time.sleep(0.05)
+    self.assertEqual(self.bus.stats()["tx_cnt"], [0, 0, 0])
+    self.assertEqual(self.p.health()["safety_tx_blocked"], 1)
+
+  def test_tx_timeout(self):
+    # more than the TX queue holds on a slow bus, endpoint 3 NAKs until the write times out
+    self.p.set_safety_mode(CarParams.SafetyModel.allOutput)
+    self.p.set_can_speed_kbps(0, 10)
+    with self.assertRaises(usb1.USBErrorTimeout):
+      self.p.can_send_many([[0x200, b"\x00" * 8, 0]] * 1000, timeout=100)
+
+  def test_echo(self):
+    self.p.set_safety_mode(CarParams.SafetyModel.allOutput)
+    self.p.can_recv()
+    for bus in range(3):
+      self.p.can_send(0x123 + bus, bytes([bus]) * 8, bus)
+    msgs = recv_until(self.p, 3)
+    self.assertEqual(sorted(msgs), [(0x123 + bus, bytes([bus]) * 8, bus + 128) for bus in range(3)])
+    self.assertEqual(self.bus.stats()["tx_cnt"], [1, 1, 1])
+
+  def test_send_many(self):
+    # more than fits in the TX queue, it's flow controlled through endpoint 3
+    self.p.set_safety_mode(CarParams.SafetyModel.allOutput)
+    self.p.can_recv()
+    msgs = [[0x100 + (i % 0x100), i.to_bytes(8, "little"), 0] for i in range(3000)]
+    echoed = []
+    for i in range(0, len(msgs), 500):
+      self.p.can_send_many(msgs[i:i+500], timeout=5000)
+      echoed += self.p.can_recv()
+    echoed += recv_until(self.p, len(msgs) - len(echoed))
+    self.assertEqual([m[1] for m in echoed], [m[1] for m in msgs])
+    self.assertEqual(self.bus.stats()["tx_cnt"], [3000, 0, 0])
+    health = self.p.health()
+    self.assertEqual(health["tx_buffer_overflow"], 0)
+    self.assertEqual(health["rx_buffer_overflow"], 0)
+
+  def test_traffic(self):
+    for bus in range(3):
+      self.bus.add_traffic(bus, 0x300 + bus, b"\x00" * 8, 1000, count=100)
+    self.bus.add_traffic(0, 0x18DAF110, b"\x00" * 64, 1000, count=100, fd=True, brs=True)
+    msgs = recv_until(self.p, 400)
+    self.assertEqual(len(msgs), 400)
+    for addr, bus, length in ((0x300, 0, 8), (0x301, 1, 8), (0x302, 2, 8), (0x18DAF110, 0, 64)):
+      dat = [m[1] for m in msgs if m[0] == addr]
+      self.assertTrue(all(m[2] == bus for m in msgs if m[0] == addr))
+      self.assertTrue(all(len(d) == length for d in dat))
+      # the counter of each frame
+      self.assertEqual([int.from_bytes(d[:4], "little") for d in dat], list(range(100)))
+    self.assertEqual(self.bus.stats()["rx_cnt"], [200, 100, 100])
+
+    health = self.p.can_health(0)
+    self.assertTrue(health["canfd_enabled"])
+    self.assertTrue(health["brs_enabled"])
+
+  def test_traffic_clear(self):
+    self.bus.add_traffic(0, 0x300, b"\x00" * 8, 1000)
+    time.sleep(0.05)
+    self.bus.clear_traffic()
+    rx_cnt = self.bus.stats()["rx_cnt"][0]
+    self.assertGreater(rx_cnt, 0)
+    time.sleep(0.05)
+    self.assertEqual(self.bus.stats()["rx_cnt"][0], rx_cnt)
+
+  def test_reset(self):
+    self.p.set_safety_mode(CarParams.SafetyModel.allOutput)
+    self.p.reset()
+    self.assertEqual(self.p.health()["safety_mode"], CarParams.SafetyModel.silent)
+    self.bus.close()
+    self.bus = self.sim.connect()
+    self.assertEqual(self.bus.stats()["tx_cnt"], [0, 0, 0])
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+import random
+import struct
+import unittest
+from unittest.mock import patch
+
+from panda import Panda
+from panda.python.sof_sync import FRAME_WRAP, TIMER_WRAP, SofSync, unwrap_frame
+
+
+class SimulatedBus:
+  """
+  A host controller sending SOFs every 1ms of host time and a panda latching its drifting timer at them,
+  late by the interrupt latency. Reads of the latches take a while, like a control transfer.
+  """
+  LATCH_CNT = 8
+  LATCH_S = 5.0
+
+  def __init__(self, drift_ppm, first_frame, first_us, host_jitter_us=2.0):
+    self.now = 100.0
+    self.start = self.now
+    self.drift_ppm = drift_ppm
+    self.first_frame = first_frame
+    self.first_us = first_us
+    self.host_jitter_us = host_jitter_us
+    self.latching_since = None
+    self.latching_until = None
+    self._latency = {}
+
+  def clock(self):
+    return self.now
+
+  def timer_exact(self, host_time):
+    return self.first_us + (host_time - self.start) * 1e6 * (1 + self.drift_ppm * 1e-6)
+
+  def timer(self, host_time):
+    return round(self.timer_exact(host_time)) % TIMER_WRAP
+
+  def frame_at(self, host_time):
+    return int((host_time - self.start) / 1e-3)
+
+  def frame_start(self, k):
+    return self.start + k * 1e-3
+
+  def latch(self, k):
+    # the interrupt is mostly a couple of us late, now and then held off by another one
+    if k not in self._latency:
+      self._latency[k] = random.uniform(1, 3) if random.random() > 0.02 else random.uniform(20, 200)
+    us = round(self.timer_exact(self.frame_start(k)) + self._latency[k]) % TIMER_WRAP
+    return ((self.first_frame + k) % FRAME_WRAP, us)
+
+  def read_latches(self):
+    self.now += random.uniform(0.1e-3, 1.5e-3)
+    if self.latching_until is None or self.now > self.latching_until:
+      self.latching_since = self.now
+      latches = []
+    else:
+      newest = self.frame_at(self.now)
+      oldest = max(newest - self.LATCH_CNT + 1, self.frame_at(self.latching_since) + 1)
+      latches = [self.latch(k) for k in range(oldest, newest + 1)]
+    self.latching_until = self.now + self.LATCH_S
+    return latches
+
+  def host_frame(self):
+    k = self.frame_at(self.now)
+    return (self.first_frame + k) % FRAME_WRAP, self.frame_start(k) + random.gauss(0, self.host_jitter_us * 1e-6)
+
+
+class TestSofSync(unittest.TestCase):
+  def _sync(self, bus, gaps):
+    sync = SofSync(bus.read_latches, bus.host_frame, clock=bus.clock)
+    for gap in gaps:
+      sync.sample()
+      bus.now += gap
+    sync.sample()
+    return sync
+
+  def _check(self, bus, sync, max_err_us):
+    self.assertTrue(sync.synced)
+    self.assertAlmostEqual(sync.drift_ppm, bus.drift_ppm, delta=0.5)
+    for _ in range(200):
+      host_time = random.uniform(bus.start, bus.now)
+      est, err = sync.to_host(bus.timer(host_time))
+      self.assertLess(abs(est - host_time), max_err_us * 1e-6)
+      self.assertLess(abs(est - host_time), err + 1e-6)
+      self.assertLess(abs((sync.to_timer(host_time) - bus.timer(host_time) + TIMER_WRAP // 2) % TIMER_WRAP - TIMER_WRAP // 2), max_err_us)
+
+  def test_unwrap_frame(self):
+    self.assertEqual(unwrap_frame(5, 2046, 7), 2053)
+    self.assertEqual(unwrap_frame(5, 2046, 7 + 3 * FRAME_WRAP), 2053 + 3 * FRAME_WRAP)
+    self.assertEqual(unwrap_frame(2040, 2053, -13), 2040)
+    # up to half a wrap of error in the elapsed time is fine
+    self.assertEqual(unwrap_frame(5, 2046, 7 + 1000), 2053)
+
+  def test_drift_and_wraps(self):
+    for _ in range(10):
+      # the frame number wraps every 2s, the timer 4s in
+      bus = SimulatedBus(random.uniform(-100, 100), random.randrange(FRAME_WRAP), TIMER_WRAP - 4_000_000)
+      sync = self._sync(bus, [random.uniform(0.005, 0.5) for _ in range(40)])
+      self._check(bus, sync, 15)
+
+  def test_long_gaps(self):
+    # latching stops in between, so reads come back empty, and many frame wraps pass
+    bus = SimulatedBus(random.uniform(-100, 100), random.randrange(FRAME_WRAP), random.getrandbits(32))
+    gaps = []
+    for _ in range(10):
+      gaps += [0.01] * 3 + [random.uniform(6, 20)]
+    sync = self._sync(bus, gaps)
+    self._check(bus, sync, 15)
+
+  def test_repeated_latches(self):
+    bus = SimulatedBus(20, 2000, 0)
+    sync = SofSync(bus.read_latches, bus.host_frame, clock=bus.clock)
+    for _ in range(50):
+      sync.sample()
+      bus.now += 0.002
+    # reads every 2ms overlap, every frame is only added once
+    frames = [f for f, _ in sync._device]
+    self.assertEqual(frames, sorted(set(frames)))
+    self.assertEqual(frames[-1] - frames[0] + 1, len(frames))
+
+  def test_not_synced(self):
+    bus = SimulatedBus(0, 0, 0)
+    sync = SofSync(bus.read_latches, bus.host_frame, clock=bus.clock)
+    with self.assertRaises(RuntimeError):
+      sync.add_device_latches([(0, 0)], bus.now)
+    # the first read only starts latching
+    sync.sample()
+    self.assertFalse(sync.synced)
+    with self.assertRaises(RuntimeError):
+      sync.to_host(0)
+
+  def test_panda_latches(self):
+    latches = [(2047, 0xFFFFFC18), (0, 0x00000000), (1, 0x000003E8)]
+
+    class FakeHandle:
+      def controlRead(self, request_type, request, value, index, length, timeout=0):
+        assert request == 0xb6
+        return b"".join(struct.pack("<HI", *latch) for latch in latches)
+
+    with patch.object(Panda, "connect"):
+      p = Panda("x", cli=False)
+    p._handle = FakeHandle()
+    self.assertEqual(p.get_usb_sof_latches(), latches)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,432 @@
+#!/usr/bin/env python3
+import ctypes
+import random
+import time
+import unittest
+from contextlib import contextmanager
+from unittest.mock import patch
+
+from opendbc.car.structs import CarParams
+from panda import DLC_TO_LEN, Panda, pack_can_buffer, unpack_can_buffer
+from panda.python.native import load_spi_library
+from panda.python.spi import XFER_SIZE, NativeSpi, PandaSpiHandle, PandaSpiNackResponse
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+TX_QUEUES = (lpp.tx1_q, lpp.tx2_q, lpp.tx3_q)
+SPI_UNDERRUN = 0xcd  # board/stm32h7/llspi.h
+SPI_STAGE_CHUNK = 0x200  # board/drivers/spi.h
+
+
+# linux/spi/spidev.h
+class SpiIocTransfer(ctypes.Structure):
+  _fields_ = [
+    ("tx_buf", ctypes.c_uint64),
+    ("rx_buf", ctypes.c_uint64),
+    ("len", ctypes.c_uint32),
+    ("speed_hz", ctypes.c_uint32),
+    ("delay_usecs", ctypes.c_uint16),
+    ("bits_per_word", ctypes.c_uint8),
+    ("cs_change", ctypes.c_uint8),
+    ("tx_nbits", ctypes.c_uint8),
+    ("rx_nbits", ctypes.c_uint8),
+    ("word_delay_usecs", ctypes.c_uint8),
+    ("pad", ctypes.c_uint8),
+  ]
+
+SPI_XFER_FN = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.POINTER(SpiIocTransfer), ctypes.c_uint)
+
+
+class FakeSpiDevice:
+  """
+  The SPI bus between a PandaSpiHandle and board/drivers/spi.h, with the DMA done byte by byte.
+  Each xfer2/readbytes/writebytes is a transaction, the chip select going high at its end is
+  when the panda sees a finished MISO DMA. The panda's interrupts take no time.
+
+  With background, the low priority staging interrupt runs whenever it's kicked, as soon as the
+  SPI interrupt that kicked it is done or, for CAN RX, before the next transaction. Without it
+  everything is read on demand. headers has (ns, RX ring bytes read) of every header interrupt,
+  from the header's last byte to the response being ready. With header_latency, the header
+  interrupt runs that many transactions late, like a panda busy with other interrupts.
+
+  With native, the handle's transfers go through host/libpanda_spi.so, its SPI_IOC_MESSAGE
+  ioctls end up here. Each of their transfers is a transaction, like the kernel toggling
+  chip select between them.
+  """
+  def __init__(self, background=False, native=False):
+    self.background = background
+    self.use_native = native
+    self.transactions = 0
+    self.messages = 0
+    self.corrupt_next_data = False
+    self.headers = []
+    self.header_latency = 0
+    self._late_header = 0
+    self._miso_done = False
+    self._mosi_armed = lpp.spi_mosi_len
+
+  def _run_background(self):
+    if self.background and lpp.spi_stage_kicked:
+      lpp.spi_stage_kicked = False
+      lpp.spi_stage_fill()
+
+  def _rx_done(self):
+    if (self._mosi_armed == 7) and (self.header_latency > 0):
+      self._late_header = self.header_latency
+    else:
+      self._run_rx_done()
+
+  def _run_rx_done(self):
+    if self._mosi_armed == 7:
+      pending = rx_pending()
+      start = time.perf_counter_ns()
+      lpp.spi_rx_done()
+      dt = time.perf_counter_ns() - start
+      self.headers.append((dt, pending - rx_pending()))
+    else:
+      lpp.spi_rx_done()
+    self._mosi_armed = lpp.spi_mosi_len
+    self._run_background()
+
+  @contextmanager
+  def acquire(self):
+    yield self
+
+  def close(self):
+    pass
+
+  def _clock(self, mosi):
+    if self.corrupt_next_data and len(mosi) > 7:
+      self.corrupt_next_data = False
+      mosi = [mosi[0] ^ 0x1, *mosi[1:]]
+
+    self._run_background()
+    self.transactions += 1
+    if self._late_header > 0:
+      self._late_header -= 1
+      if self._late_header == 0:
+        self._run_rx_done()
+    miso = []
+    for b in mosi:
+      if lpp.spi_miso_len > 0:
+        miso.append(lpp.spi_miso_addr[0])
+        lpp.spi_miso_addr += 1
+        lpp.spi_miso_len -= 1
+        self._miso_done = lpp.spi_miso_len == 0
+      else:
+        miso.append(SPI_UNDERRUN)
+
+      if lpp.spi_mosi_len > 0:
+        lpp.spi_mosi_addr[0] = b
+        lpp.spi_mosi_addr += 1
+        lpp.spi_mosi_len -= 1
+        if lpp.spi_mosi_len == 0:
+          self._rx_done()
+
+    if self._miso_done:
+      self._miso_done = False
+      lpp.spi_tx_done(False)
+      self._mosi_armed = lpp.spi_mosi_len
+      self._run_background()
+    return miso
+
+  def _message(self, ctx, xfers, cnt):
+    self.messages += 1
+    for i in range(cnt):
+      t = xfers[i]
+      assert t.cs_change == (i < cnt - 1)
+      tx = ctypes.string_at(t.tx_buf, t.len) if t.tx_buf else bytes(t.len)
+      miso = bytes(self._clock(list(tx)))
+      if t.rx_buf:
+        ctypes.memmove(t.rx_buf, miso, t.len)
+    return 0
+
+  def native(self):
+    lib = load_spi_library()
+    return NativeSpi(lib, xfer=SPI_XFER_FN(self._message)) if (self.use_native and lib is not None) else None
+
+  def xfer2(self, data):
+    return self._clock(list(data))
+
+  def readbytes(self, n):
+    return self._clock([0] * n)
+
+  def writebytes(self, data):
+    self._clock(list(data))
+
+
+def random_can_messages(n, bus=None):
+  msgs = []
+  for _ in range(n):
+    data = bytes(random.getrandbits(8) for _ in range(DLC_TO_LEN[random.randrange(len(DLC_TO_LEN))]))
+    msgs.append((random.randint(1, 0x7FF), data, random.randint(0, 2) if bus is None else bus))
+  return msgs
+
+
+def rx_pending():
+  return sum(lpp.can_rx_pending(libpanda_py.ffi.addressof(ring)) for ring in lpp.can_rx_rings)
+
+
+def push_rx(msgs):
+  for i, (addr, dat, bus) in enumerate(msgs):
+    assert lpp.can_rx_push(0, libpanda_py.make_CANPacket(addr, bus, dat), i)
+  # like the FDCAN RX interrupt
+  lpp.llspi_stage_kick()
+
+
+def pop_tx():
+  msgs = []
+  pkt = libpanda_py.ffi.new('CANPacket_t *')
+  for bus, q in enumerate(TX_QUEUES):
+    while lpp.can_pop(q, pkt):
+      msgs.append((pkt[0].addr, bytes(pkt[0].data[0:DLC_TO_LEN[pkt[0].data_len_code]]), bus))
+  return msgs
+
+
+def spi_handle(background=False, native=False):
+  lpp.set_safety_hooks(CarParams.SafetyModel.allOutput, 0)
+  lpp.can_rx_clear()
+  pop_tx()
+  lpp.spi_init()
+  lpp.spi_stage_kicked = False
+
+  with patch("panda.python.spi.SpiDevice", lambda: FakeSpiDevice(background, native)):
+    handle = PandaSpiHandle()
+  handle.controlWrite(Panda.REQUEST_OUT, 0xc0, 0, 0, b'')
+  lpp.refresh_can_tx_slots_available()
+  handle.dev.transactions = 0
+  handle.dev.messages = 0
+  handle.dev.headers.clear()
+  return handle
+
+
+class TestSpiProtocol(unittest.TestCase):
+  BACKGROUND = False
+  NATIVE = False
+
+  def setUp(self):
+    self.handle = spi_handle(self.BACKGROUND, self.NATIVE)
+    self.bus = self.handle.dev
+
+  def tearDown(self):
+    self.handle.close()
+
+  def _recv_all(self, read, dat=b""):
+    while True:
+      d = read()
+      if len(d) == 0:
+        return unpack_can_buffer(dat)[0]
+      dat += d
+
+  def test_protocol_version(self):
+    dat = self.handle.get_protocol_version()
+    self.assertEqual(dat[14], PandaSpiHandle.PROTOCOL_VERSION)
+    self.assertEqual(dat[14], 3)
+
+  def test_nack(self):
+    # test endpoint, it always NACKs
+    self.handle.no_retry = True
+    with self.assertRaises(PandaSpiNackResponse):
+      self.handle._transfer(0xAC, b"test", 100)
+
+  def test_control_read(self):
+    dat = self.handle.controlRead(Panda.REQUEST_IN, 0xc7, 0, 0, 64)
+    self.assertEqual(len(dat), 8)
+
+  def test_exchange_both_ways(self):
+    rx_msgs = random_can_messages(3)
+    tx_msgs = random_can_messages(20)
+    push_rx(rx_msgs)
+    errors = lpp.spi_error_count
+
+    rx, accepted = self.handle.can_exchange(pack_can_buffer(tx_msgs, chunk=False)[0])
+    self.assertTrue(accepted)
+    self.assertEqual(unpack_can_buffer(rx), (rx_msgs, b""))
+    self.assertEqual(sorted(pop_tx(), key=lambda m: m[2]), sorted(tx_msgs, key=lambda m: m[2]))
+
+    # the header, one HACK poll and one full-duplex transfer
+    self.assertEqual(self.bus.transactions, 3)
+    self.assertEqual(lpp.spi_error_count, errors)
+
+  def test_exchange_late_header_interrupt(self):
+    # the host polls until the panda set up the exchange, nothing is sent into an unarmed DMA
+    for latency in (1, 2, 10):
+      # short enough for the exchange to not need a second read
+      rx_msgs = [(0x100 + i, bytes([i]) * 8, i % 3) for i in range(3)]
+      tx_msgs = random_can_messages(10)
+      push_rx(rx_msgs)
+      errors = lpp.spi_error_count
+      self.bus.header_latency = latency
+      self.bus.transactions = 0
+
+      rx, accepted = self.handle.can_exchange(pack_can_buffer(tx_msgs, chunk=False)[0])
+      self.assertTrue(accepted)
+      self.assertEqual(unpack_can_buffer(rx), (rx_msgs, b""))
+      self.assertEqual(sorted(pop_tx(), key=lambda m: m[2]), sorted(tx_msgs, key=lambda m: m[2]))
+      self.assertEqual(self.bus.transactions, 2 + latency)
+      self.assertEqual(lpp.spi_error_count, errors)
+
+  def test_large_rx(self):
+    rx_msgs = random_can_messages(500)
+    push_rx(rx_msgs)
+    self.assertEqual(self._recv_all(lambda: self.handle.can_exchange()[0]), rx_msgs)
+
+  def test_tx_not_accepted_when_full(self):
+    # the next exchange's data is taken, then nothing until there's room again
+    pkt = libpanda_py.make_CANPacket(0x100, 0, b"full")
+    while lpp.can_push(lpp.tx1_q, pkt):
+      pass
+    tx = pack_can_buffer([(0x200, b"test", 0)], chunk=False)[0]
+    self.assertTrue(self.handle.can_exchange(tx)[1])
+
+    rx_msgs = random_can_messages(5)
+    push_rx(rx_msgs)
+    rx, accepted = self.handle.can_exchange(tx)
+    self.assertFalse(accepted)
+    self.assertEqual(unpack_can_buffer(rx), (rx_msgs, b""))
+
+    pop_tx()
+    lpp.refresh_can_tx_slots_available()
+    self.assertTrue(self.handle.can_exchange(tx)[1])
+    self.assertEqual(pop_tx(), [(0x200, b"test", 0)])
+
+  def test_corrupted_tx_resent_in_order(self):
+    first = random_can_messages(30, bus=0)
+    second = random_can_messages(30, bus=0)
+    errors = lpp.spi_error_count
+
+    self.bus.corrupt_next_data = True
+    self.handle.bulkWrite(3, pack_can_buffer(first, chunk=False)[0])
+    self.assertEqual(lpp.spi_error_count, errors + 1)
+    self.assertEqual(pop_tx(), [])
+
+    self.handle.bulkWrite(3, pack_can_buffer(second, chunk=False)[0])
+    self.assertEqual(pop_tx(), first + second)
+
+  def test_corrupted_tx_resent_on_read(self):
+    msgs = random_can_messages(10, bus=1)
+    self.bus.corrupt_next_data = True
+    self.handle.bulkWrite(3, pack_can_buffer(msgs, chunk=False)[0])
+    self.assertEqual(self.handle.bulkRead(1, 16384), b"")
+    self.assertEqual(pop_tx(), msgs)
+
+  def test_staged_data_first_on_endpoint1(self):
+    # more than fits in one exchange, the rest is staged for the next one and a v2 read gets it first.
+    # without the staging interrupt, the header reads a chunk at most
+    self.handle.can_exchange()
+    msgs = random_can_messages(600)
+    push_rx(msgs)
+    dat, _ = self.handle.can_exchange()
+    self.assertEqual(len(dat), XFER_SIZE if self.BACKGROUND else SPI_STAGE_CHUNK)
+    self.assertEqual(self._recv_all(lambda: self.handle._transfer(1, [], 1000, max_rx_len=XFER_SIZE), dat), msgs)
+
+  def test_transactions_per_message(self):
+    # the same messages for each protocol, RX fits in what the header reads without the staging interrupt
+    rounds = [(random_can_messages(random.randint(1, 7)), random_can_messages(random.randint(1, 20))) for _ in range(20)]
+
+    def run(send, recv):
+      self.bus.transactions = 0
+      msg_cnt = 0
+      for rx_msgs, tx_msgs in rounds:
+        push_rx(rx_msgs)
+        rx = send(pack_can_buffer(tx_msgs, chunk=False)[0]) + recv()
+        self.assertEqual(unpack_can_buffer(rx), (rx_msgs, b""))
+        self.assertEqual(len(pop_tx()), len(tx_msgs))
+        msg_cnt += len(rx_msgs) + len(tx_msgs)
+      return self.bus.transactions / msg_cnt
+
+    # protocol version 2: separate transfers for endpoints 3 and 1, each with two ACK polls
+    v2 = run(lambda tx: self.handle._transfer(3, tx, 1000) and b"",
+             lambda: self.handle._transfer(1, [], 1000, max_rx_len=XFER_SIZE))
+    # one exchange sends and receives
+    v3 = run(lambda tx: self.handle.can_exchange(tx)[0], lambda: b"")
+    # the same through bulkWrite/bulkRead, as Panda uses it
+    v3_bulk = run(lambda tx: self.handle.bulkWrite(3, tx) and b"", lambda: self.handle.bulkRead(1, 16384))
+
+    # the bulkRead ends on an empty exchange, and each exchange has its HACK poll
+    self.assertLess(v3, v2 / 2)
+    self.assertLess(v3_bulk, v2 * 0.8)
+
+
+class TestSpiProtocolBackgroundStaging(TestSpiProtocol):
+  BACKGROUND = True
+
+  def test_header_reads_only_new_data(self):
+    # staged while the bus was idle, the header only reads what came in since the last fill.
+    # that's from the first exchange on, see test_no_staging_before_exchange
+    self.handle.can_exchange()
+    push_rx(random_can_messages(100))
+    self.handle.can_exchange()
+    self.assertEqual(self.bus.headers[-1][1], 0)
+
+    # while a transfer is in flight, the next one is staged in the other buffer
+    msgs = random_can_messages(600)
+    push_rx(msgs)
+    dat, _ = self.handle.can_exchange()
+    self.assertEqual(self.bus.headers[-1][1], 0)
+    self.assertEqual(self._recv_all(lambda: self.handle.can_exchange()[0], dat), msgs)
+    self.assertEqual([n for _, n in self.bus.headers[-2:]], [0, 0])
+
+  def test_reset_drops_staged(self):
+    # what didn't fit in the exchange is staged right after it
+    push_rx(random_can_messages(100))
+    self.handle.can_exchange()
+    self.assertEqual(rx_pending(), 0)
+    self.handle.controlWrite(Panda.REQUEST_OUT, 0xc0, 0, 0, b'')
+
+    msgs = random_can_messages(10)
+    push_rx(msgs)
+    self.assertEqual(self._recv_all(lambda: self.handle.can_exchange()[0]), msgs)
+
+  def test_v2_read_from_staged(self):
+    msgs = random_can_messages(50)
+    push_rx(msgs)
+    self.assertEqual(self._recv_all(lambda: self.handle.can_exchange()[0]), msgs)
+    msgs = random_can_messages(50)
+    push_rx(msgs)
+    self.assertEqual(self._recv_all(lambda: self.handle._transfer(1, [], 1000, max_rx_len=XFER_SIZE)), msgs)
+
+  def test_v2_short_reads_from_staged(self):
+    # reads with less room than is staged take from its front, new data goes behind the rest
+    self.handle.can_exchange()
+    msgs = random_can_messages(300)
+    push_rx(msgs[:150])
+    dat = b""
+    for _ in range(3):
+      dat += self.handle._transfer(1, [], 1000, max_rx_len=500)
+    push_rx(msgs[150:])
+    self.assertEqual(self._recv_all(lambda: self.handle.can_exchange()[0], dat), msgs)
+
+  def test_no_staging_before_exchange(self):
+    # a host on endpoint 1 reads doesn't see staged data, nothing is staged until it exchanges
+    msgs = random_can_messages(50)
+    push_rx(msgs)
+    self.bus._run_background()
+    self.assertGreater(rx_pending(), 0)
+    self.assertEqual(self._recv_all(lambda: self.handle._transfer(1, [], 1000, max_rx_len=XFER_SIZE)), msgs)
+
+
+@unittest.skipIf(load_spi_library() is None, "host/libpanda_spi.so not built")
+class TestSpiProtocolNative(TestSpiProtocol):
+  NATIVE = True
+
+  def test_native_used(self):
+    self.assertIsNotNone(self.handle.native)
+
+  def test_ioctls_per_transfer(self):
+    # header with the first ACK poll, then data with the first data ACK poll
+    self.handle.controlRead(Panda.REQUEST_IN, 0xc7, 0, 0, 64)
+    self.assertEqual(self.bus.messages, 2)
+    self.assertEqual(self.bus.transactions, 4)
+
+    # header with the first HACK poll, the exchange, the rest of a large response
+    self.bus.messages = 0
+    push_rx(random_can_messages(400))
+    dat, _ = self.handle.can_exchange()
+    self.assertEqual(len(dat), SPI_STAGE_CHUNK)
+    self.assertEqual(self.bus.messages, 3)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+import struct
+import unittest
+
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+
+DESC_TYPE_CONFIGURATION = 2
+DESC_TYPE_INTERFACE = 4
+DESC_TYPE_ENDPOINT = 5
+ENDPOINT_TYPE_BULK = 2
+ENDPOINT_TYPE_INT = 3
+
+
+def parse_configuration(desc):
+  # {alt setting: {endpoint address: (type, max packet size, interval)}}
+  length, desc_type, total_len, num_interfaces = struct.unpack_from("<BBHB", desc)
+  assert (length, desc_type, total_len, num_interfaces) == (9, DESC_TYPE_CONFIGURATION, len(desc), 1)
+
+  alts = {}
+  num_endpoints = {}
+  pos = length
+  alt = None
+  while pos < len(desc):
+    length, desc_type = desc[pos], desc[pos + 1]
+    if desc_type == DESC_TYPE_INTERFACE:
+      assert length == 9
+      interface, alt, num_endpoints[alt] = desc[pos + 2], desc[pos + 3], desc[pos + 4]
+      assert interface == 0 and alt not in alts
+      alts[alt] = {}
+    elif desc_type == DESC_TYPE_ENDPOINT:
+      assert length == 7 and alt is not None
+      addr, attributes, max_packet, interval = struct.unpack_from("<BBHB", desc, pos + 2)
+      alts[alt][addr] = (attributes, max_packet, interval)
+    else:
+      raise AssertionError(f"unexpected descriptor type {desc_type}")
+    pos += length
+  assert pos == len(desc)
+  assert all(len(alts[a]) == num_endpoints[a] for a in alts)
+  return alts
+
+
+class TestUSBDescriptors(unittest.TestCase):
+  def test_configuration(self):
+    desc = bytes(lpp.usb_configuration_desc)
+    alts = parse_configuration(desc)
+
+    out_eps = {0x02: (ENDPOINT_TYPE_BULK, 64, 0), 0x03: (ENDPOINT_TYPE_BULK, 64, 0)}
+    self.assertEqual(alts, {
+      0: {0x81: (ENDPOINT_TYPE_BULK, 64, 0), **out_eps},
+      1: {0x81: (ENDPOINT_TYPE_INT, 64, 5), **out_eps},
+      # bulk CAN stays on EP1, the priority CAN IDs are polled from EP4 every frame
+      2: {0x81: (ENDPOINT_TYPE_BULK, 64, 0), **out_eps, 0x84: (ENDPOINT_TYPE_INT, 64, 1)},
+    })
+
+
+if __name__ == "__main__":
+  unittest.main()
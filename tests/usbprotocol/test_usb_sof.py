@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+import struct
+import unittest
+
+from panda.tests.libpanda import libpanda_py
+
+lpp = libpanda_py.libpanda
+ffi = libpanda_py.ffi
+
+GINTSTS_SOF = 1 << 3
+GINTSTS_RXFLVL = 1 << 4
+GINTMSK_SOFM = 1 << 3
+LATCH_FRAMES = 5000
+
+
+class TestUsbSofLatches(unittest.TestCase):
+  def setUp(self):
+    self.frame = 0
+    # run out whatever latching the last test left on
+    for _ in range(LATCH_FRAMES):
+      self._sof()
+    lpp.usb_otg.GINTMSK = 0
+
+  def _read(self):
+    resp = ffi.new("uint8_t[64]")
+    return list(struct.iter_unpack("<HI", bytes(resp[0:lpp.usb_sof_latches_get(resp)])))
+
+  def _irq(self, gintsts):
+    lpp.usb_otg.GINTSTS = gintsts
+    lpp.usb_sof_irq(gintsts)
+
+  def _sof(self, gintsts=0):
+    self.frame = (self.frame + 1) % 2048
+    lpp.usb_otg_device.DSTS = self.frame << 8
+    lpp.MICROSECOND_TIMER.CNT = self.frame * 1000
+    self._irq(GINTSTS_SOF | gintsts)
+
+  def test_latches(self):
+    self.assertEqual(self._read(), [])
+    self.assertEqual(lpp.usb_otg.GINTMSK & GINTMSK_SOFM, GINTMSK_SOFM)
+    for _ in range(10):
+      self._sof()
+    self.assertEqual(self._read(), [(f, f * 1000) for f in range(self.frame - 7, self.frame + 1)])
+
+  def test_other_interrupts_in_between(self):
+    self._read()
+    for _ in range(3):
+      self._sof()
+      self._irq(GINTSTS_RXFLVL)
+    latches = self._read()
+    self.assertEqual(latches, [(f, f * 1000) for f in range(self.frame - 2, self.frame + 1)])
+
+    # an SOF together with another interrupt
+    self._sof(GINTSTS_RXFLVL)
+    self._irq(GINTSTS_RXFLVL)
+    self.assertEqual(self._read(), latches + [(self.frame, self.frame * 1000)])
+
+  def test_stops(self):
+    self._read()
+    for _ in range(LATCH_FRAMES):
+      self._sof()
+    self.assertEqual(lpp.usb_otg.GINTMSK & GINTMSK_SOFM, 0)
+
+    # the SOF status keeps being set while masked, other interrupts see it
+    for _ in range(20):
+      self._sof(GINTSTS_RXFLVL)
+
+    # the next read starts over, without latches from the masked frames
+    self.assertEqual(self._read(), [])
+    self.assertEqual(lpp.usb_otg.GINTMSK & GINTMSK_SOFM, GINTMSK_SOFM)
+    self._sof()
+    self.assertEqual(self._read(), [(self.frame, self.frame * 1000)])
+
+
+if __name__ == "__main__":
+  unittest.main()